@@ -0,0 +1,85 @@
+-- Compare a rollup pipeline against the equivalent sequence pipeline command
+-- on the events schema from sql/sequence.sql.
+--
+-- Usage: psql -X -f bench/rollup.sql
+--
+-- Each pipeline processes the same range of new rows, and the final query
+-- checks that both produce the same summary.
+\set rows 5000000
+\set clients 100000
+
+create extension if not exists pg_incremental cascade;
+drop schema if exists rollup_bench cascade;
+create schema rollup_bench;
+set search_path to rollup_bench;
+
+create table events (
+  event_id bigint generated always as identity,
+  event_time timestamptz default now(),
+  client_id bigint,
+  path text,
+  response_time double precision
+);
+create index on events using brin (event_id);
+
+create table events_agg_sql (
+  day timestamptz,
+  client_id bigint,
+  event_count bigint,
+  total_response_time double precision,
+  min_response_time double precision,
+  max_response_time double precision,
+  primary key (day, client_id)
+);
+create table events_agg_rollup (like events_agg_sql including all);
+
+select incremental.create_sequence_pipeline('bench-sql', 'events',
+  schedule := NULL,
+  command := $$
+  insert into events_agg_sql as t
+  select date_trunc('day', event_time), client_id, count(*), sum(response_time), min(response_time), max(response_time)
+  from events
+  where event_id between $1 and $2
+  group by 1, 2
+  on conflict (day, client_id) do update set
+    event_count = t.event_count + excluded.event_count,
+    total_response_time = t.total_response_time + excluded.total_response_time,
+    min_response_time = least(t.min_response_time, excluded.min_response_time),
+    max_response_time = greatest(t.max_response_time, excluded.max_response_time)
+  $$);
+
+select incremental.create_rollup_pipeline('bench-rollup', 'events', 'events_agg_rollup',
+  dimensions := array['day:date_trunc(''day'', event_time)', 'client_id'],
+  aggregates := array['event_count:count(*)',
+                      'total_response_time:sum(response_time)',
+                      'min_response_time:min(response_time)',
+                      'max_response_time:max(response_time)'],
+  schedule := NULL);
+
+insert into events (event_time, client_id, path, response_time)
+select now() - (s % 7) * interval '1 day', s % :clients, '/page-' || (s % 10), random()
+from generate_series(1, :rows) s;
+vacuum analyze events;
+
+\timing on
+call incremental.execute_pipeline('bench-sql');
+call incremental.execute_pipeline('bench-rollup');
+
+-- a second range that mostly updates existing groups
+insert into events (event_time, client_id, path, response_time)
+select now() - (s % 7) * interval '1 day', s % :clients, '/page-' || (s % 10), random()
+from generate_series(1, :rows) s;
+vacuum analyze events;
+
+call incremental.execute_pipeline('bench-sql');
+call incremental.execute_pipeline('bench-rollup');
+\timing off
+
+select count(*) as mismatched_groups
+from events_agg_sql s full join events_agg_rollup r using (day, client_id)
+where s.event_count is distinct from r.event_count
+   or abs(s.total_response_time - r.total_response_time) > 1e-6
+   or s.min_response_time is distinct from r.min_response_time
+   or s.max_response_time is distinct from r.max_response_time;
+
+drop schema rollup_bench cascade;
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "crunchy/incremental/pipeline.h"
+
+void		ExecuteDimensionCorrections(char *pipelineName, PipelineType pipelineType);
+void		RemoveDimensionChanges(char *pipelineName);
+void		RemovePipelineDimensions(char *pipelineName);
@@ -0,0 +1,7 @@
+#pragma once
+
+/* port on which to serve metrics, 0 disables the exporter */
+extern int	MetricsPort;
+
+void		RegisterMetricsExporter(void);
+PGDLLEXPORT void IncrementalMetricsExporterMain(Datum arg);
@@ -1,11 +1,14 @@
 #pragma once
 
+#include "datatype/timestamp.h"
+
 #define DEFAULT_FILE_LIST_FUNCTION "crunchy_lake.list_files"
 
 extern char *DefaultFileListFunction;
 
-void		InitializeFileListPipelineState(char *pipelineName, char *prefix, bool batched, char *listFunction, int maxBatchSize);
+void		InitializeFileListPipelineState(char *pipelineName, char *prefix, bool batched, char *listFunction, int maxBatchSize,
+											int batchesPerCommit, Interval *cleanupGracePeriod);
 void		RemoveProcessedFileList(char *pipelineName);
-void		ExecuteFileListPipeline(char *pipelineName, char *command);
+void		ExecuteFileListPipeline(char *pipelineName, char *command, bool allowCommit);
 char	   *SanitizeListFunction(char *listFunction);
 void		InsertProcessedFile(char *pipelineName, char *path);
@@ -0,0 +1,7 @@
+#pragma once
+
+void		InitializeFileTailPipelineState(char *pipelineName, char *filePattern,
+											int64 maxBatchBytes);
+void		RemoveTailedFiles(char *pipelineName);
+void		ExecuteFileTailPipeline(char *pipelineName, char *command);
+void		EnsureFileTailPrivileges(void);
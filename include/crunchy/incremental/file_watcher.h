@@ -0,0 +1,10 @@
+#pragma once
+
+/* database in which the file watcher runs, NULL or empty disables it */
+extern char *FileWatcherDatabase;
+
+/* time to wait for more file events before executing a pipeline, in ms */
+extern int	FileWatcherDebounce;
+
+void		RegisterFileWatcher(void);
+PGDLLEXPORT void IncrementalFileWatcherMain(Datum arg);
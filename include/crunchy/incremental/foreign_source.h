@@ -0,0 +1,4 @@
+#pragma once
+
+void		EnsureForeignSourceSupported(Oid relationId);
+int64		GetForeignSourceSafeSequenceNumber(Oid relationId);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "datatype/timestamp.h"
+
+void		InitializeJoinPipelineState(char *pipelineName, Oid rightRelationId,
+										Oid rightSequenceId, Interval *joinWindow);
+void		ResetJoinPipeline(char *pipelineName);
+void		ExecuteJoinPipeline(char *pipelineName, char *command);
@@ -0,0 +1,8 @@
+#pragma once
+
+/* thresholds for maintenance hints, 0 disables the check */
+extern int	MaintenanceDeadTupleThreshold;
+extern int	MaintenanceNonHotUpdateThreshold;
+
+bool		MaintenanceHintsEnabled(void);
+void		CheckTargetMaintenance(char *pipelineName);
@@ -0,0 +1,9 @@
+#pragma once
+
+void		InitializeOffsetPipelineState(char *pipelineName, char *fetchFunction,
+										  int batchSize, int maxRowsPerRun,
+										  char *startOffset);
+void		ResetOffsetPipeline(char *pipelineName);
+void		ExecuteOffsetPipeline(char *pipelineName, char *command);
+char	   *SanitizeFetchFunction(char *fetchFunction);
+char	   *BuildOffsetBatchQuery(char *fetchFunction, char *command);
@@ -0,0 +1,3 @@
+#pragma once
+
+PGDLLEXPORT void IncrementalPipelineWorkerMain(Datum arg);
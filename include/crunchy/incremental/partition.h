@@ -0,0 +1,11 @@
+#pragma once
+
+#include "datatype/timestamp.h"
+
+/* maximum number of partitions to create before executing a single range */
+#define MAX_PARTITIONS_PER_RANGE 1000
+
+void		EnsureTargetPartitions(char *pipelineName, TimestampTz rangeStart,
+								   TimestampTz rangeEnd);
+void		EnsureSequenceRangePartitions(char *pipelineName, Oid sourceRelationId,
+										  int64 rangeStart, int64 rangeEnd);
@@ -3,6 +3,11 @@
 #define SEQUENCE_RANGE_PIPELINE 's'
 #define TIME_INTERVAL_PIPELINE 't'
 #define FILE_LIST_PIPELINE 'f'
+#define FILE_TAIL_PIPELINE 'l'
+#define TIME_BUCKET_PIPELINE 'b'
+#define JOIN_PIPELINE 'j'
+#define OFFSET_PIPELINE 'o'
+#define ROLLUP_PIPELINE 'r'
 
 typedef char PipelineType;
 
@@ -23,6 +28,12 @@ typedef struct PipelineDesc
 	/* OID of the source relation or sequence */
 	Oid			sourceRelationId;
 
+	/* OID of the relation modified by the command, if known */
+	Oid			targetRelationId;
+
+	/* whether the target relation was determined, false for pipelines from before 1.4 */
+	bool		targetRelationChecked;
+
 	/* command to run for the pipeline */
 	char	   *command;
 
@@ -31,3 +42,7 @@ typedef struct PipelineDesc
 }			PipelineDesc;
 
 PipelineDesc *ReadPipelineDesc(char *pipelineName);
+void		EnsurePipelineOwner(char *pipelineName, Oid ownerId);
+void		ExecutePipeline(char *pipelineName, PipelineType pipelineType,
+							char *command, char *searchPath, bool allowCommit);
+void		CommitPipelineTransaction(void);
@@ -4,5 +4,8 @@
 #include "nodes/parsenodes.h"
 
 Query	   *ParseQuery(char *command, List *paramTypes);
+Oid			GetTargetRelationId(Query *query);
+Oid			GetCommandTargetRelationId(char *command);
+bool		ReplaceTargetRelation(Query *query, Oid newRelationId);
 char	   *DeparseQuery(Query *query);
 void		ExecuteCommand(char *commandString);
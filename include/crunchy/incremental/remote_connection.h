@@ -0,0 +1,15 @@
+#pragma once
+
+#include "libpq-fe.h"
+
+PGconn	   *ConnectToRemoteServer(const char *const *keywords, const char *const *values,
+								  bool expandDbname);
+void		ConfigureRemoteSession(PGconn *connection);
+int			SetTransmissionModes(void);
+void		ResetTransmissionModes(int nestLevel);
+PGresult   *ExecuteRemoteQuery(PGconn *connection, const char *query, int paramCount,
+							   const char *const *paramValues);
+PGresult   *GetRemoteResult(PGconn *connection);
+bool		PutRemoteCopyData(PGconn *connection, const char *buffer, int length);
+bool		PutRemoteCopyEnd(PGconn *connection);
+void		CloseRemoteConnection(PGconn *connection);
@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * RemoteSink describes a remote table into which the results of a pipeline
+ * command are copied.
+ */
+typedef struct RemoteSink
+{
+	/* libpq connection string of the remote server */
+	char	   *connectionString;
+
+	/* name of the remote table that receives the rows */
+	char	   *remoteTable;
+
+	/* name of the remote table that tracks the last delivered range */
+	char	   *progressTable;
+
+	/* number of rows to fetch and send at a time */
+	int			batchSize;
+}			RemoteSink;
+
+RemoteSink *ReadRemoteSink(char *pipelineName);
+void		ExecuteRemoteSinkForRange(char *pipelineName, RemoteSink * sink, char *command,
+									  int64 rangeStart, int64 rangeEnd);
+void		ClearRemoteProgress(char *pipelineName);
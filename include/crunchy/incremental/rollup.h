@@ -0,0 +1,29 @@
+#pragma once
+
+#include "nodes/pg_list.h"
+#include "utils/array.h"
+
+/*
+ * RollupDefinition describes how a rollup pipeline aggregates the new rows
+ * of its source table into its target table.
+ */
+typedef struct RollupDefinition
+{
+	/* query that returns the dimensions and aggregate inputs of a range */
+	char	   *scanCommand;
+
+	/* upsert of the aggregated groups into the target table */
+	char	   *mergeCommand;
+
+	/* number of leading columns of the scan command that are dimensions */
+	int			dimensionCount;
+
+	/* names of the aggregates, in order of the target columns */
+	List	   *aggregateNames;
+}			RollupDefinition;
+
+RollupDefinition *BuildRollupDefinition(Oid sourceRelationId, Oid sequenceId,
+										Oid targetRelationId, ArrayType *dimensions,
+										ArrayType *aggregates);
+void		InitializeRollupPipelineState(char *pipelineName, RollupDefinition * definition);
+void		ExecuteRollupPipeline(char *pipelineName, char *command);
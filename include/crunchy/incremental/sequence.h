@@ -1,6 +1,34 @@
 #pragma once
 
-void		InitializeSequencePipelineState(char *pipelineName, Oid sequenceId);
+#include "storage/block.h"
+
+/* maximum number of new heap blocks to prefetch, 0 disables prefetching */
+extern int	PrefetchBlockLimit;
+
+/*
+ * SequenceNumberRange represents a range of sequence numbers that can
+ * be safely processed.
+ */
+typedef struct SequenceNumberRange
+{
+	uint64		rangeStart;
+	uint64		rangeEnd;
+
+	/* whether the range end came from a replicated watermark */
+	bool		fromWatermark;
+
+	/* whether the range end has to come from the server of a foreign table */
+	bool		fromForeignSource;
+
+	/* number of heap blocks in the source during the previous run */
+	BlockNumber lastBlockNumber;
+}			SequenceNumberRange;
+
+void		InitializeSequencePipelineState(char *pipelineName, Oid sequenceId,
+											char *watermarkName, bool foreignSource);
 void		UpdateLastProcessedSequenceNumber(char *pipelineName, int64 lastSequenceNumber);
 void		ExecuteSequenceRangePipeline(char *pipelineName, char *command);
+SequenceNumberRange *PopSequenceNumberRange(char *pipelineName, Oid relationId);
+void		WaitForSequenceWriters(Oid relationId);
 Oid			FindSequenceForRelation(Oid relationId);
+void		EnsureWatermarkOwner(char *watermarkName);
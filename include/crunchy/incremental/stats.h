@@ -0,0 +1,56 @@
+#pragma once
+
+#include "crunchy/incremental/pipeline.h"
+#include "datatype/timestamp.h"
+
+/* maximum length of a pipeline name in shared memory statistics */
+#define STATS_PIPELINE_NAME_LEN 128
+
+/*
+ * PipelineStats contains the execution statistics of a pipeline, kept
+ * in shared memory.
+ */
+typedef struct PipelineStats
+{
+	/* whether the slot is used */
+	bool		inUse;
+
+	/* database in which the pipeline lives */
+	Oid			databaseId;
+	char		databaseName[NAMEDATALEN];
+
+	/* name of the pipeline, truncated if needed */
+	char		pipelineName[STATS_PIPELINE_NAME_LEN];
+
+	/* type of the pipeline */
+	PipelineType pipelineType;
+
+	/* number of executions, including failed ones */
+	int64		runCount;
+
+	/* number of executions that threw an error */
+	int64		failureCount;
+
+	/* total and most recent execution time in microseconds */
+	int64		totalDuration;
+	int64		lastDuration;
+
+	/* total time spent waiting for concurrent writers in microseconds */
+	int64		totalLockWait;
+
+	/* start time of the most recent (successful) execution */
+	TimestampTz lastRunTime;
+	TimestampTz lastSuccessTime;
+}			PipelineStats;
+
+/* maximum number of pipelines for which statistics are tracked */
+extern int	MaxTrackedPipelines;
+
+void		InitializePipelineStats(void);
+bool		PipelineStatsEnabled(void);
+void		StartPipelineStats(void);
+void		RecordLockWait(TimestampTz waitStart);
+void		RecordPipelineRun(char *pipelineName, PipelineType pipelineType,
+							  TimestampTz startTime, bool succeeded);
+void		RemovePipelineStats(char *pipelineName);
+int			CopyPipelineStats(PipelineStats * statsArray, int maxCount);
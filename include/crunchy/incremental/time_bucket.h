@@ -0,0 +1,11 @@
+#pragma once
+
+void		InitializeTimeBucketPipelineState(char *pipelineName, char *sequenceColumn,
+											  char *timeColumn, Oid stagingRelationId,
+											  Interval *timeInterval,
+											  Interval *allowedLateness,
+											  char *correctionCommand,
+											  Interval *idleTimeout);
+void		EnsureStagingColumnsMatch(Oid sourceRelationId, Oid stagingRelationId);
+void		ResetTimeBucketPipeline(char *pipelineName);
+void		ExecuteTimeBucketPipeline(char *pipelineName, char *command);
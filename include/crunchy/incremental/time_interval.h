@@ -1,8 +1,26 @@
 #pragma once
 
+/*
+ * TimeParameterType is the type as which the start and end of a time range
+ * are passed to the command, such that they match the source column.
+ */
+typedef enum TimeParameterType
+{
+	TIME_PARAMETER_TIMESTAMPTZ,
+	TIME_PARAMETER_TIMESTAMP,
+	TIME_PARAMETER_DATE,
+	TIME_PARAMETER_EPOCH_SECONDS,
+	TIME_PARAMETER_EPOCH_MS
+}			TimeParameterType;
+
 void		InitializeTimeRangePipelineState(char *pipelineName, bool batched,
 											 TimestampTz startTime,
 											 Interval *timeInterval,
-											 Interval *minDelay);
+											 Interval *minDelay,
+											 TimeParameterType parameterType);
 void		UpdateLastProcessedTimeInterval(char *pipelineName, TimestampTz lastProcessedTime);
 void		ExecuteTimeIntervalPipeline(char *pipelineName, char *command);
+TimeParameterType ParseTimeParameterType(char *parameterTypeName);
+Oid			TimeParameterTypeId(TimeParameterType parameterType);
+Datum		ConvertTimeParameter(TimestampTz timestamp, TimeParameterType parameterType);
+TimeParameterType ReadTimeParameterType(char *pipelineName);
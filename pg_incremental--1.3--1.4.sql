@@ -0,0 +1,817 @@
+/* HyperLogLog sketches for approximate distinct counts */
+CREATE TYPE incremental.hll;
+
+CREATE FUNCTION incremental.hll_in(cstring)
+ RETURNS incremental.hll
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_in$function$;
+
+CREATE FUNCTION incremental.hll_out(incremental.hll)
+ RETURNS cstring
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_out$function$;
+
+CREATE FUNCTION incremental.hll_recv(internal)
+ RETURNS incremental.hll
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_recv$function$;
+
+CREATE FUNCTION incremental.hll_send(incremental.hll)
+ RETURNS bytea
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_send$function$;
+
+CREATE TYPE incremental.hll (
+    input = incremental.hll_in,
+    output = incremental.hll_out,
+    receive = incremental.hll_recv,
+    send = incremental.hll_send,
+    internallength = variable,
+    storage = extended
+);
+COMMENT ON TYPE incremental.hll
+ IS 'HyperLogLog sketch for approximate distinct counts';
+
+CREATE FUNCTION incremental.hll_agg_trans(internal, anyelement)
+ RETURNS internal
+ LANGUAGE C
+ PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_agg_trans$function$;
+
+CREATE FUNCTION incremental.hll_merge_trans(internal, incremental.hll)
+ RETURNS internal
+ LANGUAGE C
+ PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_merge_trans$function$;
+
+CREATE FUNCTION incremental.hll_agg_final(internal)
+ RETURNS incremental.hll
+ LANGUAGE C
+ STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_agg_final$function$;
+
+CREATE FUNCTION incremental.hll_combine(internal, internal)
+ RETURNS internal
+ LANGUAGE C
+ PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_combine$function$;
+
+CREATE FUNCTION incremental.hll_serialize(internal)
+ RETURNS bytea
+ LANGUAGE C
+ STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_serialize$function$;
+
+CREATE FUNCTION incremental.hll_deserialize(bytea, internal)
+ RETURNS internal
+ LANGUAGE C
+ STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_deserialize$function$;
+
+CREATE AGGREGATE incremental.hll_agg(anyelement) (
+    sfunc = incremental.hll_agg_trans,
+    stype = internal,
+    finalfunc = incremental.hll_agg_final,
+    combinefunc = incremental.hll_combine,
+    serialfunc = incremental.hll_serialize,
+    deserialfunc = incremental.hll_deserialize,
+    parallel = safe
+);
+COMMENT ON AGGREGATE incremental.hll_agg(anyelement)
+ IS 'build a HyperLogLog sketch of the distinct input values';
+
+CREATE AGGREGATE incremental.merge_agg(incremental.hll) (
+    sfunc = incremental.hll_merge_trans,
+    stype = internal,
+    finalfunc = incremental.hll_agg_final,
+    combinefunc = incremental.hll_combine,
+    serialfunc = incremental.hll_serialize,
+    deserialfunc = incremental.hll_deserialize,
+    parallel = safe
+);
+COMMENT ON AGGREGATE incremental.merge_agg(incremental.hll)
+ IS 'merge HyperLogLog sketches';
+
+CREATE FUNCTION incremental.merge(incremental.hll, incremental.hll)
+ RETURNS incremental.hll
+ LANGUAGE C
+ IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_merge$function$;
+COMMENT ON FUNCTION incremental.merge(incremental.hll,incremental.hll)
+ IS 'merge two HyperLogLog sketches';
+
+CREATE FUNCTION incremental.distinct_count(incremental.hll)
+ RETURNS bigint
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_hll_distinct_count$function$;
+COMMENT ON FUNCTION incremental.distinct_count(incremental.hll)
+ IS 'estimate the number of distinct values in a HyperLogLog sketch';
+
+/* DDSketch sketches for approximate quantiles */
+CREATE TYPE incremental.ddsketch;
+
+CREATE FUNCTION incremental.ddsketch_in(cstring)
+ RETURNS incremental.ddsketch
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_in$function$;
+
+CREATE FUNCTION incremental.ddsketch_out(incremental.ddsketch)
+ RETURNS cstring
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_out$function$;
+
+CREATE FUNCTION incremental.ddsketch_recv(internal)
+ RETURNS incremental.ddsketch
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_recv$function$;
+
+CREATE FUNCTION incremental.ddsketch_send(incremental.ddsketch)
+ RETURNS bytea
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_send$function$;
+
+CREATE TYPE incremental.ddsketch (
+    input = incremental.ddsketch_in,
+    output = incremental.ddsketch_out,
+    receive = incremental.ddsketch_recv,
+    send = incremental.ddsketch_send,
+    internallength = variable,
+    alignment = double,
+    storage = extended
+);
+COMMENT ON TYPE incremental.ddsketch
+ IS 'DDSketch for approximate quantiles with 1% relative error';
+
+CREATE FUNCTION incremental.ddsketch_agg_trans(internal, double precision)
+ RETURNS internal
+ LANGUAGE C
+ PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_agg_trans$function$;
+
+CREATE FUNCTION incremental.ddsketch_merge_trans(internal, incremental.ddsketch)
+ RETURNS internal
+ LANGUAGE C
+ PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_merge_trans$function$;
+
+CREATE FUNCTION incremental.ddsketch_agg_final(internal)
+ RETURNS incremental.ddsketch
+ LANGUAGE C
+ STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_agg_final$function$;
+
+CREATE FUNCTION incremental.ddsketch_combine(internal, internal)
+ RETURNS internal
+ LANGUAGE C
+ PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_combine$function$;
+
+CREATE FUNCTION incremental.ddsketch_serialize(internal)
+ RETURNS bytea
+ LANGUAGE C
+ STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_serialize$function$;
+
+CREATE FUNCTION incremental.ddsketch_deserialize(bytea, internal)
+ RETURNS internal
+ LANGUAGE C
+ STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_deserialize$function$;
+
+CREATE AGGREGATE incremental.ddsketch_agg(double precision) (
+    sfunc = incremental.ddsketch_agg_trans,
+    stype = internal,
+    finalfunc = incremental.ddsketch_agg_final,
+    combinefunc = incremental.ddsketch_combine,
+    serialfunc = incremental.ddsketch_serialize,
+    deserialfunc = incremental.ddsketch_deserialize,
+    parallel = safe
+);
+COMMENT ON AGGREGATE incremental.ddsketch_agg(double precision)
+ IS 'build a DDSketch of the input values';
+
+CREATE AGGREGATE incremental.merge_agg(incremental.ddsketch) (
+    sfunc = incremental.ddsketch_merge_trans,
+    stype = internal,
+    finalfunc = incremental.ddsketch_agg_final,
+    combinefunc = incremental.ddsketch_combine,
+    serialfunc = incremental.ddsketch_serialize,
+    deserialfunc = incremental.ddsketch_deserialize,
+    parallel = safe
+);
+COMMENT ON AGGREGATE incremental.merge_agg(incremental.ddsketch)
+ IS 'merge DDSketches';
+
+CREATE FUNCTION incremental.merge(incremental.ddsketch, incremental.ddsketch)
+ RETURNS incremental.ddsketch
+ LANGUAGE C
+ IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_merge$function$;
+COMMENT ON FUNCTION incremental.merge(incremental.ddsketch,incremental.ddsketch)
+ IS 'merge two DDSketches';
+
+CREATE FUNCTION incremental.quantile(incremental.ddsketch, double precision)
+ RETURNS double precision
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_quantile$function$;
+COMMENT ON FUNCTION incremental.quantile(incremental.ddsketch,double precision)
+ IS 'approximate value at the given quantile of a DDSketch';
+
+CREATE FUNCTION incremental.value_count(incremental.ddsketch)
+ RETURNS bigint
+ LANGUAGE C
+ IMMUTABLE STRICT PARALLEL SAFE
+AS 'MODULE_PATHNAME', $function$incremental_ddsketch_count$function$;
+COMMENT ON FUNCTION incremental.value_count(incremental.ddsketch)
+ IS 'number of values in a DDSketch';
+
+/* pipelines that process bytes appended to local files */
+CREATE TABLE incremental.file_tail_pipelines (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    file_pattern text not null,
+    max_batch_bytes bigint,
+    primary key (pipeline_name)
+);
+GRANT SELECT ON incremental.file_tail_pipelines TO public;
+
+/* files that are being tailed, and the offset up to which they were processed */
+CREATE TABLE incremental.tailed_files (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    path text not null,
+    inode bigint not null,
+    last_processed_offset bigint not null,
+    primary key (pipeline_name, path)
+);
+GRANT SELECT ON incremental.tailed_files TO public;
+
+CREATE FUNCTION incremental.create_file_tail_pipeline(
+    pipeline_name text,
+    file_pattern text,
+    command text,
+    max_batch_bytes bigint default 67108864,
+    schedule text default '* * * * *',
+    execute_immediately bool default true)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_file_tail_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_file_tail_pipeline(text,text,text,bigint,text,bool)
+ IS 'create a pipeline of bytes appended to local files';
+
+/* last sequence numbers up to which all writes committed, usually replicated */
+CREATE TABLE incremental.sequence_watermarks (
+    watermark_name text not null,
+    last_safe_sequence_number bigint not null,
+    owner_id oid not null,
+    updated_time timestamptz not null default now(),
+    primary key (watermark_name)
+);
+GRANT SELECT ON incremental.sequence_watermarks TO public;
+
+/* sequence pipelines can use a watermark instead of a local sequence */
+ALTER TABLE incremental.sequence_pipelines ALTER COLUMN sequence_name DROP NOT NULL;
+ALTER TABLE incremental.sequence_pipelines ADD COLUMN watermark_name text;
+
+DROP FUNCTION incremental.create_sequence_pipeline(text,regclass,text,text,bool);
+CREATE FUNCTION incremental.create_sequence_pipeline(
+    pipeline_name text,
+    source_table_name regclass,
+    command text,
+    schedule text default '* * * * *',
+    execute_immediately bool default true,
+    watermark_name text default NULL)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_sequence_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_sequence_pipeline(text,regclass,text,text,bool,text)
+ IS 'create a pipeline of new sequence ranges';
+
+CREATE FUNCTION incremental.set_sequence_watermark(
+    watermark_name text,
+    sequence_number bigint)
+ RETURNS void
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_set_sequence_watermark$function$;
+COMMENT ON FUNCTION incremental.set_sequence_watermark(text,bigint)
+ IS 'advance the sequence number up to which all writes committed';
+
+CREATE FUNCTION incremental.reset_sequence_watermark(
+    watermark_name text,
+    sequence_number bigint)
+ RETURNS void
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_reset_sequence_watermark$function$;
+COMMENT ON FUNCTION incremental.reset_sequence_watermark(text,bigint)
+ IS 'set the sequence number up to which all writes committed, even if lower';
+
+/* pipelines that stage sequence ranges and process time buckets once closed */
+CREATE TABLE incremental.time_bucket_pipelines (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    sequence_column text not null,
+    time_column text not null,
+    staging_table regclass not null,
+    time_interval interval not null,
+    allowed_lateness interval not null,
+    correction_command text,
+    idle_timeout interval,
+    closed_until timestamptz,
+    watermark timestamptz,
+    primary key (pipeline_name)
+);
+GRANT SELECT ON incremental.time_bucket_pipelines TO public;
+
+CREATE FUNCTION incremental.create_time_bucket_pipeline(
+    pipeline_name text,
+    source_table_name regclass,
+    time_column text,
+    staging_table_name regclass,
+    command text,
+    time_interval interval default '1 day',
+    allowed_lateness interval default '1 hour',
+    correction_command text default NULL,
+    idle_timeout interval default NULL,
+    schedule text default '* * * * *',
+    execute_immediately bool default true)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_time_bucket_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_time_bucket_pipeline(text,regclass,text,regclass,text,interval,interval,text,interval,text,bool)
+ IS 'create a pipeline that processes time buckets once they are closed';
+
+/* number of heap blocks in the source table at the time of the last run, used for prefetching */
+ALTER TABLE incremental.sequence_pipelines ADD COLUMN last_block_number bigint;
+
+CREATE FUNCTION incremental.pipeline_stats(
+    OUT pipeline_name text,
+    OUT run_count bigint,
+    OUT failure_count bigint,
+    OUT total_time double precision,
+    OUT last_time double precision,
+    OUT lock_wait_time double precision,
+    OUT last_run_time timestamptz,
+    OUT last_success_time timestamptz)
+ RETURNS SETOF record
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_pipeline_stats$function$;
+COMMENT ON FUNCTION incremental.pipeline_stats()
+ IS 'execution statistics of pipelines in the current database';
+
+CREATE FUNCTION incremental.execute_pipelines(
+    pipeline_names text[],
+    parallelism int default 4,
+    OUT pipeline_name text,
+    OUT succeeded bool,
+    OUT duration double precision,
+    OUT error_message text)
+ RETURNS SETOF record
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_execute_pipelines$function$;
+COMMENT ON FUNCTION incremental.execute_pipelines(text[],int)
+ IS 'execute pipelines in parallel background workers';
+
+/* number of batches after which a file list pipeline commits its progress */
+ALTER TABLE incremental.file_list_pipelines ADD COLUMN batches_per_commit int;
+
+DROP FUNCTION incremental.create_file_list_pipeline(text,text,text,text,bool,int,text,bool);
+CREATE FUNCTION incremental.create_file_list_pipeline(
+    pipeline_name text,
+    file_pattern text,
+    command text,
+    list_function text default NULL,
+    batched bool default false,
+    max_batch_size int default 100,
+    schedule text default '*/15 * * * *',
+    execute_immediately bool default true,
+    batches_per_commit int default NULL)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_file_list_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_file_list_pipeline(text,text,text,text,bool,int,text,bool,int)
+ IS 'create a pipeline of new files';
+
+/* relation modified by the pipeline command, 0 if none, NULL if not yet determined */
+ALTER TABLE incremental.pipelines ADD COLUMN target_relation regclass;
+
+/* maintenance suggestions for relations modified by pipelines */
+CREATE TABLE incremental.maintenance_hints (
+    target_relation regclass not null,
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    dead_tuples bigint not null,
+    non_hot_updates bigint not null,
+    non_hot_update_baseline bigint not null,
+    vacuum_command text,
+    reindex_commands text[],
+    hint_time timestamptz,
+    primary key (target_relation)
+);
+GRANT SELECT ON incremental.maintenance_hints TO public;
+
+CREATE FUNCTION incremental.replay_range(
+    pipeline_name text,
+    range_start text,
+    range_end text,
+    target_override regclass default NULL,
+    dry_run bool default true,
+    OUT execution_time double precision,
+    OUT rows_processed bigint,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint,
+    OUT shared_blks_dirtied bigint,
+    OUT shared_blks_written bigint,
+    OUT temp_blks_read bigint,
+    OUT temp_blks_written bigint)
+ RETURNS record
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_replay_range$function$;
+COMMENT ON FUNCTION incremental.replay_range(text,text,text,regclass,bool)
+ IS 'execute the pipeline command for a past range without updating the pipeline';
+
+/* range-partitioned tables into which pipelines write, partitions are created ahead of each range */
+CREATE TABLE incremental.partitioned_targets (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    target_relation regclass not null,
+    partition_interval interval not null,
+    lookahead interval not null,
+    source_time_column text,
+    sequence_column text,
+    primary key (pipeline_name)
+);
+GRANT SELECT ON incremental.partitioned_targets TO public;
+
+CREATE FUNCTION incremental.set_partitioned_target(
+    pipeline_name text,
+    target_table regclass,
+    partition_interval interval default '1 day',
+    lookahead interval default '1 day',
+    source_time_column text default NULL)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_set_partitioned_target$function$;
+COMMENT ON FUNCTION incremental.set_partitioned_target(text,regclass,interval,interval,text)
+ IS 'create partitions of a range-partitioned target ahead of each pipeline range';
+
+/* remote tables into which sequence pipelines copy their results, contains connection strings */
+CREATE TABLE incremental.remote_sinks (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    connection_string text not null,
+    remote_table text not null,
+    progress_table text not null,
+    batch_size int not null,
+    primary key (pipeline_name)
+);
+
+CREATE FUNCTION incremental.set_remote_sink(
+    pipeline_name text,
+    connection_string text,
+    remote_table text,
+    progress_table text default 'incremental_progress',
+    batch_size int default 10000)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_set_remote_sink$function$;
+REVOKE ALL ON FUNCTION incremental.set_remote_sink(text,text,text,text,int) FROM public;
+COMMENT ON FUNCTION incremental.set_remote_sink(text,text,text,text,int)
+ IS 'copy the results of a sequence pipeline into a remote table';
+
+/* right-hand side of join pipelines, the left-hand side is tracked in sequence_pipelines */
+CREATE TABLE incremental.join_pipelines (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    right_relation regclass not null,
+    right_sequence_name regclass not null,
+    right_last_processed_sequence_number bigint,
+    join_window interval not null,
+    primary key (pipeline_name)
+);
+GRANT SELECT ON incremental.join_pipelines TO public;
+
+/* start of the ranges processed by join pipelines, retained for the join window */
+CREATE TABLE incremental.join_ranges (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    processed_time timestamptz not null,
+    left_range_start bigint not null,
+    right_range_start bigint not null
+);
+CREATE INDEX ON incremental.join_ranges (pipeline_name, processed_time);
+GRANT SELECT ON incremental.join_ranges TO public;
+
+CREATE FUNCTION incremental.create_join_pipeline(
+    pipeline_name text,
+    left_table_name regclass,
+    right_table_name regclass,
+    command text,
+    join_window interval default '10 minutes',
+    schedule text default '* * * * *',
+    execute_immediately bool default true)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_join_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_join_pipeline(text,regclass,regclass,text,interval,text,bool)
+ IS 'create a pipeline that joins new rows of two tables within a window';
+
+/* append-only delta tables that are compacted into a summary table */
+CREATE TABLE incremental.delta_tables (
+    delta_table regclass not null,
+    base_table regclass not null,
+    combined_view regclass not null,
+    compaction_command text not null,
+    job_name text,
+    owner_id oid not null,
+    primary key (delta_table)
+);
+GRANT SELECT ON incremental.delta_tables TO public;
+
+CREATE FUNCTION incremental.create_delta_table(
+    base_table regclass,
+    key_columns text[],
+    combine_aggregates text[] default NULL,
+    delta_table_name text default NULL,
+    view_name text default NULL,
+    compaction_schedule text default '* * * * *')
+ RETURNS regclass
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_delta_table$function$;
+COMMENT ON FUNCTION incremental.create_delta_table(regclass,text[],text[],text,text,text)
+ IS 'create an append-only delta table that is compacted into a summary table';
+
+CREATE FUNCTION incremental.compact_delta(
+    delta_table regclass)
+ RETURNS bigint
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_compact_delta$function$;
+COMMENT ON FUNCTION incremental.compact_delta(regclass)
+ IS 'fold the rows of a delta table into its summary table';
+
+CREATE FUNCTION incremental.drop_delta_table(
+    delta_table regclass)
+ RETURNS void
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_drop_delta_table$function$;
+COMMENT ON FUNCTION incremental.drop_delta_table(regclass)
+ IS 'drop a delta table and its combined view';
+
+/* also drop join pipelines when the right-hand table is dropped, and forget dropped delta tables */
+CREATE OR REPLACE FUNCTION incremental._drop_trigger()
+ RETURNS event_trigger
+ LANGUAGE plpgsql
+ SET search_path = pg_catalog
+ SECURITY DEFINER
+ AS $function$
+DECLARE
+  v_obj record;
+  v_job_name text;
+BEGIN
+  FOR v_obj IN
+    SELECT * FROM pg_event_trigger_dropped_objects()
+    WHERE object_type IN ('table', 'foreign table', 'sequence')
+  LOOP
+    PERFORM incremental.drop_pipeline(pipeline_name)
+    FROM incremental.pipelines
+    WHERE source_relation = v_obj.objid;
+
+    PERFORM incremental.drop_pipeline(pipeline_name)
+    FROM incremental.join_pipelines
+    WHERE right_relation = v_obj.objid;
+
+    FOR v_job_name IN
+      DELETE FROM incremental.delta_tables
+      WHERE delta_table = v_obj.objid OR base_table = v_obj.objid
+      RETURNING job_name
+    LOOP
+      IF v_job_name IS NOT NULL THEN
+        PERFORM cron.unschedule(jobid) FROM cron.job WHERE jobname = v_job_name;
+      END IF;
+    END LOOP;
+  END LOOP;
+END;
+$function$;
+
+/* pipelines that consume rows from a user-defined function that pages by offset */
+CREATE TABLE incremental.offset_pipelines (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    fetch_function text not null,
+    batch_size int not null,
+    max_rows_per_run int not null,
+    start_offset text,
+    last_offset text,
+    primary key (pipeline_name)
+);
+GRANT SELECT ON incremental.offset_pipelines TO public;
+
+CREATE FUNCTION incremental.create_offset_pipeline(
+    pipeline_name text,
+    fetch_function text,
+    command text,
+    batch_size int default 1000,
+    max_rows_per_run int default 100000,
+    start_offset text default NULL,
+    schedule text default '* * * * *',
+    execute_immediately bool default true)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_offset_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_offset_pipeline(text,text,text,int,int,text,text,bool)
+ IS 'create a pipeline of rows returned by a fetch function after the last offset';
+
+/* type as which time interval pipelines pass the range to the command */
+ALTER TABLE incremental.time_interval_pipelines
+ ADD COLUMN parameter_type text not null default 'timestamptz'
+ CHECK (parameter_type IN ('timestamptz', 'timestamp', 'date', 'epoch_seconds', 'epoch_ms'));
+
+DROP FUNCTION incremental.create_time_interval_pipeline(text,interval,text,bool,timestamptz,regclass,text,interval,bool);
+CREATE FUNCTION incremental.create_time_interval_pipeline(
+    pipeline_name text,
+    time_interval interval,
+    command text,
+    batched bool default true,
+    start_time timestamptz default NULL,
+    source_table_name regclass default NULL,
+    schedule text default '* * * * *',
+    min_delay interval default '30 seconds',
+    execute_immediately bool default true,
+    parameter_type text default 'timestamptz')
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_time_interval_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_time_interval_pipeline(text,interval,text,bool,timestamptz,regclass,text,interval,bool,text)
+ IS 'create a pipeline of new time intervals';
+
+/* sequence pipelines over postgres_fdw tables get a safe sequence number from the remote server */
+ALTER TABLE incremental.sequence_pipelines ADD COLUMN foreign_source bool not null default false;
+
+CREATE FUNCTION incremental.get_safe_sequence_number(source_table_name regclass)
+ RETURNS bigint
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_get_safe_sequence_number$function$;
+COMMENT ON FUNCTION incremental.get_safe_sequence_number(regclass)
+ IS 'get the last sequence number of a table after waiting for concurrent writers';
+
+/* dimension tables whose changes are corrected in the summary of a pipeline */
+CREATE TABLE incremental.pipeline_dimensions (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    dimension_table regclass not null,
+    key_column text not null,
+    correction_command text not null,
+    primary key (pipeline_name, dimension_table)
+);
+GRANT SELECT ON incremental.pipeline_dimensions TO public;
+
+/* keys of dimension rows that changed since the last run of a pipeline */
+CREATE TABLE incremental.dimension_changes (
+    pipeline_name text not null,
+    dimension_table regclass not null,
+    key text not null,
+    primary key (pipeline_name, dimension_table, key),
+    foreign key (pipeline_name, dimension_table) references incremental.pipeline_dimensions (pipeline_name, dimension_table) on delete cascade on update cascade
+);
+
+CREATE FUNCTION incremental._dimension_change_trigger()
+ RETURNS trigger
+ LANGUAGE plpgsql
+ SET search_path = pg_catalog
+ SECURITY DEFINER
+ AS $function$
+DECLARE
+  v_dimension record;
+BEGIN
+  /*
+   * Keys that are already logged are updated rather than skipped, such that
+   * a pipeline that pops them waits for this transaction to commit and its
+   * correction sees the new values.
+   */
+  FOR v_dimension IN
+    SELECT pipeline_name, key_column FROM incremental.pipeline_dimensions
+    WHERE dimension_table = TG_RELID
+  LOOP
+    IF TG_OP IN ('UPDATE', 'DELETE') THEN
+      EXECUTE format('INSERT INTO incremental.dimension_changes (pipeline_name, dimension_table, key) '
+                     'SELECT DISTINCT $1, $2, %1$I::text FROM old_rows WHERE %1$I IS NOT NULL '
+                     'ON CONFLICT (pipeline_name, dimension_table, key) DO UPDATE SET key = excluded.key',
+                     v_dimension.key_column)
+      USING v_dimension.pipeline_name, TG_RELID::regclass;
+    END IF;
+
+    IF TG_OP IN ('INSERT', 'UPDATE') THEN
+      EXECUTE format('INSERT INTO incremental.dimension_changes (pipeline_name, dimension_table, key) '
+                     'SELECT DISTINCT $1, $2, %1$I::text FROM new_rows WHERE %1$I IS NOT NULL '
+                     'ON CONFLICT (pipeline_name, dimension_table, key) DO UPDATE SET key = excluded.key',
+                     v_dimension.key_column)
+      USING v_dimension.pipeline_name, TG_RELID::regclass;
+    END IF;
+  END LOOP;
+
+  RETURN NULL;
+END;
+$function$;
+
+CREATE FUNCTION incremental.add_dimension(
+    pipeline_name text,
+    dimension_table regclass,
+    key_column text,
+    correction_command text)
+ RETURNS void
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_add_dimension$function$;
+COMMENT ON FUNCTION incremental.add_dimension(text,regclass,text,text)
+ IS 'correct the summary of a pipeline for changed rows of a dimension table';
+
+CREATE FUNCTION incremental.remove_dimension(
+    pipeline_name text,
+    dimension_table regclass)
+ RETURNS void
+ LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $function$incremental_remove_dimension$function$;
+COMMENT ON FUNCTION incremental.remove_dimension(text,regclass)
+ IS 'stop correcting the summary of a pipeline for changes to a dimension table';
+
+CREATE OR REPLACE FUNCTION incremental._drop_trigger()
+ RETURNS event_trigger
+ LANGUAGE plpgsql
+ SET search_path = pg_catalog
+ SECURITY DEFINER
+ AS $function$
+DECLARE
+  v_obj record;
+  v_job_name text;
+BEGIN
+  FOR v_obj IN
+    SELECT * FROM pg_event_trigger_dropped_objects()
+    WHERE object_type IN ('table', 'foreign table', 'sequence')
+  LOOP
+    PERFORM incremental.drop_pipeline(pipeline_name)
+    FROM incremental.pipelines
+    WHERE source_relation = v_obj.objid;
+
+    PERFORM incremental.drop_pipeline(pipeline_name)
+    FROM incremental.join_pipelines
+    WHERE right_relation = v_obj.objid;
+
+    DELETE FROM incremental.pipeline_dimensions
+    WHERE dimension_table = v_obj.objid;
+
+    FOR v_job_name IN
+      DELETE FROM incremental.delta_tables
+      WHERE delta_table = v_obj.objid OR base_table = v_obj.objid
+      RETURNING job_name
+    LOOP
+      IF v_job_name IS NOT NULL THEN
+        PERFORM cron.unschedule(jobid) FROM cron.job WHERE jobname = v_job_name;
+      END IF;
+    END LOOP;
+  END LOOP;
+END;
+$function$;
+
+CREATE TABLE incremental.rollup_pipelines (
+    pipeline_name text not null references incremental.pipelines (pipeline_name) on delete cascade on update cascade,
+    scan_command text not null,
+    dimension_count int not null,
+    aggregate_names text[] not null,
+    primary key (pipeline_name)
+);
+GRANT SELECT ON incremental.rollup_pipelines TO public;
+
+CREATE FUNCTION incremental.create_rollup_pipeline(
+    pipeline_name text,
+    source_table_name regclass,
+    target_table_name regclass,
+    dimensions text[],
+    aggregates text[],
+    schedule text default '* * * * *',
+    execute_immediately bool default true)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_rollup_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_rollup_pipeline(text,regclass,regclass,text[],text[],text,bool)
+ IS 'create a pipeline that aggregates new rows into a target table without a command';
+
+/* removal of processed files that no longer appear in the listing */
+ALTER TABLE incremental.processed_files ADD COLUMN processed_time timestamptz not null default now();
+ALTER TABLE incremental.processed_files ADD COLUMN missing_count int not null default 0;
+ALTER TABLE incremental.file_list_pipelines ADD COLUMN cleanup_grace_period interval;
+
+DROP FUNCTION incremental.create_file_list_pipeline(text,text,text,text,bool,int,text,bool,int);
+CREATE FUNCTION incremental.create_file_list_pipeline(
+    pipeline_name text,
+    file_pattern text,
+    command text,
+    list_function text default NULL,
+    batched bool default false,
+    max_batch_size int default 100,
+    schedule text default '*/15 * * * *',
+    execute_immediately bool default true,
+    batches_per_commit int default NULL,
+    cleanup_grace_period interval default NULL)
+ RETURNS void
+ LANGUAGE C
+AS 'MODULE_PATHNAME', $function$incremental_create_file_list_pipeline$function$;
+COMMENT ON FUNCTION incremental.create_file_list_pipeline(text,text,text,text,bool,int,text,bool,int,interval)
+ IS 'create a pipeline of new files';
@@ -0,0 +1,57 @@
+# Time interval pipelines only wait for writers whose transaction started
+# before the end of the range.
+
+setup
+{
+	create extension if not exists pg_incremental cascade;
+	create table writer_events (event_time timestamptz default now(), value int);
+	create table daily_counts (day timestamptz primary key, event_count bigint);
+	create table second_counts (second timestamptz primary key, event_count bigint);
+
+	select incremental.create_time_interval_pipeline('daily-counts', '1 day',
+	  start_time := now() - interval '3 days',
+	  source_table_name := 'writer_events',
+	  schedule := NULL,
+	  min_delay := '0 seconds',
+	  execute_immediately := false,
+	  command := $$
+	  insert into daily_counts
+	  select date_trunc('day', event_time), count(*)
+	  from writer_events where event_time >= $1 and event_time < $2 group by 1
+	  $$);
+
+	select incremental.create_time_interval_pipeline('second-counts', '1 second',
+	  start_time := now() - interval '5 seconds',
+	  source_table_name := 'writer_events',
+	  schedule := NULL,
+	  min_delay := '0 seconds',
+	  execute_immediately := false,
+	  command := $$
+	  insert into second_counts
+	  select date_trunc('second', event_time), count(*)
+	  from writer_events where event_time >= $1 and event_time < $2 group by 1
+	  $$);
+}
+
+teardown
+{
+	drop extension pg_incremental;
+	drop table writer_events, daily_counts, second_counts;
+}
+
+session writer
+step w_begin { begin; }
+step w_insert { insert into writer_events (value) values (1); }
+step w_commit { commit; }
+
+session pipeline
+setup { set client_min_messages to warning; }
+step p_daily { call incremental.execute_pipeline('daily-counts'); }
+step p_sleep { do $$ begin perform pg_sleep(1.1); end $$; }
+step p_seconds { call incremental.execute_pipeline('second-counts'); }
+
+# the writer started after the end of the last full day, so the range closes
+permutation w_begin w_insert p_daily w_commit
+
+# the writer started before the end of the last full second, so we wait
+permutation w_begin w_insert p_sleep p_seconds w_commit
@@ -0,0 +1,65 @@
+create extension pg_incremental cascade;
+create schema file_tail;
+set search_path to file_tail;
+
+-- tail a local file that is appended to, rotated, and truncated
+copy (select where false) to program 'rm -f /tmp/pg_incremental_tail.log*';
+copy (select 'line-' || s from generate_series(1,3) s) to '/tmp/pg_incremental_tail.log';
+create table tail_lines (path text, line text);
+
+select incremental.create_file_tail_pipeline('log-tail', '/tmp/pg_incremental_tail.log*', $$
+  insert into tail_lines
+  select $1, line
+  from regexp_split_to_table(rtrim(pg_read_file($1, $2, $3 - $2), E'\n'), E'\n') line
+  $$,
+  schedule := NULL);
+
+-- only complete lines are processed
+copy (select 'line-' || s from generate_series(4,5) s) to program 'cat >> /tmp/pg_incremental_tail.log';
+copy (select where false) to program 'printf line-6 >> /tmp/pg_incremental_tail.log';
+call incremental.execute_pipeline('log-tail');
+
+-- after rotation, the rest of the old file and the new file are processed
+copy (select where false) to program 'echo >> /tmp/pg_incremental_tail.log';
+copy (select where false) to program 'mv /tmp/pg_incremental_tail.log /tmp/pg_incremental_tail.log.1';
+copy (select 'line-7') to '/tmp/pg_incremental_tail.log';
+call incremental.execute_pipeline('log-tail');
+
+-- a file that is truncated in place is processed from the start
+copy (select 'l8') to '/tmp/pg_incremental_tail.log';
+call incremental.execute_pipeline('log-tail');
+
+call incremental.execute_pipeline('log-tail');
+
+select path, last_processed_offset from incremental.tailed_files where pipeline_name = 'log-tail' order by path;
+
+select path, line from tail_lines order by path, line collate "C";
+
+-- without max_batch_bytes, all complete lines are processed at once
+copy (select 'line-' || s from generate_series(1,3) s) to '/tmp/pg_incremental_tail_batch.log';
+
+select incremental.create_file_tail_pipeline('unlimited-tail', '/tmp/pg_incremental_tail_batch.log', $$
+  insert into tail_lines
+  select $1, line
+  from regexp_split_to_table(rtrim(pg_read_file($1, $2, $3 - $2), E'\n'), E'\n') line
+  $$,
+  max_batch_bytes := NULL,
+  schedule := NULL);
+
+-- batches end at the last complete line that fits in max_batch_bytes
+select incremental.create_file_tail_pipeline('small-batch-tail', '/tmp/pg_incremental_tail_batch.log', $$
+  insert into tail_lines
+  select $1, line
+  from regexp_split_to_table(rtrim(pg_read_file($1, $2, $3 - $2), E'\n'), E'\n') line
+  $$,
+  max_batch_bytes := 10,
+  schedule := NULL);
+
+select pipeline_name, max_batch_bytes from incremental.file_tail_pipelines order by 1;
+
+copy (select where false) to program 'rm -f /tmp/pg_incremental_tail_batch.log';
+
+copy (select where false) to program 'rm -f /tmp/pg_incremental_tail.log*';
+
+drop schema file_tail cascade;
+drop extension pg_incremental;
@@ -0,0 +1,87 @@
+-- postgres_fdw is not available in every installation, in which case the
+-- test is skipped (see foreign_source_1.out)
+select count(*) = 0 as skip_test from pg_available_extensions where name = 'postgres_fdw' \gset
+\if :skip_test
+\quit
+\endif
+
+create extension pg_incremental cascade;
+create extension postgres_fdw;
+create schema foreign_source;
+set search_path to foreign_source;
+set client_min_messages to warning;
+
+-- a loopback server stands in for the remote server
+do $do$
+begin
+  execute format('create server loopback foreign data wrapper postgres_fdw options (dbname %L, port %L)',
+                 current_database(), current_setting('port'));
+end
+$do$;
+
+create table events (event_id bigint generated always as identity, value int);
+create foreign table remote_events (event_id bigint, value int)
+server loopback options (schema_name 'foreign_source', table_name 'events');
+create table event_totals (pipeline_name text, total bigint);
+
+insert into events (value) select s from generate_series(1,10) s;
+
+select incremental.create_sequence_pipeline('remote-totals', 'remote_events',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  insert into event_totals
+  select 'remote-totals', sum(value) from remote_events where event_id between $1 and $2
+  $$);
+
+-- the pipeline owner needs a user mapping to get a safe sequence number
+\set VERBOSITY terse
+call incremental.execute_pipeline('remote-totals');
+\set VERBOSITY default
+
+create user mapping for current_user server loopback;
+call incremental.execute_pipeline('remote-totals');
+select * from event_totals order by 1;
+select pipeline_name, last_processed_sequence_number from incremental.sequence_pipelines
+where pipeline_name = 'remote-totals';
+
+insert into events (value) select s from generate_series(11,20) s;
+
+-- a superuser does not need a password, but other roles do
+create role regress_fdw_user;
+grant usage on schema foreign_source to regress_fdw_user;
+grant select on remote_events to regress_fdw_user;
+grant insert on event_totals to regress_fdw_user;
+grant usage on foreign server loopback to regress_fdw_user;
+create user mapping for regress_fdw_user server loopback;
+
+set role regress_fdw_user;
+select incremental.create_sequence_pipeline('user-totals', 'remote_events',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  insert into event_totals
+  select 'user-totals', sum(value) from remote_events where event_id between $1 and $2
+  $$);
+
+\set VERBOSITY terse
+call incremental.execute_pipeline('user-totals');
+\set VERBOSITY default
+reset role;
+
+-- unless a superuser sets password_required to false on the user mapping
+alter user mapping for regress_fdw_user server loopback options (add password_required 'false');
+
+set role regress_fdw_user;
+call incremental.execute_pipeline('user-totals');
+select incremental.drop_pipeline('user-totals');
+reset role;
+
+select * from event_totals order by 1;
+
+select incremental.drop_pipeline('remote-totals');
+drop schema foreign_source cascade;
+drop server loopback cascade;
+drop role regress_fdw_user;
+drop extension postgres_fdw;
+drop extension pg_incremental;
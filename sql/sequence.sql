@@ -71,5 +71,443 @@ call incremental.execute_pipeline('event-aggregation');
 select count(*) from events;
 select sum(event_count) from events_agg;
 
+-- replay the full range without changing the target
+select rows_processed > 0 from incremental.replay_range('event-aggregation', '1', '201');
+select sum(event_count) from events_agg;
+
+-- replay the full range into a separate table
+create table events_agg_replay (like events_agg including all);
+select rows_processed > 0 from incremental.replay_range('event-aggregation', '1', '201',
+  target_override := 'events_agg_replay',
+  dry_run := false);
+select sum(event_count) from events_agg_replay;
+select sum(event_count) from events_agg;
+
+-- join requests and responses within a window
+create table requests (id bigint generated always as identity, request_id bigint);
+create table responses (id bigint generated always as identity, request_id bigint);
+create table request_pairs (request_id bigint primary key);
+
+insert into requests (request_id) select s from generate_series(1,10) s;
+insert into responses (request_id) select s from generate_series(1,5) s;
+
+select incremental.create_join_pipeline('request-pairs', 'requests', 'responses',
+  schedule := NULL,
+  command := $$
+  insert into request_pairs
+  select q.request_id
+  from requests q join responses s using (request_id)
+  where (q.id between $1 and $2 and s.id between $6 and $4)
+     or (q.id between $5 and $1 - 1 and s.id between $3 and $4)
+  $$);
+
+select count(*) from request_pairs;
+
+-- new responses are joined with retained requests
+insert into responses (request_id) select s from generate_series(6,10) s;
+
+call incremental.execute_pipeline('request-pairs');
+call incremental.execute_pipeline('request-pairs');
+
+select count(*) from request_pairs;
+
+-- correct summaries for clients that changed plan
+create table clients (client_id bigint primary key, plan text not null);
+create table client_events (id bigint generated always as identity, client_id bigint not null);
+create table client_plan_counts (client_id bigint primary key, plan text not null, event_count bigint not null);
+
+insert into clients values (1, 'free'), (2, 'free'), (3, 'pro');
+insert into client_events (client_id) select s % 3 + 1 from generate_series(1,30) s;
+
+select incremental.create_sequence_pipeline('client-plan-counts', 'client_events',
+  schedule := NULL,
+  command := $$
+  insert into client_plan_counts
+  select client_id, plan, count(*)
+  from client_events join clients using (client_id)
+  where id between $1 and $2
+  group by 1, 2
+  on conflict (client_id) do update set event_count = client_plan_counts.event_count + excluded.event_count
+  $$);
+
+select incremental.add_dimension('client-plan-counts', 'clients', 'client_id', $$
+  insert into client_plan_counts
+  select client_id, plan, count(*)
+  from client_events join clients using (client_id)
+  where id <= $2 and client_id = any($1::bigint[])
+  group by 1, 2
+  on conflict (client_id) do update set plan = excluded.plan, event_count = excluded.event_count
+  $$);
+
+update clients set plan = 'pro' where client_id = 1;
+insert into client_events (client_id) values (1);
+
+call incremental.execute_pipeline('client-plan-counts');
+call incremental.execute_pipeline('client-plan-counts');
+
+select * from client_plan_counts order by client_id;
+
+-- aggregate new rows in C without a command
+create table page_views (id bigint generated always as identity, path text, duration int);
+create table page_view_stats (path text primary key, view_count bigint, total_duration bigint, min_duration int, max_duration int);
+
+insert into page_views (path, duration) select '/page-' || (s % 3), s from generate_series(1,30) s;
+
+select incremental.create_rollup_pipeline('page-view-stats', 'page_views', 'page_view_stats',
+  dimensions := '{path}',
+  aggregates := '{view_count:count(*),total_duration:sum(duration),min_duration:min(duration),max_duration:max(duration)}',
+  schedule := NULL);
+
+insert into page_views (path, duration) select '/page-' || (s % 4), s from generate_series(31,40) s;
+
+call incremental.execute_pipeline('page-view-stats');
+
+select * from page_view_stats order by path;
+
+-- many groups per batch, such that the hash table grows while aggregating
+create table client_views (id bigint generated always as identity, client_id bigint, amount int);
+create table client_totals (client_id bigint primary key, view_count bigint, total_amount bigint);
+
+insert into client_views (client_id, amount) select s % 5000, s from generate_series(1,20000) s;
+
+select incremental.create_rollup_pipeline('client-totals', 'client_views', 'client_totals',
+  dimensions := '{client_id}',
+  aggregates := '{view_count:count(*),total_amount:sum(amount)}',
+  schedule := NULL);
+
+select count(*) from client_totals;
+select count(*) from client_totals t
+full join (select client_id, count(*) view_count, sum(amount) total_amount from client_views group by 1) v using (client_id)
+where t.view_count is distinct from v.view_count or t.total_amount is distinct from v.total_amount;
+
+-- NULL dimensions only merge into NOT NULL columns or a NULLS NOT DISTINCT index
+create table plan_views (id bigint generated always as identity, plan text);
+create table plan_counts (plan text, view_count bigint);
+create unique index plan_counts_plan_idx on plan_counts (plan);
+
+insert into plan_views (plan) values ('free'), (NULL), (NULL);
+
+select incremental.create_rollup_pipeline('plan-counts', 'plan_views', 'plan_counts',
+  dimensions := '{plan}',
+  aggregates := '{view_count:count(*)}',
+  schedule := NULL);
+
+drop index plan_counts_plan_idx;
+create unique index plan_counts_plan_idx on plan_counts (plan) nulls not distinct;
+
+select incremental.create_rollup_pipeline('plan-counts', 'plan_views', 'plan_counts',
+  dimensions := '{plan}',
+  aggregates := '{view_count:count(*)}',
+  schedule := NULL);
+
+insert into plan_views (plan) values (NULL);
+call incremental.execute_pipeline('plan-counts');
+
+select * from plan_counts order by plan;
+
+-- append partial aggregates to a delta table and compact them manually
+create table path_counts (path text primary key, view_count bigint);
+insert into path_counts values ('/page-0', 100);
+
+select incremental.create_delta_table('path_counts', '{path}', compaction_schedule := NULL);
+
+insert into path_counts_delta select path, count(*) from page_views group by 1;
+insert into path_counts_delta values ('/page-0', 1);
+
+select * from path_counts_combined order by path;
+select incremental.compact_delta('path_counts_delta');
+select count(*) from path_counts_delta;
+select * from path_counts order by path;
+
+-- compaction requires privileges on both tables
+create role regress_delta_reader;
+grant usage on schema sequence to regress_delta_reader;
+grant select on path_counts_combined to regress_delta_reader;
+set role regress_delta_reader;
+select count(*) from path_counts_combined;
+select incremental.compact_delta('path_counts_delta');
+reset role;
+revoke all on path_counts_combined from regress_delta_reader;
+revoke usage on schema sequence from regress_delta_reader;
+drop role regress_delta_reader;
+
+-- consume rows from a spool table page by page
+create table feed_spool (id bigint generated always as identity, payload jsonb);
+create table feed_events (client_id bigint);
+
+create function fetch_feed(from_offset text, max_rows int)
+returns table (payload jsonb, next_offset text) language sql as $function$
+  select payload, id::text
+  from feed_spool
+  where id > coalesce(from_offset::bigint, 0)
+  order by id
+  limit max_rows
+$function$;
+
+insert into feed_spool (payload) select jsonb_build_object('client_id', s) from generate_series(1,25) s;
+
+-- a command that does not modify a table would never run
+select incremental.create_offset_pipeline('feed-select', 'fetch_feed', $$
+  select count(*) from fetched
+  $$,
+  schedule := NULL);
+
+select incremental.create_offset_pipeline('feed-import', 'fetch_feed', $$
+  insert into feed_events select (payload->>'client_id')::bigint from fetched
+  $$,
+  batch_size := 10,
+  max_rows_per_run := 20,
+  schedule := NULL);
+
+select last_offset from incremental.offset_pipelines where pipeline_name = 'feed-import';
+
+call incremental.execute_pipeline('feed-import');
+call incremental.execute_pipeline('feed-import');
+
+select count(*), count(distinct client_id), max(client_id) from feed_events;
+
+-- resetting goes back to the start offset
+select incremental.reset_pipeline('feed-import', execute_immediately := false);
+select last_offset is null from incremental.offset_pipelines where pipeline_name = 'feed-import';
+
+truncate feed_events;
+call incremental.execute_pipeline('feed-import');
+
+select count(*), max(client_id) from feed_events;
+select last_offset from incremental.offset_pipelines where pipeline_name = 'feed-import';
+
+-- forget processed files that disappear from the listing
+create table listed_files (path text);
+create table imported_files (path text);
+
+create function list_test_files(pattern text)
+returns setof text language sql as $function$
+  select path from listed_files where path like pattern
+$function$;
+
+insert into listed_files values ('file-1');
+
+select incremental.create_file_list_pipeline('file-cleanup', 'file-%',
+  list_function := 'list_test_files',
+  schedule := NULL,
+  cleanup_grace_period := '0 seconds',
+  command := $$ insert into imported_files values ($1) $$);
+
+-- a missing file is counted, and the count resets when it reappears
+delete from listed_files;
+call incremental.execute_pipeline('file-cleanup');
+select path, missing_count from incremental.processed_files where pipeline_name = 'file-cleanup';
+
+insert into listed_files values ('file-1');
+call incremental.execute_pipeline('file-cleanup');
+select path, missing_count from incremental.processed_files where pipeline_name = 'file-cleanup';
+
+-- a file that is missing from 3 listings is removed and processed again when it reappears
+delete from listed_files;
+call incremental.execute_pipeline('file-cleanup');
+call incremental.execute_pipeline('file-cleanup');
+select path, missing_count from incremental.processed_files where pipeline_name = 'file-cleanup';
+call incremental.execute_pipeline('file-cleanup');
+select count(*) from incremental.processed_files where pipeline_name = 'file-cleanup';
+
+insert into listed_files values ('file-1');
+call incremental.execute_pipeline('file-cleanup');
+select path, count(*) from imported_files group by 1;
+
+-- commit after every file when called outside a transaction block
+create table batch_imports (path text constraint not_batch_3 check (path <> 'batch-3'), xid xid8);
+insert into listed_files values ('batch-1'), ('batch-2'), ('batch-3'), ('batch-4');
+
+select incremental.create_file_list_pipeline('batch-import', 'batch-%',
+  list_function := 'list_test_files',
+  schedule := NULL,
+  execute_immediately := false,
+  batches_per_commit := 1,
+  command := $$ insert into batch_imports values ($1, pg_current_xact_id()) $$);
+
+-- a failure keeps the files that were committed before it
+\set VERBOSITY terse
+call incremental.execute_pipeline('batch-import');
+\set VERBOSITY default
+select path from incremental.processed_files where pipeline_name = 'batch-import' order by 1;
+select count(*), count(distinct xid) from batch_imports;
+
+-- the next run only processes the remaining files
+alter table batch_imports drop constraint not_batch_3;
+call incremental.execute_pipeline('batch-import');
+select path, count(*) from batch_imports group by 1 order by 1;
+select count(distinct xid) from batch_imports;
+
+-- use a manually advanced watermark instead of a sequence, as on a subscriber
+create table replicated_events (id bigint primary key, amount int);
+create table replicated_copy (id bigint primary key, amount int);
+
+insert into replicated_events select s, s from generate_series(1,20) s;
+select incremental.set_sequence_watermark('replicated-events', 10);
+
+select incremental.create_sequence_pipeline('replicated-copy', 'replicated_events',
+  watermark_name := 'replicated-events',
+  schedule := NULL,
+  command := $$
+  insert into replicated_copy
+  select id, amount from replicated_events where id between $1 and $2
+  $$);
+
+call incremental.execute_pipeline('replicated-copy');
+
+-- watermarks never go backwards
+select incremental.set_sequence_watermark('replicated-events', 20);
+select incremental.set_sequence_watermark('replicated-events', 15);
+select last_safe_sequence_number from incremental.sequence_watermarks where watermark_name = 'replicated-events';
+
+call incremental.execute_pipeline('replicated-copy');
+
+select count(*), sum(amount) from replicated_copy;
+
+-- pipelines created before target_relation existed get it on their next run
+update incremental.pipelines set target_relation = null where pipeline_name = 'replicated-copy';
+call incremental.execute_pipeline('replicated-copy');
+select target_relation from incremental.pipelines where pipeline_name = 'replicated-copy';
+
+-- a command that does not modify a relation is only parsed once
+select incremental.create_sequence_pipeline('replicated-count', 'replicated_events',
+  watermark_name := 'replicated-events',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  select count(*) from replicated_events where id between $1 and $2
+  $$);
+update incremental.pipelines set target_relation = null where pipeline_name = 'replicated-count';
+call incremental.execute_pipeline('replicated-count');
+select target_relation::oid from incremental.pipelines where pipeline_name = 'replicated-count';
+
+-- suggest VACUUM once when the target relation has many dead tuples
+create table hint_source (id bigint generated always as identity, k int);
+create table hint_target (k int primary key, c bigint) with (autovacuum_enabled = false);
+insert into hint_target select s, 0 from generate_series(1,100) s;
+delete from hint_target where k > 50;
+select pg_stat_force_next_flush();
+
+set incremental.maintenance_dead_tuple_threshold to 10;
+insert into hint_source (k) values (1);
+
+select incremental.create_sequence_pipeline('hint-counts', 'hint_source',
+  schedule := NULL,
+  command := $$
+  insert into hint_target select k, count(*) from hint_source where id between $1 and $2 group by k
+  on conflict (k) do update set c = hint_target.c + excluded.c
+  $$);
+
+insert into hint_source (k) values (1);
+call incremental.execute_pipeline('hint-counts');
+select vacuum_command from incremental.maintenance_hints where pipeline_name = 'hint-counts';
+
+-- the hint is cleared after VACUUM
+vacuum hint_target;
+insert into hint_source (k) values (1);
+call incremental.execute_pipeline('hint-counts');
+select vacuum_command from incremental.maintenance_hints where pipeline_name = 'hint-counts';
+reset incremental.maintenance_dead_tuple_threshold;
+
+-- only the owner of a watermark can advance it or follow it
+select incremental.create_sequence_pipeline('unset-copy', 'replicated_events',
+  watermark_name := 'unset-events',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  insert into replicated_copy
+  select id, amount from replicated_events where id between $1 and $2
+  $$);
+
+create role regress_watermark_user;
+grant usage on schema sequence to regress_watermark_user;
+set role regress_watermark_user;
+select incremental.set_sequence_watermark('replicated-events', 30);
+select incremental.set_sequence_watermark('unset-events', 30);
+select incremental.reset_sequence_watermark('replicated-events', 0);
+select incremental.create_sequence_pipeline('user-copy', 'replicated_events',
+  watermark_name := 'replicated-events',
+  schedule := NULL,
+  command := $$
+  insert into replicated_copy
+  select id, amount from replicated_events where id between $1 and $2
+  $$);
+reset role;
+revoke usage on schema sequence from regress_watermark_user;
+drop role regress_watermark_user;
+
+-- the owner can lower a watermark after a resync
+select incremental.reset_sequence_watermark('replicated-events', 15);
+select last_safe_sequence_number from incremental.sequence_watermarks where watermark_name = 'replicated-events';
+select incremental.reset_sequence_watermark('unknown-events', 15);
+
+-- copy the results of a pipeline into a remote table over a loopback connection
+create table export_source (id bigint generated always as identity, value int);
+create table export_target (id bigint, value int);
+insert into export_source (value) select s from generate_series(1,10) s;
+
+select incremental.create_sequence_pipeline('export', 'export_source',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  select id, value from export_source where id between $1 and $2
+  $$);
+
+select incremental.set_remote_sink('export',
+  connection_string := format('dbname=%s port=%s', current_database(), current_setting('port')),
+  remote_table := 'sequence.export_target',
+  progress_table := 'sequence.export_progress');
+
+call incremental.execute_pipeline('export');
+select count(*), sum(value) from export_target;
+select pipeline_name, last_processed_sequence_number from export_progress;
+
+-- resetting the pipeline clears the remote progress, so all rows are copied again
+select incremental.reset_pipeline('export', execute_immediately := false);
+select count(*) from export_progress;
+call incremental.execute_pipeline('export');
+select count(*), sum(value) from export_target;
+
+-- dropping the pipeline clears the remote progress
+select incremental.drop_pipeline('export');
+select count(*) from export_progress;
+
+-- execute pipelines in parallel background workers, each in its own transaction
+create table parallel_events (id bigint generated always as identity, value int);
+create table parallel_counts (event_count bigint);
+create table parallel_sums (total bigint);
+create table parallel_failures (total bigint check (total < 0));
+
+insert into parallel_events (value) select s from generate_series(1,10) s;
+
+select incremental.create_sequence_pipeline('parallel-counts', 'parallel_events',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  insert into parallel_counts select count(*) from parallel_events where id between $1 and $2
+  $$);
+
+select incremental.create_sequence_pipeline('parallel-sums', 'parallel_events',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  insert into parallel_sums select sum(value) from parallel_events where id between $1 and $2
+  $$);
+
+select incremental.create_sequence_pipeline('parallel-failure', 'parallel_events',
+  schedule := NULL,
+  execute_immediately := false,
+  command := $$
+  insert into parallel_failures select sum(value) from parallel_events where id between $1 and $2
+  $$);
+
+select pipeline_name, succeeded, error_message
+from incremental.execute_pipelines(array['parallel-counts', 'parallel-sums', 'parallel-failure'], parallelism := 2);
+
+select * from parallel_counts;
+select * from parallel_sums;
+select pipeline_name, last_processed_sequence_number from incremental.sequence_pipelines
+where pipeline_name like 'parallel-%' order by 1;
+
 drop schema sequence cascade;
 drop extension pg_incremental;
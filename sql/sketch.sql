@@ -0,0 +1,63 @@
+create extension pg_incremental cascade;
+create schema sketch;
+set search_path to sketch;
+set client_min_messages to warning;
+
+-- create a source table
+create table events (
+  event_id bigint generated always as identity,
+  event_time timestamptz default now(),
+  client_id bigint,
+  path text,
+  response_time double precision
+);
+
+insert into events (client_id, path, response_time)
+select s % 1000, '/page-' || (s % 3), s from generate_series(1,10000) s;
+
+-- create a summary table with sketches per path
+create table events_agg (
+  path text,
+  clients incremental.hll,
+  response_times incremental.ddsketch,
+  primary key (path)
+);
+
+select incremental.create_sequence_pipeline('event-sketches', 'events',
+  schedule := NULL,
+  command := $$
+  insert into events_agg
+  select path, incremental.hll_agg(client_id), incremental.ddsketch_agg(response_time)
+  from events
+  where event_id between $1 and $2
+  group by 1
+  on conflict (path) do update set
+    clients = incremental.merge(events_agg.clients, excluded.clients),
+    response_times = incremental.merge(events_agg.response_times, excluded.response_times);
+  $$);
+
+insert into events (client_id, path, response_time)
+select s % 2000, '/page-' || (s % 3), s from generate_series(10001,20000) s;
+
+call incremental.execute_pipeline('event-sketches');
+
+-- every path saw 2000 distinct clients
+select bool_and(abs(incremental.distinct_count(clients) - 2000) < 100) from events_agg;
+select abs(incremental.distinct_count(incremental.merge_agg(clients)) - 2000) < 100 from events_agg;
+
+-- quantiles are within the relative accuracy
+select incremental.value_count(incremental.merge_agg(response_times)) from events_agg;
+select abs(incremental.quantile(incremental.merge_agg(response_times), 0.99) - 19800) / 19800 <= 0.01 from events_agg;
+select abs(incremental.quantile(incremental.merge_agg(response_times), 0.5) - 10000) / 10000 <= 0.01 from events_agg;
+select incremental.quantile(incremental.merge_agg(response_times), 1) from events_agg;
+
+-- sketches survive a text round-trip
+select incremental.distinct_count(incremental.hll_agg(path)) from events;
+select incremental.distinct_count(incremental.hll_agg(path)::text::incremental.hll) from events;
+
+-- merging with NULL returns the other sketch
+select incremental.merge(NULL::incremental.hll, NULL) is null;
+select incremental.value_count(incremental.merge(NULL, response_times)) from events_agg where path = '/page-0';
+
+drop schema sketch cascade;
+drop extension pg_incremental;
@@ -0,0 +1,40 @@
+create extension pg_incremental cascade;
+create schema stats;
+set search_path to stats;
+set client_min_messages to warning;
+
+-- statistics are only kept when pg_incremental is in shared_preload_libraries,
+-- otherwise incremental.pipeline_stats() returns no rows (see stats_1.out)
+create table events (id bigint generated always as identity, value int);
+create table event_totals (total bigint);
+
+insert into events (value) select s from generate_series(1,10) s;
+
+select incremental.create_sequence_pipeline('stats-totals', 'events',
+  schedule := NULL,
+  command := $$
+  insert into event_totals select sum(value) from events where id between $1 and $2
+  $$);
+
+call incremental.execute_pipeline('stats-totals');
+
+select pipeline_name, run_count, failure_count, last_time <= total_time, last_success_time = last_run_time
+from incremental.pipeline_stats() where pipeline_name = 'stats-totals';
+
+-- a failed execution counts as a run and a failure
+alter table event_totals add constraint small_totals check (total < 100);
+insert into events (value) select s from generate_series(11,20) s;
+
+\set VERBOSITY terse
+call incremental.execute_pipeline('stats-totals');
+\set VERBOSITY default
+
+select pipeline_name, run_count, failure_count, last_time <= total_time, last_success_time < last_run_time
+from incremental.pipeline_stats() where pipeline_name = 'stats-totals';
+
+-- dropping the pipeline removes its statistics
+select incremental.drop_pipeline('stats-totals');
+select count(*) from incremental.pipeline_stats() where pipeline_name = 'stats-totals';
+
+drop schema stats cascade;
+drop extension pg_incremental;
@@ -0,0 +1,149 @@
+create extension pg_incremental cascade;
+create schema time_bucket;
+set search_path to time_bucket;
+set timezone to 'UTC';
+set client_min_messages to warning;
+
+-- create a source table
+create table events (
+  event_id bigint generated always as identity,
+  event_time timestamptz,
+  client_id bigint
+);
+
+-- rows are staged until their day is closed
+create table events_staging (like events);
+
+insert into events (event_time, client_id)
+select '2024-01-01 00:00:00' + (s % 48) * interval '1 hour', s % 10 from generate_series(1,100) s;
+
+-- exact distinct counts per day
+create table daily_clients (
+  day timestamptz,
+  distinct_clients bigint,
+  primary key (day)
+);
+
+select incremental.create_time_bucket_pipeline('daily-clients',
+  source_table_name := 'events',
+  time_column := 'event_time',
+  staging_table_name := 'events_staging',
+  schedule := NULL,
+  command := $$
+    insert into daily_clients
+    select $1, count(distinct client_id)
+    from events_staging
+    where event_time >= $1 and event_time < $2
+  $$,
+  correction_command := $$
+    insert into daily_clients
+    select day, (select count(distinct client_id) from events where event_time >= day and event_time < day + interval '1 day')
+    from (select distinct date_trunc('day', event_time) as day from events where event_id between $1 and $2 and event_time < $3) late
+    on conflict (day) do update set distinct_clients = excluded.distinct_clients
+  $$);
+
+-- rows are staged, but days are not closed until event time passes them
+select count(*) from events_staging;
+select count(*) from daily_clients;
+
+-- no new rows, so event time does not progress and days stay open
+call incremental.execute_pipeline('daily-clients');
+
+select count(*) from events_staging;
+select count(*) from daily_clients;
+
+-- a row from a later day moves event time past the first two days
+insert into events (event_time, client_id) values ('2024-01-03 12:00:00', 7);
+
+call incremental.execute_pipeline('daily-clients');
+
+select count(*) from events_staging;
+select to_char(day, 'YYYY-MM-DD'), distinct_clients from daily_clients order by 1;
+
+-- a late row goes to the correction command
+insert into events (event_time, client_id) values ('2024-01-01 12:00:00', 42);
+
+call incremental.execute_pipeline('daily-clients');
+
+select count(*) from events_staging;
+select to_char(day, 'YYYY-MM-DD'), distinct_clients from daily_clients order by 1;
+
+-- with an idle timeout, days are closed once the current time passed them,
+-- and days without rows are skipped
+insert into events (event_time, client_id) values ('2024-01-06 12:00:00', 8);
+
+create table events_staging_idle (like events);
+create table daily_rows (day timestamptz primary key, row_count bigint);
+
+select incremental.create_time_bucket_pipeline('idle-daily-rows',
+  source_table_name := 'events',
+  time_column := 'event_time',
+  staging_table_name := 'events_staging_idle',
+  idle_timeout := '1 day',
+  schedule := NULL,
+  command := $$
+    insert into daily_rows
+    select $1, count(*)
+    from events_staging_idle
+    where event_time >= $1 and event_time < $2
+  $$);
+
+select count(*) from daily_rows;
+
+call incremental.execute_pipeline('idle-daily-rows');
+
+select count(*) from events_staging_idle;
+select to_char(day, 'YYYY-MM-DD'), row_count from daily_rows order by 1;
+
+-- bucket bounds match date_bin across daylight saving time changes
+set timezone to 'Europe/Amsterdam';
+
+create table dst_events (event_id bigint generated always as identity, event_time timestamptz);
+create table dst_events_staging (like dst_events);
+create table dst_buckets (bucket_start timestamptz, bucket_end timestamptz, row_count bigint);
+
+insert into dst_events (event_time)
+values ('2024-03-30 12:00'), ('2024-03-31 12:00'), ('2024-04-01 12:00'), ('2024-04-03 12:00');
+
+select incremental.create_time_bucket_pipeline('dst-buckets',
+  source_table_name := 'dst_events',
+  time_column := 'event_time',
+  staging_table_name := 'dst_events_staging',
+  schedule := NULL,
+  command := $$
+    insert into dst_buckets
+    select $1, $2, count(*)
+    from dst_events_staging
+    where event_time >= $1 and event_time < $2
+  $$);
+
+insert into dst_events (event_time) values ('2024-04-10 12:00');
+
+call incremental.execute_pipeline('dst-buckets');
+
+select to_char(bucket_start, 'YYYY-MM-DD HH24:MIOF') bucket_start,
+       to_char(bucket_end, 'YYYY-MM-DD HH24:MIOF') bucket_end,
+       row_count,
+       bucket_start = date_bin('1 day', bucket_start, '2001-01-01') aligned
+from dst_buckets order by 1;
+
+-- rows are staged by column name, so new source columns do not break staging
+alter table dst_events add column note text;
+insert into dst_events (event_time, note) values ('2024-04-20 12:00', 'new');
+
+call incremental.execute_pipeline('dst-buckets');
+
+select count(*) from dst_buckets;
+
+-- staging columns need to match the source columns
+create table dst_events_bad_staging (event_time timestamptz, event_id text);
+
+select incremental.create_time_bucket_pipeline('bad-staging',
+  source_table_name := 'dst_events',
+  time_column := 'event_time',
+  staging_table_name := 'dst_events_bad_staging',
+  schedule := NULL,
+  command := $$ select $1, $2 $$);
+
+drop schema time_bucket cascade;
+drop extension pg_incremental;
@@ -49,5 +49,94 @@ select count(*) from events;
 -- counts have not changed, because past is already processed
 select sum(event_count) from events_agg;
 
+-- create a partitioned summary table, partitions are created ahead of each range
+set timezone to 'UTC';
+
+create table events_agg_part (
+  day timestamptz,
+  event_count bigint,
+  primary key (day)
+) partition by range (day);
+create table events_agg_part_default partition of events_agg_part default;
+
+-- partitions are clipped around existing partitions within the range
+create table events_agg_part_custom partition of events_agg_part
+for values from (date_trunc('day', now()) - interval '2 days' + interval '6 hours')
+to (date_trunc('day', now()) - interval '2 days' + interval '12 hours');
+
+select incremental.create_time_interval_pipeline('event-aggregation-part', '1 day',
+  schedule := NULL,
+  start_time := date_trunc('day', now()) - interval '3 days',
+  execute_immediately := false,
+  command := $$
+  insert into events_agg_part
+  select date_trunc('day', event_time), count(*)
+  from events
+  where event_time >= $1 and event_time < $2
+  group by 1
+  $$);
+
+select incremental.set_partitioned_target('event-aggregation-part', 'events_agg_part', '1 day', lookahead := '1 day');
+
+call incremental.execute_pipeline('event-aggregation-part');
+
+select sum(event_count) from events_agg_part;
+select count(*) from events_agg_part_default;
+select count(*) >= 4 from pg_inherits where inhparent = 'events_agg_part'::regclass;
+
+-- date partition keys need whole days
+create table events_agg_date (day date, event_count bigint) partition by range (day);
+select incremental.set_partitioned_target('event-aggregation-part', 'events_agg_date', '12 hours');
+
+-- pass the range as timestamp, date, or epoch milliseconds
+create table local_events (event_time timestamp, event_day date, event_ms bigint);
+create table local_counts (parameter_type text primary key, event_count bigint);
+
+insert into local_events
+select t, t::date, (extract(epoch from t) * 1000)::bigint
+from generate_series(timestamp '2024-01-01', timestamp '2024-01-10 23:00', interval '1 hour') t;
+
+select incremental.create_time_interval_pipeline('local-timestamp', '1 day',
+  schedule := NULL,
+  start_time := '2024-01-03',
+  parameter_type := 'timestamp',
+  command := $$
+  insert into local_counts
+  select 'timestamp', count(*) from local_events
+  where event_time >= $1 and event_time < $2
+  $$);
+
+select incremental.create_time_interval_pipeline('local-date', '1 day',
+  schedule := NULL,
+  start_time := '2024-01-03',
+  parameter_type := 'date',
+  command := $$
+  insert into local_counts
+  select 'date', count(*) from local_events
+  where event_day >= $1 and event_day < $2
+  $$);
+
+select incremental.create_time_interval_pipeline('local-epoch-ms', '1 day',
+  schedule := NULL,
+  start_time := '2024-01-03',
+  parameter_type := 'epoch_ms',
+  command := $$
+  insert into local_counts
+  select 'epoch_ms', count(*) from local_events
+  where event_ms >= $1 and event_ms < $2
+  $$);
+
+select * from local_counts order by parameter_type;
+
+-- date parameters need whole days
+select incremental.create_time_interval_pipeline('local-date-hourly', '1 hour',
+  schedule := NULL,
+  parameter_type := 'date',
+  command := $$
+  insert into local_counts
+  select 'date', count(*) from local_events
+  where event_day >= $1 and event_day < $2
+  $$);
+
 drop schema time_range cascade;
 drop extension pg_incremental;
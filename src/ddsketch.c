@@ -0,0 +1,692 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include <math.h>
+
+#include "utils/builtins.h"
+#include "utils/fmgrprotos.h"
+#include "utils/float.h"
+
+
+/* values are returned with at most 1% relative error */
+#define DDSKETCH_RELATIVE_ACCURACY 0.01
+
+/* maximum number of buckets per store, lowest buckets are collapsed beyond */
+#define DDSKETCH_MAX_BUCKETS 2048
+
+/* values with a smaller magnitude are counted as 0 */
+#define DDSKETCH_MIN_INDEXABLE_VALUE 1e-9
+
+/* version of the on-disk format */
+#define DDSKETCH_VERSION 1
+
+
+/*
+ * DDSketchStore is the in-memory representation of a set of buckets,
+ * stored densely as an array of counts for consecutive keys.
+ */
+typedef struct DDSketchStore
+{
+	/* key of counts[0] */
+	int32		offset;
+
+	/* number of used entries in counts */
+	int32		length;
+
+	/* number of allocated entries in counts */
+	int32		capacity;
+
+	uint64	   *counts;
+}			DDSketchStore;
+
+
+/*
+ * DDSketchState is the in-memory representation of a DDSketch, which is
+ * used as the aggregate transition state.
+ */
+typedef struct DDSketchState
+{
+	/* memory context in which buckets are allocated */
+	MemoryContext context;
+
+	double		relativeAccuracy;
+	double		gamma;
+	double		multiplier;
+
+	uint64		count;
+	uint64		zeroCount;
+	double		min;
+	double		max;
+
+	/* buckets for positive values */
+	DDSketchStore positive;
+
+	/* buckets for the magnitude of negative values */
+	DDSketchStore negative;
+}			DDSketchState;
+
+
+/*
+ * DDSketch is the on-disk (varlena) representation of a DDSketch.
+ *
+ * The counts of the positive buckets are followed by the counts of the
+ * negative buckets.
+ */
+typedef struct DDSketch
+{
+	int32		vl_len_;
+	uint8		version;
+	double		relativeAccuracy;
+	uint64		count;
+	uint64		zeroCount;
+	double		min;
+	double		max;
+	int32		positiveOffset;
+	int32		positiveLength;
+	int32		negativeOffset;
+	int32		negativeLength;
+	uint64		counts[FLEXIBLE_ARRAY_MEMBER];
+}			DDSketch;
+
+#define DDSKETCH_SIZE(bucketCount) (offsetof(DDSketch, counts) + (bucketCount) * sizeof(uint64))
+
+#define DatumGetDDSketchP(X) ((DDSketch *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_DDSKETCH_P(n) DatumGetDDSketchP(PG_GETARG_DATUM(n))
+
+
+static DDSketchState * CreateDDSketchState(MemoryContext context);
+static void DDSketchAddValue(DDSketchState * state, double value, uint64 count);
+static void DDSketchStoreAdd(DDSketchState * state, DDSketchStore * store,
+							 int32 key, uint64 count);
+static void DDSketchStoreMerge(DDSketchState * state, DDSketchStore * target,
+							   int32 offset, int32 length, uint64 *counts);
+static void DDSketchMergeState(DDSketchState * target, DDSketchState * source);
+static void DDSketchMergeSketch(DDSketchState * target, DDSketch * source);
+static DDSketch * SerializeDDSketch(DDSketchState * state);
+static DDSketchState * DeserializeDDSketch(DDSketch * sketch, MemoryContext context);
+static void ValidateDDSketch(DDSketch * sketch);
+static double DDSketchQuantile(DDSketch * sketch, double quantile);
+static inline double DDSketchKeyValue(double gamma, int32 key);
+
+
+PG_FUNCTION_INFO_V1(incremental_ddsketch_in);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_out);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_recv);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_send);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_agg_trans);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_merge_trans);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_agg_final);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_combine);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_serialize);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_deserialize);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_merge);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_quantile);
+PG_FUNCTION_INFO_V1(incremental_ddsketch_count);
+
+
+/*
+ * incremental_ddsketch_in parses the hex-encoded text representation of a
+ * DDSketch.
+ */
+Datum
+incremental_ddsketch_in(PG_FUNCTION_ARGS)
+{
+	Datum		bytes = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+	DDSketch   *sketch = DatumGetDDSketchP(bytes);
+
+	ValidateDDSketch(sketch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+
+/*
+ * incremental_ddsketch_out returns the hex-encoded text representation of a
+ * DDSketch.
+ */
+Datum
+incremental_ddsketch_out(PG_FUNCTION_ARGS)
+{
+	return DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+}
+
+
+/*
+ * incremental_ddsketch_recv reads the binary representation of a DDSketch.
+ */
+Datum
+incremental_ddsketch_recv(PG_FUNCTION_ARGS)
+{
+	Datum		bytes = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+	DDSketch   *sketch = DatumGetDDSketchP(bytes);
+
+	ValidateDDSketch(sketch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+
+/*
+ * incremental_ddsketch_send returns the binary representation of a DDSketch.
+ */
+Datum
+incremental_ddsketch_send(PG_FUNCTION_ARGS)
+{
+	return DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+}
+
+
+/*
+ * incremental_ddsketch_agg_trans adds a value to the transition state.
+ */
+Datum
+incremental_ddsketch_agg_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "incremental_ddsketch_agg_trans called in non-aggregate context");
+
+	DDSketchState *state = PG_ARGISNULL(0) ? NULL : (DDSketchState *) PG_GETARG_POINTER(0);
+
+	if (state == NULL)
+		state = CreateDDSketchState(aggContext);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	double		value = PG_GETARG_FLOAT8(1);
+
+	if (isnan(value) || isinf(value))
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("cannot add NaN or infinity to a ddsketch")));
+
+	DDSketchAddValue(state, value, 1);
+
+	PG_RETURN_POINTER(state);
+}
+
+
+/*
+ * incremental_ddsketch_merge_trans merges a DDSketch into the transition
+ * state.
+ */
+Datum
+incremental_ddsketch_merge_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "incremental_ddsketch_merge_trans called in non-aggregate context");
+
+	DDSketchState *state = PG_ARGISNULL(0) ? NULL : (DDSketchState *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	DDSketch   *input = PG_GETARG_DDSKETCH_P(1);
+
+	if (state == NULL)
+		state = DeserializeDDSketch(input, aggContext);
+	else
+		DDSketchMergeSketch(state, input);
+
+	PG_RETURN_POINTER(state);
+}
+
+
+/*
+ * incremental_ddsketch_agg_final converts the transition state into a
+ * DDSketch.
+ */
+Datum
+incremental_ddsketch_agg_final(PG_FUNCTION_ARGS)
+{
+	DDSketchState *state = (DDSketchState *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_POINTER(SerializeDDSketch(state));
+}
+
+
+/*
+ * incremental_ddsketch_combine combines two transition states, for parallel
+ * aggregation.
+ */
+Datum
+incremental_ddsketch_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "incremental_ddsketch_combine called in non-aggregate context");
+
+	DDSketchState *state1 = PG_ARGISNULL(0) ? NULL : (DDSketchState *) PG_GETARG_POINTER(0);
+	DDSketchState *state2 = PG_ARGISNULL(1) ? NULL : (DDSketchState *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+		PG_RETURN_POINTER(state1);
+
+	if (state1 == NULL)
+		state1 = CreateDDSketchState(aggContext);
+
+	DDSketchMergeState(state1, state2);
+
+	PG_RETURN_POINTER(state1);
+}
+
+
+/*
+ * incremental_ddsketch_serialize converts the transition state to bytea.
+ */
+Datum
+incremental_ddsketch_serialize(PG_FUNCTION_ARGS)
+{
+	DDSketchState *state = (DDSketchState *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_BYTEA_P(SerializeDDSketch(state));
+}
+
+
+/*
+ * incremental_ddsketch_deserialize converts a serialized transition state
+ * back into a transition state.
+ */
+Datum
+incremental_ddsketch_deserialize(PG_FUNCTION_ARGS)
+{
+	DDSketch   *sketch = (DDSketch *) PG_GETARG_BYTEA_P(0);
+
+	ValidateDDSketch(sketch);
+
+	PG_RETURN_POINTER(DeserializeDDSketch(sketch, CurrentMemoryContext));
+}
+
+
+/*
+ * incremental_ddsketch_merge returns the union of two DDSketches. It is meant
+ * to be used in ON CONFLICT clauses, so a NULL on either side returns the
+ * other side.
+ */
+Datum
+incremental_ddsketch_merge(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+	if (PG_ARGISNULL(0))
+		PG_RETURN_POINTER(PG_GETARG_DDSKETCH_P(1));
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(PG_GETARG_DDSKETCH_P(0));
+
+	DDSketchState *state = DeserializeDDSketch(PG_GETARG_DDSKETCH_P(0),
+											   CurrentMemoryContext);
+
+	DDSketchMergeSketch(state, PG_GETARG_DDSKETCH_P(1));
+
+	PG_RETURN_POINTER(SerializeDDSketch(state));
+}
+
+
+/*
+ * incremental_ddsketch_quantile returns the approximate value at the given
+ * quantile.
+ */
+Datum
+incremental_ddsketch_quantile(PG_FUNCTION_ARGS)
+{
+	DDSketch   *sketch = PG_GETARG_DDSKETCH_P(0);
+	double		quantile = PG_GETARG_FLOAT8(1);
+
+	if (isnan(quantile) || quantile < 0.0 || quantile > 1.0)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("quantile must be between 0 and 1")));
+
+	if (sketch->count == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(DDSketchQuantile(sketch, quantile));
+}
+
+
+/*
+ * incremental_ddsketch_count returns the number of values in a DDSketch.
+ */
+Datum
+incremental_ddsketch_count(PG_FUNCTION_ARGS)
+{
+	DDSketch   *sketch = PG_GETARG_DDSKETCH_P(0);
+
+	PG_RETURN_INT64((int64) sketch->count);
+}
+
+
+/*
+ * CreateDDSketchState returns an empty DDSketch state allocated in the
+ * given memory context.
+ */
+static DDSketchState *
+CreateDDSketchState(MemoryContext context)
+{
+	DDSketchState *state = MemoryContextAllocZero(context, sizeof(DDSketchState));
+
+	state->context = context;
+	state->relativeAccuracy = DDSKETCH_RELATIVE_ACCURACY;
+	state->gamma = (1.0 + state->relativeAccuracy) / (1.0 - state->relativeAccuracy);
+	state->multiplier = 1.0 / log(state->gamma);
+	state->min = get_float8_infinity();
+	state->max = -get_float8_infinity();
+
+	return state;
+}
+
+
+/*
+ * DDSketchAddValue adds count occurrences of a value to the sketch.
+ */
+static void
+DDSketchAddValue(DDSketchState * state, double value, uint64 count)
+{
+	double		magnitude = fabs(value);
+
+	if (magnitude < DDSKETCH_MIN_INDEXABLE_VALUE)
+		state->zeroCount += count;
+	else
+	{
+		int32		key = (int32) ceil(log(magnitude) * state->multiplier);
+
+		if (value > 0)
+			DDSketchStoreAdd(state, &state->positive, key, count);
+		else
+			DDSketchStoreAdd(state, &state->negative, key, count);
+	}
+
+	state->count += count;
+
+	if (value < state->min)
+		state->min = value;
+	if (value > state->max)
+		state->max = value;
+}
+
+
+/*
+ * DDSketchStoreAdd adds count to the bucket with the given key, growing the
+ * store if needed. When the store would exceed DDSKETCH_MAX_BUCKETS, the
+ * lowest buckets are collapsed into the lowest remaining bucket.
+ */
+static void
+DDSketchStoreAdd(DDSketchState * state, DDSketchStore * store, int32 key, uint64 count)
+{
+	if (store->length == 0)
+	{
+		if (store->capacity == 0)
+		{
+			store->capacity = 64;
+			store->counts = MemoryContextAllocZero(state->context,
+												   store->capacity * sizeof(uint64));
+		}
+
+		store->offset = key;
+		store->length = 1;
+		store->counts[0] += count;
+		return;
+	}
+
+	int32		minKey = store->offset;
+	int32		maxKey = store->offset + store->length - 1;
+
+	if (key > maxKey)
+		maxKey = key;
+	if (key < minKey)
+		minKey = key;
+
+	/* collapse the lowest keys if the range becomes too wide */
+	if (maxKey - minKey + 1 > DDSKETCH_MAX_BUCKETS)
+	{
+		minKey = maxKey - DDSKETCH_MAX_BUCKETS + 1;
+
+		if (key < minKey)
+			key = minKey;
+	}
+
+	int32		newLength = maxKey - minKey + 1;
+
+	if (minKey != store->offset || newLength != store->length)
+	{
+		uint64	   *newCounts = store->counts;
+		int32		newCapacity = store->capacity;
+
+		if (newLength > store->capacity)
+		{
+			newCapacity = Max(newLength, store->capacity * 2);
+			newCapacity = Min(newCapacity, DDSKETCH_MAX_BUCKETS);
+			newCounts = MemoryContextAllocZero(state->context, newCapacity * sizeof(uint64));
+		}
+		else if (minKey != store->offset)
+			newCounts = MemoryContextAllocZero(state->context, newCapacity * sizeof(uint64));
+
+		if (newCounts != store->counts)
+		{
+			for (int32 index = 0; index < store->length; index++)
+			{
+				int32		oldKey = store->offset + index;
+				int32		newIndex = Max(oldKey, minKey) - minKey;
+
+				newCounts[newIndex] += store->counts[index];
+			}
+
+			pfree(store->counts);
+		}
+
+		store->counts = newCounts;
+		store->capacity = newCapacity;
+		store->offset = minKey;
+		store->length = newLength;
+	}
+
+	store->counts[key - store->offset] += count;
+}
+
+
+/*
+ * DDSketchStoreMerge adds dense bucket counts to a store.
+ */
+static void
+DDSketchStoreMerge(DDSketchState * state, DDSketchStore * target,
+				   int32 offset, int32 length, uint64 *counts)
+{
+	for (int32 index = 0; index < length; index++)
+	{
+		if (counts[index] > 0)
+			DDSketchStoreAdd(state, target, offset + index, counts[index]);
+	}
+}
+
+
+/*
+ * DDSketchMergeState merges the source state into the target state.
+ */
+static void
+DDSketchMergeState(DDSketchState * target, DDSketchState * source)
+{
+	if (source->count == 0)
+		return;
+
+	DDSketchStoreMerge(target, &target->positive, source->positive.offset,
+					   source->positive.length, source->positive.counts);
+	DDSketchStoreMerge(target, &target->negative, source->negative.offset,
+					   source->negative.length, source->negative.counts);
+
+	target->count += source->count;
+	target->zeroCount += source->zeroCount;
+	target->min = Min(target->min, source->min);
+	target->max = Max(target->max, source->max);
+}
+
+
+/*
+ * DDSketchMergeSketch merges a serialized DDSketch into the target state.
+ */
+static void
+DDSketchMergeSketch(DDSketchState * target, DDSketch * source)
+{
+	if (source->relativeAccuracy != target->relativeAccuracy)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("cannot merge ddsketch values with different relative accuracy")));
+
+	if (source->count == 0)
+		return;
+
+	DDSketchStoreMerge(target, &target->positive, source->positiveOffset,
+					   source->positiveLength, source->counts);
+	DDSketchStoreMerge(target, &target->negative, source->negativeOffset,
+					   source->negativeLength, source->counts + source->positiveLength);
+
+	target->count += source->count;
+	target->zeroCount += source->zeroCount;
+	target->min = Min(target->min, source->min);
+	target->max = Max(target->max, source->max);
+}
+
+
+/*
+ * SerializeDDSketch converts a DDSketch state into its varlena representation
+ * in the current memory context.
+ */
+static DDSketch *
+SerializeDDSketch(DDSketchState * state)
+{
+	int32		bucketCount = state->positive.length + state->negative.length;
+	Size		size = DDSKETCH_SIZE(bucketCount);
+	DDSketch   *sketch = (DDSketch *) palloc0(size);
+
+	SET_VARSIZE(sketch, size);
+	sketch->version = DDSKETCH_VERSION;
+	sketch->relativeAccuracy = state->relativeAccuracy;
+	sketch->count = state->count;
+	sketch->zeroCount = state->zeroCount;
+	sketch->min = state->min;
+	sketch->max = state->max;
+	sketch->positiveOffset = state->positive.offset;
+	sketch->positiveLength = state->positive.length;
+	sketch->negativeOffset = state->negative.offset;
+	sketch->negativeLength = state->negative.length;
+
+	if (state->positive.length > 0)
+		memcpy(sketch->counts, state->positive.counts,
+			   state->positive.length * sizeof(uint64));
+
+	if (state->negative.length > 0)
+		memcpy(sketch->counts + state->positive.length, state->negative.counts,
+			   state->negative.length * sizeof(uint64));
+
+	return sketch;
+}
+
+
+/*
+ * DeserializeDDSketch converts the varlena representation of a DDSketch
+ * into a state allocated in the given memory context.
+ */
+static DDSketchState *
+DeserializeDDSketch(DDSketch * sketch, MemoryContext context)
+{
+	DDSketchState *state = CreateDDSketchState(context);
+
+	DDSketchMergeSketch(state, sketch);
+
+	return state;
+}
+
+
+/*
+ * ValidateDDSketch throws an error if the given bytes are not a valid
+ * DDSketch.
+ */
+static void
+ValidateDDSketch(DDSketch * sketch)
+{
+	if (VARSIZE(sketch) < offsetof(DDSketch, counts) ||
+		sketch->version != DDSKETCH_VERSION ||
+		sketch->relativeAccuracy != DDSKETCH_RELATIVE_ACCURACY ||
+		sketch->positiveLength < 0 || sketch->positiveLength > DDSKETCH_MAX_BUCKETS ||
+		sketch->negativeLength < 0 || sketch->negativeLength > DDSKETCH_MAX_BUCKETS ||
+		VARSIZE(sketch) != DDSKETCH_SIZE(sketch->positiveLength + sketch->negativeLength))
+		ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						errmsg("invalid ddsketch value")));
+}
+
+
+/*
+ * DDSketchQuantile returns the approximate value at the given quantile
+ * by walking the buckets from the lowest to the highest value.
+ */
+static double
+DDSketchQuantile(DDSketch * sketch, double quantile)
+{
+	double		gamma = (1.0 + sketch->relativeAccuracy) / (1.0 - sketch->relativeAccuracy);
+	double		rank = quantile * (sketch->count - 1);
+	uint64		cumulativeCount = 0;
+	double		result = sketch->max;
+	bool		found = false;
+	uint64	   *negativeCounts = sketch->counts + sketch->positiveLength;
+
+	/* the extremes are tracked exactly */
+	if (quantile == 0.0)
+		return sketch->min;
+	if (quantile == 1.0)
+		return sketch->max;
+
+	/* negative values, from the largest magnitude to the smallest */
+	for (int32 index = sketch->negativeLength - 1; index >= 0 && !found; index--)
+	{
+		cumulativeCount += negativeCounts[index];
+
+		if (cumulativeCount > rank)
+		{
+			result = -DDSketchKeyValue(gamma, sketch->negativeOffset + index);
+			found = true;
+		}
+	}
+
+	if (!found)
+	{
+		cumulativeCount += sketch->zeroCount;
+
+		if (cumulativeCount > rank)
+		{
+			result = 0.0;
+			found = true;
+		}
+	}
+
+	for (int32 index = 0; index < sketch->positiveLength && !found; index++)
+	{
+		cumulativeCount += sketch->counts[index];
+
+		if (cumulativeCount > rank)
+		{
+			result = DDSketchKeyValue(gamma, sketch->positiveOffset + index);
+			found = true;
+		}
+	}
+
+	/* never return a value outside of the observed range */
+	if (result < sketch->min)
+		result = sketch->min;
+	if (result > sketch->max)
+		result = sketch->max;
+
+	return result;
+}
+
+
+/*
+ * DDSketchKeyValue returns the value that represents the bucket with the
+ * given key, which is within the relative accuracy of all values in it.
+ */
+static inline double
+DDSketchKeyValue(double gamma, int32 key)
+{
+	return 2.0 * pow(gamma, key) / (gamma + 1.0);
+}
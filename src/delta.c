@@ -0,0 +1,590 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "access/relation.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_authid.h"
+#include "crunchy/incremental/cron.h"
+#include "crunchy/incremental/query.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/regproc.h"
+#include "utils/rel.h"
+
+
+/*
+ * DeltaTable describes a delta table and the summary table into which it is
+ * compacted.
+ */
+typedef struct DeltaTable
+{
+	/* append-only table with partial aggregates */
+	Oid			deltaRelationId;
+
+	/* summary table with a unique key into which deltas are folded */
+	Oid			baseRelationId;
+
+	/* view that combines the base table and uncompacted deltas */
+	Oid			viewRelationId;
+
+	/* statement that moves the deltas into the base table */
+	char	   *compactionCommand;
+
+	/* pg_cron job that runs the compaction, if any */
+	char	   *jobName;
+
+	/* user ID of the role that created the delta table */
+	Oid			ownerId;
+}			DeltaTable;
+
+
+static char *QuoteQualifiedName(char *qualifiedName);
+static char *GetCombineAggregate(char *columnName, Oid typeId, List *combineAggregates);
+static void InsertDeltaTable(Oid deltaRelationId, Oid baseRelationId, Oid viewRelationId,
+							 char *compactionCommand, char *jobName);
+static DeltaTable * ReadDeltaTable(Oid deltaRelationId);
+static void DeleteDeltaTable(Oid deltaRelationId);
+
+
+PG_FUNCTION_INFO_V1(incremental_create_delta_table);
+PG_FUNCTION_INFO_V1(incremental_compact_delta);
+PG_FUNCTION_INFO_V1(incremental_drop_delta_table);
+
+
+/*
+ * incremental_create_delta_table creates an append-only delta table with the
+ * same columns as a summary table, a view that combines both, and optionally
+ * schedules a job that compacts the deltas into the summary table.
+ *
+ * Pipelines insert partial aggregates into the delta table without conflicts,
+ * instead of upserting into hot rows of the summary table. Compaction folds
+ * the deltas into the summary table using the combine aggregate of each
+ * non-key column, which is sum by default, or merge_agg for sketches.
+ */
+Datum
+incremental_create_delta_table(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("base_table cannot be NULL")));
+	if (PG_ARGISNULL(1))
+		ereport(ERROR, (errmsg("key_columns cannot be NULL")));
+
+	Oid			baseRelationId = PG_GETARG_OID(0);
+	ArrayType  *keyColumnsArray = PG_GETARG_ARRAYTYPE_P(1);
+	List	   *combineAggregates = NIL;
+	char	   *deltaTableName = PG_ARGISNULL(3) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(3));
+	char	   *viewName = PG_ARGISNULL(4) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(4));
+	char	   *schedule = PG_ARGISNULL(5) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(5));
+
+	Datum	   *keyColumnDatums = NULL;
+	int			keyColumnCount = 0;
+
+	deconstruct_array(keyColumnsArray, TEXTOID, -1, false, TYPALIGN_INT,
+					  &keyColumnDatums, NULL, &keyColumnCount);
+
+	if (keyColumnCount == 0)
+		ereport(ERROR, (errmsg("key_columns cannot be empty")));
+
+	if (!PG_ARGISNULL(2))
+	{
+		Datum	   *aggregateDatums = NULL;
+		int			aggregateCount = 0;
+
+		deconstruct_array(PG_GETARG_ARRAYTYPE_P(2), TEXTOID, -1, false, TYPALIGN_INT,
+						  &aggregateDatums, NULL, &aggregateCount);
+
+		for (int aggregateIndex = 0; aggregateIndex < aggregateCount; aggregateIndex++)
+			combineAggregates = lappend(combineAggregates,
+										TextDatumGetCString(aggregateDatums[aggregateIndex]));
+	}
+
+	char	   *baseSchemaName = get_namespace_name(get_rel_namespace(baseRelationId));
+	char	   *baseRelationName = get_rel_name(baseRelationId);
+	char	   *baseName = quote_qualified_identifier(baseSchemaName, baseRelationName);
+
+	if (deltaTableName != NULL)
+		deltaTableName = QuoteQualifiedName(deltaTableName);
+	else
+		deltaTableName = quote_qualified_identifier(baseSchemaName,
+													psprintf("%s_delta", baseRelationName));
+
+	if (viewName != NULL)
+		viewName = QuoteQualifiedName(viewName);
+	else
+		viewName = quote_qualified_identifier(baseSchemaName,
+											  psprintf("%s_combined", baseRelationName));
+
+	/* build the column lists of the generated statements */
+	StringInfo	keyColumns = makeStringInfo();
+	StringInfo	baseKeyColumns = makeStringInfo();
+	StringInfo	deltaKeyColumns = makeStringInfo();
+	StringInfo	valueColumns = makeStringInfo();
+	StringInfo	baseValueColumns = makeStringInfo();
+	StringInfo	combinedColumns = makeStringInfo();
+	StringInfo	updateColumns = makeStringInfo();
+
+	for (int keyIndex = 0; keyIndex < keyColumnCount; keyIndex++)
+	{
+		char	   *keyColumn = TextDatumGetCString(keyColumnDatums[keyIndex]);
+
+		if (get_attnum(baseRelationId, keyColumn) == InvalidAttrNumber)
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+							errmsg("column \"%s\" of relation \"%s\" does not exist",
+								   keyColumn, baseRelationName)));
+
+		appendStringInfo(keyColumns, "%s%s", keyIndex > 0 ? ", " : "",
+						 quote_identifier(keyColumn));
+		appendStringInfo(baseKeyColumns, "%sb.%s", keyIndex > 0 ? ", " : "",
+						 quote_identifier(keyColumn));
+		appendStringInfo(deltaKeyColumns, "%sd.%s", keyIndex > 0 ? ", " : "",
+						 quote_identifier(keyColumn));
+	}
+
+	Relation	baseRelation = relation_open(baseRelationId, AccessShareLock);
+	TupleDesc	baseDesc = RelationGetDescr(baseRelation);
+	int			valueColumnCount = 0;
+
+	for (int columnIndex = 0; columnIndex < baseDesc->natts; columnIndex++)
+	{
+		Form_pg_attribute attr = TupleDescAttr(baseDesc, columnIndex);
+		char	   *columnName = NameStr(attr->attname);
+		bool		isKeyColumn = false;
+
+		if (attr->attisdropped || attr->attgenerated)
+			continue;
+
+		for (int keyIndex = 0; keyIndex < keyColumnCount; keyIndex++)
+		{
+			if (strcmp(columnName, TextDatumGetCString(keyColumnDatums[keyIndex])) == 0)
+				isKeyColumn = true;
+		}
+
+		if (isKeyColumn)
+			continue;
+
+		char	   *quotedName = quote_identifier(columnName);
+		char	   *aggregate = GetCombineAggregate(columnName, attr->atttypid,
+													combineAggregates);
+		char	   *typeName = format_type_extended(attr->atttypid, attr->atttypmod,
+													FORMAT_TYPE_TYPEMOD_GIVEN |
+													FORMAT_TYPE_FORCE_QUALIFY);
+		char	   *separator = valueColumnCount > 0 ? ", " : "";
+
+		appendStringInfo(valueColumns, "%s%s", separator, quotedName);
+		appendStringInfo(baseValueColumns, "%sb.%s", separator, quotedName);
+		appendStringInfo(combinedColumns, "%s%s(%s)::%s as %s",
+						 separator, aggregate, quotedName, typeName, quotedName);
+		appendStringInfo(updateColumns, "%s%s = excluded.%s",
+						 separator, quotedName, quotedName);
+
+		valueColumnCount++;
+	}
+
+	relation_close(baseRelation, NoLock);
+
+	if (valueColumnCount == 0)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("relation \"%s\" does not have columns other than the "
+							   "key columns", baseRelationName)));
+
+	/*
+	 * Keys without deltas come straight from the base table, keys with deltas
+	 * are combined with their base row.
+	 */
+	StringInfo	viewCommand = makeStringInfo();
+
+	appendStringInfo(viewCommand,
+					 "create view %s as "
+					 "select %s, %s from %s b "
+					 "where not exists (select from %s d where (%s) = (%s)) "
+					 "union all "
+					 "select %s, %s from ("
+					 " select %s, %s from %s"
+					 " union all"
+					 " select %s, %s from %s b where (%s) in (select %s from %s)"
+					 ") d group by %s",
+					 viewName,
+					 baseKeyColumns->data, baseValueColumns->data, baseName,
+					 deltaTableName, deltaKeyColumns->data, baseKeyColumns->data,
+					 keyColumns->data, combinedColumns->data,
+					 keyColumns->data, valueColumns->data, deltaTableName,
+					 baseKeyColumns->data, baseValueColumns->data, baseName,
+					 baseKeyColumns->data, keyColumns->data, deltaTableName,
+					 keyColumns->data);
+
+	/*
+	 * Moving the deltas and updating the base rows happens in one statement,
+	 * such that readers of the view never see a delta twice.
+	 */
+	StringInfo	compactionCommand = makeStringInfo();
+
+	appendStringInfo(compactionCommand,
+					 "with moved as ("
+					 " delete from %s returning %s, %s"
+					 "), "
+					 "combined as ("
+					 " select %s, %s from ("
+					 "  select %s, %s from moved"
+					 "  union all"
+					 "  select %s, %s from %s b where (%s) in (select %s from moved)"
+					 " ) d group by %s"
+					 ") "
+					 "insert into %s (%s, %s) "
+					 "select %s, %s from combined "
+					 "on conflict (%s) do update set %s",
+					 deltaTableName, keyColumns->data, valueColumns->data,
+					 keyColumns->data, combinedColumns->data,
+					 keyColumns->data, valueColumns->data,
+					 baseKeyColumns->data, baseValueColumns->data, baseName,
+					 baseKeyColumns->data, keyColumns->data,
+					 keyColumns->data,
+					 baseName, keyColumns->data, valueColumns->data,
+					 keyColumns->data, valueColumns->data,
+					 keyColumns->data, updateColumns->data);
+
+	/* create the delta table and view as the current user */
+	char	   *createCommand = psprintf("create table %s (like %s including defaults)",
+										 deltaTableName, baseName);
+
+	SPI_connect();
+	SPI_execute(createCommand, false, 0);
+	SPI_execute(viewCommand->data, false, 0);
+	SPI_finish();
+
+	/* validate the compaction command */
+	ParseQuery(compactionCommand->data, NIL);
+
+	Oid			deltaRelationId =
+		DatumGetObjectId(DirectFunctionCall1(regclassin, CStringGetDatum(deltaTableName)));
+	Oid			viewRelationId =
+		DatumGetObjectId(DirectFunctionCall1(regclassin, CStringGetDatum(viewName)));
+
+	char	   *jobName = NULL;
+
+	if (schedule != NULL)
+	{
+		jobName = psprintf("pipeline:compact:%s", deltaTableName);
+
+		char	   *cronCommand = psprintf("select incremental.compact_delta(%s)",
+										   quote_literal_cstr(deltaTableName));
+		int64		jobId = ScheduleCronJob(jobName, schedule, cronCommand);
+
+		ereport(NOTICE, (errmsg("delta table %s: scheduled compaction job with ID "
+								INT64_FORMAT " and schedule %s",
+								deltaTableName, jobId, schedule)));
+	}
+
+	InsertDeltaTable(deltaRelationId, baseRelationId, viewRelationId,
+					 compactionCommand->data, jobName);
+
+	PG_RETURN_OID(deltaRelationId);
+}
+
+
+/*
+ * incremental_compact_delta folds the rows in a delta table into its base
+ * table and returns the number of keys that were updated.
+ */
+Datum
+incremental_compact_delta(PG_FUNCTION_ARGS)
+{
+	Oid			deltaRelationId = PG_GETARG_OID(0);
+	DeltaTable *deltaTable = ReadDeltaTable(deltaRelationId);
+
+	/*
+	 * Check the privileges that compaction needs before taking a lock that
+	 * blocks writers of the base table.
+	 */
+	if (pg_class_aclcheck(deltaRelationId, GetUserId(),
+						  ACL_SELECT | ACL_DELETE) != ACLCHECK_OK)
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						errmsg("permission denied for table %s",
+							   get_rel_name(deltaRelationId))));
+
+	if (pg_class_aclcheck(deltaTable->baseRelationId, GetUserId(),
+						  ACL_SELECT | ACL_INSERT | ACL_UPDATE) != ACLCHECK_OK)
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						errmsg("permission denied for table %s",
+							   get_rel_name(deltaTable->baseRelationId))));
+
+	/*
+	 * Block concurrent compactions, which would otherwise combine the same
+	 * base rows. The compaction statement takes its snapshot after the lock
+	 * is acquired, so it sees the result of the previous compaction.
+	 */
+	LockRelationOid(deltaTable->baseRelationId, ShareRowExclusiveLock);
+
+	/* run the compaction as the current user */
+	SPI_connect();
+	SPI_execute(deltaTable->compactionCommand, false, 0);
+
+	int64		keyCount = SPI_processed;
+
+	SPI_finish();
+
+	PG_RETURN_INT64(keyCount);
+}
+
+
+/*
+ * incremental_drop_delta_table unschedules the compaction job and drops the
+ * view and delta table. Uncompacted deltas are lost, so callers should run
+ * compact_delta first.
+ */
+Datum
+incremental_drop_delta_table(PG_FUNCTION_ARGS)
+{
+	Oid			deltaRelationId = PG_GETARG_OID(0);
+	DeltaTable *deltaTable = ReadDeltaTable(deltaRelationId);
+
+	if (!superuser() && deltaTable->ownerId != GetUserId())
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						errmsg("permission denied for delta table %s",
+							   get_rel_name(deltaRelationId))));
+
+	DeleteDeltaTable(deltaRelationId);
+
+	if (deltaTable->jobName != NULL)
+		UnscheduleCronJob(deltaTable->jobName);
+
+	char	   *viewName = get_rel_name(deltaTable->viewRelationId);
+	char	   *dropViewCommand = NULL;
+
+	if (viewName != NULL)
+		dropViewCommand =
+			psprintf("drop view if exists %s",
+					 quote_qualified_identifier(get_namespace_name(get_rel_namespace(deltaTable->viewRelationId)),
+												viewName));
+
+	char	   *dropTableCommand =
+		psprintf("drop table %s",
+				 quote_qualified_identifier(get_namespace_name(get_rel_namespace(deltaRelationId)),
+											get_rel_name(deltaRelationId)));
+
+	SPI_connect();
+
+	if (dropViewCommand != NULL)
+		SPI_execute(dropViewCommand, false, 0);
+
+	SPI_execute(dropTableCommand, false, 0);
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * QuoteQualifiedName parses a possibly-qualified name and returns it with
+ * every part quoted where needed.
+ */
+static char *
+QuoteQualifiedName(char *qualifiedName)
+{
+#if (PG_VERSION_NUM >= 160000)
+	List	   *names = stringToQualifiedNameList(qualifiedName, NULL);
+#else
+	List	   *names = stringToQualifiedNameList(qualifiedName);
+#endif
+
+	return NameListToQuotedString(names);
+}
+
+
+/*
+ * GetCombineAggregate returns the aggregate with which deltas of the given
+ * column are combined. Entries in combineAggregates have the form
+ * column:aggregate and take precedence over the default.
+ */
+static char *
+GetCombineAggregate(char *columnName, Oid typeId, List *combineAggregates)
+{
+	ListCell   *aggregateCell = NULL;
+	size_t		columnNameLength = strlen(columnName);
+
+	foreach(aggregateCell, combineAggregates)
+	{
+		char	   *entry = lfirst(aggregateCell);
+
+		if (strncmp(entry, columnName, columnNameLength) == 0 &&
+			entry[columnNameLength] == ':')
+			return QuoteQualifiedName(entry + columnNameLength + 1);
+	}
+
+	/* sketches are combined by merging */
+	char	   *typeName = format_type_extended(typeId, -1, FORMAT_TYPE_FORCE_QUALIFY);
+
+	if (strcmp(typeName, "incremental.hll") == 0 ||
+		strcmp(typeName, "incremental.ddsketch") == 0)
+		return "incremental.merge_agg";
+
+	return "pg_catalog.sum";
+}
+
+
+/*
+ * InsertDeltaTable records a new delta table.
+ */
+static void
+InsertDeltaTable(Oid deltaRelationId, Oid baseRelationId, Oid viewRelationId,
+				 char *compactionCommand, char *jobName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the delta tables table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.delta_tables "
+		"(delta_table, base_table, combined_view, compaction_command, job_name, owner_id) "
+		"values ($1, $2, $3, $4, $5, $6)";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 6;
+	Oid			argTypes[] = {OIDOID, OIDOID, OIDOID, TEXTOID, TEXTOID, OIDOID};
+	Datum		argValues[] = {
+		ObjectIdGetDatum(deltaRelationId),
+		ObjectIdGetDatum(baseRelationId),
+		ObjectIdGetDatum(viewRelationId),
+		CStringGetTextDatum(compactionCommand),
+		jobName != NULL ? CStringGetTextDatum(jobName) : 0,
+		ObjectIdGetDatum(savedUserId)
+	};
+	char		argNulls[] = {
+		' ', ' ', ' ', ' ',
+		jobName != NULL ? ' ' : 'n',
+		' '
+	};
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * ReadDeltaTable returns the description of a delta table.
+ */
+static DeltaTable *
+ReadDeltaTable(Oid deltaRelationId)
+{
+	DeltaTable *deltaTable = (DeltaTable *) palloc0(sizeof(DeltaTable));
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	char	   *query =
+		"select base_table, combined_view, compaction_command, job_name, owner_id "
+		"from incremental.delta_tables "
+		"where delta_table operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {OIDOID};
+	Datum		argValues[] = {
+		ObjectIdGetDatum(deltaRelationId)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("relation \"%s\" is not a delta table",
+							   get_rel_name(deltaRelationId))));
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		baseTableDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+	Datum		viewDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+	Datum		commandDatum = SPI_getbinval(row, rowDesc, 3, &isNull);
+
+	bool		jobNameIsNull = false;
+	Datum		jobNameDatum = SPI_getbinval(row, rowDesc, 4, &jobNameIsNull);
+	Datum		ownerIdDatum = SPI_getbinval(row, rowDesc, 5, &isNull);
+
+	MemoryContext oldContext = MemoryContextSwitchTo(callerContext);
+
+	deltaTable->deltaRelationId = deltaRelationId;
+	deltaTable->baseRelationId = DatumGetObjectId(baseTableDatum);
+	deltaTable->viewRelationId = DatumGetObjectId(viewDatum);
+	deltaTable->compactionCommand = TextDatumGetCString(commandDatum);
+	deltaTable->jobName = jobNameIsNull ? NULL : TextDatumGetCString(jobNameDatum);
+	deltaTable->ownerId = DatumGetObjectId(ownerIdDatum);
+
+	MemoryContextSwitchTo(oldContext);
+
+	SPI_finish();
+
+	return deltaTable;
+}
+
+
+/*
+ * DeleteDeltaTable removes a delta table from incremental.delta_tables.
+ */
+static void
+DeleteDeltaTable(Oid deltaRelationId)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the delta tables table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"delete from incremental.delta_tables "
+		"where delta_table operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {OIDOID};
+	Datum		argValues[] = {
+		ObjectIdGetDatum(deltaRelationId)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
@@ -0,0 +1,606 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "crunchy/incremental/dimension.h"
+#include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/query.h"
+#include "executor/spi.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/snapmgr.h"
+
+
+/*
+ * DimensionTriggers are the statement-level triggers that log the keys of
+ * changed rows of a dimension table, one per event since triggers with
+ * transition tables can only have a single event.
+ */
+static const char *DimensionTriggers[][2] = {
+	{"incremental_dimension_insert", "AFTER INSERT ON %s REFERENCING NEW TABLE AS new_rows"},
+	{"incremental_dimension_update", "AFTER UPDATE ON %s REFERENCING OLD TABLE AS old_rows "
+	"NEW TABLE AS new_rows"},
+	{"incremental_dimension_delete", "AFTER DELETE ON %s REFERENCING OLD TABLE AS old_rows"}
+};
+
+
+static void CreateDimensionTriggers(Oid dimensionRelationId);
+static void DropUnusedDimensionTriggers(Oid dimensionRelationId);
+static Oid	GetProgressTypeId(PipelineType pipelineType);
+static Datum GetPipelineProgress(char *pipelineName, PipelineType pipelineType,
+								 bool *isNull);
+static Datum PopChangedDimensionKeys(char *pipelineName, Oid dimensionRelationId,
+									 bool *isNull);
+
+
+PG_FUNCTION_INFO_V1(incremental_add_dimension);
+PG_FUNCTION_INFO_V1(incremental_remove_dimension);
+
+
+/*
+ * incremental_add_dimension declares that the summary of a pipeline depends
+ * on a dimension table, such that changes to the dimension table are logged
+ * and corrected by a command in the next run.
+ */
+Datum
+incremental_add_dimension(PG_FUNCTION_ARGS)
+{
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	Oid			dimensionRelationId = PG_GETARG_OID(1);
+	char	   *keyColumn = text_to_cstring(PG_GETARG_TEXT_P(2));
+	char	   *correctionCommand = text_to_cstring(PG_GETARG_TEXT_P(3));
+
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+	EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
+
+	if (pipelineDesc->pipelineType != SEQUENCE_RANGE_PIPELINE &&
+		pipelineDesc->pipelineType != TIME_INTERVAL_PIPELINE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("dimensions are only supported for sequence and time "
+							   "interval pipelines")));
+
+	if (get_attnum(dimensionRelationId, keyColumn) == InvalidAttrNumber)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+						errmsg("column \"%s\" of relation \"%s\" does not exist",
+							   keyColumn, get_rel_name(dimensionRelationId))));
+
+	/* validate the query */
+	List	   *paramTypes = list_make2_oid(TEXTARRAYOID,
+											GetProgressTypeId(pipelineDesc->pipelineType));
+
+	ParseQuery(correctionCommand, paramTypes);
+
+	/* creating triggers checks the TRIGGER privilege of the current user */
+	CreateDimensionTriggers(dimensionRelationId);
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the dimensions table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.pipeline_dimensions "
+		"(pipeline_name, dimension_table, key_column, correction_command) "
+		"values ($1, $2, $3, $4) "
+		"on conflict (pipeline_name, dimension_table) do update set "
+		"key_column = excluded.key_column, "
+		"correction_command = excluded.correction_command";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 4;
+	Oid			argTypes[] = {TEXTOID, OIDOID, TEXTOID, TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		ObjectIdGetDatum(dimensionRelationId),
+		CStringGetTextDatum(keyColumn),
+		CStringGetTextDatum(correctionCommand)
+	};
+	char	   *argNulls = "    ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * incremental_remove_dimension removes a dimension table from a pipeline.
+ */
+Datum
+incremental_remove_dimension(PG_FUNCTION_ARGS)
+{
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	Oid			dimensionRelationId = PG_GETARG_OID(1);
+
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+	EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the dimensions table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"delete from incremental.pipeline_dimensions "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"and dimension_table operator(pg_catalog.=) $2";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, OIDOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		ObjectIdGetDatum(dimensionRelationId)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("%s is not a dimension of pipeline %s",
+							   get_rel_name(dimensionRelationId), pipelineName)));
+
+	SPI_finish();
+
+	DropUnusedDimensionTriggers(dimensionRelationId);
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * ExecuteDimensionCorrections executes the correction command of each
+ * dimension of a pipeline for the keys that changed since the previous
+ * run. The command receives the changed keys as a text array ($1) and the
+ * progress of the pipeline ($2), such that it can recompute the summary for
+ * exactly the ranges that were already processed.
+ *
+ * It runs after the regular range in the same transaction, so a failed
+ * correction retries the whole run.
+ */
+void
+ExecuteDimensionCorrections(char *pipelineName, PipelineType pipelineType)
+{
+	char	   *query =
+		"select dimension_table, correction_command "
+		"from incremental.pipeline_dimensions "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"order by dimension_table";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	MemoryContext callerContext = CurrentMemoryContext;
+	List	   *dimensionIds = NIL;
+	List	   *correctionCommands = NIL;
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	for (uint64 rowIndex = 0; rowIndex < SPI_processed; rowIndex++)
+	{
+		TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+		HeapTuple	row = SPI_tuptable->vals[rowIndex];
+		bool		isNull = false;
+
+		Datum		dimensionIdDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+		Datum		commandDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+		dimensionIds = lappend_oid(dimensionIds, DatumGetObjectId(dimensionIdDatum));
+		correctionCommands = lappend(correctionCommands, TextDatumGetCString(commandDatum));
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	if (dimensionIds == NIL)
+		return;
+
+	bool		progressIsNull = false;
+	Datum		progress = GetPipelineProgress(pipelineName, pipelineType, &progressIsNull);
+
+	for (int dimensionIndex = 0; dimensionIndex < list_length(dimensionIds); dimensionIndex++)
+	{
+		Oid			dimensionRelationId = list_nth_oid(dimensionIds, dimensionIndex);
+		char	   *correctionCommand = list_nth(correctionCommands, dimensionIndex);
+		bool		keysIsNull = false;
+		Datum		changedKeys = PopChangedDimensionKeys(pipelineName, dimensionRelationId,
+														  &keysIsNull);
+
+		/* nothing changed, or nothing was summarized yet */
+		if (keysIsNull || progressIsNull)
+			continue;
+
+		ArrayType  *keyArray = DatumGetArrayTypeP(changedKeys);
+		int			keyCount = ArrayGetNItems(ARR_NDIM(keyArray), ARR_DIMS(keyArray));
+
+		ereport(NOTICE, (errmsg("pipeline %s: correcting %d keys that changed in %s",
+								pipelineName, keyCount, get_rel_name(dimensionRelationId))));
+
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		int			commandArgCount = 2;
+		Oid			commandArgTypes[] = {TEXTARRAYOID, GetProgressTypeId(pipelineType)};
+		Datum		commandArgValues[] = {changedKeys, progress};
+		char	   *commandArgNulls = "  ";
+
+		SPI_connect();
+		SPI_execute_with_args(correctionCommand,
+							  commandArgCount,
+							  commandArgTypes,
+							  commandArgValues,
+							  commandArgNulls,
+							  readOnly,
+							  tupleCount);
+		SPI_finish();
+
+		PopActiveSnapshot();
+	}
+}
+
+
+/*
+ * RemoveDimensionChanges removes the logged dimension changes of a pipeline,
+ * which are obsolete once the pipeline is reset.
+ */
+void
+RemoveDimensionChanges(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the dimension changes table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"delete from incremental.dimension_changes "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * RemovePipelineDimensions removes the dimensions of a pipeline that is
+ * being dropped, and drops the triggers of dimension tables that are no
+ * longer used by any pipeline.
+ */
+void
+RemovePipelineDimensions(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the dimensions table, or does not own the dimension
+	 * tables.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"delete from incremental.pipeline_dimensions "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"returning dimension_table";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	MemoryContext callerContext = CurrentMemoryContext;
+	List	   *dimensionIds = NIL;
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	for (uint64 rowIndex = 0; rowIndex < SPI_processed; rowIndex++)
+	{
+		bool		isNull = false;
+		Datum		dimensionIdDatum = SPI_getbinval(SPI_tuptable->vals[rowIndex],
+													 SPI_tuptable->tupdesc, 1, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+		dimensionIds = lappend_oid(dimensionIds, DatumGetObjectId(dimensionIdDatum));
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	ListCell   *dimensionCell = NULL;
+
+	foreach(dimensionCell, dimensionIds)
+		DropUnusedDimensionTriggers(lfirst_oid(dimensionCell));
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * CreateDimensionTriggers creates the triggers that log changed keys of a
+ * dimension table, or replaces them if they already exist.
+ */
+static void
+CreateDimensionTriggers(Oid dimensionRelationId)
+{
+	char	   *qualifiedName =
+		quote_qualified_identifier(get_namespace_name(get_rel_namespace(dimensionRelationId)),
+								   get_rel_name(dimensionRelationId));
+
+	SPI_connect();
+
+	for (int triggerIndex = 0; triggerIndex < lengthof(DimensionTriggers); triggerIndex++)
+	{
+		char	   *triggerEvent = psprintf(DimensionTriggers[triggerIndex][1], qualifiedName);
+		char	   *command =
+			psprintf("CREATE OR REPLACE TRIGGER %s %s FOR EACH STATEMENT "
+					 "EXECUTE FUNCTION incremental._dimension_change_trigger()",
+					 DimensionTriggers[triggerIndex][0], triggerEvent);
+
+		SPI_execute(command, false, 0);
+	}
+
+	SPI_finish();
+}
+
+
+/*
+ * DropUnusedDimensionTriggers drops the triggers of a dimension table if no
+ * pipeline uses it anymore.
+ */
+static void
+DropUnusedDimensionTriggers(Oid dimensionRelationId)
+{
+	char	   *relationName = get_rel_name(dimensionRelationId);
+
+	/* the dimension table is being dropped, along with its triggers */
+	if (relationName == NULL)
+		return;
+
+	char	   *query =
+		"select 1 from incremental.pipeline_dimensions "
+		"where dimension_table operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 1;
+	int			argCount = 1;
+	Oid			argTypes[] = {OIDOID};
+	Datum		argValues[] = {
+		ObjectIdGetDatum(dimensionRelationId)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed == 0)
+	{
+		char	   *qualifiedName =
+			quote_qualified_identifier(get_namespace_name(get_rel_namespace(dimensionRelationId)),
+									   relationName);
+
+		for (int triggerIndex = 0; triggerIndex < lengthof(DimensionTriggers); triggerIndex++)
+		{
+			char	   *command = psprintf("DROP TRIGGER IF EXISTS %s ON %s",
+										   DimensionTriggers[triggerIndex][0],
+										   qualifiedName);
+
+			SPI_execute(command, false, 0);
+		}
+	}
+
+	SPI_finish();
+}
+
+
+/*
+ * GetProgressTypeId returns the type of the progress of a pipeline that is
+ * passed to correction commands.
+ */
+static Oid
+GetProgressTypeId(PipelineType pipelineType)
+{
+	return pipelineType == TIME_INTERVAL_PIPELINE ? TIMESTAMPTZOID : INT8OID;
+}
+
+
+/*
+ * GetPipelineProgress returns the last processed sequence number or time of
+ * a pipeline, including the range processed by the current run.
+ */
+static Datum
+GetPipelineProgress(char *pipelineName, PipelineType pipelineType, bool *isNull)
+{
+	char	   *query = pipelineType == TIME_INTERVAL_PIPELINE ?
+		"select last_processed_time "
+		"from incremental.time_interval_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1" :
+		"select nullif(last_processed_sequence_number, 0) "
+		"from incremental.sequence_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	*isNull = true;
+
+	Datum		progress = 0;
+
+	if (SPI_processed > 0)
+		progress = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, isNull);
+
+	/* int8 and timestamptz are pass-by-value */
+	SPI_finish();
+
+	return progress;
+}
+
+
+/*
+ * PopChangedDimensionKeys removes the logged keys of a dimension table for a
+ * pipeline and returns them as a text array, or sets isNull if there are
+ * none. Changes that commit concurrently remain for the next run.
+ */
+static Datum
+PopChangedDimensionKeys(char *pipelineName, Oid dimensionRelationId, bool *isNull)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the dimension changes table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"with changes as ("
+		" delete from incremental.dimension_changes "
+		" where pipeline_name operator(pg_catalog.=) $1 "
+		" and dimension_table operator(pg_catalog.=) $2 "
+		" returning key"
+		") "
+		"select pg_catalog.array_agg(key order by key) from changes";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, OIDOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		ObjectIdGetDatum(dimensionRelationId)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	Datum		changedKeys = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+											1, isNull);
+
+	/* copy the array out of the SPI memory context */
+	if (!*isNull)
+		changedKeys = SPI_datumTransfer(changedKeys, false, -1);
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return changedKeys;
+}
@@ -0,0 +1,367 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "crunchy/incremental/exporter.h"
+#include "crunchy/incremental/stats.h"
+#include "lib/stringinfo.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/latch.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+
+/* maximum size of an HTTP request we read */
+#define MAX_REQUEST_SIZE 8192
+
+/* how long to wait for a slow client, in seconds */
+#define CLIENT_TIMEOUT 5
+
+/* seconds between the Unix epoch and the PostgreSQL epoch */
+#define UNIX_EPOCH_OFFSET \
+	((double) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY)
+
+
+/* port on which to serve metrics, 0 disables the exporter */
+int			MetricsPort = 0;
+
+
+static int	OpenMetricsSocket(void);
+static void HandleMetricsRequest(int listenSocket);
+static void RenderMetrics(StringInfo body);
+static void AppendMetric(StringInfo body, const char *name, PipelineStats * stats,
+						 const char *valueFormat, double value);
+static void AppendLabelValue(StringInfo body, const char *value);
+static void SendAll(int clientSocket, const char *data, size_t length);
+
+
+/*
+ * RegisterMetricsExporter registers the background worker that serves
+ * pipeline metrics.
+ */
+void
+RegisterMetricsExporter(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	strlcpy(worker.bgw_library_name, "pg_incremental", BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, "IncrementalMetricsExporterMain", BGW_MAXLEN);
+	strlcpy(worker.bgw_name, "pg_incremental metrics exporter", BGW_MAXLEN);
+	strlcpy(worker.bgw_type, "pg_incremental metrics exporter", BGW_MAXLEN);
+
+	RegisterBackgroundWorker(&worker);
+}
+
+
+/*
+ * IncrementalMetricsExporterMain is the entry point of the metrics exporter.
+ * It serves OpenMetrics text from shared memory statistics on a localhost
+ * port, without connecting to a database.
+ */
+void
+IncrementalMetricsExporterMain(Datum arg)
+{
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	int			listenSocket = OpenMetricsSocket();
+
+	ereport(LOG, (errmsg("pg_incremental metrics exporter listening on 127.0.0.1:%d",
+						 MetricsPort)));
+
+	while (!ShutdownRequestPending)
+	{
+		int			events = WaitLatchOrSocket(MyLatch,
+											   WL_LATCH_SET | WL_SOCKET_READABLE |
+											   WL_EXIT_ON_PM_DEATH,
+											   listenSocket, -1L, PG_WAIT_EXTENSION);
+
+		if (events & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (events & WL_SOCKET_READABLE)
+			HandleMetricsRequest(listenSocket);
+	}
+
+	close(listenSocket);
+
+	proc_exit(0);
+}
+
+
+/*
+ * OpenMetricsSocket opens a non-blocking socket listening on the metrics port
+ * on the loopback interface.
+ */
+static int
+OpenMetricsSocket(void)
+{
+	int			listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (listenSocket < 0)
+		ereport(ERROR, (errcode_for_socket_access(),
+						errmsg("could not create metrics socket: %m")));
+
+	int			reuseAddress = 1;
+
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+
+	struct sockaddr_in address;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(MetricsPort);
+
+	if (bind(listenSocket, (struct sockaddr *) &address, sizeof(address)) < 0)
+		ereport(ERROR, (errcode_for_socket_access(),
+						errmsg("could not bind metrics socket to port %d: %m",
+							   MetricsPort)));
+
+	if (listen(listenSocket, 16) < 0)
+		ereport(ERROR, (errcode_for_socket_access(),
+						errmsg("could not listen on metrics socket: %m")));
+
+	if (!pg_set_noblock(listenSocket))
+		ereport(ERROR, (errcode_for_socket_access(),
+						errmsg("could not set metrics socket to non-blocking mode: %m")));
+
+	return listenSocket;
+}
+
+
+/*
+ * HandleMetricsRequest accepts a connection, reads the HTTP request, and
+ * responds with the metrics.
+ */
+static void
+HandleMetricsRequest(int listenSocket)
+{
+	int			clientSocket = accept(listenSocket, NULL, NULL);
+
+	if (clientSocket < 0)
+		return;
+
+	/* do not let a slow client block the exporter for long */
+	struct timeval timeout = {.tv_sec = CLIENT_TIMEOUT,.tv_usec = 0};
+
+	pg_set_block(clientSocket);
+	setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	char		request[MAX_REQUEST_SIZE + 1];
+	size_t		requestLength = 0;
+
+	/* read until the end of the request headers */
+	while (requestLength < MAX_REQUEST_SIZE)
+	{
+		ssize_t		bytesRead = recv(clientSocket, request + requestLength,
+									 MAX_REQUEST_SIZE - requestLength, 0);
+
+		if (bytesRead <= 0)
+			break;
+
+		requestLength += bytesRead;
+		request[requestLength] = '\0';
+
+		if (strstr(request, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	request[requestLength] = '\0';
+
+	StringInfoData response;
+
+	initStringInfo(&response);
+
+	if (strncmp(request, "GET ", 4) == 0)
+	{
+		StringInfoData body;
+
+		initStringInfo(&body);
+		RenderMetrics(&body);
+
+		appendStringInfo(&response,
+						 "HTTP/1.1 200 OK\r\n"
+						 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+						 "Content-Length: %d\r\n"
+						 "Connection: close\r\n"
+						 "\r\n",
+						 body.len);
+		appendBinaryStringInfo(&response, body.data, body.len);
+
+		pfree(body.data);
+	}
+	else
+	{
+		appendStringInfoString(&response,
+							   "HTTP/1.1 405 Method Not Allowed\r\n"
+							   "Content-Length: 0\r\n"
+							   "Connection: close\r\n"
+							   "\r\n");
+	}
+
+	SendAll(clientSocket, response.data, response.len);
+	close(clientSocket);
+
+	pfree(response.data);
+}
+
+
+/*
+ * RenderMetrics renders the pipeline statistics in OpenMetrics text format.
+ */
+static void
+RenderMetrics(StringInfo body)
+{
+	PipelineStats *statsArray = palloc0(sizeof(PipelineStats) * MaxTrackedPipelines);
+	int			statsCount = CopyPipelineStats(statsArray, MaxTrackedPipelines);
+	TimestampTz now = GetCurrentTimestamp();
+
+	appendStringInfoString(body,
+						   "# TYPE pg_incremental_pipeline_runs counter\n"
+						   "# HELP pg_incremental_pipeline_runs Number of pipeline executions.\n");
+	for (int i = 0; i < statsCount; i++)
+		AppendMetric(body, "pg_incremental_pipeline_runs_total", &statsArray[i],
+					 "%.0f", statsArray[i].runCount);
+
+	appendStringInfoString(body,
+						   "# TYPE pg_incremental_pipeline_failures counter\n"
+						   "# HELP pg_incremental_pipeline_failures Number of pipeline executions that failed.\n");
+	for (int i = 0; i < statsCount; i++)
+		AppendMetric(body, "pg_incremental_pipeline_failures_total", &statsArray[i],
+					 "%.0f", statsArray[i].failureCount);
+
+	appendStringInfoString(body,
+						   "# TYPE pg_incremental_pipeline_duration_seconds counter\n"
+						   "# UNIT pg_incremental_pipeline_duration_seconds seconds\n"
+						   "# HELP pg_incremental_pipeline_duration_seconds Total time spent executing the pipeline.\n");
+	for (int i = 0; i < statsCount; i++)
+		AppendMetric(body, "pg_incremental_pipeline_duration_seconds_total", &statsArray[i],
+					 "%.6f", statsArray[i].totalDuration / 1000000.0);
+
+	appendStringInfoString(body,
+						   "# TYPE pg_incremental_pipeline_last_duration_seconds gauge\n"
+						   "# UNIT pg_incremental_pipeline_last_duration_seconds seconds\n"
+						   "# HELP pg_incremental_pipeline_last_duration_seconds Duration of the most recent execution.\n");
+	for (int i = 0; i < statsCount; i++)
+		AppendMetric(body, "pg_incremental_pipeline_last_duration_seconds", &statsArray[i],
+					 "%.6f", statsArray[i].lastDuration / 1000000.0);
+
+	appendStringInfoString(body,
+						   "# TYPE pg_incremental_pipeline_lock_wait_seconds counter\n"
+						   "# UNIT pg_incremental_pipeline_lock_wait_seconds seconds\n"
+						   "# HELP pg_incremental_pipeline_lock_wait_seconds Total time spent waiting for concurrent writers.\n");
+	for (int i = 0; i < statsCount; i++)
+		AppendMetric(body, "pg_incremental_pipeline_lock_wait_seconds_total", &statsArray[i],
+					 "%.6f", statsArray[i].totalLockWait / 1000000.0);
+
+	appendStringInfoString(body,
+						   "# TYPE pg_incremental_pipeline_last_success_timestamp_seconds gauge\n"
+						   "# UNIT pg_incremental_pipeline_last_success_timestamp_seconds seconds\n"
+						   "# HELP pg_incremental_pipeline_last_success_timestamp_seconds Start time of the most recent successful execution.\n");
+	for (int i = 0; i < statsCount; i++)
+	{
+		if (statsArray[i].lastSuccessTime == 0)
+			continue;
+
+		AppendMetric(body, "pg_incremental_pipeline_last_success_timestamp_seconds", &statsArray[i],
+					 "%.3f", statsArray[i].lastSuccessTime / 1000000.0 + UNIX_EPOCH_OFFSET);
+	}
+
+	appendStringInfoString(body,
+						   "# TYPE pg_incremental_pipeline_time_since_last_success_seconds gauge\n"
+						   "# UNIT pg_incremental_pipeline_time_since_last_success_seconds seconds\n"
+						   "# HELP pg_incremental_pipeline_time_since_last_success_seconds Time since the start of the most recent successful execution.\n");
+	for (int i = 0; i < statsCount; i++)
+	{
+		if (statsArray[i].lastSuccessTime == 0)
+			continue;
+
+		AppendMetric(body, "pg_incremental_pipeline_time_since_last_success_seconds", &statsArray[i],
+					 "%.3f", (now - statsArray[i].lastSuccessTime) / 1000000.0);
+	}
+
+	appendStringInfoString(body, "# EOF\n");
+
+	pfree(statsArray);
+}
+
+
+/*
+ * AppendMetric appends a single sample with database and pipeline labels.
+ */
+static void
+AppendMetric(StringInfo body, const char *name, PipelineStats * stats,
+			 const char *valueFormat, double value)
+{
+	appendStringInfo(body, "%s{database=\"", name);
+	AppendLabelValue(body, stats->databaseName);
+	appendStringInfoString(body, "\",pipeline=\"");
+	AppendLabelValue(body, stats->pipelineName);
+	appendStringInfoString(body, "\"} ");
+	appendStringInfo(body, valueFormat, value);
+	appendStringInfoChar(body, '\n');
+}
+
+
+/*
+ * AppendLabelValue appends a label value with backslashes, double quotes,
+ * and newlines escaped.
+ */
+static void
+AppendLabelValue(StringInfo body, const char *value)
+{
+	for (const char *c = value; *c != '\0'; c++)
+	{
+		if (*c == '\\')
+			appendStringInfoString(body, "\\\\");
+		else if (*c == '"')
+			appendStringInfoString(body, "\\\"");
+		else if (*c == '\n')
+			appendStringInfoString(body, "\\n");
+		else
+			appendStringInfoChar(body, *c);
+	}
+}
+
+
+/*
+ * SendAll writes the full buffer to the client, giving up on errors.
+ */
+static void
+SendAll(int clientSocket, const char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t		bytesSent = send(clientSocket, data, length, MSG_NOSIGNAL);
+
+		if (bytesSent <= 0)
+			return;
+
+		data += bytesSent;
+		length -= bytesSent;
+	}
+}
@@ -22,6 +22,7 @@
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 
 /*
@@ -32,17 +33,29 @@ typedef struct FileList
 	List	   *files;
 	bool		batched;
 	int			maxBatchSize;
+
+	/* number of batches after which to commit, 0 to never commit */
+	int			batchesPerCommit;
 }			FileList;
 
 
+/*
+ * Number of consecutive listings in which a processed file must be missing
+ * before we remove it, to tolerate eventually consistent listings.
+ */
+#define FILE_CLEANUP_MISSING_LISTINGS 3
+
+
 static void ExecuteFileListPipelineForFile(char *pipelineName, char *command, char *path);
 static void ExecuteBatchedFileListPipeline(char *pipelineName, char *command, FileList * fileList,
 										   int offset);
 static void ExecuteFileListPipelineForFileArray(char *pipelineName, char *command,
 												ArrayType *filePaths);
 static FileList * GetUnprocessedFilesForPipeline(char *pipelineName);
+static void LockFileListPipeline(char *pipelineName);
+static List *RemoveProcessedFiles(char *pipelineName, List *files);
 static List *GetUnprocessedFileList(char *pipelineName, char *listFunction,
-									char *filePattern);
+									char *filePattern, Interval *cleanupGracePeriod);
 
 
 /* crunchy_lake.default_file_list_function setting */
@@ -55,7 +68,8 @@ char	   *DefaultFileListFunction = DEFAULT_FILE_LIST_FUNCTION;
  */
 void
 InitializeFileListPipelineState(char *pipelineName, char *pattern, bool batched,
-								char *listFunction, int maxBatchSize)
+								char *listFunction, int maxBatchSize,
+								int batchesPerCommit, Interval *cleanupGracePeriod)
 {
 	Oid			savedUserId = InvalidOid;
 	int			savedSecurityContext = 0;
@@ -69,22 +83,28 @@ InitializeFileListPipelineState(char *pipelineName, char *pattern, bool batched,
 
 	char	   *query =
 		"insert into incremental.file_list_pipelines "
-		"(pipeline_name, file_pattern, batched, list_function, max_batch_size) "
-		"values ($1, $2, $3, $4, $5)";
+		"(pipeline_name, file_pattern, batched, list_function, max_batch_size, "
+		"batches_per_commit, cleanup_grace_period) "
+		"values ($1, $2, $3, $4, $5, $6, $7)";
 
 	bool		readOnly = false;
 	int			tupleCount = 0;
-	int			argCount = 5;
-	Oid			argTypes[] = {TEXTOID, TEXTOID, BOOLOID, TEXTOID, INT4OID};
+	int			argCount = 7;
+	Oid			argTypes[] = {TEXTOID, TEXTOID, BOOLOID, TEXTOID, INT4OID, INT4OID, INTERVALOID};
 	Datum		argValues[] = {
 		CStringGetTextDatum(pipelineName),
 		CStringGetTextDatum(pattern),
 		BoolGetDatum(batched),
 		CStringGetTextDatum(listFunction),
-		Int32GetDatum(maxBatchSize)
+		Int32GetDatum(maxBatchSize),
+		Int32GetDatum(batchesPerCommit),
+		IntervalPGetDatum(cleanupGracePeriod)
 	};
 	char		argNulls[] = {
-		' ', ' ', ' ', ' ', maxBatchSize > 0 ? ' ' : 'n'
+		' ', ' ', ' ', ' ',
+		maxBatchSize > 0 ? ' ' : 'n',
+		batchesPerCommit > 0 ? ' ' : 'n',
+		cleanupGracePeriod != NULL ? ' ' : 'n'
 	};
 
 	SPI_connect();
@@ -103,9 +123,13 @@ InitializeFileListPipelineState(char *pipelineName, char *pattern, bool batched,
 
 /*
  * ExecuteFileListPipeline executes a file list pipeline.
+ *
+ * If allowCommit is true, the pipeline commits after every batches_per_commit
+ * batches (or files, if not batched), such that progress is preserved if a
+ * later batch fails.
  */
 void
-ExecuteFileListPipeline(char *pipelineName, char *command)
+ExecuteFileListPipeline(char *pipelineName, char *command, bool allowCommit)
 {
 	/* get the full fileList of data to process */
 	FileList   *fileList = GetUnprocessedFilesForPipeline(pipelineName);
@@ -117,6 +141,9 @@ ExecuteFileListPipeline(char *pipelineName, char *command)
 		return;
 	}
 
+	int			batchesPerCommit = allowCommit ? fileList->batchesPerCommit : 0;
+	int			batchCount = 0;
+
 	if (fileList->batched)
 	{
 		int			offset = 0;
@@ -126,22 +153,50 @@ ExecuteFileListPipeline(char *pipelineName, char *command)
 			ExecuteBatchedFileListPipeline(pipelineName, command, fileList, offset);
 
 			offset += fileList->maxBatchSize;
+			batchCount++;
+
+			if (batchesPerCommit > 0 && batchCount % batchesPerCommit == 0 &&
+				fileList->maxBatchSize > 0 && offset < list_length(fileList->files))
+			{
+				CommitPipelineTransaction();
+				LockFileListPipeline(pipelineName);
+
+				/* another execution may have processed files while unlocked */
+				fileList->files = RemoveProcessedFiles(pipelineName,
+													   list_copy_tail(fileList->files, offset));
+				offset = 0;
+			}
 		}
 		while (fileList->maxBatchSize > 0 && offset < list_length(fileList->files));
 	}
 	else
 	{
-		ListCell   *fileCell = NULL;
+		int			fileIndex = 0;
 
-		foreach(fileCell, fileList->files)
+		while (fileIndex < list_length(fileList->files))
 		{
-			char	   *path = lfirst(fileCell);
+			char	   *path = list_nth(fileList->files, fileIndex);
 
 			ereport(NOTICE, (errmsg("pipeline %s: processing file list pipeline for %s",
 									pipelineName, path)));
 
 			ExecuteFileListPipelineForFile(pipelineName, command, path);
 			InsertProcessedFile(pipelineName, path);
+
+			fileIndex++;
+			batchCount++;
+
+			if (batchesPerCommit > 0 && batchCount % batchesPerCommit == 0 &&
+				fileIndex < list_length(fileList->files))
+			{
+				CommitPipelineTransaction();
+				LockFileListPipeline(pipelineName);
+
+				/* another execution may have processed files while unlocked */
+				fileList->files = RemoveProcessedFiles(pipelineName,
+													   list_copy_tail(fileList->files, fileIndex));
+				fileIndex = 0;
+			}
 		}
 	}
 }
@@ -292,7 +347,8 @@ GetUnprocessedFilesForPipeline(char *pipelineName)
 	 * Get the file list pipeline properties.
 	 */
 	char	   *query =
-		"select batched, list_function, file_pattern, max_batch_size "
+		"select batched, list_function, file_pattern, max_batch_size, batches_per_commit, "
+		"cleanup_grace_period "
 		"from incremental.file_list_pipelines "
 		"where pipeline_name operator(pg_catalog.=) $1 "
 		"for update";
@@ -334,11 +390,28 @@ GetUnprocessedFilesForPipeline(char *pipelineName)
 	if (!isNull)
 		maxBatchSize = DatumGetInt32(maxBatchSizeDatum);
 
+	Datum		batchesPerCommitDatum = SPI_getbinval(row, rowDesc, 5, &isNull);
+
+	int			batchesPerCommit = 0;
+
+	if (!isNull)
+		batchesPerCommit = DatumGetInt32(batchesPerCommitDatum);
+
+	Datum		cleanupGracePeriodDatum = SPI_getbinval(row, rowDesc, 6, &isNull);
+
 	MemoryContext oldContext = MemoryContextSwitchTo(outerContext);
 
 	bool		batched = DatumGetBool(batchedDatum);
 	char	   *listFunction = TextDatumGetCString(listFunctionDatum);
 	char	   *filePattern = TextDatumGetCString(filePatternDatum);
+	Interval   *cleanupGracePeriod = NULL;
+
+	if (!isNull)
+	{
+		cleanupGracePeriod = (Interval *) palloc(sizeof(Interval));
+		memcpy(cleanupGracePeriod, DatumGetIntervalP(cleanupGracePeriodDatum),
+			   sizeof(Interval));
+	}
 
 	MemoryContextSwitchTo(oldContext);
 
@@ -350,18 +423,164 @@ GetUnprocessedFilesForPipeline(char *pipelineName)
 
 	fileList->batched = batched;
 	fileList->maxBatchSize = maxBatchSize;
-	fileList->files = GetUnprocessedFileList(pipelineName, listFunction, filePattern);
+	fileList->batchesPerCommit = batchesPerCommit;
+	fileList->files = GetUnprocessedFileList(pipelineName, listFunction, filePattern,
+											 cleanupGracePeriod);
 
 	return fileList;
 }
 
 
+/*
+ * LockFileListPipeline blocks other executions of a file list pipeline
+ * after an intermediate commit released the lock.
+ */
+static void
+LockFileListPipeline(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"select 1 "
+		"from incremental.file_list_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"for update";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * RemoveProcessedFiles returns the files in the given list that are not yet
+ * in processed_files, in the same order.
+ */
+static List *
+RemoveProcessedFiles(char *pipelineName, List *files)
+{
+	List	   *remainingFiles = NIL;
+	MemoryContext outerContext = CurrentMemoryContext;
+
+	if (files == NIL)
+		return NIL;
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have read
+	 * privileges for the processed files table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	Datum	   *fileDatums = palloc0(sizeof(Datum) * list_length(files));
+	int			fileIndex = 0;
+	ListCell   *fileCell = NULL;
+
+	foreach(fileCell, files)
+		fileDatums[fileIndex++] = CStringGetTextDatum(lfirst(fileCell));
+
+	ArrayType  *filesArray = construct_array(fileDatums, list_length(files), TEXTOID,
+											 -1, false, TYPALIGN_INT);
+
+	char	   *query =
+		"select list.path "
+		"from pg_catalog.unnest($2) with ordinality as list(path, position) "
+		"where not exists ("
+		" select 1 from incremental.processed_files proc"
+		" where proc.pipeline_name operator(pg_catalog.=) $1"
+		" and proc.path operator(pg_catalog.=) list.path) "
+		"order by list.position";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, TEXTARRAYOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		PointerGetDatum(filesArray)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+
+	for (int rowIndex = 0; rowIndex < SPI_processed; rowIndex++)
+	{
+		HeapTuple	row = SPI_tuptable->vals[rowIndex];
+
+		bool		isNull = false;
+		Datum		pathDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+
+		MemoryContext oldContext = MemoryContextSwitchTo(outerContext);
+
+		remainingFiles = lappend(remainingFiles, TextDatumGetCString(pathDatum));
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return remainingFiles;
+}
+
+
 /*
  * GetUnprocessedFileList lists the current set of files and subtracts
  * the already processed files,
+ *
+ * If a cleanup grace period is set, the same statement also removes processed
+ * files that were processed longer than the grace period ago and have been
+ * missing from FILE_CLEANUP_MISSING_LISTINGS consecutive listings, since they
+ * can never be listed again. The listing is materialized so that the list
+ * function is only called once.
  */
 static List *
-GetUnprocessedFileList(char *pipelineName, char *listFunction, char *filePattern)
+GetUnprocessedFileList(char *pipelineName, char *listFunction, char *filePattern,
+					   Interval *cleanupGracePeriod)
 {
 	List	   *fileList = NIL;
 	MemoryContext outerContext = CurrentMemoryContext;
@@ -381,24 +600,73 @@ GetUnprocessedFileList(char *pipelineName, char *listFunction, char *filePattern
 	 */
 	StringInfo	query = makeStringInfo();
 
-	appendStringInfo(query,
-					 "select list.path "
-					 "from %s($2) as list(path) "
-					 "left join incremental.processed_files proc "
-					 "on (pipeline_name operator(pg_catalog.=) $1 "
-					 "and list.path operator(pg_catalog.=) proc.path) "
-					 "where proc.path is null",
-					 listFunction);
+	if (cleanupGracePeriod == NULL)
+	{
+		appendStringInfo(query,
+						 "select list.path "
+						 "from %s($2) as list(path) "
+						 "left join incremental.processed_files proc "
+						 "on (pipeline_name operator(pg_catalog.=) $1 "
+						 "and list.path operator(pg_catalog.=) proc.path) "
+						 "where proc.path is null",
+						 listFunction);
+	}
+	else
+	{
+		/*
+		 * The removed, missing, and found CTEs modify disjoint sets of
+		 * processed files. The final select still sees the removed files, but
+		 * those are not in the listing.
+		 */
+		appendStringInfo(query,
+						 "with list as materialized ("
+						 " select path from %s($2) as list(path)"
+						 "), "
+						 "removed as ("
+						 " delete from incremental.processed_files proc"
+						 " where pipeline_name operator(pg_catalog.=) $1"
+						 " and processed_time operator(pg_catalog.<) pg_catalog.now() operator(pg_catalog.-) $3"
+						 " and missing_count operator(pg_catalog.+) 1 operator(pg_catalog.>=) $4"
+						 " and not exists (select 1 from list where list.path operator(pg_catalog.=) proc.path)"
+						 " returning 1"
+						 "), "
+						 "missing as ("
+						 " update incremental.processed_files proc"
+						 " set missing_count = missing_count operator(pg_catalog.+) 1"
+						 " where pipeline_name operator(pg_catalog.=) $1"
+						 " and processed_time operator(pg_catalog.<) pg_catalog.now() operator(pg_catalog.-) $3"
+						 " and missing_count operator(pg_catalog.+) 1 operator(pg_catalog.<) $4"
+						 " and not exists (select 1 from list where list.path operator(pg_catalog.=) proc.path)"
+						 " returning 1"
+						 "), "
+						 "found as ("
+						 " update incremental.processed_files proc"
+						 " set missing_count = 0"
+						 " where pipeline_name operator(pg_catalog.=) $1"
+						 " and missing_count operator(pg_catalog.>) 0"
+						 " and exists (select 1 from list where list.path operator(pg_catalog.=) proc.path)"
+						 " returning 1"
+						 ") "
+						 "select list.path "
+						 "from list "
+						 "left join incremental.processed_files proc "
+						 "on (pipeline_name operator(pg_catalog.=) $1 "
+						 "and list.path operator(pg_catalog.=) proc.path) "
+						 "where proc.path is null",
+						 listFunction);
+	}
 
 	bool		readOnly = false;
 	int			tupleCount = 0;
-	int			argCount = 2;
-	Oid			argTypes[] = {TEXTOID, TEXTOID};
+	int			argCount = cleanupGracePeriod == NULL ? 2 : 4;
+	Oid			argTypes[] = {TEXTOID, TEXTOID, INTERVALOID, INT4OID};
 	Datum		argValues[] = {
 		CStringGetTextDatum(pipelineName),
-		CStringGetTextDatum(filePattern)
+		CStringGetTextDatum(filePattern),
+		IntervalPGetDatum(cleanupGracePeriod),
+		Int32GetDatum(FILE_CLEANUP_MISSING_LISTINGS)
 	};
-	char	   *argNulls = "  ";
+	char	   *argNulls = "    ";
 
 	SPI_connect();
 	SPI_execute_with_args(query->data,
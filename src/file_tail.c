@@ -0,0 +1,696 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "catalog/pg_authid.h"
+#include "crunchy/incremental/file_tail.h"
+#include "crunchy/incremental/pipeline.h"
+#include "executor/spi.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/palloc.h"
+#include "utils/snapmgr.h"
+
+
+/* size of the blocks read when searching backwards for a newline */
+#define TAIL_READ_BLOCK_SIZE 8192
+
+
+/*
+ * TailedFile represents the state of a file in a file tail pipeline.
+ */
+typedef struct TailedFile
+{
+	char	   *path;
+
+	/* inode of the file, used to detect rotation */
+	int64		inode;
+
+	/* size of the file when it was listed */
+	int64		size;
+
+	/* offset up to which the file was processed (exclusive) */
+	int64		offset;
+}			TailedFile;
+
+
+static int64 LockFileTailPipeline(char *pipelineName, char **filePattern);
+static List *ListTailFiles(char *filePattern);
+static List *ReadTailedFiles(char *pipelineName);
+static TailedFile * FindTailedFileByPath(List *tailedFiles, char *path);
+static TailedFile * FindTailedFileByInode(List *tailedFiles, int64 inode);
+static int64 FindLastNewline(char *path, int64 startOffset, int64 endOffset);
+static void ExecuteFileTailPipelineForRange(char *pipelineName, char *command, char *path,
+											int64 startOffset, int64 endOffset);
+static void UpdateTailedFile(char *pipelineName, char *path, int64 inode, int64 offset);
+static void RemoveUnlistedTailedFiles(char *pipelineName, List *files);
+
+
+/*
+ * InitializeFileTailPipelineState adds the initial file tail pipeline state.
+ */
+void
+InitializeFileTailPipelineState(char *pipelineName, char *filePattern, int64 maxBatchBytes)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.file_tail_pipelines "
+		"(pipeline_name, file_pattern, max_batch_bytes) "
+		"values ($1, $2, $3)";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 3;
+	Oid			argTypes[] = {TEXTOID, TEXTOID, INT8OID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		CStringGetTextDatum(filePattern),
+		Int64GetDatum(maxBatchBytes)
+	};
+	char		argNulls[] = {
+		' ',
+		' ',
+		maxBatchBytes > 0 ? ' ' : 'n'
+	};
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * EnsureFileTailPrivileges throws an error if the current user is not
+ * allowed to read files on the server.
+ */
+void
+EnsureFileTailPrivileges(void)
+{
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						errmsg("permission denied to tail files"),
+						errdetail("Only roles with privileges of the \"%s\" role may "
+								  "use file tail pipelines.",
+								  "pg_read_server_files")));
+}
+
+
+/*
+ * ExecuteFileTailPipeline executes a file tail pipeline for the bytes that
+ * were appended to the matching files since the last execution, up to the
+ * last complete line.
+ */
+void
+ExecuteFileTailPipeline(char *pipelineName, char *command)
+{
+	EnsureFileTailPrivileges();
+
+	char	   *filePattern = NULL;
+	int64		maxBatchBytes = LockFileTailPipeline(pipelineName, &filePattern);
+
+	List	   *tailedFiles = ReadTailedFiles(pipelineName);
+	List	   *files = ListTailFiles(filePattern);
+	bool		processedAny = false;
+	ListCell   *fileCell = NULL;
+
+	/* determine where to start in each file before changing any state */
+	foreach(fileCell, files)
+	{
+		TailedFile *file = lfirst(fileCell);
+		TailedFile *previous = FindTailedFileByPath(tailedFiles, file->path);
+
+		if (previous == NULL || previous->inode != file->inode)
+		{
+			/* the file may have been renamed by log rotation */
+			previous = FindTailedFileByInode(tailedFiles, file->inode);
+		}
+
+		file->offset = previous != NULL ? previous->offset : 0;
+
+		/* file was truncated in place (e.g. copytruncate) */
+		if (file->offset > file->size)
+			file->offset = 0;
+	}
+
+	foreach(fileCell, files)
+	{
+		TailedFile *file = lfirst(fileCell);
+		TailedFile *previous = FindTailedFileByPath(tailedFiles, file->path);
+		int64		startOffset = file->offset;
+
+		while (startOffset < file->size)
+		{
+			int64		endOffset = file->size;
+
+			if (maxBatchBytes > 0 && endOffset - startOffset > maxBatchBytes)
+				endOffset = startOffset + maxBatchBytes;
+
+			/* only process complete lines */
+			int64		lineEndOffset = FindLastNewline(file->path, startOffset, endOffset);
+
+			if (lineEndOffset == startOffset)
+			{
+				if (endOffset < file->size)
+					ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+									errmsg("pipeline %s: line at offset " INT64_FORMAT
+										   " in %s is longer than max_batch_bytes",
+										   pipelineName, startOffset, file->path)));
+
+				break;
+			}
+
+			ereport(NOTICE, (errmsg("pipeline %s: processing bytes " INT64_FORMAT
+									" to " INT64_FORMAT " of %s",
+									pipelineName, startOffset, lineEndOffset, file->path)));
+
+			ExecuteFileTailPipelineForRange(pipelineName, command, file->path,
+											startOffset, lineEndOffset);
+
+			startOffset = lineEndOffset;
+			processedAny = true;
+		}
+
+		file->offset = startOffset;
+
+		if (previous == NULL || previous->inode != file->inode ||
+			previous->offset != file->offset)
+			UpdateTailedFile(pipelineName, file->path, file->inode, file->offset);
+	}
+
+	RemoveUnlistedTailedFiles(pipelineName, files);
+
+	if (!processedAny)
+		ereport(NOTICE, (errmsg("pipeline %s: no new lines to process",
+								pipelineName)));
+}
+
+
+/*
+ * ExecuteFileTailPipelineForRange executes a file tail pipeline for
+ * the given byte range of a file.
+ */
+static void
+ExecuteFileTailPipelineForRange(char *pipelineName, char *command, char *path,
+								int64 startOffset, int64 endOffset)
+{
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 3;
+	Oid			argTypes[] = {TEXTOID, INT8OID, INT8OID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(path),
+		Int64GetDatum(startOffset),
+		Int64GetDatum(endOffset)
+	};
+	char	   *argNulls = "   ";
+
+	SPI_connect();
+	SPI_execute_with_args(command,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	PopActiveSnapshot();
+}
+
+
+/*
+ * LockFileTailPipeline locks the file tail pipeline to block concurrent
+ * executions and returns its properties.
+ */
+static int64
+LockFileTailPipeline(char *pipelineName, char **filePattern)
+{
+	MemoryContext outerContext = CurrentMemoryContext;
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"select file_pattern, max_batch_bytes "
+		"from incremental.file_tail_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"for update";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		filePatternDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+	Datum		maxBatchBytesDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+
+	int64		maxBatchBytes = 0;
+
+	if (!isNull)
+		maxBatchBytes = DatumGetInt64(maxBatchBytesDatum);
+
+	MemoryContext oldContext = MemoryContextSwitchTo(outerContext);
+
+	*filePattern = TextDatumGetCString(filePatternDatum);
+
+	MemoryContextSwitchTo(oldContext);
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return maxBatchBytes;
+}
+
+
+/*
+ * ListTailFiles returns the regular files matching the given glob pattern,
+ * along with their inode and current size.
+ */
+static List *
+ListTailFiles(char *filePattern)
+{
+	List	   *files = NIL;
+	glob_t		globResult;
+
+	int			globStatus = glob(filePattern, 0, NULL, &globResult);
+
+	if (globStatus == GLOB_NOMATCH)
+		return NIL;
+
+	if (globStatus != 0)
+		ereport(ERROR, (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+						errmsg("could not list files matching \"%s\"", filePattern)));
+
+	for (size_t pathIndex = 0; pathIndex < globResult.gl_pathc; pathIndex++)
+	{
+		char	   *path = globResult.gl_pathv[pathIndex];
+		struct stat fileStat;
+
+		if (stat(path, &fileStat) != 0)
+		{
+			/* file was removed after listing */
+			if (errno == ENOENT)
+				continue;
+
+			globfree(&globResult);
+
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not stat file \"%s\": %m", path)));
+		}
+
+		if (!S_ISREG(fileStat.st_mode))
+			continue;
+
+		TailedFile *file = (TailedFile *) palloc0(sizeof(TailedFile));
+
+		file->path = pstrdup(path);
+		file->inode = (int64) fileStat.st_ino;
+		file->size = (int64) fileStat.st_size;
+
+		files = lappend(files, file);
+	}
+
+	globfree(&globResult);
+
+	return files;
+}
+
+
+/*
+ * ReadTailedFiles returns the current state of the files in a file tail
+ * pipeline.
+ */
+static List *
+ReadTailedFiles(char *pipelineName)
+{
+	List	   *tailedFiles = NIL;
+	MemoryContext outerContext = CurrentMemoryContext;
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have read
+	 * privileges for the tailed files table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"select path, inode, last_processed_offset "
+		"from incremental.tailed_files "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+
+	for (int rowIndex = 0; rowIndex < SPI_processed; rowIndex++)
+	{
+		HeapTuple	row = SPI_tuptable->vals[rowIndex];
+
+		bool		isNull = false;
+		Datum		pathDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+		Datum		inodeDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+		Datum		offsetDatum = SPI_getbinval(row, rowDesc, 3, &isNull);
+
+		MemoryContext oldContext = MemoryContextSwitchTo(outerContext);
+
+		TailedFile *tailedFile = (TailedFile *) palloc0(sizeof(TailedFile));
+
+		tailedFile->path = TextDatumGetCString(pathDatum);
+		tailedFile->inode = DatumGetInt64(inodeDatum);
+		tailedFile->offset = DatumGetInt64(offsetDatum);
+
+		tailedFiles = lappend(tailedFiles, tailedFile);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return tailedFiles;
+}
+
+
+/*
+ * FindTailedFileByPath returns the tailed file with the given path, or NULL.
+ */
+static TailedFile *
+FindTailedFileByPath(List *tailedFiles, char *path)
+{
+	ListCell   *fileCell = NULL;
+
+	foreach(fileCell, tailedFiles)
+	{
+		TailedFile *tailedFile = lfirst(fileCell);
+
+		if (strcmp(tailedFile->path, path) == 0)
+			return tailedFile;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * FindTailedFileByInode returns the tailed file with the given inode, or NULL.
+ */
+static TailedFile *
+FindTailedFileByInode(List *tailedFiles, int64 inode)
+{
+	ListCell   *fileCell = NULL;
+
+	foreach(fileCell, tailedFiles)
+	{
+		TailedFile *tailedFile = lfirst(fileCell);
+
+		if (tailedFile->inode == inode)
+			return tailedFile;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * FindLastNewline returns the offset after the last newline in the byte range
+ * [startOffset, endOffset) of the file, or startOffset if there is none.
+ */
+static int64
+FindLastNewline(char *path, int64 startOffset, int64 endOffset)
+{
+	char		buffer[TAIL_READ_BLOCK_SIZE];
+	int64		blockEnd = endOffset;
+	int64		lineEndOffset = startOffset;
+
+	int			fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+
+	if (fd < 0)
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not open file \"%s\" for reading: %m", path)));
+
+	while (blockEnd > startOffset && lineEndOffset == startOffset)
+	{
+		int64		blockStart = Max(startOffset, blockEnd - TAIL_READ_BLOCK_SIZE);
+		size_t		blockSize = (size_t) (blockEnd - blockStart);
+
+		ssize_t		bytesRead = pg_pread(fd, buffer, blockSize, (off_t) blockStart);
+
+		if (bytesRead < 0)
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not read file \"%s\": %m", path)));
+
+		if ((size_t) bytesRead < blockSize)
+			ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+							errmsg("file \"%s\" was truncated while reading", path)));
+
+		for (int64 index = blockSize - 1; index >= 0; index--)
+		{
+			if (buffer[index] == '\n')
+			{
+				lineEndOffset = blockStart + index + 1;
+				break;
+			}
+		}
+
+		blockEnd = blockStart;
+	}
+
+	CloseTransientFile(fd);
+
+	return lineEndOffset;
+}
+
+
+/*
+ * UpdateTailedFile stores the processed offset and inode of a file.
+ */
+static void
+UpdateTailedFile(char *pipelineName, char *path, int64 inode, int64 offset)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the tailed files table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.tailed_files "
+		"(pipeline_name, path, inode, last_processed_offset) "
+		"values ($1, $2, $3, $4) "
+		"on conflict (pipeline_name, path) do update set "
+		"inode = excluded.inode, "
+		"last_processed_offset = excluded.last_processed_offset";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 4;
+	Oid			argTypes[] = {TEXTOID, TEXTOID, INT8OID, INT8OID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		CStringGetTextDatum(path),
+		Int64GetDatum(inode),
+		Int64GetDatum(offset)
+	};
+	char	   *argNulls = "    ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * RemoveUnlistedTailedFiles removes the state of files that no longer match
+ * the file pattern.
+ */
+static void
+RemoveUnlistedTailedFiles(char *pipelineName, List *files)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the tailed files table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	int			fileCount = list_length(files);
+	Datum	   *pathDatums = palloc0(sizeof(Datum) * (fileCount + 1));
+	int			pathIndex = 0;
+	ListCell   *fileCell = NULL;
+
+	foreach(fileCell, files)
+	{
+		TailedFile *file = lfirst(fileCell);
+
+		pathDatums[pathIndex++] = CStringGetTextDatum(file->path);
+	}
+
+	ArrayType  *pathArray = construct_array(pathDatums,
+											fileCount,
+											TEXTOID,
+											-1,
+											false,
+											TYPALIGN_INT);
+
+	char	   *query =
+		"delete from incremental.tailed_files "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"and path operator(pg_catalog.<>) all ($2)";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, TEXTARRAYOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		PointerGetDatum(pathArray)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * RemoveTailedFiles removes the state of all files in the given pipeline.
+ */
+void
+RemoveTailedFiles(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the tailed files table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"delete from incremental.tailed_files "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
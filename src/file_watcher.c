@@ -0,0 +1,533 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <fnmatch.h>
+#include <sys/inotify.h>
+#endif
+
+#include "access/xact.h"
+#include "commands/extension.h"
+#include "crunchy/incremental/file_watcher.h"
+#include "crunchy/incremental/pipeline.h"
+#include "executor/spi.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/latch.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+
+/* how often to re-read the list of file list pipelines, in milliseconds */
+#define WATCH_REFRESH_INTERVAL 60000
+
+/*
+ * maximum time between the first file event and the execution, as a multiple
+ * of the debounce, such that a steady stream of files still gets processed
+ */
+#define MAX_DEBOUNCE_FACTOR 10
+
+/* prefix of local file URLs */
+#define FILE_URL_PREFIX "file://"
+
+
+/* database in which the file watcher runs, NULL or empty disables it */
+char	   *FileWatcherDatabase = NULL;
+
+/* time to wait for more file events before executing a pipeline, in ms */
+int			FileWatcherDebounce = 1000;
+
+
+#ifdef __linux__
+
+/*
+ * WatchedPipeline is a file list pipeline over a local directory.
+ */
+typedef struct WatchedPipeline
+{
+	char	   *pipelineName;
+
+	/* directory that contains the files matched by the pattern */
+	char	   *directory;
+
+	/* pattern for file names within the directory */
+	char	   *namePattern;
+
+	/* inotify watch descriptor of the directory */
+	int			watchDescriptor;
+
+	/* whether a new file was seen since the last execution */
+	bool		pending;
+}			WatchedPipeline;
+
+
+static List *RefreshWatchedPipelines(int inotifyFd, List *oldPipelines,
+									 MemoryContext *watchContext);
+static List *ReadLocalFileListPipelines(MemoryContext watchContext);
+static bool SplitLocalFilePattern(char *filePattern, char **directory,
+								  char **namePattern);
+static bool ReadFileEvents(int inotifyFd, List *watchedPipelines);
+static void ExecutePendingPipelines(List *watchedPipelines);
+static void ExecuteWatchedPipeline(char *pipelineName);
+
+#endif
+
+
+/*
+ * RegisterFileWatcher registers the background worker that executes file
+ * list pipelines over local directories when new files appear.
+ */
+void
+RegisterFileWatcher(void)
+{
+#ifdef __linux__
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	strlcpy(worker.bgw_library_name, "pg_incremental", BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, "IncrementalFileWatcherMain", BGW_MAXLEN);
+	strlcpy(worker.bgw_name, "pg_incremental file watcher", BGW_MAXLEN);
+	strlcpy(worker.bgw_type, "pg_incremental file watcher", BGW_MAXLEN);
+
+	RegisterBackgroundWorker(&worker);
+#else
+	ereport(WARNING, (errmsg("pg_incremental file watcher is only supported on Linux")));
+#endif
+}
+
+
+/*
+ * IncrementalFileWatcherMain is the entry point of the file watcher. It
+ * watches the directories behind file list pipelines with local file
+ * patterns and executes a pipeline shortly after a matching file is
+ * written or moved into its directory.
+ */
+void
+IncrementalFileWatcherMain(Datum arg)
+{
+#ifdef __linux__
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(FileWatcherDatabase, NULL, 0);
+
+	int			inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (inotifyFd < 0)
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not initialize inotify: %m")));
+
+	MemoryContext watchContext = NULL;
+	List	   *watchedPipelines = NIL;
+	TimestampTz nextRefreshTime = 0;
+	TimestampTz executeTime = 0;
+	TimestampTz firstEventTime = 0;
+
+	ereport(LOG, (errmsg("pg_incremental file watcher started in database \"%s\"",
+						 FileWatcherDatabase)));
+
+	while (!ShutdownRequestPending)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+
+		if (now >= nextRefreshTime)
+		{
+			watchedPipelines = RefreshWatchedPipelines(inotifyFd, watchedPipelines,
+													   &watchContext);
+			nextRefreshTime = TimestampTzPlusMilliseconds(now, WATCH_REFRESH_INTERVAL);
+		}
+
+		TimestampTz wakeTime = nextRefreshTime;
+
+		if (executeTime != 0 && executeTime < wakeTime)
+			wakeTime = executeTime;
+
+		long		timeout = TimestampDifferenceMilliseconds(now, wakeTime);
+		int			events = WaitLatchOrSocket(MyLatch,
+											   WL_LATCH_SET | WL_SOCKET_READABLE |
+											   WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+											   inotifyFd, timeout, PG_WAIT_EXTENSION);
+
+		if (events & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/*
+		 * Each matching event extends the debounce window, such that a burst
+		 * of new files results in a single execution, but we execute at most
+		 * MAX_DEBOUNCE_FACTOR times the debounce after the first event.
+		 */
+		if ((events & WL_SOCKET_READABLE) &&
+			ReadFileEvents(inotifyFd, watchedPipelines))
+		{
+			TimestampTz eventTime = GetCurrentTimestamp();
+
+			if (firstEventTime == 0)
+				firstEventTime = eventTime;
+
+			TimestampTz maxExecuteTime =
+				TimestampTzPlusMilliseconds(firstEventTime,
+											(int64) FileWatcherDebounce * MAX_DEBOUNCE_FACTOR);
+
+			executeTime = TimestampTzPlusMilliseconds(eventTime, FileWatcherDebounce);
+
+			if (executeTime > maxExecuteTime)
+				executeTime = maxExecuteTime;
+		}
+
+		if (executeTime != 0 && GetCurrentTimestamp() >= executeTime)
+		{
+			ExecutePendingPipelines(watchedPipelines);
+			executeTime = 0;
+			firstEventTime = 0;
+		}
+	}
+
+	close(inotifyFd);
+#endif
+
+	proc_exit(0);
+}
+
+
+#ifdef __linux__
+
+/*
+ * RefreshWatchedPipelines re-reads the file list pipelines with local file
+ * patterns, adds watches for their directories, and removes watches that
+ * are no longer needed. The new list is allocated in a new memory context
+ * that replaces *watchContext.
+ */
+static List *
+RefreshWatchedPipelines(int inotifyFd, List *oldPipelines,
+						MemoryContext *watchContext)
+{
+	MemoryContext newContext = AllocSetContextCreate(TopMemoryContext,
+													 "pg_incremental file watcher",
+													 ALLOCSET_DEFAULT_SIZES);
+	List	   *newPipelines = ReadLocalFileListPipelines(newContext);
+	ListCell   *pipelineCell = NULL;
+
+	foreach(pipelineCell, newPipelines)
+	{
+		WatchedPipeline *watchedPipeline = lfirst(pipelineCell);
+
+		/* adding a watch for an already-watched directory returns the same one */
+		watchedPipeline->watchDescriptor =
+			inotify_add_watch(inotifyFd, watchedPipeline->directory,
+							  IN_CLOSE_WRITE | IN_MOVED_TO);
+
+		if (watchedPipeline->watchDescriptor < 0)
+		{
+			ereport(WARNING, (errcode_for_file_access(),
+							  errmsg("could not watch directory \"%s\" of pipeline %s: %m",
+									 watchedPipeline->directory,
+									 watchedPipeline->pipelineName)));
+			continue;
+		}
+
+		/* preserve events that were seen, but not yet acted on */
+		ListCell   *oldCell = NULL;
+
+		foreach(oldCell, oldPipelines)
+		{
+			WatchedPipeline *oldPipeline = lfirst(oldCell);
+
+			if (strcmp(oldPipeline->pipelineName, watchedPipeline->pipelineName) == 0)
+				watchedPipeline->pending = oldPipeline->pending;
+		}
+	}
+
+	/* remove watches of directories that are no longer used */
+	foreach(pipelineCell, oldPipelines)
+	{
+		WatchedPipeline *oldPipeline = lfirst(pipelineCell);
+		bool		stillWatched = false;
+		ListCell   *newCell = NULL;
+
+		if (oldPipeline->watchDescriptor < 0)
+			continue;
+
+		foreach(newCell, newPipelines)
+		{
+			WatchedPipeline *watchedPipeline = lfirst(newCell);
+
+			if (watchedPipeline->watchDescriptor == oldPipeline->watchDescriptor)
+				stillWatched = true;
+		}
+
+		if (!stillWatched)
+			inotify_rm_watch(inotifyFd, oldPipeline->watchDescriptor);
+	}
+
+	if (*watchContext != NULL)
+		MemoryContextDelete(*watchContext);
+
+	*watchContext = newContext;
+
+	return newPipelines;
+}
+
+
+/*
+ * ReadLocalFileListPipelines returns a list of WatchedPipeline for file list
+ * pipelines whose file pattern refers to a local directory, allocated in
+ * watchContext.
+ */
+static List *
+ReadLocalFileListPipelines(MemoryContext watchContext)
+{
+	List	   *watchedPipelines = NIL;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "reading file list pipelines");
+
+	char	   *query =
+		"select pipeline_name, file_pattern "
+		"from incremental.file_list_pipelines "
+		"order by pipeline_name";
+
+	bool		readOnly = true;
+	int			tupleCount = 0;
+
+	uint64		rowCount = 0;
+
+	SPI_connect();
+
+	/* the extension may not be created yet */
+	if (OidIsValid(get_extension_oid("pg_incremental", true)))
+	{
+		SPI_execute(query, readOnly, tupleCount);
+		rowCount = SPI_processed;
+	}
+
+	for (uint64 rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+		HeapTuple	row = SPI_tuptable->vals[rowIndex];
+		bool		isNull = false;
+
+		Datum		pipelineNameDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+		Datum		filePatternDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+
+		char	   *pipelineName = TextDatumGetCString(pipelineNameDatum);
+		char	   *filePattern = TextDatumGetCString(filePatternDatum);
+		char	   *directory = NULL;
+		char	   *namePattern = NULL;
+
+		if (!SplitLocalFilePattern(filePattern, &directory, &namePattern))
+			continue;
+
+		MemoryContext spiContext = MemoryContextSwitchTo(watchContext);
+
+		WatchedPipeline *watchedPipeline = palloc0(sizeof(WatchedPipeline));
+
+		watchedPipeline->pipelineName = pstrdup(pipelineName);
+		watchedPipeline->directory = pstrdup(directory);
+		watchedPipeline->namePattern = pstrdup(namePattern);
+		watchedPipeline->watchDescriptor = -1;
+
+		watchedPipelines = lappend(watchedPipelines, watchedPipeline);
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return watchedPipelines;
+}
+
+
+/*
+ * SplitLocalFilePattern splits a local file pattern into a directory and a
+ * pattern for file names within that directory. It returns false if the
+ * pattern does not refer to a single local directory.
+ */
+static bool
+SplitLocalFilePattern(char *filePattern, char **directory, char **namePattern)
+{
+	char	   *path = filePattern;
+
+	if (strncmp(path, FILE_URL_PREFIX, strlen(FILE_URL_PREFIX)) == 0)
+		path += strlen(FILE_URL_PREFIX);
+
+	if (path[0] != '/')
+		return false;
+
+	char	   *lastSlash = strrchr(path, '/');
+
+	char	   *firstWildcard = strpbrk(path, "*?[");
+
+	/* directories with wildcards would require watching a tree */
+	if (firstWildcard != NULL && firstWildcard < lastSlash)
+		return false;
+
+	if (lastSlash[1] == '\0')
+		return false;
+
+	*namePattern = lastSlash + 1;
+	*directory = lastSlash == path ? pstrdup("/") : pnstrdup(path, lastSlash - path);
+
+	return true;
+}
+
+
+/*
+ * ReadFileEvents reads all available inotify events and marks pipelines
+ * whose file pattern matches a new file as pending. It returns whether any
+ * pipeline was marked.
+ */
+static bool
+ReadFileEvents(int inotifyFd, List *watchedPipelines)
+{
+	union
+	{
+		struct inotify_event event;
+		char		data[4096];
+	}			buffer;
+	bool		foundMatch = false;
+
+	while (true)
+	{
+		ssize_t		readSize = read(inotifyFd, buffer.data, sizeof(buffer.data));
+
+		if (readSize < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ereport(WARNING, (errcode_for_file_access(),
+								  errmsg("could not read inotify events: %m")));
+			break;
+		}
+
+		for (char *eventPointer = buffer.data; eventPointer < buffer.data + readSize;)
+		{
+			struct inotify_event *event = (struct inotify_event *) eventPointer;
+			ListCell   *pipelineCell = NULL;
+
+			eventPointer += sizeof(struct inotify_event) + event->len;
+
+			foreach(pipelineCell, watchedPipelines)
+			{
+				WatchedPipeline *watchedPipeline = lfirst(pipelineCell);
+
+				/* events were dropped, so we cannot tell which files are new */
+				bool		overflow = (event->mask & IN_Q_OVERFLOW) != 0;
+
+				if (!overflow &&
+					(event->wd != watchedPipeline->watchDescriptor ||
+					 event->len == 0 || (event->mask & IN_ISDIR) != 0 ||
+					 fnmatch(watchedPipeline->namePattern, event->name, 0) != 0))
+					continue;
+
+				if (!overflow)
+					ereport(DEBUG1, (errmsg("pipeline %s: new file %s/%s",
+											watchedPipeline->pipelineName,
+											watchedPipeline->directory,
+											event->name)));
+
+				watchedPipeline->pending = true;
+				foundMatch = true;
+			}
+		}
+	}
+
+	return foundMatch;
+}
+
+
+/*
+ * ExecutePendingPipelines executes the pipelines for which new files were
+ * seen, each in its own transaction.
+ */
+static void
+ExecutePendingPipelines(List *watchedPipelines)
+{
+	ListCell   *pipelineCell = NULL;
+
+	foreach(pipelineCell, watchedPipelines)
+	{
+		WatchedPipeline *watchedPipeline = lfirst(pipelineCell);
+
+		if (!watchedPipeline->pending)
+			continue;
+
+		watchedPipeline->pending = false;
+
+		ExecuteWatchedPipeline(watchedPipeline->pipelineName);
+	}
+}
+
+
+/*
+ * ExecuteWatchedPipeline executes a pipeline as its owner in a new
+ * transaction and logs rather than throws errors.
+ */
+static void
+ExecuteWatchedPipeline(char *pipelineName)
+{
+	MemoryContext workerContext = CurrentMemoryContext;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	pgstat_report_activity(STATE_RUNNING, pipelineName);
+
+	PG_TRY();
+	{
+		PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+		Oid			savedUserId = InvalidOid;
+		int			savedSecurityContext = 0;
+
+		/* execute with the privileges of the pipeline owner, like pg_cron */
+		GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+		SetUserIdAndSecContext(pipelineDesc->ownerId, SECURITY_LOCAL_USERID_CHANGE);
+
+		ExecutePipeline(pipelineName, pipelineDesc->pipelineType,
+						pipelineDesc->command, pipelineDesc->searchPath, false);
+
+		SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(workerContext);
+
+		EmitErrorReport();
+		FlushErrorState();
+		AbortCurrentTransaction();
+	}
+	PG_END_TRY();
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+#endif
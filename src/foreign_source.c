@@ -0,0 +1,339 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/dependency.h"
+#include "catalog/pg_class.h"
+#include "commands/defrem.h"
+#include "crunchy/incremental/foreign_source.h"
+#include "crunchy/incremental/remote_connection.h"
+#include "crunchy/incremental/sequence.h"
+#include "executor/spi.h"
+#include "foreign/foreign.h"
+#include "libpq-fe.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/syscache.h"
+
+
+/* foreign data wrapper whose servers we can connect to using libpq */
+#define POSTGRES_FDW_NAME "postgres_fdw"
+
+
+static PGconn *ConnectToForeignServer(Oid serverId);
+static bool UserMappingExists(Oid userId, Oid serverId);
+static bool UserMappingPasswordRequired(UserMapping *userMapping);
+static char *GetRemoteTableName(Oid relationId);
+static bool IsConnectionOption(PQconninfoOption *connectionOptions, char *optionName);
+
+
+PG_FUNCTION_INFO_V1(incremental_get_safe_sequence_number);
+
+
+/*
+ * incremental_get_safe_sequence_number returns the last-drawn sequence number
+ * of a table after waiting for writers that may still insert lower sequence
+ * numbers. It is called on the remote server by pipelines over foreign
+ * tables, but also works as a standalone function.
+ */
+Datum
+incremental_get_safe_sequence_number(PG_FUNCTION_ARGS)
+{
+	Oid			sequenceId = PG_GETARG_OID(0);
+	Oid			relationId = InvalidOid;
+
+	if (get_rel_relkind(sequenceId) == RELKIND_SEQUENCE)
+	{
+		int32		columnNumber = 0;
+
+		if (!sequenceIsOwned(sequenceId, DEPENDENCY_AUTO, &relationId, &columnNumber))
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("only sequences that are owned by a table are supported")));
+	}
+	else
+	{
+		relationId = sequenceId;
+		sequenceId = FindSequenceForRelation(relationId);
+	}
+
+	/* waiting for lockers reveals nothing, but reading the sequence does */
+	if (pg_class_aclcheck(relationId, GetUserId(), ACL_SELECT) != ACLCHECK_OK)
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						errmsg("permission denied for table %s", get_rel_name(relationId))));
+
+	char	   *query = "select pg_catalog.pg_sequence_last_value($1)";
+
+	bool		readOnly = true;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {REGCLASSOID};
+	Datum		argValues[] = {
+		ObjectIdGetDatum(sequenceId)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		lastValueDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+
+	/* a sequence that was never used has no last value */
+	int64		lastValue = isNull ? 0 : DatumGetInt64(lastValueDatum);
+
+	SPI_finish();
+
+	/* writers that drew a sequence number lock the table before inserting */
+	WaitForSequenceWriters(relationId);
+
+	PG_RETURN_INT64(lastValue);
+}
+
+
+/*
+ * EnsureForeignSourceSupported throws an error if a foreign table is not
+ * managed by postgres_fdw, in which case we cannot obtain a safe sequence
+ * number from the remote server.
+ */
+void
+EnsureForeignSourceSupported(Oid relationId)
+{
+	ForeignTable *foreignTable = GetForeignTable(relationId);
+	ForeignServer *server = GetForeignServer(foreignTable->serverid);
+	ForeignDataWrapper *wrapper = GetForeignDataWrapper(server->fdwid);
+
+	if (strcmp(wrapper->fdwname, POSTGRES_FDW_NAME) != 0)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("foreign table %s does not use %s",
+							   get_rel_name(relationId), POSTGRES_FDW_NAME),
+						errhint("Specify a local sequence or a watermark_name instead "
+								"of the foreign table.")));
+}
+
+
+/*
+ * GetForeignSourceSafeSequenceNumber connects to the server of a foreign
+ * table and calls incremental.get_safe_sequence_number on the remote table,
+ * which returns once all rows up to the returned sequence number are visible
+ * on the remote server.
+ */
+int64
+GetForeignSourceSafeSequenceNumber(Oid relationId)
+{
+	ForeignTable *foreignTable = GetForeignTable(relationId);
+	char	   *remoteTableName = GetRemoteTableName(relationId);
+	PGconn	   *connection = ConnectToForeignServer(foreignTable->serverid);
+
+	char	   *query = "SELECT incremental.get_safe_sequence_number($1::pg_catalog.regclass)";
+	const char *paramValues[] = {remoteTableName};
+
+	PGresult   *result = NULL;
+
+	/* the remote call waits for in-progress writers, so allow cancellation */
+	PG_TRY();
+	{
+		result = ExecuteRemoteQuery(connection, query, 1, paramValues);
+	}
+	PG_CATCH();
+	{
+		CloseRemoteConnection(connection);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) != 1)
+	{
+		char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+		PQclear(result);
+		CloseRemoteConnection(connection);
+
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("could not get a safe sequence number for remote table %s",
+							   remoteTableName),
+						errdetail_internal("%s", errorMessage),
+						errhint("Make sure pg_incremental is installed on the remote "
+								"server.")));
+	}
+
+	int64		safeSequenceNumber = 0;
+
+	if (!PQgetisnull(result, 0, 0))
+		safeSequenceNumber = pg_strtoint64(PQgetvalue(result, 0, 0));
+
+	PQclear(result);
+	CloseRemoteConnection(connection);
+
+	return safeSequenceNumber;
+}
+
+
+/*
+ * ConnectToForeignServer opens a libpq connection to a postgres_fdw server
+ * using the server options and the user mapping of the current user.
+ */
+static PGconn *
+ConnectToForeignServer(Oid serverId)
+{
+	ForeignServer *server = GetForeignServer(serverId);
+
+	if (!UserMappingExists(GetUserId(), serverId))
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline owner has no user mapping for server \"%s\"",
+							   server->servername),
+						errhint("Create a user mapping for the pipeline owner using "
+								"CREATE USER MAPPING.")));
+
+	UserMapping *userMapping = GetUserMapping(GetUserId(), serverId);
+	List	   *options = list_concat(list_copy(server->options), userMapping->options);
+
+	/* postgres_fdw-specific options such as fetch_size are not for libpq */
+	PQconninfoOption *connectionOptions = PQconndefaults();
+
+	if (connectionOptions == NULL)
+		ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY),
+						errmsg("out of memory")));
+
+	const char **keywords = palloc0((list_length(options) + 2) * sizeof(char *));
+	const char **values = palloc0((list_length(options) + 2) * sizeof(char *));
+	int			optionCount = 0;
+	ListCell   *optionCell = NULL;
+
+	foreach(optionCell, options)
+	{
+		DefElem    *option = lfirst(optionCell);
+
+		if (!IsConnectionOption(connectionOptions, option->defname))
+			continue;
+
+		keywords[optionCount] = option->defname;
+		values[optionCount] = defGetString(option);
+		optionCount++;
+	}
+
+	keywords[optionCount] = "fallback_application_name";
+	values[optionCount] = "pg_incremental";
+
+	PQconninfoFree(connectionOptions);
+
+	bool		expandDbname = false;
+	PGconn	   *connection = ConnectToRemoteServer(keywords, values, expandDbname);
+
+	if (connection == NULL || PQstatus(connection) != CONNECTION_OK)
+	{
+		char	   *errorMessage = connection != NULL ?
+			pstrdup(PQerrorMessage(connection)) : "out of memory";
+
+		PQfinish(connection);
+
+		ereport(ERROR, (errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
+						errmsg("could not connect to server \"%s\"", server->servername),
+						errdetail_internal("%s", errorMessage)));
+	}
+
+	/* same rule as postgres_fdw, to avoid connecting as the OS user */
+	if (!superuser() && UserMappingPasswordRequired(userMapping) &&
+		!PQconnectionUsedPassword(connection))
+	{
+		PQfinish(connection);
+
+		ereport(ERROR, (errcode(ERRCODE_S_R_E_PROHIBITED_SQL_STATEMENT_ATTEMPTED),
+						errmsg("password is required"),
+						errdetail("Non-superuser cannot connect if the server does not "
+								  "request a password."),
+						errhint("Target server's authentication method must be changed.")));
+	}
+
+	return connection;
+}
+
+
+/*
+ * UserMappingExists returns whether the user has a user mapping for the
+ * server, either of its own or for PUBLIC.
+ */
+static bool
+UserMappingExists(Oid userId, Oid serverId)
+{
+	return SearchSysCacheExists2(USERMAPPINGUSERSERVER,
+								 ObjectIdGetDatum(userId),
+								 ObjectIdGetDatum(serverId)) ||
+		SearchSysCacheExists2(USERMAPPINGUSERSERVER,
+							  ObjectIdGetDatum(InvalidOid),
+							  ObjectIdGetDatum(serverId));
+}
+
+
+/*
+ * UserMappingPasswordRequired returns false if a superuser set the
+ * password_required option of the user mapping to false, in the same way
+ * as postgres_fdw.
+ */
+static bool
+UserMappingPasswordRequired(UserMapping *userMapping)
+{
+	ListCell   *optionCell = NULL;
+
+	foreach(optionCell, userMapping->options)
+	{
+		DefElem    *option = lfirst(optionCell);
+
+		if (strcmp(option->defname, "password_required") == 0)
+			return defGetBoolean(option);
+	}
+
+	return true;
+}
+
+
+/*
+ * GetRemoteTableName returns the quoted, qualified name of the remote table
+ * of a foreign table, which defaults to the local name.
+ */
+static char *
+GetRemoteTableName(Oid relationId)
+{
+	ForeignTable *foreignTable = GetForeignTable(relationId);
+	char	   *schemaName = get_namespace_name(get_rel_namespace(relationId));
+	char	   *tableName = get_rel_name(relationId);
+	ListCell   *optionCell = NULL;
+
+	foreach(optionCell, foreignTable->options)
+	{
+		DefElem    *option = lfirst(optionCell);
+
+		if (strcmp(option->defname, "schema_name") == 0)
+			schemaName = defGetString(option);
+		else if (strcmp(option->defname, "table_name") == 0)
+			tableName = defGetString(option);
+	}
+
+	return quote_qualified_identifier(schemaName, tableName);
+}
+
+
+/*
+ * IsConnectionOption returns whether the given option name is a libpq
+ * connection option.
+ */
+static bool
+IsConnectionOption(PQconninfoOption *connectionOptions, char *optionName)
+{
+	for (PQconninfoOption *option = connectionOptions; option->keyword != NULL; option++)
+	{
+		if (strcmp(option->keyword, optionName) == 0)
+			return true;
+	}
+
+	return false;
+}
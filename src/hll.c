@@ -0,0 +1,454 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include <math.h>
+
+#include "port/pg_bitutils.h"
+#include "utils/builtins.h"
+#include "utils/fmgrprotos.h"
+#include "utils/typcache.h"
+
+
+/* number of bits of the hash used to select a register */
+#define HLL_PRECISION 12
+
+/* number of registers in a HyperLogLog */
+#define HLL_REGISTER_COUNT (1 << HLL_PRECISION)
+
+/* version of the on-disk format */
+#define HLL_VERSION 1
+
+#define HLL_SIZE(registerCount) (offsetof(HyperLogLog, registers) + (registerCount))
+
+
+/*
+ * HyperLogLog is the on-disk (varlena) representation of a HyperLogLog
+ * sketch, which is also used as the aggregate transition state.
+ *
+ * Registers are stored densely. Sparse sketches compress well, so we leave
+ * compaction of mostly-empty sketches to TOAST.
+ */
+typedef struct HyperLogLog
+{
+	int32		vl_len_;
+	uint8		version;
+	uint8		precision;
+	uint8		registers[FLEXIBLE_ARRAY_MEMBER];
+}			HyperLogLog;
+
+#define DatumGetHyperLogLogP(X) ((HyperLogLog *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_HLL_P(n) DatumGetHyperLogLogP(PG_GETARG_DATUM(n))
+
+
+static HyperLogLog * CreateHyperLogLog(void);
+static HyperLogLog * CopyHyperLogLog(HyperLogLog * hll);
+static void ValidateHyperLogLog(HyperLogLog * hll);
+static void HyperLogLogAddHash(HyperLogLog * hll, uint64 hash);
+static void HyperLogLogMerge(HyperLogLog * target, HyperLogLog * source);
+static int64 HyperLogLogEstimate(HyperLogLog * hll);
+static inline uint64 MixHash64(uint64 hash);
+
+
+PG_FUNCTION_INFO_V1(incremental_hll_in);
+PG_FUNCTION_INFO_V1(incremental_hll_out);
+PG_FUNCTION_INFO_V1(incremental_hll_recv);
+PG_FUNCTION_INFO_V1(incremental_hll_send);
+PG_FUNCTION_INFO_V1(incremental_hll_agg_trans);
+PG_FUNCTION_INFO_V1(incremental_hll_merge_trans);
+PG_FUNCTION_INFO_V1(incremental_hll_agg_final);
+PG_FUNCTION_INFO_V1(incremental_hll_combine);
+PG_FUNCTION_INFO_V1(incremental_hll_serialize);
+PG_FUNCTION_INFO_V1(incremental_hll_deserialize);
+PG_FUNCTION_INFO_V1(incremental_hll_merge);
+PG_FUNCTION_INFO_V1(incremental_hll_distinct_count);
+
+
+/*
+ * incremental_hll_in parses the hex-encoded text representation of a
+ * HyperLogLog.
+ */
+Datum
+incremental_hll_in(PG_FUNCTION_ARGS)
+{
+	Datum		bytes = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+	HyperLogLog *hll = DatumGetHyperLogLogP(bytes);
+
+	ValidateHyperLogLog(hll);
+
+	PG_RETURN_POINTER(hll);
+}
+
+
+/*
+ * incremental_hll_out returns the hex-encoded text representation of a
+ * HyperLogLog.
+ */
+Datum
+incremental_hll_out(PG_FUNCTION_ARGS)
+{
+	return DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+}
+
+
+/*
+ * incremental_hll_recv reads the binary representation of a HyperLogLog.
+ */
+Datum
+incremental_hll_recv(PG_FUNCTION_ARGS)
+{
+	Datum		bytes = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+	HyperLogLog *hll = DatumGetHyperLogLogP(bytes);
+
+	ValidateHyperLogLog(hll);
+
+	PG_RETURN_POINTER(hll);
+}
+
+
+/*
+ * incremental_hll_send returns the binary representation of a HyperLogLog.
+ */
+Datum
+incremental_hll_send(PG_FUNCTION_ARGS)
+{
+	return DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+}
+
+
+/*
+ * incremental_hll_agg_trans adds the hash of a value of any hashable type
+ * to the HyperLogLog transition state.
+ */
+Datum
+incremental_hll_agg_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "incremental_hll_agg_trans called in non-aggregate context");
+
+	HyperLogLog *state = PG_ARGISNULL(0) ? NULL : (HyperLogLog *) PG_GETARG_POINTER(0);
+
+	if (state == NULL)
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggContext);
+
+		state = CreateHyperLogLog();
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	/* look up the extended hash function of the argument type once */
+	FmgrInfo   *hashFunction = (FmgrInfo *) fcinfo->flinfo->fn_extra;
+
+	if (hashFunction == NULL)
+	{
+		Oid			argType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+		TypeCacheEntry *typeEntry =
+			lookup_type_cache(argType, TYPECACHE_HASH_EXTENDED_PROC_FINFO);
+
+		if (!OidIsValid(typeEntry->hash_extended_proc_finfo.fn_oid))
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
+							errmsg("could not identify a hash function for type %s",
+								   format_type_be(argType))));
+
+		hashFunction = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(FmgrInfo));
+		fmgr_info_copy(hashFunction, &typeEntry->hash_extended_proc_finfo,
+					   fcinfo->flinfo->fn_mcxt);
+
+		fcinfo->flinfo->fn_extra = hashFunction;
+	}
+
+	Datum		hashDatum = FunctionCall2Coll(hashFunction, PG_GET_COLLATION(),
+											  PG_GETARG_DATUM(1), Int64GetDatum(0));
+
+	HyperLogLogAddHash(state, MixHash64(DatumGetUInt64(hashDatum)));
+
+	PG_RETURN_POINTER(state);
+}
+
+
+/*
+ * incremental_hll_merge_trans merges a HyperLogLog into the transition state.
+ */
+Datum
+incremental_hll_merge_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "incremental_hll_merge_trans called in non-aggregate context");
+
+	HyperLogLog *state = PG_ARGISNULL(0) ? NULL : (HyperLogLog *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	HyperLogLog *input = PG_GETARG_HLL_P(1);
+
+	if (state == NULL)
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggContext);
+
+		state = CopyHyperLogLog(input);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+		HyperLogLogMerge(state, input);
+
+	PG_RETURN_POINTER(state);
+}
+
+
+/*
+ * incremental_hll_agg_final returns a copy of the transition state.
+ */
+Datum
+incremental_hll_agg_final(PG_FUNCTION_ARGS)
+{
+	HyperLogLog *state = (HyperLogLog *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_POINTER(CopyHyperLogLog(state));
+}
+
+
+/*
+ * incremental_hll_combine combines two transition states, for parallel
+ * aggregation.
+ */
+Datum
+incremental_hll_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+		elog(ERROR, "incremental_hll_combine called in non-aggregate context");
+
+	HyperLogLog *state1 = PG_ARGISNULL(0) ? NULL : (HyperLogLog *) PG_GETARG_POINTER(0);
+	HyperLogLog *state2 = PG_ARGISNULL(1) ? NULL : (HyperLogLog *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+		PG_RETURN_POINTER(state1);
+
+	if (state1 == NULL)
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggContext);
+
+		state1 = CopyHyperLogLog(state2);
+
+		MemoryContextSwitchTo(oldContext);
+
+		PG_RETURN_POINTER(state1);
+	}
+
+	HyperLogLogMerge(state1, state2);
+
+	PG_RETURN_POINTER(state1);
+}
+
+
+/*
+ * incremental_hll_serialize converts the transition state to bytea. The
+ * transition state already has a varlena layout, so we only copy it.
+ */
+Datum
+incremental_hll_serialize(PG_FUNCTION_ARGS)
+{
+	HyperLogLog *state = (HyperLogLog *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_BYTEA_P(CopyHyperLogLog(state));
+}
+
+
+/*
+ * incremental_hll_deserialize converts a serialized transition state back
+ * into a transition state.
+ */
+Datum
+incremental_hll_deserialize(PG_FUNCTION_ARGS)
+{
+	HyperLogLog *hll = (HyperLogLog *) PG_GETARG_BYTEA_P(0);
+
+	ValidateHyperLogLog(hll);
+
+	PG_RETURN_POINTER(CopyHyperLogLog(hll));
+}
+
+
+/*
+ * incremental_hll_merge returns the union of two HyperLogLogs. It is meant
+ * to be used in ON CONFLICT clauses, so a NULL on either side returns the
+ * other side.
+ */
+Datum
+incremental_hll_merge(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+	if (PG_ARGISNULL(0))
+		PG_RETURN_POINTER(PG_GETARG_HLL_P(1));
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(PG_GETARG_HLL_P(0));
+
+	HyperLogLog *result = CopyHyperLogLog(PG_GETARG_HLL_P(0));
+
+	HyperLogLogMerge(result, PG_GETARG_HLL_P(1));
+
+	PG_RETURN_POINTER(result);
+}
+
+
+/*
+ * incremental_hll_distinct_count returns the estimated number of distinct
+ * values added to a HyperLogLog.
+ */
+Datum
+incremental_hll_distinct_count(PG_FUNCTION_ARGS)
+{
+	HyperLogLog *hll = PG_GETARG_HLL_P(0);
+
+	PG_RETURN_INT64(HyperLogLogEstimate(hll));
+}
+
+
+/*
+ * CreateHyperLogLog returns an empty HyperLogLog.
+ */
+static HyperLogLog *
+CreateHyperLogLog(void)
+{
+	HyperLogLog *hll = (HyperLogLog *) palloc0(HLL_SIZE(HLL_REGISTER_COUNT));
+
+	SET_VARSIZE(hll, HLL_SIZE(HLL_REGISTER_COUNT));
+	hll->version = HLL_VERSION;
+	hll->precision = HLL_PRECISION;
+
+	return hll;
+}
+
+
+/*
+ * CopyHyperLogLog returns a copy of a HyperLogLog in the current memory
+ * context.
+ */
+static HyperLogLog *
+CopyHyperLogLog(HyperLogLog * hll)
+{
+	HyperLogLog *copy = (HyperLogLog *) palloc(VARSIZE(hll));
+
+	memcpy(copy, hll, VARSIZE(hll));
+
+	return copy;
+}
+
+
+/*
+ * ValidateHyperLogLog throws an error if the given bytes are not a valid
+ * HyperLogLog.
+ */
+static void
+ValidateHyperLogLog(HyperLogLog * hll)
+{
+	if (VARSIZE(hll) < offsetof(HyperLogLog, registers) ||
+		hll->version != HLL_VERSION ||
+		hll->precision != HLL_PRECISION ||
+		VARSIZE(hll) != HLL_SIZE(HLL_REGISTER_COUNT))
+		ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						errmsg("invalid hll value")));
+}
+
+
+/*
+ * HyperLogLogAddHash adds a 64-bit hash to the HyperLogLog.
+ *
+ * The first bits of the hash select the register, and the register keeps
+ * the maximum position of the first 1-bit in the remaining bits.
+ */
+static void
+HyperLogLogAddHash(HyperLogLog * hll, uint64 hash)
+{
+	int			precision = hll->precision;
+	uint32		registerIndex = (uint32) (hash >> (64 - precision));
+
+	/* set a guard bit to bound the rank when the remaining bits are 0 */
+	uint64		remainingBits = (hash << precision) | (UINT64CONST(1) << (precision - 1));
+	uint8		rank = 64 - pg_leftmost_one_pos64(remainingBits);
+
+	if (rank > hll->registers[registerIndex])
+		hll->registers[registerIndex] = rank;
+}
+
+
+/*
+ * HyperLogLogMerge merges source into target by taking the maximum of
+ * each register.
+ */
+static void
+HyperLogLogMerge(HyperLogLog * target, HyperLogLog * source)
+{
+	if (target->precision != source->precision)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("cannot merge hll values with different precision")));
+
+	int			registerCount = 1 << target->precision;
+
+	for (int registerIndex = 0; registerIndex < registerCount; registerIndex++)
+	{
+		if (source->registers[registerIndex] > target->registers[registerIndex])
+			target->registers[registerIndex] = source->registers[registerIndex];
+	}
+}
+
+
+/*
+ * HyperLogLogEstimate returns the estimated cardinality of the HyperLogLog,
+ * using linear counting for small cardinalities. With 64-bit hashes there is
+ * no need for a large range correction.
+ */
+static int64
+HyperLogLogEstimate(HyperLogLog * hll)
+{
+	int			registerCount = 1 << hll->precision;
+	double		alpha = 0.7213 / (1.0 + 1.079 / registerCount);
+	double		inverseSum = 0.0;
+	int			zeroRegisters = 0;
+
+	for (int registerIndex = 0; registerIndex < registerCount; registerIndex++)
+	{
+		uint8		rank = hll->registers[registerIndex];
+
+		inverseSum += ldexp(1.0, -rank);
+
+		if (rank == 0)
+			zeroRegisters++;
+	}
+
+	double		estimate = alpha * registerCount * registerCount / inverseSum;
+
+	if (estimate <= 2.5 * registerCount && zeroRegisters > 0)
+		estimate = registerCount * log((double) registerCount / zeroRegisters);
+
+	return (int64) rint(estimate);
+}
+
+
+/*
+ * MixHash64 applies the murmur3 finalizer to spread the entropy of
+ * hash functions that only produce good 32-bit hashes.
+ */
+static inline uint64
+MixHash64(uint64 hash)
+{
+	hash ^= hash >> 33;
+	hash *= UINT64CONST(0xff51afd7ed558ccd);
+	hash ^= hash >> 33;
+	hash *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	hash ^= hash >> 33;
+
+	return hash;
+}
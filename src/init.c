@@ -2,7 +2,12 @@
 #include "fmgr.h"
 #include "miscadmin.h"
 
+#include "crunchy/incremental/exporter.h"
 #include "crunchy/incremental/file_list.h"
+#include "crunchy/incremental/file_watcher.h"
+#include "crunchy/incremental/maintenance.h"
+#include "crunchy/incremental/sequence.h"
+#include "crunchy/incremental/stats.h"
 #include "utils/guc.h"
 
 
@@ -31,4 +36,87 @@ _PG_init(void)
 							   PGC_USERSET,
 							   0,
 							   NULL, NULL, NULL);
+
+	DefineCustomIntVariable("incremental.prefetch_block_limit",
+							gettext_noop("Maximum number of newly-added heap blocks to "
+										 "prefetch before processing a sequence range."),
+							gettext_noop("Prefetching overlaps reading new rows with waiting "
+										 "for concurrent writers. 0 disables prefetching."),
+							&PrefetchBlockLimit,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_BLOCKS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("incremental.maintenance_dead_tuple_threshold",
+							gettext_noop("Number of dead tuples in the target relation of a "
+										 "pipeline after which to suggest VACUUM."),
+							gettext_noop("0 disables the check."),
+							&MaintenanceDeadTupleThreshold,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("incremental.maintenance_non_hot_update_threshold",
+							gettext_noop("Number of non-HOT updates of the target relation of "
+										 "a pipeline after which to suggest REINDEX."),
+							gettext_noop("0 disables the check."),
+							&MaintenanceNonHotUpdateThreshold,
+							0, 0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("incremental.max_tracked_pipelines",
+							gettext_noop("Maximum number of pipelines for which execution "
+										 "statistics are kept in shared memory."),
+							NULL,
+							&MaxTrackedPipelines,
+							256, 1, 65536,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("incremental.metrics_port",
+							gettext_noop("Port on which to serve pipeline metrics on "
+										 "localhost in OpenMetrics format."),
+							gettext_noop("0 disables the metrics exporter."),
+							&MetricsPort,
+							0, 0, 65535,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomStringVariable("incremental.file_watcher_database",
+							   gettext_noop("Database in which to execute file list pipelines "
+											"over local directories when new files appear."),
+							   gettext_noop("An empty value disables the file watcher."),
+							   &FileWatcherDatabase,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL, NULL, NULL);
+
+	DefineCustomIntVariable("incremental.file_watcher_debounce",
+							gettext_noop("Time to wait after the last new file before the "
+										 "file watcher executes a pipeline."),
+							NULL,
+							&FileWatcherDebounce,
+							1000, 0, 3600000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	/* statistics and the background workers require shared memory */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		InitializePipelineStats();
+
+		if (MetricsPort > 0)
+			RegisterMetricsExporter();
+
+		if (FileWatcherDatabase != NULL && FileWatcherDatabase[0] != '\0')
+			RegisterFileWatcher();
+	}
 }
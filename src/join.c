@@ -0,0 +1,441 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/pg_authid.h"
+#include "crunchy/incremental/join.h"
+#include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/sequence.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+#include "utils/palloc.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * JoinPipeline contains the state of the right-hand side of a join pipeline.
+ * The left-hand side is tracked as a regular sequence pipeline.
+ */
+typedef struct JoinPipeline
+{
+	/* right-hand source table */
+	Oid			rightRelationId;
+
+	/* new range of sequence numbers in the right-hand table */
+	int64		rightRangeStart;
+	int64		rightRangeEnd;
+
+	/* how long rows remain available for joining after they were processed */
+	Interval   *joinWindow;
+}			JoinPipeline;
+
+
+static JoinPipeline * PopRightSequenceNumberRange(char *pipelineName);
+static void UpdateRetainedRanges(char *pipelineName, JoinPipeline * pipeline,
+								 int64 leftRangeStart, int64 *leftRetainStart,
+								 int64 *rightRetainStart);
+
+
+/*
+ * InitializeJoinPipelineState adds the initial join pipeline state.
+ */
+void
+InitializeJoinPipelineState(char *pipelineName, Oid rightRelationId,
+							Oid rightSequenceId, Interval *joinWindow)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.join_pipelines "
+		"(pipeline_name, right_relation, right_sequence_name, join_window) "
+		"values ($1, $2, $3, $4)";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 4;
+	Oid			argTypes[] = {TEXTOID, OIDOID, OIDOID, INTERVALOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		ObjectIdGetDatum(rightRelationId),
+		ObjectIdGetDatum(rightSequenceId),
+		IntervalPGetDatum(joinWindow)
+	};
+	char	   *argNulls = "    ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * ExecuteJoinPipeline determines safe ranges of new rows in both source
+ * tables and runs the command with the new ranges and the start of the rows
+ * that are retained for the join window.
+ *
+ * The command receives:
+ *   $1, $2: new range of sequence numbers in the left table
+ *   $3, $4: new range of sequence numbers in the right table
+ *   $5: start of the retained rows in the left table ($5 to $1 - 1)
+ *   $6: start of the retained rows in the right table ($6 to $3 - 1)
+ *
+ * Joining new left rows with all right rows from $6 to $4, and retained left
+ * rows with new right rows, matches every pair of rows exactly once when the
+ * second row arrives while the first one is still retained. Rows are
+ * retained until join_window after the run in which they were processed, so
+ * the cost of a run is proportional to the new rows and the window, provided
+ * the sequence columns are indexed.
+ */
+void
+ExecuteJoinPipeline(char *pipelineName, char *command)
+{
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+	/* lock the join state first to block other executions */
+	JoinPipeline *pipeline = PopRightSequenceNumberRange(pipelineName);
+
+	SequenceNumberRange *leftRange =
+		PopSequenceNumberRange(pipelineName, pipelineDesc->sourceRelationId);
+
+	int64		leftRangeStart = leftRange->rangeStart;
+	int64		leftRangeEnd = leftRange->rangeEnd;
+
+	/* pass an empty range as $1 - 1 */
+	if (leftRangeEnd < leftRangeStart)
+		leftRangeEnd = leftRangeStart - 1;
+
+	if (leftRangeStart > leftRangeEnd &&
+		pipeline->rightRangeStart > pipeline->rightRangeEnd)
+	{
+		ereport(NOTICE, (errmsg("pipeline %s: no rows to process",
+								pipelineName)));
+		return;
+	}
+
+	char	   *leftDescription = "no new left rows";
+	char	   *rightDescription = "no new right rows";
+
+	if (leftRangeStart <= leftRangeEnd)
+		leftDescription = psprintf("left sequence values from " INT64_FORMAT
+								   " to " INT64_FORMAT,
+								   leftRangeStart, leftRangeEnd);
+
+	if (pipeline->rightRangeStart <= pipeline->rightRangeEnd)
+		rightDescription = psprintf("right sequence values from " INT64_FORMAT
+									" to " INT64_FORMAT,
+									pipeline->rightRangeStart, pipeline->rightRangeEnd);
+
+	ereport(NOTICE, (errmsg("pipeline %s: processing %s and %s",
+							pipelineName, leftDescription, rightDescription)));
+
+	int64		leftRetainStart = leftRangeStart;
+	int64		rightRetainStart = pipeline->rightRangeStart;
+
+	UpdateRetainedRanges(pipelineName, pipeline, leftRangeStart,
+						 &leftRetainStart, &rightRetainStart);
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 6;
+	Oid			argTypes[] = {INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID};
+	Datum		argValues[] = {
+		Int64GetDatum(leftRangeStart),
+		Int64GetDatum(leftRangeEnd),
+		Int64GetDatum(pipeline->rightRangeStart),
+		Int64GetDatum(pipeline->rightRangeEnd),
+		Int64GetDatum(leftRetainStart),
+		Int64GetDatum(rightRetainStart)
+	};
+	char	   *argNulls = "      ";
+
+	SPI_connect();
+	SPI_execute_with_args(command,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	PopActiveSnapshot();
+}
+
+
+/*
+ * ResetJoinPipeline resets a join pipeline to its initial state.
+ */
+void
+ResetJoinPipeline(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *updateQuery =
+		"update incremental.join_pipelines "
+		"set right_last_processed_sequence_number = 0 "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	char	   *deleteQuery =
+		"delete from incremental.join_ranges "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(updateQuery,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_execute_with_args(deleteQuery,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	UpdateLastProcessedSequenceNumber(pipelineName, 0);
+}
+
+
+/*
+ * PopRightSequenceNumberRange locks the join state of a pipeline and returns
+ * a safe range of new sequence numbers in the right-hand table, in the same
+ * way as PopSequenceNumberRange does for the left-hand table.
+ */
+static JoinPipeline *
+PopRightSequenceNumberRange(char *pipelineName)
+{
+	JoinPipeline *pipeline = (JoinPipeline *) palloc0(sizeof(JoinPipeline));
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	/*
+	 * Get the last-drawn sequence number, which may be part of a write that
+	 * has not committed yet. Also block other pipeline executions.
+	 */
+	char	   *query =
+		"select"
+		" right_relation,"
+		" pg_catalog.coalesce(right_last_processed_sequence_number + 1, 0),"
+		" pg_catalog.coalesce(pg_catalog.pg_sequence_last_value(right_sequence_name), 0),"
+		" join_window "
+		"from incremental.join_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"for update";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("join pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+	bool		isNull = false;
+
+	pipeline->rightRelationId = DatumGetObjectId(SPI_getbinval(row, rowDesc, 1, &isNull));
+	pipeline->rightRangeStart = DatumGetInt64(SPI_getbinval(row, rowDesc, 2, &isNull));
+	pipeline->rightRangeEnd = DatumGetInt64(SPI_getbinval(row, rowDesc, 3, &isNull));
+
+	/* copy the interval out of the SPI memory context */
+	Interval   *joinWindow = DatumGetIntervalP(SPI_getbinval(row, rowDesc, 4, &isNull));
+
+	pipeline->joinWindow = (Interval *) SPI_palloc(sizeof(Interval));
+	memcpy(pipeline->joinWindow, joinWindow, sizeof(Interval));
+
+	/* pass an empty range as $3 - 1 */
+	if (pipeline->rightRangeEnd < pipeline->rightRangeStart)
+		pipeline->rightRangeEnd = pipeline->rightRangeStart - 1;
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	if (pipeline->rightRangeStart <= pipeline->rightRangeEnd)
+	{
+		WaitForSequenceWriters(pipeline->rightRelationId);
+
+		GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+		SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+		char	   *updateQuery =
+			"update incremental.join_pipelines "
+			"set right_last_processed_sequence_number = $2 "
+			"where pipeline_name operator(pg_catalog.=) $1";
+
+		int			updateArgCount = 2;
+		Oid			updateArgTypes[] = {TEXTOID, INT8OID};
+		Datum		updateArgValues[] = {
+			CStringGetTextDatum(pipelineName),
+			Int64GetDatum(pipeline->rightRangeEnd)
+		};
+		char	   *updateArgNulls = "  ";
+
+		SPI_connect();
+		SPI_execute_with_args(updateQuery,
+							  updateArgCount,
+							  updateArgTypes,
+							  updateArgValues,
+							  updateArgNulls,
+							  readOnly,
+							  tupleCount);
+		SPI_finish();
+
+		SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+	}
+
+	return pipeline;
+}
+
+
+/*
+ * UpdateRetainedRanges records the start of the new ranges, removes the
+ * ranges that were processed more than join_window ago, and returns the
+ * start of the oldest retained range on each side.
+ *
+ * When no earlier ranges are retained, the retain start is the start of the
+ * new range, such that the retained range is empty.
+ */
+static void
+UpdateRetainedRanges(char *pipelineName, JoinPipeline * pipeline,
+					 int64 leftRangeStart, int64 *leftRetainStart,
+					 int64 *rightRetainStart)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	/* all parts of the statement see the ranges from before the statement */
+	char	   *query =
+		"with expired as ("
+		" delete from incremental.join_ranges"
+		" where pipeline_name operator(pg_catalog.=) $1"
+		" and processed_time operator(pg_catalog.<) pg_catalog.now() operator(pg_catalog.-) $4"
+		"), "
+		"added as ("
+		" insert into incremental.join_ranges"
+		" (pipeline_name, processed_time, left_range_start, right_range_start)"
+		" values ($1, pg_catalog.now(), $2, $3)"
+		") "
+		"select"
+		" pg_catalog.min(left_range_start),"
+		" pg_catalog.min(right_range_start) "
+		"from incremental.join_ranges "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"and processed_time operator(pg_catalog.>=) pg_catalog.now() operator(pg_catalog.-) $4";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 4;
+	Oid			argTypes[] = {TEXTOID, INT8OID, INT8OID, INTERVALOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		Int64GetDatum(leftRangeStart),
+		Int64GetDatum(pipeline->rightRangeStart),
+		IntervalPGetDatum(pipeline->joinWindow)
+	};
+	char	   *argNulls = "    ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed > 0)
+	{
+		TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+		HeapTuple	row = SPI_tuptable->vals[0];
+
+		bool		leftIsNull = false;
+		Datum		leftDatum = SPI_getbinval(row, rowDesc, 1, &leftIsNull);
+
+		if (!leftIsNull)
+			*leftRetainStart = DatumGetInt64(leftDatum);
+
+		bool		rightIsNull = false;
+		Datum		rightDatum = SPI_getbinval(row, rowDesc, 2, &rightIsNull);
+
+		if (!rightIsNull)
+			*rightRetainStart = DatumGetInt64(rightDatum);
+	}
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
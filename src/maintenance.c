@@ -0,0 +1,213 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/pg_authid.h"
+#include "crunchy/incremental/maintenance.h"
+#include "executor/spi.h"
+#include "pgstat.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+
+
+/* number of dead tuples in a target relation after which to emit a hint */
+int			MaintenanceDeadTupleThreshold = 0;
+
+/* number of non-HOT updates since the last hint after which to emit a hint */
+int			MaintenanceNonHotUpdateThreshold = 0;
+
+
+/*
+ * MaintenanceHintsEnabled returns whether any of the maintenance thresholds
+ * is set.
+ */
+bool
+MaintenanceHintsEnabled(void)
+{
+	return MaintenanceDeadTupleThreshold > 0 || MaintenanceNonHotUpdateThreshold > 0;
+}
+
+
+/*
+ * CheckTargetMaintenance compares the statistics of the relation modified by
+ * a pipeline against the maintenance thresholds and records a hint in
+ * incremental.maintenance_hints when they are exceeded.
+ *
+ * Summary tables that are upserted on every run concentrate updates on a few
+ * rows, which leads to bloat and, once indexes cover the updated columns, to
+ * non-HOT updates. VACUUM and REINDEX CONCURRENTLY cannot run in the pipeline
+ * transaction, so we only suggest them.
+ *
+ * Table statistics are flushed asynchronously, so the check typically
+ * reflects the updates of earlier runs.
+ *
+ * A VACUUM hint is only recorded and reported when it is new, and cleared
+ * once the dead tuples drop below the threshold. A REINDEX hint restarts
+ * counting non-HOT updates, so each one is new.
+ */
+void
+CheckTargetMaintenance(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/* make sure we read the latest flushed statistics */
+	pgstat_clear_snapshot();
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the maintenance hints table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	char	   *query =
+		"select p.target_relation, s.n_dead_tup, s.n_tup_upd - s.n_tup_hot_upd, "
+		"h.non_hot_update_baseline, h.vacuum_command is not null "
+		"from incremental.pipelines p "
+		"join pg_catalog.pg_stat_all_tables s on (s.relid operator(pg_catalog.=) p.target_relation) "
+		"left join incremental.maintenance_hints h using (target_relation) "
+		"where p.pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+	{
+		/* pipeline does not modify a relation */
+		SPI_finish();
+		SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+		return;
+	}
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Oid			targetRelationId =
+		DatumGetObjectId(SPI_getbinval(row, rowDesc, 1, &isNull));
+	int64		deadTuples = DatumGetInt64(SPI_getbinval(row, rowDesc, 2, &isNull));
+	int64		nonHotUpdateCount = DatumGetInt64(SPI_getbinval(row, rowDesc, 3, &isNull));
+	Datum		baselineDatum = SPI_getbinval(row, rowDesc, 4, &isNull);
+
+	/* on first check, start counting non-HOT updates from now */
+	bool		isTracked = !isNull;
+	int64		nonHotUpdateBaseline = isTracked ? DatumGetInt64(baselineDatum) : nonHotUpdateCount;
+	bool		hadVacuumHint = isTracked &&
+		DatumGetBool(SPI_getbinval(row, rowDesc, 5, &isNull));
+
+	/* statistics were reset */
+	if (nonHotUpdateCount < nonHotUpdateBaseline)
+		nonHotUpdateBaseline = 0;
+
+	int64		nonHotUpdates = nonHotUpdateCount - nonHotUpdateBaseline;
+
+	bool		suggestVacuum = MaintenanceDeadTupleThreshold > 0 &&
+		deadTuples >= MaintenanceDeadTupleThreshold;
+	bool		suggestReindex = MaintenanceNonHotUpdateThreshold > 0 &&
+		nonHotUpdates >= MaintenanceNonHotUpdateThreshold;
+
+	/* skip the update if the hint did not change */
+	if (isTracked && suggestVacuum == hadVacuumHint && !suggestReindex)
+	{
+		SPI_finish();
+		SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+		return;
+	}
+
+	/* allocate the name in the caller context to use it after SPI_finish */
+	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+	char	   *targetName =
+		quote_qualified_identifier(get_namespace_name(get_rel_namespace(targetRelationId)),
+								   get_rel_name(targetRelationId));
+
+	MemoryContextSwitchTo(spiContext);
+
+	/*
+	 * Record the hint and restart counting non-HOT updates, or only start
+	 * tracking the relation if no threshold is exceeded. An earlier REINDEX
+	 * hint is kept until the next one.
+	 */
+	char	   *hintQuery =
+		"insert into incremental.maintenance_hints as h "
+		"(target_relation, pipeline_name, dead_tuples, non_hot_updates, "
+		"non_hot_update_baseline, vacuum_command, reindex_commands, hint_time) "
+		"select $1, $2, $3, $4, $5, "
+		"case when $6 then pg_catalog.format('VACUUM (ANALYZE) %s', $8) end, "
+		"case when $7 then array("
+		" select pg_catalog.format('REINDEX INDEX CONCURRENTLY %I.%I', n.nspname, c.relname) "
+		" from pg_catalog.pg_index i "
+		" join pg_catalog.pg_class c on (c.oid operator(pg_catalog.=) i.indexrelid) "
+		" join pg_catalog.pg_namespace n on (n.oid operator(pg_catalog.=) c.relnamespace) "
+		" where i.indrelid operator(pg_catalog.=) $1 order by c.relname) end, "
+		"case when ($6 and not $9) or $7 then pg_catalog.now() end "
+		"on conflict (target_relation) do update set "
+		"pipeline_name = excluded.pipeline_name, "
+		"dead_tuples = excluded.dead_tuples, "
+		"non_hot_updates = excluded.non_hot_updates, "
+		"non_hot_update_baseline = excluded.non_hot_update_baseline, "
+		"vacuum_command = excluded.vacuum_command, "
+		"reindex_commands = pg_catalog.coalesce(excluded.reindex_commands, h.reindex_commands), "
+		"hint_time = pg_catalog.coalesce(excluded.hint_time, h.hint_time)";
+
+	int			hintArgCount = 9;
+	Oid			hintArgTypes[] = {
+		OIDOID, TEXTOID, INT8OID, INT8OID, INT8OID, BOOLOID, BOOLOID, TEXTOID, BOOLOID
+	};
+	Datum		hintArgValues[] = {
+		ObjectIdGetDatum(targetRelationId),
+		CStringGetTextDatum(pipelineName),
+		Int64GetDatum(deadTuples),
+		Int64GetDatum(nonHotUpdates),
+		Int64GetDatum(suggestReindex || !isTracked ? nonHotUpdateCount : nonHotUpdateBaseline),
+		BoolGetDatum(suggestVacuum),
+		BoolGetDatum(suggestReindex),
+		CStringGetTextDatum(targetName),
+		BoolGetDatum(hadVacuumHint)
+	};
+	char	   *hintArgNulls = "         ";
+
+	SPI_execute_with_args(hintQuery,
+						  hintArgCount,
+						  hintArgTypes,
+						  hintArgValues,
+						  hintArgNulls,
+						  readOnly,
+						  tupleCount);
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	if (suggestVacuum && !hadVacuumHint)
+		ereport(NOTICE, (errmsg("pipeline %s: relation %s has " INT64_FORMAT
+								" dead tuples",
+								pipelineName, targetName, deadTuples),
+						 errhint("Consider running VACUUM (ANALYZE) %s", targetName)));
+
+	if (suggestReindex)
+		ereport(NOTICE, (errmsg("pipeline %s: relation %s had " INT64_FORMAT
+								" non-HOT updates since the last hint",
+								pipelineName, targetName, nonHotUpdates),
+						 errhint("Consider running REINDEX INDEX CONCURRENTLY on the "
+								 "indexes listed in incremental.maintenance_hints, or "
+								 "lowering the fillfactor of %s", targetName)));
+}
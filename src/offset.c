@@ -0,0 +1,464 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/pg_authid.h"
+#include "catalog/pg_proc.h"
+#include "crunchy/incremental/offset.h"
+#include "crunchy/incremental/pipeline.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "parser/parse_func.h"
+#include "parser/scansup.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/palloc.h"
+#include "utils/regproc.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+
+
+/*
+ * OffsetPipeline contains the state of an offset pipeline.
+ */
+typedef struct OffsetPipeline
+{
+	/* qualified name of the fetch(from_offset text, max_rows int) function */
+	char	   *fetchFunction;
+
+	/* maximum number of rows to fetch per command execution */
+	int			batchSize;
+
+	/* maximum number of rows to process in a single run */
+	int			maxRowsPerRun;
+
+	/* offset after the last processed row, NULL if nothing was processed */
+	char	   *lastOffset;
+}			OffsetPipeline;
+
+
+static OffsetPipeline * LockOffsetPipeline(char *pipelineName);
+static int64 ExecuteOffsetBatch(char *batchQuery, char *fromOffset, int maxRows,
+								char **nextOffset);
+static void UpdateLastOffset(char *pipelineName, char *lastOffset);
+
+
+/*
+ * InitializeOffsetPipelineState adds the initial offset pipeline state.
+ */
+void
+InitializeOffsetPipelineState(char *pipelineName, char *fetchFunction, int batchSize,
+							  int maxRowsPerRun, char *startOffset)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.offset_pipelines "
+		"(pipeline_name, fetch_function, batch_size, max_rows_per_run, "
+		"start_offset, last_offset) "
+		"values ($1, $2, $3, $4, $5, $5)";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 5;
+	Oid			argTypes[] = {TEXTOID, TEXTOID, INT4OID, INT4OID, TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		CStringGetTextDatum(fetchFunction),
+		Int32GetDatum(batchSize),
+		Int32GetDatum(maxRowsPerRun),
+		startOffset != NULL ? CStringGetTextDatum(startOffset) : 0
+	};
+	char		argNulls[] = {
+		' ', ' ', ' ', ' ',
+		startOffset != NULL ? ' ' : 'n'
+	};
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * ExecuteOffsetPipeline repeatedly fetches up to batch_size rows after the
+ * last offset and runs the command over them, until the fetch function
+ * returns fewer rows than requested or max_rows_per_run is reached.
+ *
+ * The offset after each batch is stored in the same transaction as the
+ * effects of the command, such that every row is processed exactly once.
+ */
+void
+ExecuteOffsetPipeline(char *pipelineName, char *command)
+{
+	OffsetPipeline *pipeline = LockOffsetPipeline(pipelineName);
+	char	   *batchQuery = BuildOffsetBatchQuery(pipeline->fetchFunction, command);
+	char	   *fromOffset = pipeline->lastOffset;
+	int64		totalRowCount = 0;
+
+	while (totalRowCount < pipeline->maxRowsPerRun)
+	{
+		int			maxRows = pipeline->batchSize;
+
+		if (pipeline->maxRowsPerRun - totalRowCount < maxRows)
+			maxRows = (int) (pipeline->maxRowsPerRun - totalRowCount);
+
+		char	   *nextOffset = NULL;
+		int64		rowCount = ExecuteOffsetBatch(batchQuery, fromOffset, maxRows,
+												  &nextOffset);
+
+		if (rowCount == 0)
+			break;
+
+		/* without a next offset we cannot tell where to continue */
+		if (nextOffset == NULL)
+			ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+							errmsg("fetch function %s returned a NULL next_offset",
+								   pipeline->fetchFunction)));
+
+		ereport(NOTICE, (errmsg("pipeline %s: processed " INT64_FORMAT " rows after "
+								"offset %s",
+								pipelineName, rowCount,
+								fromOffset != NULL ? fromOffset : "(start)")));
+
+		UpdateLastOffset(pipelineName, nextOffset);
+
+		totalRowCount += rowCount;
+		fromOffset = nextOffset;
+
+		if (rowCount < maxRows)
+			break;
+	}
+
+	if (totalRowCount == 0)
+		ereport(NOTICE, (errmsg("pipeline %s: no rows to process",
+								pipelineName)));
+}
+
+
+/*
+ * ResetOffsetPipeline resets an offset pipeline to its start offset.
+ */
+void
+ResetOffsetPipeline(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"update incremental.offset_pipelines "
+		"set last_offset = start_offset "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * SanitizeFetchFunction qualifies a fetch function name and errors
+ * if the function cannot be found.
+ */
+char *
+SanitizeFetchFunction(char *fetchFunction)
+{
+#if (PG_VERSION_NUM >= 160000)
+	List	   *names = stringToQualifiedNameList(fetchFunction, NULL);
+#else
+	List	   *names = stringToQualifiedNameList(fetchFunction);
+#endif
+	Oid			argTypes[] = {TEXTOID, INT4OID};
+	bool		missingOk = false;
+	Oid			functionId = LookupFuncName(names, 2, argTypes, missingOk);
+
+	HeapTuple	procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(functionId));
+
+	if (!HeapTupleIsValid(procTuple))
+		elog(ERROR, "could not find function with OID %u", functionId);
+
+	Form_pg_proc procForm = (Form_pg_proc) GETSTRUCT(procTuple);
+
+	if (!procForm->proretset)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_FUNCTION_DEFINITION),
+						errmsg("fetch function %s must return a set of rows",
+							   NameStr(procForm->proname))));
+
+	char	   *schemaName = get_namespace_name(procForm->pronamespace);
+	char	   *qualifiedName = quote_qualified_identifier(schemaName,
+														   NameStr(procForm->proname));
+
+	ReleaseSysCache(procTuple);
+
+	return qualifiedName;
+}
+
+
+/*
+ * BuildOffsetBatchQuery wraps the command of an offset pipeline into a single
+ * statement that materializes the rows returned by the fetch function as
+ * "fetched", runs the command as a data-modifying CTE over them, and returns
+ * the number of rows and the next_offset of the last row.
+ *
+ * The command CTE is not referenced, since a data-modifying CTE without
+ * RETURNING cannot be, and a plain SELECT command would therefore never run.
+ * create_offset_pipeline rejects commands that do not modify a table.
+ */
+char *
+BuildOffsetBatchQuery(char *fetchFunction, char *command)
+{
+	/* trailing semicolons are not allowed inside a CTE */
+	char	   *commandCopy = pstrdup(command);
+	int			commandLength = strlen(commandCopy);
+
+	while (commandLength > 0 &&
+		   (commandCopy[commandLength - 1] == ';' ||
+			scanner_isspace(commandCopy[commandLength - 1])))
+		commandCopy[--commandLength] = '\0';
+
+	StringInfo	query = makeStringInfo();
+
+	appendStringInfo(query,
+					 "with fetched as materialized ("
+					 " select * from %s($1, $2) with ordinality"
+					 "), "
+					 "command as (\n%s\n) "
+					 "select"
+					 " (select pg_catalog.count(*) from fetched),"
+					 " (select next_offset::pg_catalog.text from fetched"
+					 "  order by ordinality desc limit 1)",
+					 fetchFunction, commandCopy);
+
+	return query->data;
+}
+
+
+/*
+ * LockOffsetPipeline reads the state of an offset pipeline and blocks other
+ * executions of the same pipeline.
+ */
+static OffsetPipeline *
+LockOffsetPipeline(char *pipelineName)
+{
+	OffsetPipeline *pipeline = (OffsetPipeline *) palloc0(sizeof(OffsetPipeline));
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"select fetch_function, batch_size, max_rows_per_run, last_offset "
+		"from incremental.offset_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"for update";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		fetchFunctionDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+	Datum		batchSizeDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+	Datum		maxRowsPerRunDatum = SPI_getbinval(row, rowDesc, 3, &isNull);
+
+	bool		lastOffsetIsNull = false;
+	Datum		lastOffsetDatum = SPI_getbinval(row, rowDesc, 4, &lastOffsetIsNull);
+
+	MemoryContext oldContext = MemoryContextSwitchTo(callerContext);
+
+	pipeline->fetchFunction = TextDatumGetCString(fetchFunctionDatum);
+	pipeline->batchSize = DatumGetInt32(batchSizeDatum);
+	pipeline->maxRowsPerRun = DatumGetInt32(maxRowsPerRunDatum);
+
+	if (!lastOffsetIsNull)
+		pipeline->lastOffset = TextDatumGetCString(lastOffsetDatum);
+
+	MemoryContextSwitchTo(oldContext);
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return pipeline;
+}
+
+
+/*
+ * ExecuteOffsetBatch runs the batch query for the rows after fromOffset and
+ * returns the number of fetched rows, and the offset after the last row via
+ * nextOffset.
+ */
+static int64
+ExecuteOffsetBatch(char *batchQuery, char *fromOffset, int maxRows, char **nextOffset)
+{
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, INT4OID};
+	Datum		argValues[] = {
+		fromOffset != NULL ? CStringGetTextDatum(fromOffset) : 0,
+		Int32GetDatum(maxRows)
+	};
+	char		argNulls[] = {
+		fromOffset != NULL ? ' ' : 'n',
+		' '
+	};
+
+	SPI_connect();
+	SPI_execute_with_args(batchQuery,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	int64		rowCount = DatumGetInt64(SPI_getbinval(row, rowDesc, 1, &isNull));
+
+	bool		nextOffsetIsNull = false;
+	Datum		nextOffsetDatum = SPI_getbinval(row, rowDesc, 2, &nextOffsetIsNull);
+
+	if (!nextOffsetIsNull)
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(callerContext);
+
+		*nextOffset = TextDatumGetCString(nextOffsetDatum);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	SPI_finish();
+
+	PopActiveSnapshot();
+
+	return rowCount;
+}
+
+
+/*
+ * UpdateLastOffset stores the offset after the last processed row, which
+ * commits or aborts with the effects of the command.
+ */
+static void
+UpdateLastOffset(char *pipelineName, char *lastOffset)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"update incremental.offset_pipelines "
+		"set last_offset = $2 "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		CStringGetTextDatum(lastOffset)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
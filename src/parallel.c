@@ -0,0 +1,318 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "access/xact.h"
+#include "crunchy/incremental/parallel.h"
+#include "crunchy/incremental/pipeline.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+
+/* maximum length of a pipeline name passed to a worker */
+#define WORKER_PIPELINE_NAME_LEN 256
+
+/* maximum length of an error message returned by a worker */
+#define WORKER_ERROR_MESSAGE_LEN 1024
+
+
+/*
+ * PipelineResult is the outcome of a pipeline execution by a worker.
+ */
+typedef struct PipelineResult
+{
+	char		pipelineName[WORKER_PIPELINE_NAME_LEN];
+
+	/* whether a worker finished executing the pipeline */
+	bool		finished;
+
+	/* whether the execution committed */
+	bool		succeeded;
+
+	/* execution time in microseconds */
+	int64		duration;
+
+	char		errorMessage[WORKER_ERROR_MESSAGE_LEN];
+}			PipelineResult;
+
+/*
+ * ParallelPipelineState is the dynamic shared memory area shared between
+ * execute_pipelines and its workers.
+ */
+typedef struct ParallelPipelineState
+{
+	/* database and user as which to execute pipelines */
+	Oid			databaseId;
+	Oid			userId;
+
+	/* index of the next pipeline to execute */
+	pg_atomic_uint32 nextPipeline;
+
+	int			pipelineCount;
+	PipelineResult results[FLEXIBLE_ARRAY_MEMBER];
+}			ParallelPipelineState;
+
+
+static void ExecutePipelineInWorker(PipelineResult * result);
+static void WaitForPipelineWorkers(List *workerHandles);
+
+
+PG_FUNCTION_INFO_V1(incremental_execute_pipelines);
+
+
+/*
+ * incremental_execute_pipelines executes a list of pipelines using a pool of
+ * background workers, each pipeline in its own transaction, and returns the
+ * outcome of each pipeline once all of them finished.
+ */
+Datum
+incremental_execute_pipelines(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_names cannot be NULL")));
+	if (PG_ARGISNULL(1) || PG_GETARG_INT32(1) <= 0)
+		ereport(ERROR, (errmsg("parallelism must be positive")));
+
+	ArrayType  *pipelineNameArray = PG_GETARG_ARRAYTYPE_P(0);
+	int			parallelism = PG_GETARG_INT32(1);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	Datum	   *nameDatums = NULL;
+	bool	   *nameNulls = NULL;
+	int			pipelineCount = 0;
+
+	deconstruct_array(pipelineNameArray, TEXTOID, -1, false, TYPALIGN_INT,
+					  &nameDatums, &nameNulls, &pipelineCount);
+
+	if (pipelineCount == 0)
+		PG_RETURN_VOID();
+
+	Size		stateSize = add_size(offsetof(ParallelPipelineState, results),
+									 mul_size(pipelineCount, sizeof(PipelineResult)));
+	dsm_segment *segment = dsm_create(stateSize, 0);
+	ParallelPipelineState *state = dsm_segment_address(segment);
+
+	memset(state, 0, stateSize);
+	state->databaseId = MyDatabaseId;
+	state->userId = GetUserId();
+	state->pipelineCount = pipelineCount;
+	pg_atomic_init_u32(&state->nextPipeline, 0);
+
+	/* check permissions up front, workers check again */
+	for (int pipelineIndex = 0; pipelineIndex < pipelineCount; pipelineIndex++)
+	{
+		if (nameNulls[pipelineIndex])
+			ereport(ERROR, (errmsg("pipeline_names cannot contain NULL")));
+
+		char	   *pipelineName = TextDatumGetCString(nameDatums[pipelineIndex]);
+
+		if (strlen(pipelineName) >= WORKER_PIPELINE_NAME_LEN)
+			ereport(ERROR, (errcode(ERRCODE_NAME_TOO_LONG),
+							errmsg("pipeline name \"%s\" is too long", pipelineName)));
+
+		PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+		EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
+
+		strlcpy(state->results[pipelineIndex].pipelineName, pipelineName,
+				WORKER_PIPELINE_NAME_LEN);
+	}
+
+	/* start a pool of workers that take pipelines from the list */
+	int			workerCount = Min(parallelism, pipelineCount);
+	List	   *workerHandles = NIL;
+
+	for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+	{
+		BackgroundWorker worker;
+		BackgroundWorkerHandle *handle = NULL;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(segment));
+		worker.bgw_notify_pid = MyProcPid;
+		strlcpy(worker.bgw_library_name, "pg_incremental", BGW_MAXLEN);
+		strlcpy(worker.bgw_function_name, "IncrementalPipelineWorkerMain", BGW_MAXLEN);
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_incremental pipeline worker %d", workerIndex);
+		strlcpy(worker.bgw_type, "pg_incremental pipeline worker", BGW_MAXLEN);
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+			break;
+
+		workerHandles = lappend(workerHandles, handle);
+	}
+
+	if (workerHandles == NIL)
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+						errmsg("could not start background workers to execute pipelines"),
+						errhint("Consider increasing max_worker_processes.")));
+
+	if (list_length(workerHandles) < workerCount)
+		ereport(NOTICE, (errmsg("executing pipelines using %d of %d workers",
+								list_length(workerHandles), workerCount)));
+
+	WaitForPipelineWorkers(workerHandles);
+
+	for (int pipelineIndex = 0; pipelineIndex < pipelineCount; pipelineIndex++)
+	{
+		PipelineResult *result = &state->results[pipelineIndex];
+		Datum		values[4];
+		bool		nulls[4];
+
+		memset(nulls, false, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(result->pipelineName);
+		values[1] = BoolGetDatum(result->succeeded);
+		values[2] = Float8GetDatum(result->duration / 1000.0);
+
+		if (!result->finished)
+		{
+			nulls[2] = true;
+			values[3] = CStringGetTextDatum("pipeline was not executed");
+		}
+		else if (!result->succeeded)
+			values[3] = CStringGetTextDatum(result->errorMessage);
+		else
+			nulls[3] = true;
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	dsm_detach(segment);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * WaitForPipelineWorkers waits for all workers to exit, and terminates them
+ * if the wait is interrupted.
+ */
+static void
+WaitForPipelineWorkers(List *workerHandles)
+{
+	ListCell   *handleCell = NULL;
+
+	PG_TRY();
+	{
+		foreach(handleCell, workerHandles)
+		{
+			BackgroundWorkerHandle *handle = lfirst(handleCell);
+
+			WaitForBackgroundWorkerShutdown(handle);
+		}
+	}
+	PG_CATCH();
+	{
+		ListCell   *terminateCell = NULL;
+
+		foreach(terminateCell, workerHandles)
+		{
+			BackgroundWorkerHandle *handle = lfirst(terminateCell);
+
+			TerminateBackgroundWorker(handle);
+		}
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+
+/*
+ * IncrementalPipelineWorkerMain is the entry point of a worker that executes
+ * pipelines on behalf of execute_pipelines.
+ */
+void
+IncrementalPipelineWorkerMain(Datum arg)
+{
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	dsm_segment *segment = dsm_attach(DatumGetUInt32(arg));
+
+	if (segment == NULL)
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						errmsg("could not map dynamic shared memory segment")));
+
+	ParallelPipelineState *state = dsm_segment_address(segment);
+
+	BackgroundWorkerInitializeConnectionByOid(state->databaseId, state->userId, 0);
+
+	while (true)
+	{
+		uint32		pipelineIndex = pg_atomic_fetch_add_u32(&state->nextPipeline, 1);
+
+		if (pipelineIndex >= state->pipelineCount)
+			break;
+
+		ExecutePipelineInWorker(&state->results[pipelineIndex]);
+	}
+
+	dsm_detach(segment);
+
+	proc_exit(0);
+}
+
+
+/*
+ * ExecutePipelineInWorker executes a single pipeline in its own transaction
+ * and records the outcome.
+ */
+static void
+ExecutePipelineInWorker(PipelineResult * result)
+{
+	MemoryContext workerContext = CurrentMemoryContext;
+	TimestampTz startTime = GetCurrentTimestamp();
+
+	pgstat_report_activity(STATE_RUNNING, result->pipelineName);
+
+	/* otherwise now() would be the start time of the worker */
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+
+	PG_TRY();
+	{
+		PipelineDesc *pipelineDesc = ReadPipelineDesc(result->pipelineName);
+
+		EnsurePipelineOwner(result->pipelineName, pipelineDesc->ownerId);
+		ExecutePipeline(result->pipelineName, pipelineDesc->pipelineType,
+						pipelineDesc->command, pipelineDesc->searchPath, false);
+
+		CommitTransactionCommand();
+
+		result->succeeded = true;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(workerContext);
+
+		ErrorData  *errorData = CopyErrorData();
+
+		FlushErrorState();
+		AbortCurrentTransaction();
+
+		strlcpy(result->errorMessage, errorData->message, WORKER_ERROR_MESSAGE_LEN);
+		FreeErrorData(errorData);
+
+		result->succeeded = false;
+	}
+	PG_END_TRY();
+
+	result->duration = GetCurrentTimestamp() - startTime;
+	result->finished = true;
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
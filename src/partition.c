@@ -0,0 +1,788 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "access/relation.h"
+#include "access/xact.h"
+#include "catalog/dependency.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_partitioned_table.h"
+#include "crunchy/incremental/partition.h"
+#include "crunchy/incremental/pipeline.h"
+#include "executor/spi.h"
+#include "partitioning/partbounds.h"
+#include "partitioning/partdesc.h"
+#include "storage/lmgr.h"
+#include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+#include "utils/partcache.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * PartitionedTarget describes a range-partitioned table into which a pipeline
+ * writes.
+ */
+typedef struct PartitionedTarget
+{
+	Oid			targetRelationId;
+
+	/* size of each partition */
+	Interval   *partitionInterval;
+
+	/* how far beyond the end of a range to create partitions */
+	Interval   *lookahead;
+
+	/* for sequence pipelines, the event time and sequence columns */
+	char	   *sourceTimeColumn;
+	char	   *sequenceColumn;
+}			PartitionedTarget;
+
+
+static void InsertPartitionedTarget(char *pipelineName, Oid targetRelationId,
+									Interval *partitionInterval, Interval *lookahead,
+									char *sourceTimeColumn, char *sequenceColumn);
+static void DeletePartitionedTarget(char *pipelineName);
+static PartitionedTarget * ReadPartitionedTarget(char *pipelineName);
+static void CreateMissingPartitions(char *pipelineName, PartitionedTarget * target,
+									TimestampTz rangeStart, TimestampTz rangeEnd);
+static Oid	GetPartitionKeyType(Oid relationId);
+static Datum TimestampTzToPartitionKey(TimestampTz value, Oid keyTypeId);
+static TimestampTz PartitionKeyToTimestampTz(Datum keyValue, Oid keyTypeId);
+static bool GetUncoveredRange(Oid relationId, Oid keyTypeId, TimestampTz *start,
+							  TimestampTz *end);
+static void CreatePartition(char *pipelineName, Oid relationId, Oid keyTypeId,
+							TimestampTz partitionStart, TimestampTz partitionEnd,
+							Interval *partitionInterval);
+static char *GetSequenceColumnForPipeline(char *pipelineName);
+
+
+PG_FUNCTION_INFO_V1(incremental_set_partitioned_target);
+
+
+/*
+ * incremental_set_partitioned_target declares a range-partitioned target for
+ * a pipeline, such that partitions covering a range are created before the
+ * range is processed. If target_table is NULL, the target is removed.
+ */
+Datum
+incremental_set_partitioned_target(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("partition_interval cannot be NULL")));
+	if (PG_ARGISNULL(3))
+		ereport(ERROR, (errmsg("lookahead cannot be NULL")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	Oid			targetRelationId = PG_ARGISNULL(1) ? InvalidOid : PG_GETARG_OID(1);
+	Interval   *partitionInterval = PG_GETARG_INTERVAL_P(2);
+	Interval   *lookahead = PG_GETARG_INTERVAL_P(3);
+	char	   *sourceTimeColumn = PG_ARGISNULL(4) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(4));
+	char	   *sequenceColumn = NULL;
+
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+	EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
+
+	switch (pipelineDesc->pipelineType)
+	{
+		case SEQUENCE_RANGE_PIPELINE:
+			break;
+
+		case TIME_INTERVAL_PIPELINE:
+		case TIME_BUCKET_PIPELINE:
+			{
+				if (sourceTimeColumn != NULL)
+					ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+									errmsg("source_time_column is only supported for "
+										   "sequence pipelines")));
+				break;
+			}
+
+		default:
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("partitioned targets are only supported for sequence, "
+								   "time interval, and time bucket pipelines")));
+	}
+
+	if (OidIsValid(targetRelationId))
+	{
+		if (get_rel_relkind(targetRelationId) != RELKIND_PARTITIONED_TABLE)
+			ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+							errmsg("%s is not a partitioned table",
+								   get_rel_name(targetRelationId))));
+
+		/* throws an error for unsupported partition keys */
+		Oid			keyTypeId = GetPartitionKeyType(targetRelationId);
+
+		Interval	zeroInterval;
+
+		memset(&zeroInterval, 0, sizeof(Interval));
+
+		if (partitionInterval->month != 0)
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("partition_interval cannot contain months or years")));
+
+		/* otherwise both bounds of a partition could map to the same date */
+		if (keyTypeId == DATEOID && partitionInterval->time % USECS_PER_DAY != 0)
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							errmsg("partition_interval must be a whole number of days "
+								   "for a partition key of type date")));
+
+		if (DatumGetBool(DirectFunctionCall2(interval_le,
+											 IntervalPGetDatum(partitionInterval),
+											 IntervalPGetDatum(&zeroInterval))))
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							errmsg("partition_interval must be positive")));
+
+		if (DatumGetBool(DirectFunctionCall2(interval_lt,
+											 IntervalPGetDatum(lookahead),
+											 IntervalPGetDatum(&zeroInterval))))
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							errmsg("lookahead cannot be negative")));
+
+		if (sourceTimeColumn != NULL)
+		{
+			if (get_attnum(pipelineDesc->sourceRelationId, sourceTimeColumn) == InvalidAttrNumber)
+				ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+								errmsg("column \"%s\" of relation \"%s\" does not exist",
+									   sourceTimeColumn,
+									   get_rel_name(pipelineDesc->sourceRelationId))));
+
+			sequenceColumn = GetSequenceColumnForPipeline(pipelineName);
+		}
+	}
+
+	if (OidIsValid(targetRelationId))
+		InsertPartitionedTarget(pipelineName, targetRelationId, partitionInterval,
+								lookahead, sourceTimeColumn, sequenceColumn);
+	else
+		DeletePartitionedTarget(pipelineName);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * InsertPartitionedTarget adds or replaces the partitioned target of a
+ * pipeline.
+ */
+static void
+InsertPartitionedTarget(char *pipelineName, Oid targetRelationId,
+						Interval *partitionInterval, Interval *lookahead,
+						char *sourceTimeColumn, char *sequenceColumn)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the partitioned targets table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.partitioned_targets "
+		"(pipeline_name, target_relation, partition_interval, lookahead, "
+		"source_time_column, sequence_column) "
+		"values ($1, $2, $3, $4, $5, $6) "
+		"on conflict (pipeline_name) do update set "
+		"target_relation = excluded.target_relation, "
+		"partition_interval = excluded.partition_interval, "
+		"lookahead = excluded.lookahead, "
+		"source_time_column = excluded.source_time_column, "
+		"sequence_column = excluded.sequence_column";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 6;
+	Oid			argTypes[] = {TEXTOID, OIDOID, INTERVALOID, INTERVALOID, TEXTOID, TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		ObjectIdGetDatum(targetRelationId),
+		IntervalPGetDatum(partitionInterval),
+		IntervalPGetDatum(lookahead),
+		sourceTimeColumn != NULL ? CStringGetTextDatum(sourceTimeColumn) : 0,
+		sequenceColumn != NULL ? CStringGetTextDatum(sequenceColumn) : 0
+	};
+	char		argNulls[] = {
+		' ', ' ', ' ', ' ',
+		sourceTimeColumn != NULL ? ' ' : 'n',
+		sequenceColumn != NULL ? ' ' : 'n'
+	};
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * DeletePartitionedTarget removes the partitioned target of a pipeline.
+ */
+static void
+DeletePartitionedTarget(char *pipelineName)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the partitioned targets table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"delete from incremental.partitioned_targets "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * EnsureTargetPartitions creates the partitions of the partitioned target of
+ * a pipeline that cover the given time range plus the lookahead, if the
+ * pipeline has a partitioned target.
+ */
+void
+EnsureTargetPartitions(char *pipelineName, TimestampTz rangeStart, TimestampTz rangeEnd)
+{
+	PartitionedTarget *target = ReadPartitionedTarget(pipelineName);
+
+	if (target == NULL)
+		return;
+
+	CreateMissingPartitions(pipelineName, target, rangeStart, rangeEnd);
+}
+
+
+/*
+ * EnsureSequenceRangePartitions creates the partitions of the partitioned
+ * target of a sequence pipeline that cover the event times of the rows in
+ * the given sequence range plus the lookahead, or the current time if the
+ * pipeline has no source time column.
+ */
+void
+EnsureSequenceRangePartitions(char *pipelineName, Oid sourceRelationId,
+							  int64 rangeStart, int64 rangeEnd)
+{
+	PartitionedTarget *target = ReadPartitionedTarget(pipelineName);
+
+	if (target == NULL)
+		return;
+
+	if (target->sourceTimeColumn == NULL)
+	{
+		TimestampTz currentTime = GetCurrentTransactionStartTimestamp();
+
+		CreateMissingPartitions(pipelineName, target, currentTime, currentTime);
+		return;
+	}
+
+	char	   *timeColumn = quote_identifier(target->sourceTimeColumn);
+	char	   *query =
+		psprintf("select pg_catalog.min(%s)::timestamptz, pg_catalog.max(%s)::timestamptz "
+				 "from %s where %s operator(pg_catalog.>=) $1 "
+				 "and %s operator(pg_catalog.<=) $2",
+				 timeColumn, timeColumn,
+				 quote_qualified_identifier(get_namespace_name(get_rel_namespace(sourceRelationId)),
+											get_rel_name(sourceRelationId)),
+				 quote_identifier(target->sequenceColumn),
+				 quote_identifier(target->sequenceColumn));
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {INT8OID, INT8OID};
+	Datum		argValues[] = {
+		Int64GetDatum(rangeStart),
+		Int64GetDatum(rangeEnd)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		minTimeDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+
+	if (isNull)
+	{
+		/* no rows in the range */
+		SPI_finish();
+		return;
+	}
+
+	TimestampTz minTime = DatumGetTimestampTz(minTimeDatum);
+	TimestampTz maxTime = DatumGetTimestampTz(SPI_getbinval(row, rowDesc, 2, &isNull));
+
+	SPI_finish();
+
+	CreateMissingPartitions(pipelineName, target, minTime, maxTime);
+}
+
+
+/*
+ * ReadPartitionedTarget returns the partitioned target of a pipeline, or NULL
+ * if it does not have one.
+ */
+static PartitionedTarget *
+ReadPartitionedTarget(char *pipelineName)
+{
+	PartitionedTarget *target = NULL;
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have read
+	 * privileges for the partitioned targets table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	char	   *query =
+		"select target_relation, partition_interval, lookahead, "
+		"source_time_column, sequence_column "
+		"from incremental.partitioned_targets "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed > 0)
+	{
+		TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+		HeapTuple	row = SPI_tuptable->vals[0];
+
+		bool		isNull = false;
+		Datum		targetRelationDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+		Datum		partitionIntervalDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+		Datum		lookaheadDatum = SPI_getbinval(row, rowDesc, 3, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+		target = (PartitionedTarget *) palloc0(sizeof(PartitionedTarget));
+		target->targetRelationId = DatumGetObjectId(targetRelationDatum);
+		target->partitionInterval = DatumGetIntervalP(datumCopy(partitionIntervalDatum,
+																false, sizeof(Interval)));
+		target->lookahead = DatumGetIntervalP(datumCopy(lookaheadDatum,
+														false, sizeof(Interval)));
+
+		Datum		sourceTimeColumnDatum = SPI_getbinval(row, rowDesc, 4, &isNull);
+
+		if (!isNull)
+			target->sourceTimeColumn = TextDatumGetCString(sourceTimeColumnDatum);
+
+		Datum		sequenceColumnDatum = SPI_getbinval(row, rowDesc, 5, &isNull);
+
+		if (!isNull)
+			target->sequenceColumn = TextDatumGetCString(sequenceColumnDatum);
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return target;
+}
+
+
+/*
+ * CreateMissingPartitions creates partitions of the given size that cover
+ * the range from rangeStart to rangeEnd plus the lookahead. Parts of a
+ * partition that are already covered by (non-default) partitions are left
+ * out, which may split it into several smaller partitions.
+ *
+ * Partitions are aligned to the partition interval, starting at 2001-01-01
+ * in the session time zone, like date_bin.
+ */
+static void
+CreateMissingPartitions(char *pipelineName, PartitionedTarget * target,
+						TimestampTz rangeStart, TimestampTz rangeEnd)
+{
+	/*
+	 * Creating a partition needs an AccessExclusiveLock on the parent. Take a
+	 * self-conflicting lock before looking at the partitions, such that two
+	 * pipelines that write into the same target do not deadlock by upgrading
+	 * their AccessShareLock at the same time. ShareUpdateExclusiveLock does
+	 * not block concurrent writers.
+	 */
+	LockRelationOid(target->targetRelationId, ShareUpdateExclusiveLock);
+
+	Oid			keyTypeId = GetPartitionKeyType(target->targetRelationId);
+
+	TimestampTz endTime =
+		DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+												TimestampTzGetDatum(rangeEnd),
+												IntervalPGetDatum(target->lookahead)));
+	Datum		originDatum =
+		DirectFunctionCall3(timestamptz_in,
+							CStringGetDatum("2001-01-01"),
+							ObjectIdGetDatum(InvalidOid),
+							Int32GetDatum(-1));
+	TimestampTz partitionStart =
+		DatumGetTimestampTz(DirectFunctionCall3(timestamptz_bin,
+												IntervalPGetDatum(target->partitionInterval),
+												TimestampTzGetDatum(rangeStart),
+												originDatum));
+	int			partitionCount = 0;
+
+	while (partitionStart <= endTime)
+	{
+		TimestampTz partitionEnd =
+			DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+													TimestampTzGetDatum(partitionStart),
+													IntervalPGetDatum(target->partitionInterval)));
+
+		TimestampTz createStart = partitionStart;
+		TimestampTz createEnd = partitionEnd;
+
+		while (GetUncoveredRange(target->targetRelationId, keyTypeId,
+								 &createStart, &createEnd))
+		{
+			if (partitionCount >= MAX_PARTITIONS_PER_RANGE)
+				ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+								errmsg("pipeline %s: range requires more than %d new "
+									   "partitions", pipelineName,
+									   MAX_PARTITIONS_PER_RANGE),
+								errhint("Create the partitions manually or use a larger "
+										"partition_interval.")));
+
+			CreatePartition(pipelineName, target->targetRelationId, keyTypeId,
+							createStart, createEnd, target->partitionInterval);
+			partitionCount++;
+
+			/* continue with the rest of the interval, if any */
+			createStart = createEnd;
+			createEnd = partitionEnd;
+		}
+
+		partitionStart = partitionEnd;
+	}
+}
+
+
+/*
+ * GetPartitionKeyType returns the type of the partition key of a range-
+ * partitioned table, or throws an error if it is not a single timestamptz,
+ * timestamp, or date.
+ */
+static Oid
+GetPartitionKeyType(Oid relationId)
+{
+	Relation	relation = relation_open(relationId, AccessShareLock);
+	PartitionKey partitionKey = RelationGetPartitionKey(relation);
+
+	if (partitionKey == NULL ||
+		partitionKey->strategy != PARTITION_STRATEGY_RANGE ||
+		partitionKey->partnatts != 1)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("%s must be range-partitioned by a single column",
+							   RelationGetRelationName(relation))));
+
+	Oid			keyTypeId = get_partition_col_typid(partitionKey, 0);
+
+	if (keyTypeId != TIMESTAMPTZOID && keyTypeId != TIMESTAMPOID && keyTypeId != DATEOID)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("partition key of %s must be of type timestamptz, "
+							   "timestamp, or date",
+							   RelationGetRelationName(relation))));
+
+	relation_close(relation, NoLock);
+
+	return keyTypeId;
+}
+
+
+/*
+ * TimestampTzToPartitionKey converts a timestamptz to a partition key value
+ * of the given type.
+ */
+static Datum
+TimestampTzToPartitionKey(TimestampTz value, Oid keyTypeId)
+{
+	Datum		valueDatum = TimestampTzGetDatum(value);
+
+	switch (keyTypeId)
+	{
+		case TIMESTAMPOID:
+			return DirectFunctionCall1(timestamptz_timestamp, valueDatum);
+
+		case DATEOID:
+			return DirectFunctionCall1(timestamptz_date, valueDatum);
+
+		default:
+			return valueDatum;
+	}
+}
+
+
+/*
+ * PartitionKeyToTimestampTz converts a partition key value of the given type
+ * to a timestamptz.
+ */
+static TimestampTz
+PartitionKeyToTimestampTz(Datum keyValue, Oid keyTypeId)
+{
+	switch (keyTypeId)
+	{
+		case TIMESTAMPOID:
+			return DatumGetTimestampTz(DirectFunctionCall1(timestamp_timestamptz, keyValue));
+
+		case DATEOID:
+			return DatumGetTimestampTz(DirectFunctionCall1(date_timestamptz, keyValue));
+
+		default:
+			return DatumGetTimestampTz(keyValue);
+	}
+}
+
+
+/*
+ * GetUncoveredRange finds the first part of the range from start to end that
+ * is not covered by a partition other than the default partition, and
+ * narrows start and end to it. Returns false if the whole range is covered.
+ */
+static bool
+GetUncoveredRange(Oid relationId, Oid keyTypeId, TimestampTz *start, TimestampTz *end)
+{
+	Relation	relation = relation_open(relationId, AccessShareLock);
+	PartitionKey partitionKey = RelationGetPartitionKey(relation);
+	PartitionDesc partitionDesc = RelationGetPartitionDesc(relation, true);
+	PartitionBoundInfo boundInfo = partitionDesc->boundinfo;
+	bool		isUncovered = false;
+
+	while (*start < *end)
+	{
+		if (partitionDesc->nparts == 0 || boundInfo == NULL)
+		{
+			isUncovered = true;
+			break;
+		}
+
+		Datum		keyValue = TimestampTzToPartitionKey(*start, keyTypeId);
+		bool		isEqual = false;
+		int			boundOffset = partition_range_datum_bsearch(partitionKey->partsupfunc,
+																partitionKey->partcollation,
+																boundInfo, 1, &keyValue,
+																&isEqual);
+
+		/* same logic as get_partition_for_tuple */
+		bool		isCovered = boundInfo->indexes[boundOffset + 1] >= 0;
+
+		/* the segment that contains start ends at the next bound */
+		TimestampTz nextBound = DT_NOEND;
+		int			nextOffset = boundOffset + 1;
+
+		if (nextOffset < boundInfo->ndatums &&
+			boundInfo->kind[nextOffset][0] == PARTITION_RANGE_DATUM_VALUE)
+			nextBound = PartitionKeyToTimestampTz(boundInfo->datums[nextOffset][0],
+												  keyTypeId);
+		else if (nextOffset < boundInfo->ndatums &&
+				 boundInfo->kind[nextOffset][0] == PARTITION_RANGE_DATUM_MINVALUE)
+			nextBound = DT_NOBEGIN;
+
+		if (isCovered)
+		{
+			if (nextBound <= *start)
+				break;
+
+			*start = nextBound;
+			continue;
+		}
+
+		if (nextBound > *start && nextBound < *end)
+			*end = nextBound;
+
+		isUncovered = true;
+		break;
+	}
+
+	relation_close(relation, NoLock);
+
+	return isUncovered;
+}
+
+
+/*
+ * CreatePartition creates a partition of the given relation for the range
+ * from partitionStart to partitionEnd, named after the relation and the
+ * start of the range.
+ */
+static void
+CreatePartition(char *pipelineName, Oid relationId, Oid keyTypeId,
+				TimestampTz partitionStart, TimestampTz partitionEnd,
+				Interval *partitionInterval)
+{
+	text	   *timeOfDayText =
+		DatumGetTextPP(DirectFunctionCall2(timestamptz_to_char,
+										   TimestampTzGetDatum(partitionStart),
+										   CStringGetTextDatum("HH24MISS")));
+
+	/* partitions that start within a day are clipped by existing partitions */
+	bool		startsAtMidnight = strcmp(text_to_cstring(timeOfDayText), "000000") == 0;
+	char	   *suffixFormat = partitionInterval->time % USECS_PER_DAY == 0 && startsAtMidnight ?
+		"YYYYMMDD" : "YYYYMMDD\"_\"HH24MISS";
+	text	   *suffixText =
+		DatumGetTextPP(DirectFunctionCall2(timestamptz_to_char,
+										   TimestampTzGetDatum(partitionStart),
+										   CStringGetTextDatum(suffixFormat)));
+	char	   *suffix = text_to_cstring(suffixText);
+	char	   *relationName = get_rel_name(relationId);
+	char	   *schemaName = get_namespace_name(get_rel_namespace(relationId));
+
+	/* truncate the relation name to leave room for the suffix */
+	int			maxPrefixLength = NAMEDATALEN - 1 - strlen(suffix) - 2;
+	char	   *partitionName = psprintf("%s_p%s",
+										 pnstrdup(relationName, maxPrefixLength),
+										 suffix);
+
+	Oid			typeOutput = InvalidOid;
+	bool		isVarlena = false;
+
+	getTypeOutputInfo(keyTypeId, &typeOutput, &isVarlena);
+
+	char	   *startValue =
+		OidOutputFunctionCall(typeOutput, TimestampTzToPartitionKey(partitionStart, keyTypeId));
+	char	   *endValue =
+		OidOutputFunctionCall(typeOutput, TimestampTzToPartitionKey(partitionEnd, keyTypeId));
+
+	char	   *command =
+		psprintf("CREATE TABLE %s PARTITION OF %s FOR VALUES FROM (%s) TO (%s)",
+				 quote_qualified_identifier(schemaName, partitionName),
+				 quote_qualified_identifier(schemaName, relationName),
+				 quote_literal_cstr(startValue),
+				 quote_literal_cstr(endValue));
+
+	ereport(NOTICE, (errmsg("pipeline %s: creating partition %s for values from %s to %s",
+							pipelineName, partitionName, startValue, endValue)));
+
+	SPI_connect();
+	SPI_execute(command, false, 0);
+	SPI_finish();
+
+	/* make the new partition visible to the next coverage check */
+	CommandCounterIncrement();
+}
+
+
+/*
+ * GetSequenceColumnForPipeline returns the name of the column that owns the
+ * sequence of a sequence pipeline.
+ */
+static char *
+GetSequenceColumnForPipeline(char *pipelineName)
+{
+	char	   *query =
+		"select sequence_name "
+		"from incremental.sequence_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	bool		isNull = true;
+	Oid			sequenceId = InvalidOid;
+
+	if (SPI_processed > 0)
+	{
+		Datum		sequenceDatum = SPI_getbinval(SPI_tuptable->vals[0],
+												  SPI_tuptable->tupdesc, 1, &isNull);
+
+		if (!isNull)
+			sequenceId = DatumGetObjectId(sequenceDatum);
+	}
+
+	SPI_finish();
+
+	Oid			sequenceRelationId = InvalidOid;
+	int32		sequenceColumnNumber = 0;
+
+	if (!OidIsValid(sequenceId) ||
+		(!sequenceIsOwned(sequenceId, DEPENDENCY_AUTO, &sequenceRelationId, &sequenceColumnNumber) &&
+		 !sequenceIsOwned(sequenceId, DEPENDENCY_INTERNAL, &sequenceRelationId, &sequenceColumnNumber)))
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("source_time_column requires a sequence that is owned by "
+							   "the source table")));
+
+	return get_attname(sequenceRelationId, sequenceColumnNumber, false);
+}
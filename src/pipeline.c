@@ -6,12 +6,23 @@
 #include "catalog/namespace.h"
 #include "catalog/pg_authid.h"
 #include "crunchy/incremental/cron.h"
+#include "crunchy/incremental/dimension.h"
 #include "crunchy/incremental/file_list.h"
+#include "crunchy/incremental/file_tail.h"
+#include "crunchy/incremental/foreign_source.h"
+#include "crunchy/incremental/join.h"
+#include "crunchy/incremental/maintenance.h"
+#include "crunchy/incremental/offset.h"
 #include "crunchy/incremental/pipeline.h"
 #include "crunchy/incremental/query.h"
+#include "crunchy/incremental/remote_sink.h"
+#include "crunchy/incremental/rollup.h"
 #include "crunchy/incremental/sequence.h"
+#include "crunchy/incremental/stats.h"
+#include "crunchy/incremental/time_bucket.h"
 #include "crunchy/incremental/time_interval.h"
 #include "executor/spi.h"
+#include "nodes/parsenodes.h"
 #include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "utils/builtins.h"
@@ -20,12 +31,10 @@
 #include "utils/ruleutils.h"
 
 static void InsertPipeline(char *pipelineName, PipelineType pipelineType, Oid sourceRelationId,
-						   char *command, char *searchPath);
-static void EnsurePipelineOwner(char *pipelineName, Oid ownerId);
-static void ExecutePipeline(char *pipelineName, PipelineType pipelineType,
-							char *command, char *searchPath);
+						   Oid targetRelationId, char *command, char *searchPath);
 static void ResetPipeline(char *pipelineName, PipelineType pipelineType);
 static void DeletePipeline(char *pipelineName);
+static void BackfillTargetRelation(char *pipelineName, char *command, char *searchPath);
 static char *GetCronJobNameForPipeline(char *pipelineName);
 static char *GetCronCommandForPipeline(char *pipelineName);
 
@@ -33,12 +42,22 @@ static char *GetCronCommandForPipeline(char *pipelineName);
 PG_FUNCTION_INFO_V1(incremental_create_sequence_pipeline);
 PG_FUNCTION_INFO_V1(incremental_create_time_interval_pipeline);
 PG_FUNCTION_INFO_V1(incremental_create_file_list_pipeline);
+PG_FUNCTION_INFO_V1(incremental_create_file_tail_pipeline);
+PG_FUNCTION_INFO_V1(incremental_create_time_bucket_pipeline);
+PG_FUNCTION_INFO_V1(incremental_create_join_pipeline);
+PG_FUNCTION_INFO_V1(incremental_create_offset_pipeline);
+PG_FUNCTION_INFO_V1(incremental_create_rollup_pipeline);
 PG_FUNCTION_INFO_V1(incremental_skip_file);
 PG_FUNCTION_INFO_V1(incremental_execute_pipeline);
 PG_FUNCTION_INFO_V1(incremental_reset_pipeline);
 PG_FUNCTION_INFO_V1(incremental_drop_pipeline);
 
 
+/* search_path and GUC nest level of the current pipeline execution */
+static char *CurrentSearchPath = NULL;
+static int	CurrentGucNestLevel = 0;
+
+
 /*
  * incremental_create_sequence_pipeline creates a new pipeline that tracks
  * a sequence.
@@ -46,6 +65,10 @@ PG_FUNCTION_INFO_V1(incremental_drop_pipeline);
 Datum
 incremental_create_sequence_pipeline(PG_FUNCTION_ARGS)
 {
+	if (PG_NARGS() != 6)
+		ereport(ERROR, (errmsg("extension needs to be updated"),
+						errhint("Run ALTER EXTENSION pg_incremental UPDATE")));
+
 	/*
 	 * create_sequence_pipeline is not strict because the last argument can be
 	 * NULL, so check the arguments that cannot be NULL.
@@ -62,10 +85,12 @@ incremental_create_sequence_pipeline(PG_FUNCTION_ARGS)
 	char	   *command = text_to_cstring(PG_GETARG_TEXT_P(2));
 	char	   *schedule = PG_ARGISNULL(3) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(3));
 	bool		executeImmediately = PG_ARGISNULL(4) ? false : PG_GETARG_BOOL(4);
+	char	   *watermarkName = PG_ARGISNULL(5) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(5));
 
 	char	   *searchPath = pstrdup(namespace_search_path);
 
 	Oid			sourceRelationId = InvalidOid;
+	bool		foreignSource = false;
 
 	switch (get_rel_relkind(sequenceId))
 	{
@@ -92,8 +117,23 @@ incremental_create_sequence_pipeline(PG_FUNCTION_ARGS)
 			{
 				sourceRelationId = sequenceId;
 
-				/* user entered a table name, see if it has a single sequence */
-				sequenceId = FindSequenceForRelation(sourceRelationId);
+				/*
+				 * User entered a table name, see if it has a single sequence.
+				 * With a watermark, the sequence is not used and the table
+				 * might not have one (e.g. on a logical replication
+				 * subscriber). A foreign table has no local sequence, so we
+				 * ask the remote server for a safe sequence number instead.
+				 */
+				if (watermarkName != NULL)
+					sequenceId = InvalidOid;
+				else if (get_rel_relkind(sourceRelationId) == RELKIND_FOREIGN_TABLE)
+				{
+					EnsureForeignSourceSupported(sourceRelationId);
+					sequenceId = InvalidOid;
+					foreignSource = true;
+				}
+				else
+					sequenceId = FindSequenceForRelation(sourceRelationId);
 				break;
 			}
 
@@ -104,16 +144,22 @@ incremental_create_sequence_pipeline(PG_FUNCTION_ARGS)
 			}
 	}
 
+	/* only the owner of a watermark controls the ranges of pipelines using it */
+	if (watermarkName != NULL)
+		EnsureWatermarkOwner(watermarkName);
+
 	List	   *paramTypes = list_make2_oid(INT8OID, INT8OID);
 
 	/* validate the query */
-	ParseQuery(command, paramTypes);
+	Query	   *parsedQuery = ParseQuery(command, paramTypes);
 
-	InsertPipeline(pipelineName, SEQUENCE_RANGE_PIPELINE, sourceRelationId, command, searchPath);
-	InitializeSequencePipelineState(pipelineName, sequenceId);
+	InsertPipeline(pipelineName, SEQUENCE_RANGE_PIPELINE, sourceRelationId,
+				   GetTargetRelationId(parsedQuery), command, searchPath);
+	InitializeSequencePipelineState(pipelineName, sequenceId, watermarkName,
+									foreignSource);
 
 	if (executeImmediately)
-		ExecutePipeline(pipelineName, SEQUENCE_RANGE_PIPELINE, command, searchPath);
+		ExecutePipeline(pipelineName, SEQUENCE_RANGE_PIPELINE, command, searchPath, false);
 
 	if (schedule != NULL)
 	{
@@ -138,6 +184,10 @@ incremental_create_sequence_pipeline(PG_FUNCTION_ARGS)
 Datum
 incremental_create_time_interval_pipeline(PG_FUNCTION_ARGS)
 {
+	if (PG_NARGS() != 10)
+		ereport(ERROR, (errmsg("extension needs to be updated"),
+						errhint("Run ALTER EXTENSION pg_incremental UPDATE")));
+
 	/*
 	 * create_time_range_pipeline is not strict because the last argument can
 	 * be NULL, so check the arguments that cannot be NULL.
@@ -160,9 +210,18 @@ incremental_create_time_interval_pipeline(PG_FUNCTION_ARGS)
 	char	   *schedule = PG_ARGISNULL(6) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(6));
 	Interval   *minDelay = PG_GETARG_INTERVAL_P(7);
 	bool		executeImmediately = PG_ARGISNULL(8) ? false : PG_GETARG_BOOL(8);
+	TimeParameterType parameterType = PG_ARGISNULL(9) ? TIME_PARAMETER_TIMESTAMPTZ :
+		ParseTimeParameterType(text_to_cstring(PG_GETARG_TEXT_P(9)));
 
 	char	   *searchPath = pstrdup(namespace_search_path);
 
+	if (parameterType == TIME_PARAMETER_DATE && timeInterval->time != 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("time_interval must be a whole number of days when "
+							   "parameter_type is date")));
+	}
+
 	if (!batched && PG_ARGISNULL(4))
 	{
 		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
@@ -171,16 +230,19 @@ incremental_create_time_interval_pipeline(PG_FUNCTION_ARGS)
 								  "starting from the start_time")));
 	}
 
-	List	   *paramTypes = list_make2_oid(TIMESTAMPTZOID, TIMESTAMPTZOID);
+	Oid			paramTypeId = TimeParameterTypeId(parameterType);
+	List	   *paramTypes = list_make2_oid(paramTypeId, paramTypeId);
 
 	/* validate the query */
-	ParseQuery(command, paramTypes);
+	Query	   *parsedQuery = ParseQuery(command, paramTypes);
 
-	InsertPipeline(pipelineName, TIME_INTERVAL_PIPELINE, relationId, command, searchPath);
-	InitializeTimeRangePipelineState(pipelineName, batched, startTime, timeInterval, minDelay);
+	InsertPipeline(pipelineName, TIME_INTERVAL_PIPELINE, relationId,
+				   GetTargetRelationId(parsedQuery), command, searchPath);
+	InitializeTimeRangePipelineState(pipelineName, batched, startTime, timeInterval, minDelay,
+									 parameterType);
 
 	if (executeImmediately)
-		ExecutePipeline(pipelineName, TIME_INTERVAL_PIPELINE, command, searchPath);
+		ExecutePipeline(pipelineName, TIME_INTERVAL_PIPELINE, command, searchPath, false);
 
 	if (schedule != NULL)
 	{
@@ -205,7 +267,7 @@ incremental_create_time_interval_pipeline(PG_FUNCTION_ARGS)
 Datum
 incremental_create_file_list_pipeline(PG_FUNCTION_ARGS)
 {
-	if (PG_NARGS() != 8)
+	if (PG_NARGS() != 10)
 		ereport(ERROR, (errmsg("extension needs to be updated"),
 						errhint("Run ALTER EXTENSION pg_incremental UPDATE")));
 	if (PG_ARGISNULL(0))
@@ -216,6 +278,8 @@ incremental_create_file_list_pipeline(PG_FUNCTION_ARGS)
 		ereport(ERROR, (errmsg("command cannot be NULL")));
 	if (!PG_ARGISNULL(5) && PG_GETARG_INT32(5) <= 0)
 		ereport(ERROR, (errmsg("max_batch_size must be positive or NULL")));
+	if (!PG_ARGISNULL(8) && PG_GETARG_INT32(8) <= 0)
+		ereport(ERROR, (errmsg("batches_per_commit must be positive or NULL")));
 
 	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
 	char	   *prefix = text_to_cstring(PG_GETARG_TEXT_P(1));
@@ -225,6 +289,8 @@ incremental_create_file_list_pipeline(PG_FUNCTION_ARGS)
 	int			maxBatchSize = PG_ARGISNULL(5) ? 0 : PG_GETARG_INT32(5);
 	char	   *schedule = PG_ARGISNULL(6) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(6));
 	bool		executeImmediately = PG_ARGISNULL(7) ? false : PG_GETARG_BOOL(7);
+	int			batchesPerCommit = PG_ARGISNULL(8) ? 0 : PG_GETARG_INT32(8);
+	Interval   *cleanupGracePeriod = PG_ARGISNULL(9) ? NULL : PG_GETARG_INTERVAL_P(9);
 	char	   *searchPath = pstrdup(namespace_search_path);
 
 	/* validate and sanitize function name */
@@ -238,13 +304,372 @@ incremental_create_file_list_pipeline(PG_FUNCTION_ARGS)
 		paramTypes = list_make1_oid(TEXTOID);
 
 	/* validate the query */
-	ParseQuery(command, paramTypes);
+	Query	   *parsedQuery = ParseQuery(command, paramTypes);
+
+	InsertPipeline(pipelineName, FILE_LIST_PIPELINE, InvalidOid,
+				   GetTargetRelationId(parsedQuery), command, searchPath);
+	InitializeFileListPipelineState(pipelineName, prefix, batched, listFunction, maxBatchSize,
+									batchesPerCommit, cleanupGracePeriod);
+
+	if (executeImmediately)
+		ExecutePipeline(pipelineName, FILE_LIST_PIPELINE, command, searchPath, false);
+
+	if (schedule != NULL)
+	{
+		char	   *jobName = GetCronJobNameForPipeline(pipelineName);
+		char	   *cronCommand = GetCronCommandForPipeline(pipelineName);
+
+		int64		jobId = ScheduleCronJob(jobName, schedule, cronCommand);
+
+		ereport(NOTICE, (errmsg("pipeline %s: scheduled cron job with ID " INT64_FORMAT
+								" and schedule %s",
+								pipelineName, jobId, schedule)));
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * incremental_create_file_tail_pipeline creates a new pipeline that processes
+ * bytes appended to local files.
+ */
+Datum
+incremental_create_file_tail_pipeline(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (PG_ARGISNULL(1))
+		ereport(ERROR, (errmsg("file_pattern cannot be NULL")));
+	if (PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("command cannot be NULL")));
+	if (!PG_ARGISNULL(3) && PG_GETARG_INT64(3) <= 0)
+		ereport(ERROR, (errmsg("max_batch_bytes must be positive or NULL")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char	   *filePattern = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char	   *command = text_to_cstring(PG_GETARG_TEXT_P(2));
+	int64		maxBatchBytes = PG_ARGISNULL(3) ? 0 : PG_GETARG_INT64(3);
+	char	   *schedule = PG_ARGISNULL(4) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(4));
+	bool		executeImmediately = PG_ARGISNULL(5) ? false : PG_GETARG_BOOL(5);
+	char	   *searchPath = pstrdup(namespace_search_path);
+
+	/* tail pipelines read server files */
+	EnsureFileTailPrivileges();
+
+	if (!is_absolute_path(filePattern))
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("file_pattern must be an absolute path")));
+
+	List	   *paramTypes = list_make3_oid(TEXTOID, INT8OID, INT8OID);
+
+	/* validate the query */
+	Query	   *parsedQuery = ParseQuery(command, paramTypes);
+
+	InsertPipeline(pipelineName, FILE_TAIL_PIPELINE, InvalidOid,
+				   GetTargetRelationId(parsedQuery), command, searchPath);
+	InitializeFileTailPipelineState(pipelineName, filePattern, maxBatchBytes);
+
+	if (executeImmediately)
+		ExecutePipeline(pipelineName, FILE_TAIL_PIPELINE, command, searchPath, false);
+
+	if (schedule != NULL)
+	{
+		char	   *jobName = GetCronJobNameForPipeline(pipelineName);
+		char	   *cronCommand = GetCronCommandForPipeline(pipelineName);
+
+		int64		jobId = ScheduleCronJob(jobName, schedule, cronCommand);
+
+		ereport(NOTICE, (errmsg("pipeline %s: scheduled cron job with ID " INT64_FORMAT
+								" and schedule %s",
+								pipelineName, jobId, schedule)));
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * incremental_create_time_bucket_pipeline creates a new pipeline that stages
+ * safe sequence ranges and processes time buckets once they are closed.
+ */
+Datum
+incremental_create_time_bucket_pipeline(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (PG_ARGISNULL(1))
+		ereport(ERROR, (errmsg("source_table_name cannot be NULL")));
+	if (PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("time_column cannot be NULL")));
+	if (PG_ARGISNULL(3))
+		ereport(ERROR, (errmsg("staging_table_name cannot be NULL")));
+	if (PG_ARGISNULL(4))
+		ereport(ERROR, (errmsg("command cannot be NULL")));
+	if (PG_ARGISNULL(5))
+		ereport(ERROR, (errmsg("time_interval cannot be NULL")));
+	if (PG_ARGISNULL(6))
+		ereport(ERROR, (errmsg("allowed_lateness cannot be NULL")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	Oid			sourceRelationId = PG_GETARG_OID(1);
+	char	   *timeColumn = text_to_cstring(PG_GETARG_TEXT_P(2));
+	Oid			stagingRelationId = PG_GETARG_OID(3);
+	char	   *command = text_to_cstring(PG_GETARG_TEXT_P(4));
+	Interval   *timeInterval = PG_GETARG_INTERVAL_P(5);
+	Interval   *allowedLateness = PG_GETARG_INTERVAL_P(6);
+	char	   *correctionCommand = PG_ARGISNULL(7) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(7));
+	Interval   *idleTimeout = PG_ARGISNULL(8) ? NULL : PG_GETARG_INTERVAL_P(8);
+	char	   *schedule = PG_ARGISNULL(9) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(9));
+	bool		executeImmediately = PG_ARGISNULL(10) ? false : PG_GETARG_BOOL(10);
+
+	char	   *searchPath = pstrdup(namespace_search_path);
+
+	if (timeInterval->month != 0)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("time_interval cannot contain months or years")));
+
+	/* find the sequence column, rows are staged in sequence ranges */
+	Oid			sequenceId = FindSequenceForRelation(sourceRelationId);
+	Oid			sequenceRelationId = InvalidOid;
+	int32		sequenceColumnNumber = 0;
+
+	if (!sequenceIsOwned(sequenceId, DEPENDENCY_AUTO, &sequenceRelationId, &sequenceColumnNumber) &&
+		!sequenceIsOwned(sequenceId, DEPENDENCY_INTERNAL, &sequenceRelationId, &sequenceColumnNumber))
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("only sequences that are owned by a table are supported")));
+
+	char	   *sequenceColumn = get_attname(sourceRelationId, sequenceColumnNumber, false);
+
+	/* both tables need a timestamptz event time column */
+	Oid			tableIds[] = {sourceRelationId, stagingRelationId};
+
+	for (int tableIndex = 0; tableIndex < lengthof(tableIds); tableIndex++)
+	{
+		AttrNumber	timeAttNum = get_attnum(tableIds[tableIndex], timeColumn);
+
+		if (timeAttNum == InvalidAttrNumber)
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+							errmsg("column \"%s\" of relation \"%s\" does not exist",
+								   timeColumn, get_rel_name(tableIds[tableIndex]))));
+
+		if (get_atttype(tableIds[tableIndex], timeAttNum) != TIMESTAMPTZOID)
+			ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH),
+							errmsg("column \"%s\" of relation \"%s\" must be of type "
+								   "timestamptz",
+								   timeColumn, get_rel_name(tableIds[tableIndex]))));
+	}
+
+	/* rows are copied into the staging table by column name */
+	EnsureStagingColumnsMatch(sourceRelationId, stagingRelationId);
+
+	/* validate the queries */
+	Query	   *parsedQuery = ParseQuery(command, list_make2_oid(TIMESTAMPTZOID, TIMESTAMPTZOID));
+
+	if (correctionCommand != NULL)
+		ParseQuery(correctionCommand, list_make3_oid(INT8OID, INT8OID, TIMESTAMPTZOID));
+
+	InsertPipeline(pipelineName, TIME_BUCKET_PIPELINE, sourceRelationId,
+				   GetTargetRelationId(parsedQuery), command, searchPath);
+	InitializeSequencePipelineState(pipelineName, sequenceId, NULL, false);
+	InitializeTimeBucketPipelineState(pipelineName, sequenceColumn, timeColumn,
+									  stagingRelationId, timeInterval, allowedLateness,
+									  correctionCommand, idleTimeout);
+
+	if (executeImmediately)
+		ExecutePipeline(pipelineName, TIME_BUCKET_PIPELINE, command, searchPath, false);
+
+	if (schedule != NULL)
+	{
+		char	   *jobName = GetCronJobNameForPipeline(pipelineName);
+		char	   *cronCommand = GetCronCommandForPipeline(pipelineName);
+
+		int64		jobId = ScheduleCronJob(jobName, schedule, cronCommand);
+
+		ereport(NOTICE, (errmsg("pipeline %s: scheduled cron job with ID " INT64_FORMAT
+								" and schedule %s",
+								pipelineName, jobId, schedule)));
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * incremental_create_join_pipeline creates a new pipeline that joins new rows
+ * in two append-only tables with each other and with the rows that arrived
+ * within the join window.
+ */
+Datum
+incremental_create_join_pipeline(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (PG_ARGISNULL(1))
+		ereport(ERROR, (errmsg("left_table_name cannot be NULL")));
+	if (PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("right_table_name cannot be NULL")));
+	if (PG_ARGISNULL(3))
+		ereport(ERROR, (errmsg("command cannot be NULL")));
+	if (PG_ARGISNULL(4))
+		ereport(ERROR, (errmsg("join_window cannot be NULL")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	Oid			leftRelationId = PG_GETARG_OID(1);
+	Oid			rightRelationId = PG_GETARG_OID(2);
+	char	   *command = text_to_cstring(PG_GETARG_TEXT_P(3));
+	Interval   *joinWindow = PG_GETARG_INTERVAL_P(4);
+	char	   *schedule = PG_ARGISNULL(5) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(5));
+	bool		executeImmediately = PG_ARGISNULL(6) ? false : PG_GETARG_BOOL(6);
+
+	char	   *searchPath = pstrdup(namespace_search_path);
+
+	/* both tables need a sequence to track new rows */
+	Oid			leftSequenceId = FindSequenceForRelation(leftRelationId);
+	Oid			rightSequenceId = FindSequenceForRelation(rightRelationId);
+
+	/* validate the query */
+	List	   *paramTypes = list_make4_oid(INT8OID, INT8OID, INT8OID, INT8OID);
+
+	paramTypes = lappend_oid(paramTypes, INT8OID);
+	paramTypes = lappend_oid(paramTypes, INT8OID);
+
+	Query	   *parsedQuery = ParseQuery(command, paramTypes);
+
+	InsertPipeline(pipelineName, JOIN_PIPELINE, leftRelationId,
+				   GetTargetRelationId(parsedQuery), command, searchPath);
+	InitializeSequencePipelineState(pipelineName, leftSequenceId, NULL, false);
+	InitializeJoinPipelineState(pipelineName, rightRelationId, rightSequenceId, joinWindow);
+
+	if (executeImmediately)
+		ExecutePipeline(pipelineName, JOIN_PIPELINE, command, searchPath, false);
+
+	if (schedule != NULL)
+	{
+		char	   *jobName = GetCronJobNameForPipeline(pipelineName);
+		char	   *cronCommand = GetCronCommandForPipeline(pipelineName);
+
+		int64		jobId = ScheduleCronJob(jobName, schedule, cronCommand);
+
+		ereport(NOTICE, (errmsg("pipeline %s: scheduled cron job with ID " INT64_FORMAT
+								" and schedule %s",
+								pipelineName, jobId, schedule)));
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * incremental_create_offset_pipeline creates a new pipeline that consumes
+ * rows from a user-defined fetch function that pages by an opaque offset.
+ */
+Datum
+incremental_create_offset_pipeline(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (PG_ARGISNULL(1))
+		ereport(ERROR, (errmsg("fetch_function cannot be NULL")));
+	if (PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("command cannot be NULL")));
+	if (PG_ARGISNULL(3) || PG_GETARG_INT32(3) <= 0)
+		ereport(ERROR, (errmsg("batch_size must be positive")));
+	if (PG_ARGISNULL(4) || PG_GETARG_INT32(4) <= 0)
+		ereport(ERROR, (errmsg("max_rows_per_run must be positive")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char	   *fetchFunction = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char	   *command = text_to_cstring(PG_GETARG_TEXT_P(2));
+	int			batchSize = PG_GETARG_INT32(3);
+	int			maxRowsPerRun = PG_GETARG_INT32(4);
+	char	   *startOffset = PG_ARGISNULL(5) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(5));
+	char	   *schedule = PG_ARGISNULL(6) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(6));
+	bool		executeImmediately = PG_ARGISNULL(7) ? false : PG_GETARG_BOOL(7);
+
+	char	   *searchPath = pstrdup(namespace_search_path);
+
+	/* validate and sanitize function name */
+	fetchFunction = SanitizeFetchFunction(fetchFunction);
+
+	/* validate the query, the command is the last CTE */
+	char	   *batchQuery = BuildOffsetBatchQuery(fetchFunction, command);
+	Query	   *parsedQuery = ParseQuery(batchQuery, list_make2_oid(TEXTOID, INT4OID));
+	CommonTableExpr *commandCte = (CommonTableExpr *) llast(parsedQuery->cteList);
+
+	if (((Query *) commandCte->ctequery)->commandType == CMD_SELECT)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("command of an offset pipeline must modify a table")));
+
+	InsertPipeline(pipelineName, OFFSET_PIPELINE, InvalidOid,
+				   GetTargetRelationId(parsedQuery), command, searchPath);
+	InitializeOffsetPipelineState(pipelineName, fetchFunction, batchSize, maxRowsPerRun,
+								  startOffset);
+
+	if (executeImmediately)
+		ExecutePipeline(pipelineName, OFFSET_PIPELINE, command, searchPath, false);
+
+	if (schedule != NULL)
+	{
+		char	   *jobName = GetCronJobNameForPipeline(pipelineName);
+		char	   *cronCommand = GetCronCommandForPipeline(pipelineName);
+
+		int64		jobId = ScheduleCronJob(jobName, schedule, cronCommand);
+
+		ereport(NOTICE, (errmsg("pipeline %s: scheduled cron job with ID " INT64_FORMAT
+								" and schedule %s",
+								pipelineName, jobId, schedule)));
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * incremental_create_rollup_pipeline creates a new pipeline that aggregates
+ * new rows in a source table by a set of dimensions, and merges the results
+ * into a target table without a user-defined command.
+ */
+Datum
+incremental_create_rollup_pipeline(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (PG_ARGISNULL(1))
+		ereport(ERROR, (errmsg("source_table_name cannot be NULL")));
+	if (PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("target_table_name cannot be NULL")));
+	if (PG_ARGISNULL(3))
+		ereport(ERROR, (errmsg("dimensions cannot be NULL")));
+	if (PG_ARGISNULL(4))
+		ereport(ERROR, (errmsg("aggregates cannot be NULL")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	Oid			sourceRelationId = PG_GETARG_OID(1);
+	Oid			targetRelationId = PG_GETARG_OID(2);
+	ArrayType  *dimensions = PG_GETARG_ARRAYTYPE_P(3);
+	ArrayType  *aggregates = PG_GETARG_ARRAYTYPE_P(4);
+	char	   *schedule = PG_ARGISNULL(5) ? NULL : text_to_cstring(PG_GETARG_TEXT_P(5));
+	bool		executeImmediately = PG_ARGISNULL(6) ? false : PG_GETARG_BOOL(6);
+
+	char	   *searchPath = pstrdup(namespace_search_path);
+
+	/* the source table needs a sequence to track new rows */
+	Oid			sequenceId = FindSequenceForRelation(sourceRelationId);
+
+	/* build and validate the scan and merge commands */
+	RollupDefinition *definition = BuildRollupDefinition(sourceRelationId, sequenceId,
+														 targetRelationId, dimensions,
+														 aggregates);
 
-	InsertPipeline(pipelineName, FILE_LIST_PIPELINE, InvalidOid, command, searchPath);
-	InitializeFileListPipelineState(pipelineName, prefix, batched, listFunction, maxBatchSize);
+	InsertPipeline(pipelineName, ROLLUP_PIPELINE, sourceRelationId, targetRelationId,
+				   definition->mergeCommand, searchPath);
+	InitializeSequencePipelineState(pipelineName, sequenceId, NULL, false);
+	InitializeRollupPipelineState(pipelineName, definition);
 
 	if (executeImmediately)
-		ExecutePipeline(pipelineName, FILE_LIST_PIPELINE, command, searchPath);
+		ExecutePipeline(pipelineName, ROLLUP_PIPELINE, definition->mergeCommand,
+						searchPath, false);
 
 	if (schedule != NULL)
 	{
@@ -286,12 +711,32 @@ incremental_skip_file(PG_FUNCTION_ARGS)
 Datum
 incremental_execute_pipeline(PG_FUNCTION_ARGS)
 {
+	/*
+	 * When called via CALL outside of a transaction block, pipelines may
+	 * commit intermediate progress.
+	 */
+	bool		allowCommit = fcinfo->context != NULL &&
+		IsA(fcinfo->context, CallContext) &&
+		!castNode(CallContext, fcinfo->context)->atomic;
+
+	if (allowCommit)
+		SPI_connect_ext(SPI_OPT_NONATOMIC);
+
 	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
 	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
 
 	EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
+
+	/* pipelines created before version 1.4 do not have a target relation */
+	if (!pipelineDesc->targetRelationChecked)
+		BackfillTargetRelation(pipelineName, pipelineDesc->command,
+							   pipelineDesc->searchPath);
+
 	ExecutePipeline(pipelineName, pipelineDesc->pipelineType, pipelineDesc->command,
-					pipelineDesc->searchPath);
+					pipelineDesc->searchPath, allowCommit);
+
+	if (allowCommit)
+		SPI_finish();
 
 	PG_RETURN_VOID();
 }
@@ -309,10 +754,11 @@ incremental_reset_pipeline(PG_FUNCTION_ARGS)
 
 	EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
 	ResetPipeline(pipelineName, pipelineDesc->pipelineType);
+	RemoveDimensionChanges(pipelineName);
 
 	if (executeImmediately)
 		ExecutePipeline(pipelineName, pipelineDesc->pipelineType, pipelineDesc->command,
-						pipelineDesc->searchPath);
+						pipelineDesc->searchPath, false);
 
 	PG_RETURN_VOID();
 }
@@ -328,7 +774,10 @@ incremental_drop_pipeline(PG_FUNCTION_ARGS)
 	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
 
 	EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
+	RemovePipelineDimensions(pipelineName);
+	ClearRemoteProgress(pipelineName);
 	DeletePipeline(pipelineName);
+	RemovePipelineStats(pipelineName);
 
 	UnscheduleCronJob(GetCronJobNameForPipeline(pipelineName));
 
@@ -341,7 +790,7 @@ incremental_drop_pipeline(PG_FUNCTION_ARGS)
  */
 static void
 InsertPipeline(char *pipelineName, PipelineType pipelineType, Oid sourceRelationId,
-			   char *command, char *searchPath)
+			   Oid targetRelationId, char *command, char *searchPath)
 {
 	Oid			savedUserId = InvalidOid;
 	int			savedSecurityContext = 0;
@@ -355,22 +804,24 @@ InsertPipeline(char *pipelineName, PipelineType pipelineType, Oid sourceRelation
 
 	char	   *query =
 		"insert into incremental.pipelines "
-		"(pipeline_name, pipeline_type, owner_id, source_relation, command, search_path) "
-		"values ($1, $2, $3, $4, $5, $6)";
+		"(pipeline_name, pipeline_type, owner_id, source_relation, command, search_path, "
+		"target_relation) "
+		"values ($1, $2, $3, $4, $5, $6, $7)";
 
 	bool		readOnly = false;
 	int			tupleCount = 0;
-	int			argCount = 6;
-	Oid			argTypes[] = {TEXTOID, CHAROID, OIDOID, OIDOID, TEXTOID, TEXTOID};
+	int			argCount = 7;
+	Oid			argTypes[] = {TEXTOID, CHAROID, OIDOID, OIDOID, TEXTOID, TEXTOID, OIDOID};
 	Datum		argValues[] = {
 		CStringGetTextDatum(pipelineName),
 		CharGetDatum(pipelineType),
 		ObjectIdGetDatum(savedUserId),
 		ObjectIdGetDatum(sourceRelationId),
 		CStringGetTextDatum(command),
-		CStringGetTextDatum(searchPath)
+		CStringGetTextDatum(searchPath),
+		ObjectIdGetDatum(targetRelationId)
 	};
-	char	   *argNulls = "      ";
+	char	   *argNulls = "       ";
 
 	SPI_connect();
 	SPI_execute_with_args(query,
@@ -407,7 +858,8 @@ ReadPipelineDesc(char *pipelineName)
 	MemoryContext callerContext = CurrentMemoryContext;
 
 	char	   *query =
-		"select pipeline_type, owner_id, source_relation, command, search_path "
+		"select pipeline_type, owner_id, source_relation, command, search_path, "
+		"target_relation "
 		"from incremental.pipelines "
 		"where pipeline_name operator(pg_catalog.=) $1";
 
@@ -457,6 +909,14 @@ ReadPipelineDesc(char *pipelineName)
 	if (!isNull)
 		pipelineDesc->searchPath = TextDatumGetCString(searchPathDatum);
 
+	Datum		targetRelationDatum = SPI_getbinval(row, rowDesc, 6, &isNull);
+
+	/* NULL means the pipeline was created before target_relation existed */
+	pipelineDesc->targetRelationChecked = !isNull;
+
+	if (!isNull)
+		pipelineDesc->targetRelationId = DatumGetObjectId(targetRelationDatum);
+
 	MemoryContextSwitchTo(spiContext);
 
 	SPI_finish();
@@ -468,11 +928,73 @@ ReadPipelineDesc(char *pipelineName)
 
 
 
+/*
+ * BackfillTargetRelation records the relation that is modified by the command
+ * of a pipeline that does not have a target relation yet, resolving names
+ * using the search_path of the pipeline. If the command does not modify a
+ * relation, we record 0 such that the command is only parsed once.
+ */
+static void
+BackfillTargetRelation(char *pipelineName, char *command, char *searchPath)
+{
+	int			saveNestLevel = NewGUCNestLevel();
+
+	if (searchPath != NULL)
+	{
+		(void) set_config_option("search_path", searchPath,
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+	}
+
+	Oid			targetRelationId = GetCommandTargetRelationId(command);
+
+	AtEOXact_GUC(true, saveNestLevel);
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"update incremental.pipelines "
+		"set target_relation = $2 "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"and target_relation is null";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, OIDOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		ObjectIdGetDatum(targetRelationId)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
 /*
  * EnsurePipelineOwner throws an error if the current user is not
  * superuser and not the pipeline owner.
  */
-static void
+void
 EnsurePipelineOwner(char *pipelineName, Oid ownerId)
 {
 	if (superuser())
@@ -486,12 +1008,16 @@ EnsurePipelineOwner(char *pipelineName, Oid ownerId)
 
 /*
  * ExecutePipeline executes a pipeline.
+ *
+ * If allowCommit is true, the caller has a non-atomic SPI connection and
+ * the pipeline may call CommitPipelineTransaction to commit its progress.
  */
-static void
+void
 ExecutePipeline(char *pipelineName, PipelineType pipelineType,
-				char *command, char *searchPath)
+				char *command, char *searchPath, bool allowCommit)
 {
-	int			gucNestLevel = NewGUCNestLevel();
+	CurrentSearchPath = searchPath;
+	CurrentGucNestLevel = NewGUCNestLevel();
 
 	if (searchPath != NULL)
 	{
@@ -500,25 +1026,92 @@ ExecutePipeline(char *pipelineName, PipelineType pipelineType,
 								 GUC_ACTION_SAVE, true, 0, false);
 	}
 
-	switch (pipelineType)
+	TimestampTz startTime = GetCurrentTimestamp();
+
+	StartPipelineStats();
+
+	PG_TRY();
 	{
-		case SEQUENCE_RANGE_PIPELINE:
-			ExecuteSequenceRangePipeline(pipelineName, command);
-			break;
+		switch (pipelineType)
+		{
+			case SEQUENCE_RANGE_PIPELINE:
+				ExecuteSequenceRangePipeline(pipelineName, command);
+				break;
 
-		case TIME_INTERVAL_PIPELINE:
-			ExecuteTimeIntervalPipeline(pipelineName, command);
-			break;
+			case TIME_INTERVAL_PIPELINE:
+				ExecuteTimeIntervalPipeline(pipelineName, command);
+				break;
 
-		case FILE_LIST_PIPELINE:
-			ExecuteFileListPipeline(pipelineName, command);
-			break;
+			case FILE_LIST_PIPELINE:
+				ExecuteFileListPipeline(pipelineName, command, allowCommit);
+				break;
 
-		default:
-			elog(ERROR, "unknown pipeline type: %c", pipelineType);
+			case FILE_TAIL_PIPELINE:
+				ExecuteFileTailPipeline(pipelineName, command);
+				break;
+
+			case TIME_BUCKET_PIPELINE:
+				ExecuteTimeBucketPipeline(pipelineName, command);
+				break;
+
+			case JOIN_PIPELINE:
+				ExecuteJoinPipeline(pipelineName, command);
+				break;
+
+			case OFFSET_PIPELINE:
+				ExecuteOffsetPipeline(pipelineName, command);
+				break;
+
+			case ROLLUP_PIPELINE:
+				ExecuteRollupPipeline(pipelineName, command);
+				break;
+
+			default:
+				elog(ERROR, "unknown pipeline type: %c", pipelineType);
+		}
+
+		/* correct the summary for keys whose dimension rows changed */
+		if (pipelineType == SEQUENCE_RANGE_PIPELINE ||
+			pipelineType == TIME_INTERVAL_PIPELINE)
+			ExecuteDimensionCorrections(pipelineName, pipelineType);
+	}
+	PG_CATCH();
+	{
+		RecordPipelineRun(pipelineName, pipelineType, startTime, false);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+
+	RecordPipelineRun(pipelineName, pipelineType, startTime, true);
+
+	if (MaintenanceHintsEnabled())
+		CheckTargetMaintenance(pipelineName);
+
+	AtEOXact_GUC(true, CurrentGucNestLevel);
+
+	CurrentSearchPath = NULL;
+}
 
-	AtEOXact_GUC(true, gucNestLevel);
+
+/*
+ * CommitPipelineTransaction commits the progress of the current pipeline
+ * execution and starts a new transaction. It can only be used when the
+ * pipeline was executed with allowCommit.
+ */
+void
+CommitPipelineTransaction(void)
+{
+	SPI_commit();
+
+	/* commit reverted the search_path, set it again */
+	CurrentGucNestLevel = NewGUCNestLevel();
+
+	if (CurrentSearchPath != NULL)
+	{
+		(void) set_config_option("search_path", CurrentSearchPath,
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+	}
 }
 
 
@@ -532,6 +1125,7 @@ ResetPipeline(char *pipelineName, PipelineType pipelineType)
 	{
 		case SEQUENCE_RANGE_PIPELINE:
 			UpdateLastProcessedSequenceNumber(pipelineName, 0);
+			ClearRemoteProgress(pipelineName);
 			break;
 
 		case TIME_INTERVAL_PIPELINE:
@@ -542,6 +1136,25 @@ ResetPipeline(char *pipelineName, PipelineType pipelineType)
 			RemoveProcessedFileList(pipelineName);
 			break;
 
+		case FILE_TAIL_PIPELINE:
+			RemoveTailedFiles(pipelineName);
+			break;
+
+		case TIME_BUCKET_PIPELINE:
+			ResetTimeBucketPipeline(pipelineName);
+			break;
+
+		case JOIN_PIPELINE:
+			ResetJoinPipeline(pipelineName);
+			break;
+
+		case OFFSET_PIPELINE:
+			ResetOffsetPipeline(pipelineName);
+			break;
+
+		case ROLLUP_PIPELINE:
+			UpdateLastProcessedSequenceNumber(pipelineName, 0);
+			break;
 
 		default:
 			elog(ERROR, "unknown pipeline type: %c", pipelineType);
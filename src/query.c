@@ -1,13 +1,18 @@
 #include "postgres.h"
 
+#include "catalog/namespace.h"
 #include "crunchy/incremental/query.h"
 #include "nodes/pg_list.h"
 #include "nodes/parsenodes.h"
+#include "parser/parsetree.h"
 #include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "utils/ruleutils.h"
 
 
+static Oid	GetRawTargetRelationId(Node *statement);
+
+
 /*
  * ParseQuery parses a query string.
  *
@@ -42,6 +47,147 @@ ParseQuery(char *command, List *paramTypes)
 }
 
 
+/*
+ * GetTargetRelationId returns the relation that is modified by a query,
+ * either directly or in a data-modifying CTE, or InvalidOid if the query
+ * does not modify a relation.
+ */
+Oid
+GetTargetRelationId(Query *query)
+{
+	if (query->resultRelation > 0)
+	{
+		RangeTblEntry *resultRte = rt_fetch(query->resultRelation, query->rtable);
+
+		return resultRte->relid;
+	}
+
+	ListCell   *cteCell = NULL;
+
+	foreach(cteCell, query->cteList)
+	{
+		CommonTableExpr *cte = (CommonTableExpr *) lfirst(cteCell);
+		Oid			targetRelationId = GetTargetRelationId((Query *) cte->ctequery);
+
+		if (OidIsValid(targetRelationId))
+			return targetRelationId;
+	}
+
+	return InvalidOid;
+}
+
+
+/*
+ * GetCommandTargetRelationId returns the relation that is modified by a
+ * command string using only the raw parse tree, such that the parameter
+ * types of the command do not need to be known. Relation names are resolved
+ * using the current search_path.
+ */
+Oid
+GetCommandTargetRelationId(char *command)
+{
+	List	   *parseTreeList = pg_parse_query(command);
+
+	if (list_length(parseTreeList) != 1)
+		return InvalidOid;
+
+	RawStmt    *rawStmt = (RawStmt *) linitial(parseTreeList);
+
+	return GetRawTargetRelationId(rawStmt->stmt);
+}
+
+
+/*
+ * GetRawTargetRelationId returns the relation that is modified by a raw
+ * statement, either directly or in a data-modifying CTE, or InvalidOid.
+ */
+static Oid
+GetRawTargetRelationId(Node *statement)
+{
+	RangeVar   *relation = NULL;
+	WithClause *withClause = NULL;
+
+	switch (nodeTag(statement))
+	{
+		case T_InsertStmt:
+			relation = ((InsertStmt *) statement)->relation;
+			withClause = ((InsertStmt *) statement)->withClause;
+			break;
+
+		case T_UpdateStmt:
+			relation = ((UpdateStmt *) statement)->relation;
+			withClause = ((UpdateStmt *) statement)->withClause;
+			break;
+
+		case T_DeleteStmt:
+			relation = ((DeleteStmt *) statement)->relation;
+			withClause = ((DeleteStmt *) statement)->withClause;
+			break;
+
+		case T_MergeStmt:
+			relation = ((MergeStmt *) statement)->relation;
+			withClause = ((MergeStmt *) statement)->withClause;
+			break;
+
+		case T_SelectStmt:
+			withClause = ((SelectStmt *) statement)->withClause;
+			break;
+
+		default:
+			return InvalidOid;
+	}
+
+	if (relation != NULL)
+		return RangeVarGetRelid(relation, NoLock, true);
+
+	if (withClause == NULL)
+		return InvalidOid;
+
+	ListCell   *cteCell = NULL;
+
+	foreach(cteCell, withClause->ctes)
+	{
+		CommonTableExpr *cte = (CommonTableExpr *) lfirst(cteCell);
+		Oid			targetRelationId = GetRawTargetRelationId(cte->ctequery);
+
+		if (OidIsValid(targetRelationId))
+			return targetRelationId;
+	}
+
+	return InvalidOid;
+}
+
+
+/*
+ * ReplaceTargetRelation changes the relation that is modified by a query,
+ * either directly or in a data-modifying CTE, to the given relation.
+ * Returns false if the query does not modify a relation.
+ */
+bool
+ReplaceTargetRelation(Query *query, Oid newRelationId)
+{
+	if (query->resultRelation > 0)
+	{
+		RangeTblEntry *resultRte = rt_fetch(query->resultRelation, query->rtable);
+
+		resultRte->relid = newRelationId;
+		return true;
+	}
+
+	ListCell   *cteCell = NULL;
+
+	foreach(cteCell, query->cteList)
+	{
+		CommonTableExpr *cte = (CommonTableExpr *) lfirst(cteCell);
+
+		if (ReplaceTargetRelation((Query *) cte->ctequery, newRelationId))
+			return true;
+	}
+
+	return false;
+}
+
+
 /*
  * DeparsQuery deparses a Query AST.
  */
@@ -0,0 +1,329 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "crunchy/incremental/remote_connection.h"
+#include "libpq-fe.h"
+#include "mb/pg_wchar.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "utils/builtins.h"
+#include "utils/float.h"
+#include "utils/guc.h"
+
+
+static int	WaitForRemoteSocket(PGconn *connection, int socketEvents);
+static bool FlushRemoteConnection(PGconn *connection);
+
+
+/*
+ * ConnectToRemoteServer opens a connection to a remote server while checking
+ * for interrupts, such that a pipeline waiting on an unresponsive server can
+ * be cancelled. The caller checks the status of the returned connection.
+ */
+PGconn *
+ConnectToRemoteServer(const char *const *keywords, const char *const *values,
+					  bool expandDbname)
+{
+	PGconn	   *connection = PQconnectStartParams(keywords, values, expandDbname);
+
+	if (connection == NULL || PQstatus(connection) == CONNECTION_BAD)
+		return connection;
+
+	PG_TRY();
+	{
+		PostgresPollingStatusType pollStatus = PGRES_POLLING_WRITING;
+
+		while (pollStatus != PGRES_POLLING_OK && pollStatus != PGRES_POLLING_FAILED)
+		{
+			int			socketEvent = pollStatus == PGRES_POLLING_READING ?
+				WL_SOCKET_READABLE : WL_SOCKET_WRITEABLE;
+			int			events = WaitForRemoteSocket(connection, socketEvent);
+
+			if (events & socketEvent)
+				pollStatus = PQconnectPoll(connection);
+		}
+	}
+	PG_CATCH();
+	{
+		PQfinish(connection);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (PQstatus(connection) == CONNECTION_OK)
+		PQsetnonblocking(connection, 1);
+
+	return connection;
+}
+
+
+/*
+ * ConfigureRemoteSession makes the remote session interpret values in the
+ * same encoding and formats in which SetTransmissionModes outputs them.
+ */
+void
+ConfigureRemoteSession(PGconn *connection)
+{
+	char	   *commands[] = {
+		psprintf("SET client_encoding = %s",
+				 quote_literal_cstr(GetDatabaseEncodingName())),
+		"SET datestyle = ISO",
+		"SET intervalstyle = postgres",
+		"SET extra_float_digits = 3"
+	};
+
+	for (int commandIndex = 0; commandIndex < lengthof(commands); commandIndex++)
+	{
+		PGresult   *result = ExecuteRemoteQuery(connection, commands[commandIndex], 0, NULL);
+
+		if (PQresultStatus(result) != PGRES_COMMAND_OK)
+		{
+			char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+			PQclear(result);
+
+			ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+							errmsg("could not configure remote session: %s",
+								   commands[commandIndex]),
+							errdetail_internal("%s", errorMessage)));
+		}
+
+		PQclear(result);
+	}
+}
+
+
+/*
+ * SetTransmissionModes makes the local session output values in formats that
+ * do not depend on user settings, and returns the GUC nest level to pass to
+ * ResetTransmissionModes.
+ */
+int
+SetTransmissionModes(void)
+{
+	int			nestLevel = NewGUCNestLevel();
+
+	if (DateStyle != USE_ISO_DATES)
+		(void) set_config_option("datestyle", "ISO",
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+
+	if (IntervalStyle != INTSTYLE_POSTGRES)
+		(void) set_config_option("intervalstyle", "postgres",
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+
+	if (extra_float_digits < 3)
+		(void) set_config_option("extra_float_digits", "3",
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+
+	return nestLevel;
+}
+
+
+/*
+ * ResetTransmissionModes undoes SetTransmissionModes.
+ */
+void
+ResetTransmissionModes(int nestLevel)
+{
+	AtEOXact_GUC(true, nestLevel);
+}
+
+
+/*
+ * ExecuteRemoteQuery sends a query to a remote server and waits for its result
+ * while checking for interrupts. It returns NULL if the query could not be
+ * sent, in which case PQerrorMessage describes the problem.
+ */
+PGresult *
+ExecuteRemoteQuery(PGconn *connection, const char *query, int paramCount,
+				   const char *const *paramValues)
+{
+	if (!PQsendQueryParams(connection, query, paramCount, NULL, paramValues,
+						   NULL, NULL, 0))
+		return NULL;
+
+	if (!FlushRemoteConnection(connection))
+		return NULL;
+
+	return GetRemoteResult(connection);
+}
+
+
+/*
+ * GetRemoteResult waits for the result of the current query on a remote
+ * connection while checking for interrupts. It returns the last result of
+ * the query, or the COPY result if the query starts a COPY.
+ */
+PGresult *
+GetRemoteResult(PGconn *connection)
+{
+	PGresult   *volatile lastResult = NULL;
+
+	PG_TRY();
+	{
+		while (true)
+		{
+			while (PQisBusy(connection))
+			{
+				int			events = WaitForRemoteSocket(connection, WL_SOCKET_READABLE);
+
+				/* on failure, PQgetResult returns the error */
+				if ((events & WL_SOCKET_READABLE) && !PQconsumeInput(connection))
+					break;
+			}
+
+			PGresult   *result = PQgetResult(connection);
+
+			if (result == NULL)
+				break;
+
+			PQclear(lastResult);
+			lastResult = result;
+
+			ExecStatusType resultStatus = PQresultStatus(result);
+
+			if (resultStatus == PGRES_COPY_IN ||
+				resultStatus == PGRES_COPY_OUT ||
+				resultStatus == PGRES_COPY_BOTH ||
+				PQstatus(connection) == CONNECTION_BAD)
+				break;
+		}
+	}
+	PG_CATCH();
+	{
+		PQclear(lastResult);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return lastResult;
+}
+
+
+/*
+ * PutRemoteCopyData sends COPY data to a remote server, waiting for the
+ * socket while checking for interrupts if the remote server is slow to
+ * consume it.
+ */
+bool
+PutRemoteCopyData(PGconn *connection, const char *buffer, int length)
+{
+	int			putStatus = PQputCopyData(connection, buffer, length);
+
+	if (putStatus == 0)
+	{
+		/* the output buffer is full, send it and try again */
+		if (!FlushRemoteConnection(connection))
+			return false;
+
+		putStatus = PQputCopyData(connection, buffer, length);
+	}
+
+	if (putStatus != 1)
+		return false;
+
+	return FlushRemoteConnection(connection);
+}
+
+
+/*
+ * PutRemoteCopyEnd ends a COPY to a remote server. The caller then obtains
+ * the result of the COPY using GetRemoteResult.
+ */
+bool
+PutRemoteCopyEnd(PGconn *connection)
+{
+	int			putStatus = PQputCopyEnd(connection, NULL);
+
+	if (putStatus == 0)
+	{
+		/* the output buffer is full, send it and try again */
+		if (!FlushRemoteConnection(connection))
+			return false;
+
+		putStatus = PQputCopyEnd(connection, NULL);
+	}
+
+	if (putStatus != 1)
+		return false;
+
+	return FlushRemoteConnection(connection);
+}
+
+
+/*
+ * CloseRemoteConnection closes a remote connection, and cancels the query that
+ * is running on it, if any, such that the remote server does not keep running
+ * a query for a pipeline that was interrupted.
+ */
+void
+CloseRemoteConnection(PGconn *connection)
+{
+	if (connection == NULL)
+		return;
+
+	if (PQtransactionStatus(connection) == PQTRANS_ACTIVE)
+	{
+		PGcancel   *cancel = PQgetCancel(connection);
+		char		errorBuffer[256];
+
+		if (cancel != NULL)
+		{
+			/* best effort, the remote server also notices the closed socket */
+			(void) PQcancel(cancel, errorBuffer, sizeof(errorBuffer));
+			PQfreeCancel(cancel);
+		}
+	}
+
+	PQfinish(connection);
+}
+
+
+/*
+ * WaitForRemoteSocket waits until the socket of a remote connection is ready
+ * for the given events or the latch is set, and checks for interrupts. It
+ * returns the events that occurred.
+ */
+static int
+WaitForRemoteSocket(PGconn *connection, int socketEvents)
+{
+	int			events = WaitLatchOrSocket(MyLatch,
+										   WL_LATCH_SET | WL_EXIT_ON_PM_DEATH |
+										   socketEvents,
+										   PQsocket(connection), -1L, PG_WAIT_EXTENSION);
+
+	if (events & WL_LATCH_SET)
+	{
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	return events;
+}
+
+
+/*
+ * FlushRemoteConnection sends all queued data on a non-blocking remote
+ * connection, consuming input meanwhile such that neither side blocks on a
+ * full buffer.
+ */
+static bool
+FlushRemoteConnection(PGconn *connection)
+{
+	int			flushStatus;
+
+	while ((flushStatus = PQflush(connection)) == 1)
+	{
+		int			events = WaitForRemoteSocket(connection,
+												 WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE);
+
+		if ((events & WL_SOCKET_READABLE) && !PQconsumeInput(connection))
+			return false;
+	}
+
+	return flushStatus == 0;
+}
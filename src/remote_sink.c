@@ -0,0 +1,626 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/pg_authid.h"
+#include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/query.h"
+#include "crunchy/incremental/remote_connection.h"
+#include "crunchy/incremental/remote_sink.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "libpq-fe.h"
+#include "utils/builtins.h"
+#include "utils/snapmgr.h"
+
+
+static PGconn *ConnectToRemoteSink(RemoteSink * sink);
+static void ExecuteRemoteCommand(PGconn *connection, char *command);
+static int64 LockRemoteProgress(PGconn *connection, RemoteSink * sink, char *pipelineName);
+static uint64 CopyRangeToRemoteTable(PGconn *connection, RemoteSink * sink, char *command,
+									 int64 rangeStart, int64 rangeEnd);
+static void AppendCopyValue(StringInfo buffer, char *value);
+static void UpdateRemoteProgress(PGconn *connection, RemoteSink * sink, char *pipelineName,
+								 int64 rangeEnd);
+
+
+PG_FUNCTION_INFO_V1(incremental_set_remote_sink);
+
+
+/*
+ * incremental_set_remote_sink configures a sequence pipeline to copy the
+ * results of its command into a table on a remote server, or removes the
+ * remote sink if connection_string is NULL.
+ */
+Datum
+incremental_set_remote_sink(PG_FUNCTION_ARGS)
+{
+	if (!superuser())
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						errmsg("only superusers can configure remote sinks")));
+
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (!PG_ARGISNULL(1) && PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("remote_table cannot be NULL")));
+	if (PG_ARGISNULL(3))
+		ereport(ERROR, (errmsg("progress_table cannot be NULL")));
+	if (PG_ARGISNULL(4) || PG_GETARG_INT32(4) <= 0)
+		ereport(ERROR, (errmsg("batch_size must be positive")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+	if (pipelineDesc->pipelineType != SEQUENCE_RANGE_PIPELINE)
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("remote sinks are only supported for sequence pipelines")));
+
+	char	   *query = NULL;
+	int			argCount = 1;
+	Datum		argValues[5];
+	Oid			argTypes[] = {TEXTOID, TEXTOID, TEXTOID, TEXTOID, INT4OID};
+	char	   *argNulls = "     ";
+
+	argValues[0] = CStringGetTextDatum(pipelineName);
+
+	if (!PG_ARGISNULL(1))
+	{
+		RemoteSink	sink;
+
+		sink.connectionString = text_to_cstring(PG_GETARG_TEXT_P(1));
+		sink.remoteTable = text_to_cstring(PG_GETARG_TEXT_P(2));
+		sink.progressTable = text_to_cstring(PG_GETARG_TEXT_P(3));
+		sink.batchSize = PG_GETARG_INT32(4);
+
+		/* rows are copied in the order of the SELECT list */
+		Query	   *parsedQuery = ParseQuery(pipelineDesc->command,
+											 list_make2_oid(INT8OID, INT8OID));
+
+		if (parsedQuery->commandType != CMD_SELECT ||
+			OidIsValid(GetTargetRelationId(parsedQuery)))
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("the command of pipeline %s must be a SELECT to use "
+								   "a remote sink", pipelineName)));
+
+		/* check the connection and create the progress table if needed */
+		PGconn	   *connection = ConnectToRemoteSink(&sink);
+
+		PG_TRY();
+		{
+			char	   *createCommand =
+				psprintf("CREATE TABLE IF NOT EXISTS %s ("
+						 "pipeline_name text not null primary key, "
+						 "last_processed_sequence_number bigint not null, "
+						 "updated_time timestamptz not null default now())",
+						 sink.progressTable);
+
+			ExecuteRemoteCommand(connection, createCommand);
+		}
+		PG_CATCH();
+		{
+			CloseRemoteConnection(connection);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		CloseRemoteConnection(connection);
+
+		query =
+			"insert into incremental.remote_sinks "
+			"(pipeline_name, connection_string, remote_table, progress_table, batch_size) "
+			"values ($1, $2, $3, $4, $5) "
+			"on conflict (pipeline_name) do update set "
+			"connection_string = excluded.connection_string, "
+			"remote_table = excluded.remote_table, "
+			"progress_table = excluded.progress_table, "
+			"batch_size = excluded.batch_size";
+
+		argCount = 5;
+		argValues[1] = CStringGetTextDatum(sink.connectionString);
+		argValues[2] = CStringGetTextDatum(sink.remoteTable);
+		argValues[3] = CStringGetTextDatum(sink.progressTable);
+		argValues[4] = Int32GetDatum(sink.batchSize);
+	}
+	else
+	{
+		query =
+			"delete from incremental.remote_sinks "
+			"where pipeline_name operator(pg_catalog.=) $1";
+	}
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * ReadRemoteSink returns the remote sink of a pipeline, or NULL if it does not
+ * have one.
+ */
+RemoteSink *
+ReadRemoteSink(char *pipelineName)
+{
+	RemoteSink *sink = NULL;
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser, since the remote sinks table contains connection
+	 * strings and is not readable by other users.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	char	   *query =
+		"select connection_string, remote_table, progress_table, batch_size "
+		"from incremental.remote_sinks "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed > 0)
+	{
+		TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+		HeapTuple	row = SPI_tuptable->vals[0];
+
+		bool		isNull = false;
+		Datum		connectionStringDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+		Datum		remoteTableDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+		Datum		progressTableDatum = SPI_getbinval(row, rowDesc, 3, &isNull);
+		Datum		batchSizeDatum = SPI_getbinval(row, rowDesc, 4, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+		sink = (RemoteSink *) palloc0(sizeof(RemoteSink));
+		sink->connectionString = TextDatumGetCString(connectionStringDatum);
+		sink->remoteTable = TextDatumGetCString(remoteTableDatum);
+		sink->progressTable = TextDatumGetCString(progressTableDatum);
+		sink->batchSize = DatumGetInt32(batchSizeDatum);
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return sink;
+}
+
+
+/*
+ * ExecuteRemoteSinkForRange executes the command of a pipeline for a sequence
+ * range and copies the results into the remote table.
+ *
+ * The remote progress table is updated in the same remote transaction as the
+ * copy, and the remote transaction commits before the local one. If the local
+ * transaction fails after the remote commit, the next run finds that part of
+ * the range was already delivered and skips it, such that each row is
+ * delivered exactly once.
+ */
+void
+ExecuteRemoteSinkForRange(char *pipelineName, RemoteSink * sink, char *command,
+						  int64 rangeStart, int64 rangeEnd)
+{
+	PGconn	   *connection = ConnectToRemoteSink(sink);
+
+	PG_TRY();
+	{
+		ExecuteRemoteCommand(connection, "BEGIN");
+
+		/* reconcile with the remote progress */
+		int64		remoteProgress = LockRemoteProgress(connection, sink, pipelineName);
+
+		if (remoteProgress >= rangeEnd)
+		{
+			ereport(NOTICE, (errmsg("pipeline %s: sequence values up to " INT64_FORMAT
+									" were already delivered",
+									pipelineName, remoteProgress)));
+
+			ExecuteRemoteCommand(connection, "ROLLBACK");
+		}
+		else
+		{
+			if (remoteProgress >= rangeStart)
+			{
+				ereport(NOTICE, (errmsg("pipeline %s: sequence values up to " INT64_FORMAT
+										" were already delivered",
+										pipelineName, remoteProgress)));
+
+				rangeStart = remoteProgress + 1;
+			}
+
+			uint64		rowCount = CopyRangeToRemoteTable(connection, sink, command,
+														  rangeStart, rangeEnd);
+
+			UpdateRemoteProgress(connection, sink, pipelineName, rangeEnd);
+			ExecuteRemoteCommand(connection, "COMMIT");
+
+			ereport(NOTICE, (errmsg("pipeline %s: copied " UINT64_FORMAT " rows to %s",
+									pipelineName, rowCount, sink->remoteTable)));
+		}
+	}
+	PG_CATCH();
+	{
+		CloseRemoteConnection(connection);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	CloseRemoteConnection(connection);
+}
+
+
+/*
+ * ClearRemoteProgress removes the progress of a pipeline from the remote
+ * progress table when the pipeline is reset or dropped, such that a new
+ * pipeline with the same name does not skip its first ranges.
+ */
+void
+ClearRemoteProgress(char *pipelineName)
+{
+	RemoteSink *sink = ReadRemoteSink(pipelineName);
+
+	if (sink == NULL)
+		return;
+
+	PGconn	   *connection = ConnectToRemoteSink(sink);
+
+	PG_TRY();
+	{
+		char	   *query =
+			psprintf("DELETE FROM %s WHERE pipeline_name = $1",
+					 sink->progressTable);
+		const char *paramValues[] = {pipelineName};
+
+		PGresult   *result = ExecuteRemoteQuery(connection, query, 1, paramValues);
+
+		if (PQresultStatus(result) != PGRES_COMMAND_OK)
+		{
+			char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+			PQclear(result);
+
+			ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+							errmsg("could not clear remote progress of pipeline %s",
+								   pipelineName),
+							errdetail_internal("%s", errorMessage)));
+		}
+
+		PQclear(result);
+	}
+	PG_CATCH();
+	{
+		CloseRemoteConnection(connection);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	CloseRemoteConnection(connection);
+}
+
+
+/*
+ * ConnectToRemoteSink opens a connection to the remote server of a sink and
+ * configures the session to accept the values we send in COPY.
+ */
+static PGconn *
+ConnectToRemoteSink(RemoteSink * sink)
+{
+	const char *keywords[] = {"dbname", "fallback_application_name", NULL};
+	const char *values[] = {sink->connectionString, "pg_incremental", NULL};
+	bool		expandDbname = true;
+
+	PGconn	   *connection = ConnectToRemoteServer(keywords, values, expandDbname);
+
+	if (connection == NULL || PQstatus(connection) != CONNECTION_OK)
+	{
+		char	   *errorMessage = connection != NULL ?
+			pstrdup(PQerrorMessage(connection)) : "out of memory";
+
+		PQfinish(connection);
+
+		ereport(ERROR, (errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
+						errmsg("could not connect to remote sink"),
+						errdetail_internal("%s", errorMessage)));
+	}
+
+	PG_TRY();
+	{
+		ConfigureRemoteSession(connection);
+	}
+	PG_CATCH();
+	{
+		CloseRemoteConnection(connection);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return connection;
+}
+
+
+/*
+ * ExecuteRemoteCommand executes a command that does not return rows on a
+ * remote connection.
+ */
+static void
+ExecuteRemoteCommand(PGconn *connection, char *command)
+{
+	PGresult   *result = ExecuteRemoteQuery(connection, command, 0, NULL);
+
+	if (PQresultStatus(result) != PGRES_COMMAND_OK)
+	{
+		char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+		PQclear(result);
+
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("remote command failed: %s", command),
+						errdetail_internal("%s", errorMessage)));
+	}
+
+	PQclear(result);
+}
+
+
+/*
+ * LockRemoteProgress locks the progress of a pipeline in the remote progress
+ * table and returns the last delivered sequence number, or 0.
+ */
+static int64
+LockRemoteProgress(PGconn *connection, RemoteSink * sink, char *pipelineName)
+{
+	char	   *query =
+		psprintf("SELECT last_processed_sequence_number FROM %s "
+				 "WHERE pipeline_name = $1 FOR UPDATE",
+				 sink->progressTable);
+	const char *paramValues[] = {pipelineName};
+
+	PGresult   *result = ExecuteRemoteQuery(connection, query, 1, paramValues);
+
+	if (PQresultStatus(result) != PGRES_TUPLES_OK)
+	{
+		char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+		PQclear(result);
+
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("could not read remote progress of pipeline %s",
+							   pipelineName),
+						errdetail_internal("%s", errorMessage)));
+	}
+
+	int64		remoteProgress = 0;
+
+	if (PQntuples(result) > 0)
+		remoteProgress = pg_strtoint64(PQgetvalue(result, 0, 0));
+
+	PQclear(result);
+
+	return remoteProgress;
+}
+
+
+/*
+ * CopyRangeToRemoteTable executes the command for a sequence range and sends
+ * the results to the remote table using COPY, in batches of rows.
+ */
+static uint64
+CopyRangeToRemoteTable(PGconn *connection, RemoteSink * sink, char *command,
+					   int64 rangeStart, int64 rangeEnd)
+{
+	char	   *copyCommand = psprintf("COPY %s FROM STDIN", sink->remoteTable);
+	PGresult   *result = ExecuteRemoteQuery(connection, copyCommand, 0, NULL);
+
+	if (PQresultStatus(result) != PGRES_COPY_IN)
+	{
+		char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+		PQclear(result);
+
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("could not start COPY into %s", sink->remoteTable),
+						errdetail_internal("%s", errorMessage)));
+	}
+
+	PQclear(result);
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	int			argCount = 2;
+	Oid			argTypes[] = {INT8OID, INT8OID};
+	Datum		argValues[] = {
+		Int64GetDatum(rangeStart),
+		Int64GetDatum(rangeEnd)
+	};
+	char	   *argNulls = "  ";
+	bool		readOnly = true;
+	int			cursorOptions = 0;
+	uint64		rowCount = 0;
+	StringInfoData buffer;
+
+	initStringInfo(&buffer);
+
+	SPI_connect();
+
+	Portal		cursor = SPI_cursor_open_with_args(NULL, command,
+												   argCount, argTypes,
+												   argValues, argNulls,
+												   readOnly, cursorOptions);
+
+	while (true)
+	{
+		SPI_cursor_fetch(cursor, true, sink->batchSize);
+
+		if (SPI_processed == 0)
+			break;
+
+		TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+
+		resetStringInfo(&buffer);
+
+		/* output values in the formats the remote session expects */
+		int			nestLevel = SetTransmissionModes();
+
+		for (uint64 rowIndex = 0; rowIndex < SPI_processed; rowIndex++)
+		{
+			HeapTuple	row = SPI_tuptable->vals[rowIndex];
+
+			for (int columnIndex = 1; columnIndex <= rowDesc->natts; columnIndex++)
+			{
+				if (columnIndex > 1)
+					appendStringInfoChar(&buffer, '\t');
+
+				AppendCopyValue(&buffer, SPI_getvalue(row, rowDesc, columnIndex));
+			}
+
+			appendStringInfoChar(&buffer, '\n');
+		}
+
+		ResetTransmissionModes(nestLevel);
+
+		rowCount += SPI_processed;
+		SPI_freetuptable(SPI_tuptable);
+
+		if (!PutRemoteCopyData(connection, buffer.data, buffer.len))
+			ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+							errmsg("could not send rows to %s", sink->remoteTable),
+							errdetail_internal("%s", PQerrorMessage(connection))));
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	SPI_cursor_close(cursor);
+	SPI_finish();
+
+	PopActiveSnapshot();
+
+	if (!PutRemoteCopyEnd(connection))
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("could not finish COPY into %s", sink->remoteTable),
+						errdetail_internal("%s", PQerrorMessage(connection))));
+
+	result = GetRemoteResult(connection);
+
+	if (PQresultStatus(result) != PGRES_COMMAND_OK)
+	{
+		char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+		PQclear(result);
+
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("COPY into %s failed", sink->remoteTable),
+						errdetail_internal("%s", errorMessage)));
+	}
+
+	PQclear(result);
+
+	return rowCount;
+}
+
+
+/*
+ * AppendCopyValue appends a value in COPY text format to the buffer.
+ */
+static void
+AppendCopyValue(StringInfo buffer, char *value)
+{
+	if (value == NULL)
+	{
+		appendStringInfoString(buffer, "\\N");
+		return;
+	}
+
+	for (char *current = value; *current != '\0'; current++)
+	{
+		switch (*current)
+		{
+			case '\\':
+				appendStringInfoString(buffer, "\\\\");
+				break;
+
+			case '\t':
+				appendStringInfoString(buffer, "\\t");
+				break;
+
+			case '\n':
+				appendStringInfoString(buffer, "\\n");
+				break;
+
+			case '\r':
+				appendStringInfoString(buffer, "\\r");
+				break;
+
+			default:
+				appendStringInfoChar(buffer, *current);
+		}
+	}
+}
+
+
+/*
+ * UpdateRemoteProgress sets the last delivered sequence number of a pipeline
+ * in the remote progress table.
+ */
+static void
+UpdateRemoteProgress(PGconn *connection, RemoteSink * sink, char *pipelineName,
+					 int64 rangeEnd)
+{
+	char	   *query =
+		psprintf("INSERT INTO %s (pipeline_name, last_processed_sequence_number) "
+				 "VALUES ($1, $2) "
+				 "ON CONFLICT (pipeline_name) DO UPDATE SET "
+				 "last_processed_sequence_number = excluded.last_processed_sequence_number, "
+				 "updated_time = now()",
+				 sink->progressTable);
+	char	   *rangeEndStr = psprintf(INT64_FORMAT, rangeEnd);
+	const char *paramValues[] = {pipelineName, rangeEndStr};
+
+	PGresult   *result = ExecuteRemoteQuery(connection, query, 2, paramValues);
+
+	if (PQresultStatus(result) != PGRES_COMMAND_OK)
+	{
+		char	   *errorMessage = pstrdup(PQerrorMessage(connection));
+
+		PQclear(result);
+
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+						errmsg("could not update remote progress of pipeline %s",
+							   pipelineName),
+						errdetail_internal("%s", errorMessage)));
+	}
+
+	PQclear(result);
+}
@@ -0,0 +1,275 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/xact.h"
+#include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/query.h"
+#include "crunchy/incremental/time_interval.h"
+#include "executor/instrument.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+
+static void EnsureCompatibleTargetRelation(Oid targetRelationId, Oid overrideRelationId);
+
+
+PG_FUNCTION_INFO_V1(incremental_replay_range);
+
+
+/*
+ * incremental_replay_range executes the command of a pipeline for an arbitrary
+ * range without updating the pipeline state, and reports the execution time,
+ * buffer usage, and number of rows processed.
+ *
+ * The command can write into an alternate relation with the same columns as
+ * the pipeline target, and/or be rolled back (dry run), such that changes to
+ * a command or indexes can be benchmarked on real data.
+ */
+Datum
+incremental_replay_range(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, (errmsg("pipeline_name cannot be NULL")));
+	if (PG_ARGISNULL(1))
+		ereport(ERROR, (errmsg("range_start cannot be NULL")));
+	if (PG_ARGISNULL(2))
+		ereport(ERROR, (errmsg("range_end cannot be NULL")));
+
+	char	   *pipelineName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char	   *rangeStartStr = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char	   *rangeEndStr = text_to_cstring(PG_GETARG_TEXT_P(2));
+	Oid			overrideRelationId = PG_ARGISNULL(3) ? InvalidOid : PG_GETARG_OID(3);
+	bool		dryRun = PG_ARGISNULL(4) ? true : PG_GETARG_BOOL(4);
+
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+	EnsurePipelineOwner(pipelineName, pipelineDesc->ownerId);
+
+	if (!dryRun && !OidIsValid(overrideRelationId))
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("replaying a range requires dry_run or a target_override"),
+						errdetail("Replaying into the pipeline target could process rows "
+								  "twice.")));
+
+	Oid			paramType = InvalidOid;
+
+	switch (pipelineDesc->pipelineType)
+	{
+		case SEQUENCE_RANGE_PIPELINE:
+			paramType = INT8OID;
+			break;
+
+		case TIME_INTERVAL_PIPELINE:
+			paramType = TimeParameterTypeId(ReadTimeParameterType(pipelineName));
+			break;
+
+		case TIME_BUCKET_PIPELINE:
+			paramType = TIMESTAMPTZOID;
+			break;
+
+		default:
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("replay is only supported for sequence, time interval, "
+								   "and time bucket pipelines")));
+	}
+
+	Oid			typeInput = InvalidOid;
+	Oid			typeIOParam = InvalidOid;
+
+	getTypeInputInfo(paramType, &typeInput, &typeIOParam);
+
+	Datum		rangeStart = OidInputFunctionCall(typeInput, rangeStartStr, typeIOParam, -1);
+	Datum		rangeEnd = OidInputFunctionCall(typeInput, rangeEndStr, typeIOParam, -1);
+
+	/* apply the search_path of the pipeline, also for parsing */
+	int			gucNestLevel = NewGUCNestLevel();
+
+	if (pipelineDesc->searchPath != NULL)
+	{
+		(void) set_config_option("search_path", pipelineDesc->searchPath,
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+	}
+
+	char	   *command = pipelineDesc->command;
+
+	if (OidIsValid(overrideRelationId))
+	{
+		Query	   *parsedQuery = ParseQuery(command, list_make2_oid(paramType, paramType));
+		Oid			targetRelationId = GetTargetRelationId(parsedQuery);
+
+		if (!OidIsValid(targetRelationId))
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("pipeline %s does not modify a relation, cannot "
+								   "override its target", pipelineName)));
+
+		EnsureCompatibleTargetRelation(targetRelationId, overrideRelationId);
+		ReplaceTargetRelation(parsedQuery, overrideRelationId);
+
+		command = DeparseQuery(parsedQuery);
+	}
+
+	ereport(NOTICE, (errmsg("pipeline %s: replaying range from %s to %s%s",
+							pipelineName, rangeStartStr, rangeEndStr,
+							dryRun ? " (dry run)" : "")));
+
+	MemoryContext callerContext = CurrentMemoryContext;
+	ResourceOwner callerOwner = CurrentResourceOwner;
+
+	/* run the command in a subtransaction that we roll back for a dry run */
+	if (dryRun)
+	{
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(callerContext);
+	}
+
+	BufferUsage bufferUsageStart = pgBufferUsage;
+	BufferUsage bufferUsage;
+	TimestampTz startTime = GetCurrentTimestamp();
+	uint64		rowsProcessed = 0;
+
+	PG_TRY();
+	{
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		bool		readOnly = false;
+		int			tupleCount = 0;
+		int			argCount = 2;
+		Oid			argTypes[] = {paramType, paramType};
+		Datum		argValues[] = {
+			rangeStart,
+			rangeEnd
+		};
+		char	   *argNulls = "  ";
+
+		SPI_connect();
+		SPI_execute_with_args(command,
+							  argCount,
+							  argTypes,
+							  argValues,
+							  argNulls,
+							  readOnly,
+							  tupleCount);
+
+		rowsProcessed = SPI_processed;
+
+		SPI_finish();
+
+		PopActiveSnapshot();
+	}
+	PG_CATCH();
+	{
+		/* do not leave the dry run subtransaction open if the caller catches */
+		if (dryRun)
+		{
+			MemoryContextSwitchTo(callerContext);
+
+			ErrorData  *errorData = CopyErrorData();
+
+			FlushErrorState();
+
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(callerContext);
+			CurrentResourceOwner = callerOwner;
+
+			ReThrowError(errorData);
+		}
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	long		durationSecs = 0;
+	int			durationMicrosecs = 0;
+
+	TimestampDifference(startTime, GetCurrentTimestamp(), &durationSecs, &durationMicrosecs);
+
+	memset(&bufferUsage, 0, sizeof(BufferUsage));
+	BufferUsageAccumDiff(&bufferUsage, &pgBufferUsage, &bufferUsageStart);
+
+	if (dryRun)
+	{
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(callerContext);
+		CurrentResourceOwner = callerOwner;
+	}
+
+	AtEOXact_GUC(true, gucNestLevel);
+
+	TupleDesc	tupleDesc = NULL;
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	Datum		values[8];
+	bool		nulls[8];
+
+	memset(nulls, false, sizeof(nulls));
+
+	values[0] = Float8GetDatum(durationSecs * 1000.0 + durationMicrosecs / 1000.0);
+	values[1] = Int64GetDatum(rowsProcessed);
+	values[2] = Int64GetDatum(bufferUsage.shared_blks_hit);
+	values[3] = Int64GetDatum(bufferUsage.shared_blks_read);
+	values[4] = Int64GetDatum(bufferUsage.shared_blks_dirtied);
+	values[5] = Int64GetDatum(bufferUsage.shared_blks_written);
+	values[6] = Int64GetDatum(bufferUsage.temp_blks_read);
+	values[7] = Int64GetDatum(bufferUsage.temp_blks_written);
+
+	HeapTuple	resultTuple = heap_form_tuple(BlessTupleDesc(tupleDesc), values, nulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(resultTuple));
+}
+
+
+/*
+ * EnsureCompatibleTargetRelation throws an error if the override relation
+ * does not have the same columns as the target relation, since the parsed
+ * command refers to columns by attribute number.
+ */
+static void
+EnsureCompatibleTargetRelation(Oid targetRelationId, Oid overrideRelationId)
+{
+	if (targetRelationId == overrideRelationId)
+		return;
+
+	Relation	targetRelation = relation_open(targetRelationId, AccessShareLock);
+	Relation	overrideRelation = relation_open(overrideRelationId, AccessShareLock);
+	TupleDesc	targetDesc = RelationGetDescr(targetRelation);
+	TupleDesc	overrideDesc = RelationGetDescr(overrideRelation);
+
+	if (targetDesc->natts != overrideDesc->natts)
+		ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH),
+						errmsg("relation %s does not have the same columns as %s",
+							   RelationGetRelationName(overrideRelation),
+							   RelationGetRelationName(targetRelation))));
+
+	for (int columnIndex = 0; columnIndex < targetDesc->natts; columnIndex++)
+	{
+		Form_pg_attribute targetAttr = TupleDescAttr(targetDesc, columnIndex);
+		Form_pg_attribute overrideAttr = TupleDescAttr(overrideDesc, columnIndex);
+
+		if (targetAttr->attisdropped != overrideAttr->attisdropped ||
+			(!targetAttr->attisdropped &&
+			 (strcmp(NameStr(targetAttr->attname), NameStr(overrideAttr->attname)) != 0 ||
+			  targetAttr->atttypid != overrideAttr->atttypid)))
+			ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH),
+							errmsg("relation %s does not have the same columns as %s",
+								   RelationGetRelationName(overrideRelation),
+								   RelationGetRelationName(targetRelation)),
+							errhint("Create the relation using CREATE TABLE ... (LIKE ... "
+									"INCLUDING ALL)")));
+	}
+
+	relation_close(overrideRelation, NoLock);
+	relation_close(targetRelation, NoLock);
+}
@@ -0,0 +1,1289 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include <ctype.h>
+
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "catalog/dependency.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_index.h"
+#include "catalog/pg_type.h"
+#include "common/hashfn.h"
+#include "common/int.h"
+#include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/query.h"
+#include "crunchy/incremental/rollup.h"
+#include "crunchy/incremental/sequence.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "nodes/nodeFuncs.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/formatting.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/portal.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/typcache.h"
+
+
+/* number of rows to fetch from the scan and accumulate at a time */
+#define ROLLUP_BATCH_SIZE 1024
+
+/* initial size of the group hash table */
+#define ROLLUP_INITIAL_GROUPS 1024
+
+
+/*
+ * RollupAggregateKind is an aggregate that the rollup engine can compute.
+ */
+typedef enum RollupAggregateKind
+{
+	ROLLUP_COUNT_ROWS,
+	ROLLUP_COUNT,
+	ROLLUP_SUM_INT,
+	ROLLUP_SUM_FLOAT,
+	ROLLUP_MIN,
+	ROLLUP_MAX
+}			RollupAggregateKind;
+
+/*
+ * RollupAggregate is an aggregate over a column of the scan command.
+ */
+typedef struct RollupAggregate
+{
+	RollupAggregateKind kind;
+
+	/* index of the input column in the scan command, or -1 for count(*) */
+	int			inputColumn;
+
+	/* type of the input column */
+	Oid			inputTypeId;
+
+	/* type of the value that is merged into the target column */
+	Oid			resultTypeId;
+}			RollupAggregate;
+
+/*
+ * RollupAggregateState is the state of an aggregate for a single group.
+ */
+typedef struct RollupAggregateState
+{
+	/* number of rows, or number of non-NULL inputs */
+	int64		count;
+
+	int64		intSum;
+	double		floatSum;
+
+	/* current minimum or maximum, if count > 0 */
+	Datum		value;
+}			RollupAggregateState;
+
+/*
+ * RollupKey is the set of dimension values of a group.
+ */
+typedef struct RollupKey
+{
+	Datum	   *values;
+	bool	   *nulls;
+}			RollupKey;
+
+/*
+ * RollupGroup is an entry in the group hash table.
+ */
+typedef struct RollupGroup
+{
+	RollupKey	key;
+	RollupAggregateState *aggregates;
+	uint32		hash;
+	char		status;
+}			RollupGroup;
+
+typedef struct RollupState RollupState;
+
+static uint32 HashRollupKey(RollupState * state, RollupKey key);
+static bool RollupKeysEqual(RollupState * state, RollupKey left, RollupKey right);
+
+#define SH_PREFIX rollup_groups
+#define SH_ELEMENT_TYPE RollupGroup
+#define SH_KEY_TYPE RollupKey
+#define SH_KEY key
+#define SH_HASH_KEY(tb, key) HashRollupKey((RollupState *) (tb)->private_data, key)
+#define SH_EQUAL(tb, a, b) RollupKeysEqual((RollupState *) (tb)->private_data, a, b)
+#define SH_STORE_HASH
+#define SH_GET_HASH(tb, a) a->hash
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+/*
+ * RollupState is the state of a rollup pipeline execution.
+ */
+struct RollupState
+{
+	/* memory context for the hash table, group keys, and states */
+	MemoryContext context;
+
+	/* columns of the scan command, dimensions first */
+	int			columnCount;
+	TupleDesc	scanDesc;
+	TypeCacheEntry **columnTypes;
+
+	int			dimensionCount;
+	int			aggregateCount;
+	RollupAggregate *aggregates;
+
+	rollup_groups_hash *groups;
+
+	/*
+	 * Deformed rows, hashes, and aggregate states of the current batch. We
+	 * keep the aggregate states rather than the groups, since inserting into
+	 * the hash table may move existing groups.
+	 */
+	Datum	   *batchValues;
+	bool	   *batchNulls;
+	uint32	   *batchHashes;
+	RollupAggregateState **batchStates;
+
+	/* total number of rows accumulated */
+	uint64		rowCount;
+};
+
+
+static char *TrimWhitespace(char *value);
+static void ParseAggregate(char *aggregate, char **targetColumn, char **aggregateName,
+						   char **argument);
+static void EnsureTargetColumn(Oid targetRelationId, char *columnName);
+static void EnsureNullDimensionsMatch(Oid targetRelationId, List *dimensionColumns);
+static char *GetSequenceColumnName(Oid sequenceId);
+static RollupAggregate *BuildRollupAggregates(List *aggregateNames, Oid *columnTypes,
+											  int dimensionCount);
+static void EnsureDimensionType(Oid typeId);
+static List *ReadRollupDefinition(char *pipelineName, char **scanCommand,
+								  int *dimensionCount);
+static RollupState * CreateRollupState(TupleDesc scanDesc, int dimensionCount,
+									   List *aggregateNames);
+static void AccumulateBatch(RollupState * state, SPITupleTable *tupleTable, int rowCount);
+static RollupGroup * CreateGroup(RollupState * state, RollupGroup * group);
+static void AccumulateMinMax(RollupState * state, RollupAggregate * aggregate,
+							 int aggregateIndex, int rowCount);
+static uint32 MergeRollupGroups(RollupState * state, char *mergeCommand);
+static int	CompareRollupGroups(const void *left, const void *right, void *arg);
+
+
+/*
+ * BuildRollupDefinition builds the scan and merge commands of a rollup
+ * pipeline from its dimensions and aggregates.
+ *
+ * Dimensions are specified as target_column or target_column:expression,
+ * and aggregates as target_column:count(*), or target_column:count(expr),
+ * sum(expr), min(expr), or max(expr), where expressions are over the source
+ * table.
+ */
+RollupDefinition *
+BuildRollupDefinition(Oid sourceRelationId, Oid sequenceId, Oid targetRelationId,
+					  ArrayType *dimensions, ArrayType *aggregates)
+{
+	Datum	   *dimensionDatums = NULL;
+	int			dimensionCount = 0;
+	Datum	   *aggregateDatums = NULL;
+	int			aggregateCount = 0;
+
+	deconstruct_array(dimensions, TEXTOID, -1, false, TYPALIGN_INT,
+					  &dimensionDatums, NULL, &dimensionCount);
+	deconstruct_array(aggregates, TEXTOID, -1, false, TYPALIGN_INT,
+					  &aggregateDatums, NULL, &aggregateCount);
+
+	if (dimensionCount == 0)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("a rollup pipeline needs at least one dimension")));
+
+	if (aggregateCount == 0)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("a rollup pipeline needs at least one aggregate")));
+
+	StringInfoData scanColumns;
+	StringInfoData targetColumns;
+	StringInfoData conflictColumns;
+	StringInfoData updates;
+	List	   *dimensionColumns = NIL;
+
+	initStringInfo(&scanColumns);
+	initStringInfo(&targetColumns);
+	initStringInfo(&conflictColumns);
+	initStringInfo(&updates);
+
+	for (int dimensionIndex = 0; dimensionIndex < dimensionCount; dimensionIndex++)
+	{
+		char	   *dimension = TextDatumGetCString(dimensionDatums[dimensionIndex]);
+		char	   *separator = strchr(dimension, ':');
+		char	   *targetColumn = NULL;
+		char	   *expression = NULL;
+
+		/* without an expression, use the source column of the same name */
+		if (separator == NULL)
+		{
+			targetColumn = TrimWhitespace(dimension);
+			expression = (char *) quote_identifier(targetColumn);
+		}
+		else
+		{
+			targetColumn = TrimWhitespace(pnstrdup(dimension, separator - dimension));
+			expression = TrimWhitespace(separator + 1);
+		}
+
+		EnsureTargetColumn(targetRelationId, targetColumn);
+		dimensionColumns = lappend(dimensionColumns, targetColumn);
+
+		appendStringInfo(&scanColumns, "%s%s", dimensionIndex > 0 ? ", " : "", expression);
+		appendStringInfo(&targetColumns, "%s%s", dimensionIndex > 0 ? ", " : "",
+						 quote_identifier(targetColumn));
+		appendStringInfo(&conflictColumns, "%s%s", dimensionIndex > 0 ? ", " : "",
+						 quote_identifier(targetColumn));
+	}
+
+	EnsureNullDimensionsMatch(targetRelationId, dimensionColumns);
+
+	List	   *aggregateNames = NIL;
+
+	for (int aggregateIndex = 0; aggregateIndex < aggregateCount; aggregateIndex++)
+	{
+		char	   *aggregate = TextDatumGetCString(aggregateDatums[aggregateIndex]);
+		char	   *targetColumn = NULL;
+		char	   *aggregateName = NULL;
+		char	   *argument = NULL;
+
+		ParseAggregate(aggregate, &targetColumn, &aggregateName, &argument);
+		EnsureTargetColumn(targetRelationId, targetColumn);
+
+		const char *column = quote_identifier(targetColumn);
+
+		if (strcmp(aggregateName, "count") == 0 && strcmp(argument, "*") == 0)
+		{
+			aggregateName = "count(*)";
+			appendStringInfo(&updates, "%s = t.%s + excluded.%s", column, column, column);
+		}
+		else if (strcmp(aggregateName, "count") == 0)
+			appendStringInfo(&updates, "%s = t.%s + excluded.%s", column, column, column);
+		else if (strcmp(aggregateName, "sum") == 0)
+			appendStringInfo(&updates, "%s = pg_catalog.coalesce(t.%s + excluded.%s, t.%s, excluded.%s)",
+							 column, column, column, column, column);
+		else if (strcmp(aggregateName, "min") == 0)
+			appendStringInfo(&updates, "%s = pg_catalog.least(t.%s, excluded.%s)",
+							 column, column, column);
+		else if (strcmp(aggregateName, "max") == 0)
+			appendStringInfo(&updates, "%s = pg_catalog.greatest(t.%s, excluded.%s)",
+							 column, column, column);
+		else
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("aggregate \"%s\" is not supported in rollup pipelines",
+								   aggregateName),
+							errhint("Rollup pipelines support count, sum, min, and max.")));
+
+		if (strcmp(aggregateName, "count(*)") != 0)
+			appendStringInfo(&scanColumns, ", %s", argument);
+
+		appendStringInfo(&targetColumns, ", %s", column);
+
+		if (aggregateIndex < aggregateCount - 1)
+			appendStringInfoString(&updates, ", ");
+
+		aggregateNames = lappend(aggregateNames, aggregateName);
+	}
+
+	RollupDefinition *definition = palloc0(sizeof(RollupDefinition));
+
+	definition->dimensionCount = dimensionCount;
+	definition->aggregateNames = aggregateNames;
+	definition->scanCommand =
+		psprintf("select %s from %s where %s between $1 and $2",
+				 scanColumns.data,
+				 quote_qualified_identifier(get_namespace_name(get_rel_namespace(sourceRelationId)),
+											get_rel_name(sourceRelationId)),
+				 quote_identifier(GetSequenceColumnName(sequenceId)));
+
+	/* validate the scan command and determine the types of its columns */
+	Query	   *scanQuery = ParseQuery(definition->scanCommand,
+									   list_make2_oid(INT8OID, INT8OID));
+	Oid		   *columnTypes = palloc0(list_length(scanQuery->targetList) * sizeof(Oid));
+	int			columnCount = 0;
+	ListCell   *targetCell = NULL;
+
+	foreach(targetCell, scanQuery->targetList)
+	{
+		TargetEntry *targetEntry = lfirst(targetCell);
+
+		if (!targetEntry->resjunk)
+			columnTypes[columnCount++] = exprType((Node *) targetEntry->expr);
+	}
+
+	for (int dimensionIndex = 0; dimensionIndex < dimensionCount; dimensionIndex++)
+		EnsureDimensionType(columnTypes[dimensionIndex]);
+
+	RollupAggregate *rollupAggregates =
+		BuildRollupAggregates(aggregateNames, columnTypes, dimensionCount);
+
+	/* the merge command receives one array per target column */
+	List	   *paramTypes = NIL;
+	StringInfoData params;
+
+	initStringInfo(&params);
+
+	for (int paramIndex = 0; paramIndex < dimensionCount + aggregateCount; paramIndex++)
+	{
+		Oid			elementTypeId = paramIndex < dimensionCount ?
+			columnTypes[paramIndex] :
+			rollupAggregates[paramIndex - dimensionCount].resultTypeId;
+
+		paramTypes = lappend_oid(paramTypes, get_array_type(elementTypeId));
+		appendStringInfo(&params, "%s$%d", paramIndex > 0 ? ", " : "", paramIndex + 1);
+	}
+
+	definition->mergeCommand =
+		psprintf("insert into %s as t (%s) "
+				 "select * from pg_catalog.unnest(%s) "
+				 "on conflict (%s) do update set %s",
+				 quote_qualified_identifier(get_namespace_name(get_rel_namespace(targetRelationId)),
+											get_rel_name(targetRelationId)),
+				 targetColumns.data,
+				 params.data,
+				 conflictColumns.data,
+				 updates.data);
+
+	/* validate the merge command, including the conflict target */
+	ParseQuery(definition->mergeCommand, paramTypes);
+
+	return definition;
+}
+
+
+/*
+ * InitializeRollupPipelineState adds the rollup definition of a pipeline.
+ * The range state is tracked as a sequence pipeline.
+ */
+void
+InitializeRollupPipelineState(char *pipelineName, RollupDefinition * definition)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	int			aggregateCount = list_length(definition->aggregateNames);
+	Datum	   *aggregateDatums = palloc(aggregateCount * sizeof(Datum));
+
+	for (int aggregateIndex = 0; aggregateIndex < aggregateCount; aggregateIndex++)
+		aggregateDatums[aggregateIndex] =
+			CStringGetTextDatum(list_nth(definition->aggregateNames, aggregateIndex));
+
+	ArrayType  *aggregateArray = construct_array(aggregateDatums, aggregateCount, TEXTOID,
+												 -1, false, TYPALIGN_INT);
+
+	char	   *query =
+		"insert into incremental.rollup_pipelines "
+		"(pipeline_name, scan_command, dimension_count, aggregate_names) "
+		"values ($1, $2, $3, $4)";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 4;
+	Oid			argTypes[] = {TEXTOID, TEXTOID, INT4OID, TEXTARRAYOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		CStringGetTextDatum(definition->scanCommand),
+		Int32GetDatum(definition->dimensionCount),
+		PointerGetDatum(aggregateArray)
+	};
+	char	   *argNulls = "    ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * ExecuteRollupPipeline aggregates the rows in a new sequence range into
+ * a hash table, and merges the groups into the target table using a single
+ * upsert in the order of the dimensions.
+ *
+ * The scan uses the regular executor, such that BRIN and B-tree indexes on
+ * the sequence column select the new range, but the aggregation does not
+ * need per-group executor state and the target is only modified once.
+ */
+void
+ExecuteRollupPipeline(char *pipelineName, char *command)
+{
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+
+	SequenceNumberRange *range =
+		PopSequenceNumberRange(pipelineName, pipelineDesc->sourceRelationId);
+
+	if (range->rangeStart > range->rangeEnd)
+	{
+		ereport(NOTICE, (errmsg("pipeline %s: no rows to process",
+								pipelineName)));
+		return;
+	}
+
+	ereport(NOTICE, (errmsg("pipeline %s: processing sequence values from "
+							INT64_FORMAT " to " INT64_FORMAT,
+							pipelineName, range->rangeStart, range->rangeEnd)));
+
+	char	   *scanCommand = NULL;
+	int			dimensionCount = 0;
+	List	   *aggregateNames = ReadRollupDefinition(pipelineName, &scanCommand,
+													  &dimensionCount);
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	SPI_connect();
+
+	Oid			argTypes[] = {INT8OID, INT8OID};
+	Datum		argValues[] = {
+		Int64GetDatum(range->rangeStart),
+		Int64GetDatum(range->rangeEnd)
+	};
+	bool		readOnly = true;
+
+	SPIPlanPtr	scanPlan = SPI_prepare(scanCommand, 2, argTypes);
+
+	if (scanPlan == NULL)
+		elog(ERROR, "could not prepare rollup scan: %s",
+			 SPI_result_code_string(SPI_result));
+
+	Portal		scanPortal = SPI_cursor_open(NULL, scanPlan, argValues, NULL, readOnly);
+
+	/* the state outlives the SPI connection until the merge is done */
+	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+	RollupState *state = CreateRollupState(scanPortal->tupDesc, dimensionCount,
+										   aggregateNames);
+
+	MemoryContextSwitchTo(spiContext);
+
+	while (true)
+	{
+		SPI_cursor_fetch(scanPortal, true, ROLLUP_BATCH_SIZE);
+
+		if (SPI_processed == 0)
+			break;
+
+		AccumulateBatch(state, SPI_tuptable, (int) SPI_processed);
+		SPI_freetuptable(SPI_tuptable);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	SPI_cursor_close(scanPortal);
+
+	uint32		groupCount = MergeRollupGroups(state, command);
+
+	SPI_finish();
+
+	PopActiveSnapshot();
+
+	ereport(NOTICE, (errmsg("pipeline %s: merged " UINT64_FORMAT " rows into %u groups",
+							pipelineName, state->rowCount, groupCount)));
+
+	MemoryContextDelete(state->context);
+}
+
+
+/*
+ * TrimWhitespace returns a copy of value without leading and trailing
+ * whitespace.
+ */
+static char *
+TrimWhitespace(char *value)
+{
+	while (isspace((unsigned char) *value))
+		value++;
+
+	int			length = strlen(value);
+
+	while (length > 0 && isspace((unsigned char) value[length - 1]))
+		length--;
+
+	return pnstrdup(value, length);
+}
+
+
+/*
+ * ParseAggregate splits an aggregate of the form target_column:name(argument)
+ * into its parts.
+ */
+static void
+ParseAggregate(char *aggregate, char **targetColumn, char **aggregateName,
+			   char **argument)
+{
+	char	   *trimmed = TrimWhitespace(aggregate);
+	char	   *separator = strchr(trimmed, ':');
+	char	   *openParenthesis = separator != NULL ? strchr(separator, '(') : NULL;
+	int			length = strlen(trimmed);
+
+	if (separator == NULL || openParenthesis == NULL || trimmed[length - 1] != ')')
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("invalid aggregate \"%s\"", aggregate),
+						errhint("Specify aggregates as target_column:count(*) or "
+								"target_column:function(expression).")));
+
+	*targetColumn = TrimWhitespace(pnstrdup(trimmed, separator - trimmed));
+	*aggregateName = TrimWhitespace(asc_tolower(separator + 1,
+												openParenthesis - separator - 1));
+	*argument = TrimWhitespace(pnstrdup(openParenthesis + 1,
+										trimmed + length - 1 - openParenthesis - 1));
+}
+
+
+/*
+ * EnsureTargetColumn throws an error if the target table does not have the
+ * given column.
+ */
+static void
+EnsureTargetColumn(Oid targetRelationId, char *columnName)
+{
+	if (get_attnum(targetRelationId, columnName) == InvalidAttrNumber)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+						errmsg("column \"%s\" of relation \"%s\" does not exist",
+							   columnName, get_rel_name(targetRelationId))));
+}
+
+
+/*
+ * EnsureNullDimensionsMatch throws an error if a dimension column of the
+ * target table can be NULL and the unique index on the dimension columns
+ * treats NULLs as distinct, since ON CONFLICT would then never match a group
+ * with a NULL dimension and insert a new row on every run.
+ */
+static void
+EnsureNullDimensionsMatch(Oid targetRelationId, List *dimensionColumns)
+{
+	Relation	targetRelation = relation_open(targetRelationId, AccessShareLock);
+	TupleDesc	targetDesc = RelationGetDescr(targetRelation);
+	Bitmapset  *dimensionAttrs = NULL;
+	char	   *nullableColumn = NULL;
+	ListCell   *columnCell = NULL;
+
+	foreach(columnCell, dimensionColumns)
+	{
+		char	   *columnName = lfirst(columnCell);
+		AttrNumber	attrNumber = get_attnum(targetRelationId, columnName);
+
+		dimensionAttrs = bms_add_member(dimensionAttrs, attrNumber);
+
+		if (!TupleDescAttr(targetDesc, attrNumber - 1)->attnotnull && nullableColumn == NULL)
+			nullableColumn = columnName;
+	}
+
+	bool		nullsNotDistinct = false;
+
+	if (nullableColumn != NULL)
+	{
+		List	   *indexList = RelationGetIndexList(targetRelation);
+		ListCell   *indexCell = NULL;
+
+		foreach(indexCell, indexList)
+		{
+			Oid			indexId = lfirst_oid(indexCell);
+			HeapTuple	indexTuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(indexId));
+
+			if (!HeapTupleIsValid(indexTuple))
+				elog(ERROR, "cache lookup failed for index %u", indexId);
+
+			Form_pg_index indexForm = (Form_pg_index) GETSTRUCT(indexTuple);
+
+			/* only a plain unique index on the dimension columns is inferred */
+			if (indexForm->indisunique && indexForm->indnullsnotdistinct &&
+				heap_attisnull(indexTuple, Anum_pg_index_indexprs, NULL) &&
+				heap_attisnull(indexTuple, Anum_pg_index_indpred, NULL))
+			{
+				Bitmapset  *indexAttrs = NULL;
+
+				for (int keyIndex = 0; keyIndex < indexForm->indnkeyatts; keyIndex++)
+					indexAttrs = bms_add_member(indexAttrs, indexForm->indkey.values[keyIndex]);
+
+				if (bms_equal(indexAttrs, dimensionAttrs))
+					nullsNotDistinct = true;
+			}
+
+			ReleaseSysCache(indexTuple);
+		}
+	}
+
+	relation_close(targetRelation, AccessShareLock);
+
+	if (nullableColumn != NULL && !nullsNotDistinct)
+		ereport(ERROR, (errcode(ERRCODE_INVALID_TABLE_DEFINITION),
+						errmsg("dimension column \"%s\" of relation \"%s\" can be NULL",
+							   nullableColumn, get_rel_name(targetRelationId)),
+						errhint("Declare the dimension columns NOT NULL or use a unique "
+								"index with NULLS NOT DISTINCT.")));
+}
+
+
+/*
+ * GetSequenceColumnName returns the name of the column that owns the given
+ * sequence.
+ */
+static char *
+GetSequenceColumnName(Oid sequenceId)
+{
+	Oid			relationId = InvalidOid;
+	int32		columnNumber = 0;
+
+	if (!sequenceIsOwned(sequenceId, DEPENDENCY_AUTO, &relationId, &columnNumber) &&
+		!sequenceIsOwned(sequenceId, DEPENDENCY_INTERNAL, &relationId, &columnNumber))
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("rollup pipelines require a sequence that is owned by "
+							   "a column of the source table")));
+
+	return get_attname(relationId, columnNumber, false);
+}
+
+
+/*
+ * BuildRollupAggregates determines the kind and types of the aggregates for
+ * the given column types of the scan command.
+ */
+static RollupAggregate *
+BuildRollupAggregates(List *aggregateNames, Oid *columnTypes, int dimensionCount)
+{
+	RollupAggregate *aggregates = palloc0(list_length(aggregateNames) * sizeof(RollupAggregate));
+	int			inputColumn = dimensionCount;
+
+	for (int aggregateIndex = 0; aggregateIndex < list_length(aggregateNames); aggregateIndex++)
+	{
+		char	   *aggregateName = list_nth(aggregateNames, aggregateIndex);
+		RollupAggregate *aggregate = &aggregates[aggregateIndex];
+
+		if (strcmp(aggregateName, "count(*)") == 0)
+		{
+			aggregate->kind = ROLLUP_COUNT_ROWS;
+			aggregate->inputColumn = -1;
+			aggregate->resultTypeId = INT8OID;
+			continue;
+		}
+
+		aggregate->inputColumn = inputColumn++;
+		aggregate->inputTypeId = columnTypes[aggregate->inputColumn];
+
+		if (strcmp(aggregateName, "count") == 0)
+		{
+			aggregate->kind = ROLLUP_COUNT;
+			aggregate->resultTypeId = INT8OID;
+		}
+		else if (strcmp(aggregateName, "sum") == 0)
+		{
+			switch (aggregate->inputTypeId)
+			{
+				case INT2OID:
+				case INT4OID:
+				case INT8OID:
+					aggregate->kind = ROLLUP_SUM_INT;
+					aggregate->resultTypeId = INT8OID;
+					break;
+
+				case FLOAT4OID:
+				case FLOAT8OID:
+					aggregate->kind = ROLLUP_SUM_FLOAT;
+					aggregate->resultTypeId = FLOAT8OID;
+					break;
+
+				default:
+					ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+									errmsg("rollup pipelines do not support sum over type %s",
+										   format_type_be(aggregate->inputTypeId)),
+									errhint("Cast the expression to bigint or double precision.")));
+			}
+		}
+		else
+		{
+			TypeCacheEntry *typeEntry = lookup_type_cache(aggregate->inputTypeId,
+														  TYPECACHE_CMP_PROC);
+
+			if (!OidIsValid(typeEntry->cmp_proc))
+				ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
+								errmsg("could not identify a comparison function for type %s",
+									   format_type_be(aggregate->inputTypeId))));
+
+			aggregate->kind = strcmp(aggregateName, "min") == 0 ? ROLLUP_MIN : ROLLUP_MAX;
+			aggregate->resultTypeId = aggregate->inputTypeId;
+		}
+	}
+
+	return aggregates;
+}
+
+
+/*
+ * EnsureDimensionType throws an error if a dimension type cannot be hashed,
+ * compared for equality, or sorted.
+ */
+static void
+EnsureDimensionType(Oid typeId)
+{
+	TypeCacheEntry *typeEntry = lookup_type_cache(typeId, TYPECACHE_HASH_PROC |
+												  TYPECACHE_EQ_OPR |
+												  TYPECACHE_CMP_PROC);
+
+	if (!OidIsValid(typeEntry->hash_proc) || !OidIsValid(typeEntry->eq_opr) ||
+		!OidIsValid(typeEntry->cmp_proc))
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_FUNCTION),
+						errmsg("rollup pipelines do not support dimensions of type %s",
+							   format_type_be(typeId))));
+}
+
+
+/*
+ * ReadRollupDefinition reads the scan command, the number of dimensions, and
+ * the aggregate names of a rollup pipeline.
+ */
+static List *
+ReadRollupDefinition(char *pipelineName, char **scanCommand, int *dimensionCount)
+{
+	char	   *query =
+		"select scan_command, dimension_count, aggregate_names "
+		"from incremental.rollup_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+	bool		isNull = false;
+
+	Datum		scanCommandDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+	Datum		dimensionCountDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+	Datum		aggregateNamesDatum = SPI_getbinval(row, rowDesc, 3, &isNull);
+
+	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+	Datum	   *aggregateDatums = NULL;
+	int			aggregateCount = 0;
+	List	   *aggregateNames = NIL;
+
+	*scanCommand = TextDatumGetCString(scanCommandDatum);
+	*dimensionCount = DatumGetInt32(dimensionCountDatum);
+
+	deconstruct_array(DatumGetArrayTypeP(aggregateNamesDatum), TEXTOID, -1, false,
+					  TYPALIGN_INT, &aggregateDatums, NULL, &aggregateCount);
+
+	for (int aggregateIndex = 0; aggregateIndex < aggregateCount; aggregateIndex++)
+		aggregateNames = lappend(aggregateNames,
+								 TextDatumGetCString(aggregateDatums[aggregateIndex]));
+
+	MemoryContextSwitchTo(spiContext);
+
+	SPI_finish();
+
+	return aggregateNames;
+}
+
+
+/*
+ * CreateRollupState creates the hash table and batch buffers for aggregating
+ * the rows returned by the scan command.
+ */
+static RollupState *
+CreateRollupState(TupleDesc scanDesc, int dimensionCount, List *aggregateNames)
+{
+	MemoryContext rollupContext = AllocSetContextCreate(CurrentMemoryContext,
+														"rollup pipeline",
+														ALLOCSET_DEFAULT_SIZES);
+	MemoryContext oldContext = MemoryContextSwitchTo(rollupContext);
+
+	RollupState *state = palloc0(sizeof(RollupState));
+	int			columnCount = scanDesc->natts;
+	Oid		   *columnTypes = palloc(columnCount * sizeof(Oid));
+
+	state->context = rollupContext;
+	state->columnCount = columnCount;
+	state->scanDesc = CreateTupleDescCopy(scanDesc);
+	state->columnTypes = palloc(columnCount * sizeof(TypeCacheEntry *));
+
+	for (int columnIndex = 0; columnIndex < columnCount; columnIndex++)
+	{
+		columnTypes[columnIndex] = TupleDescAttr(scanDesc, columnIndex)->atttypid;
+		state->columnTypes[columnIndex] =
+			lookup_type_cache(columnTypes[columnIndex],
+							  TYPECACHE_HASH_PROC_FINFO | TYPECACHE_EQ_OPR_FINFO |
+							  TYPECACHE_CMP_PROC_FINFO);
+	}
+
+	state->dimensionCount = dimensionCount;
+	state->aggregateCount = list_length(aggregateNames);
+	state->aggregates = BuildRollupAggregates(aggregateNames, columnTypes, dimensionCount);
+
+	state->batchValues = palloc(ROLLUP_BATCH_SIZE * columnCount * sizeof(Datum));
+	state->batchNulls = palloc(ROLLUP_BATCH_SIZE * columnCount * sizeof(bool));
+	state->batchHashes = palloc(ROLLUP_BATCH_SIZE * sizeof(uint32));
+	state->batchStates = palloc(ROLLUP_BATCH_SIZE * sizeof(RollupAggregateState *));
+
+	state->groups = rollup_groups_create(rollupContext, ROLLUP_INITIAL_GROUPS, state);
+
+	MemoryContextSwitchTo(oldContext);
+
+	return state;
+}
+
+
+/*
+ * AccumulateBatch adds a batch of rows to the groups. Each step is done for
+ * the whole batch before the next, such that each loop only touches the
+ * data it needs: deforming rows, hashing dimensions, finding groups, and
+ * then updating one aggregate at a time.
+ */
+static void
+AccumulateBatch(RollupState * state, SPITupleTable *tupleTable, int rowCount)
+{
+	int			columnCount = state->columnCount;
+
+	for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+		heap_deform_tuple(tupleTable->vals[rowIndex], tupleTable->tupdesc,
+						  &state->batchValues[rowIndex * columnCount],
+						  &state->batchNulls[rowIndex * columnCount]);
+
+	for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		RollupKey	key = {
+			&state->batchValues[rowIndex * columnCount],
+			&state->batchNulls[rowIndex * columnCount]
+		};
+
+		state->batchHashes[rowIndex] = HashRollupKey(state, key);
+	}
+
+	for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		RollupKey	key = {
+			&state->batchValues[rowIndex * columnCount],
+			&state->batchNulls[rowIndex * columnCount]
+		};
+		bool		found = false;
+
+		RollupGroup *group = rollup_groups_insert_hash(state->groups, key,
+													   state->batchHashes[rowIndex],
+													   &found);
+
+		if (!found)
+			group = CreateGroup(state, group);
+
+		state->batchStates[rowIndex] = group->aggregates;
+	}
+
+	for (int aggregateIndex = 0; aggregateIndex < state->aggregateCount; aggregateIndex++)
+	{
+		RollupAggregate *aggregate = &state->aggregates[aggregateIndex];
+		int			inputColumn = aggregate->inputColumn;
+
+		switch (aggregate->kind)
+		{
+			case ROLLUP_COUNT_ROWS:
+				{
+					for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+						state->batchStates[rowIndex][aggregateIndex].count++;
+
+					break;
+				}
+
+			case ROLLUP_COUNT:
+				{
+					for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+					{
+						if (!state->batchNulls[rowIndex * columnCount + inputColumn])
+							state->batchStates[rowIndex][aggregateIndex].count++;
+					}
+
+					break;
+				}
+
+			case ROLLUP_SUM_INT:
+				{
+					for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+					{
+						int			offset = rowIndex * columnCount + inputColumn;
+
+						if (state->batchNulls[offset])
+							continue;
+
+						RollupAggregateState *aggregateState =
+							&state->batchStates[rowIndex][aggregateIndex];
+						Datum		value = state->batchValues[offset];
+						int64		intValue =
+							aggregate->inputTypeId == INT8OID ? DatumGetInt64(value) :
+							aggregate->inputTypeId == INT4OID ? DatumGetInt32(value) :
+							DatumGetInt16(value);
+
+						if (pg_add_s64_overflow(aggregateState->intSum, intValue,
+												&aggregateState->intSum))
+							ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+											errmsg("bigint out of range")));
+
+						aggregateState->count++;
+					}
+
+					break;
+				}
+
+			case ROLLUP_SUM_FLOAT:
+				{
+					for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+					{
+						int			offset = rowIndex * columnCount + inputColumn;
+
+						if (state->batchNulls[offset])
+							continue;
+
+						RollupAggregateState *aggregateState =
+							&state->batchStates[rowIndex][aggregateIndex];
+						Datum		value = state->batchValues[offset];
+
+						aggregateState->floatSum +=
+							aggregate->inputTypeId == FLOAT8OID ? DatumGetFloat8(value) :
+							DatumGetFloat4(value);
+						aggregateState->count++;
+					}
+
+					break;
+				}
+
+			case ROLLUP_MIN:
+			case ROLLUP_MAX:
+				{
+					AccumulateMinMax(state, aggregate, aggregateIndex, rowCount);
+					break;
+				}
+		}
+	}
+
+	state->rowCount += rowCount;
+}
+
+
+/*
+ * CreateGroup copies the dimension values of a new group into the rollup
+ * memory context, since they currently point into the batch.
+ */
+static RollupGroup *
+CreateGroup(RollupState * state, RollupGroup * group)
+{
+	MemoryContext oldContext = MemoryContextSwitchTo(state->context);
+	int			dimensionCount = state->dimensionCount;
+	Datum	   *values = palloc(dimensionCount * sizeof(Datum));
+	bool	   *nulls = palloc(dimensionCount * sizeof(bool));
+
+	for (int dimensionIndex = 0; dimensionIndex < dimensionCount; dimensionIndex++)
+	{
+		TypeCacheEntry *typeEntry = state->columnTypes[dimensionIndex];
+
+		nulls[dimensionIndex] = group->key.nulls[dimensionIndex];
+		values[dimensionIndex] = nulls[dimensionIndex] ? (Datum) 0 :
+			datumCopy(group->key.values[dimensionIndex], typeEntry->typbyval,
+					  typeEntry->typlen);
+	}
+
+	group->key.values = values;
+	group->key.nulls = nulls;
+	group->aggregates = palloc0(state->aggregateCount * sizeof(RollupAggregateState));
+
+	MemoryContextSwitchTo(oldContext);
+
+	return group;
+}
+
+
+/*
+ * AccumulateMinMax updates a min or max aggregate for a batch of rows.
+ */
+static void
+AccumulateMinMax(RollupState * state, RollupAggregate * aggregate, int aggregateIndex,
+				 int rowCount)
+{
+	int			columnCount = state->columnCount;
+	int			inputColumn = aggregate->inputColumn;
+	TypeCacheEntry *typeEntry = state->columnTypes[inputColumn];
+	Oid			collation = TupleDescAttr(state->scanDesc, inputColumn)->attcollation;
+	int			sign = aggregate->kind == ROLLUP_MIN ? -1 : 1;
+
+	for (int rowIndex = 0; rowIndex < rowCount; rowIndex++)
+	{
+		int			offset = rowIndex * columnCount + inputColumn;
+
+		if (state->batchNulls[offset])
+			continue;
+
+		RollupAggregateState *aggregateState =
+			&state->batchStates[rowIndex][aggregateIndex];
+		Datum		value = state->batchValues[offset];
+
+		if (aggregateState->count > 0)
+		{
+			int32		comparison =
+				DatumGetInt32(FunctionCall2Coll(&typeEntry->cmp_proc_finfo, collation,
+												value, aggregateState->value));
+
+			if (comparison * sign <= 0)
+				continue;
+
+			if (!typeEntry->typbyval)
+				pfree(DatumGetPointer(aggregateState->value));
+		}
+
+		MemoryContext oldContext = MemoryContextSwitchTo(state->context);
+
+		aggregateState->value = datumCopy(value, typeEntry->typbyval, typeEntry->typlen);
+		aggregateState->count++;
+
+		MemoryContextSwitchTo(oldContext);
+	}
+}
+
+
+/*
+ * MergeRollupGroups sorts the groups by their dimensions and merges them
+ * into the target table using the merge command, which receives an array
+ * per target column. It returns the number of groups.
+ */
+static uint32
+MergeRollupGroups(RollupState * state, char *mergeCommand)
+{
+	uint32		groupCount = state->groups->members;
+
+	if (groupCount == 0)
+		return 0;
+
+	RollupGroup **groups = palloc(groupCount * sizeof(RollupGroup *));
+	rollup_groups_iterator iterator;
+	RollupGroup *group = NULL;
+	uint32		groupIndex = 0;
+
+	rollup_groups_start_iterate(state->groups, &iterator);
+
+	while ((group = rollup_groups_iterate(state->groups, &iterator)) != NULL)
+		groups[groupIndex++] = group;
+
+	/* upserting in index order keeps the target index accesses local */
+	qsort_arg(groups, groupCount, sizeof(RollupGroup *), CompareRollupGroups, state);
+
+	int			paramCount = state->dimensionCount + state->aggregateCount;
+	Oid		   *paramTypes = palloc(paramCount * sizeof(Oid));
+	Datum	   *paramValues = palloc(paramCount * sizeof(Datum));
+	Datum	   *elementValues = palloc(groupCount * sizeof(Datum));
+	bool	   *elementNulls = palloc(groupCount * sizeof(bool));
+
+	for (int paramIndex = 0; paramIndex < paramCount; paramIndex++)
+	{
+		bool		isDimension = paramIndex < state->dimensionCount;
+		int			aggregateIndex = paramIndex - state->dimensionCount;
+		RollupAggregate *aggregate = isDimension ? NULL : &state->aggregates[aggregateIndex];
+		Oid			elementTypeId = isDimension ?
+			TupleDescAttr(state->scanDesc, paramIndex)->atttypid :
+			aggregate->resultTypeId;
+
+		for (groupIndex = 0; groupIndex < groupCount; groupIndex++)
+		{
+			RollupGroup *currentGroup = groups[groupIndex];
+
+			if (isDimension)
+			{
+				elementValues[groupIndex] = currentGroup->key.values[paramIndex];
+				elementNulls[groupIndex] = currentGroup->key.nulls[paramIndex];
+				continue;
+			}
+
+			RollupAggregateState *aggregateState = &currentGroup->aggregates[aggregateIndex];
+
+			/* sum, min, and max are NULL if there were only NULL inputs */
+			elementNulls[groupIndex] = aggregateState->count == 0 &&
+				aggregate->kind != ROLLUP_COUNT_ROWS && aggregate->kind != ROLLUP_COUNT;
+
+			switch (aggregate->kind)
+			{
+				case ROLLUP_COUNT_ROWS:
+				case ROLLUP_COUNT:
+					elementValues[groupIndex] = Int64GetDatum(aggregateState->count);
+					break;
+
+				case ROLLUP_SUM_INT:
+					elementValues[groupIndex] = Int64GetDatum(aggregateState->intSum);
+					break;
+
+				case ROLLUP_SUM_FLOAT:
+					elementValues[groupIndex] = Float8GetDatum(aggregateState->floatSum);
+					break;
+
+				case ROLLUP_MIN:
+				case ROLLUP_MAX:
+					elementValues[groupIndex] = aggregateState->value;
+					break;
+			}
+		}
+
+		int16		typeLength = 0;
+		bool		typeByValue = false;
+		char		typeAlign = 0;
+		int			dims[] = {groupCount};
+		int			lowerBounds[] = {1};
+
+		get_typlenbyvalalign(elementTypeId, &typeLength, &typeByValue, &typeAlign);
+
+		paramTypes[paramIndex] = get_array_type(elementTypeId);
+		paramValues[paramIndex] =
+			PointerGetDatum(construct_md_array(elementValues, elementNulls, 1, dims,
+											   lowerBounds, elementTypeId, typeLength,
+											   typeByValue, typeAlign));
+	}
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+
+	SPI_execute_with_args(mergeCommand,
+						  paramCount,
+						  paramTypes,
+						  paramValues,
+						  NULL,
+						  readOnly,
+						  tupleCount);
+
+	return groupCount;
+}
+
+
+/*
+ * CompareRollupGroups compares groups by their dimensions, with NULLs last.
+ */
+static int
+CompareRollupGroups(const void *left, const void *right, void *arg)
+{
+	RollupState *state = (RollupState *) arg;
+	RollupGroup *leftGroup = *(RollupGroup * const *) left;
+	RollupGroup *rightGroup = *(RollupGroup * const *) right;
+
+	for (int dimensionIndex = 0; dimensionIndex < state->dimensionCount; dimensionIndex++)
+	{
+		bool		leftNull = leftGroup->key.nulls[dimensionIndex];
+		bool		rightNull = rightGroup->key.nulls[dimensionIndex];
+
+		if (leftNull || rightNull)
+		{
+			if (leftNull != rightNull)
+				return leftNull ? 1 : -1;
+
+			continue;
+		}
+
+		TypeCacheEntry *typeEntry = state->columnTypes[dimensionIndex];
+		Oid			collation = TupleDescAttr(state->scanDesc, dimensionIndex)->attcollation;
+		int32		comparison =
+			DatumGetInt32(FunctionCall2Coll(&typeEntry->cmp_proc_finfo, collation,
+											leftGroup->key.values[dimensionIndex],
+											rightGroup->key.values[dimensionIndex]));
+
+		if (comparison != 0)
+			return comparison;
+	}
+
+	return 0;
+}
+
+
+/*
+ * HashRollupKey hashes the dimension values of a group.
+ */
+static uint32
+HashRollupKey(RollupState * state, RollupKey key)
+{
+	uint32		hash = 0;
+
+	for (int dimensionIndex = 0; dimensionIndex < state->dimensionCount; dimensionIndex++)
+	{
+		uint32		valueHash = 0;
+
+		if (!key.nulls[dimensionIndex])
+		{
+			TypeCacheEntry *typeEntry = state->columnTypes[dimensionIndex];
+			Oid			collation = TupleDescAttr(state->scanDesc, dimensionIndex)->attcollation;
+
+			valueHash = DatumGetUInt32(FunctionCall1Coll(&typeEntry->hash_proc_finfo,
+														 collation,
+														 key.values[dimensionIndex]));
+		}
+
+		hash = hash_combine(hash, valueHash);
+	}
+
+	return hash;
+}
+
+
+/*
+ * RollupKeysEqual returns whether two groups have the same dimension values,
+ * where NULLs are considered equal as in GROUP BY.
+ */
+static bool
+RollupKeysEqual(RollupState * state, RollupKey left, RollupKey right)
+{
+	for (int dimensionIndex = 0; dimensionIndex < state->dimensionCount; dimensionIndex++)
+	{
+		if (left.nulls[dimensionIndex] || right.nulls[dimensionIndex])
+		{
+			if (left.nulls[dimensionIndex] != right.nulls[dimensionIndex])
+				return false;
+
+			continue;
+		}
+
+		TypeCacheEntry *typeEntry = state->columnTypes[dimensionIndex];
+		Oid			collation = TupleDescAttr(state->scanDesc, dimensionIndex)->attcollation;
+
+		if (!DatumGetBool(FunctionCall2Coll(&typeEntry->eq_opr_finfo, collation,
+											left.values[dimensionIndex],
+											right.values[dimensionIndex])))
+			return false;
+	}
+
+	return true;
+}
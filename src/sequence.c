@@ -3,11 +3,18 @@
 #include "funcapi.h"
 #include "miscadmin.h"
 
+#include "access/relation.h"
 #include "catalog/dependency.h"
 #include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "crunchy/incremental/foreign_source.h"
+#include "crunchy/incremental/partition.h"
 #include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/remote_sink.h"
 #include "crunchy/incremental/sequence.h"
+#include "crunchy/incremental/stats.h"
 #include "executor/spi.h"
+#include "storage/bufmgr.h"
 #include "storage/lmgr.h"
 #include "storage/lock.h"
 #include "utils/acl.h"
@@ -16,31 +23,30 @@
 #include "utils/palloc.h"
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 
-/*
- * SequenceNumberRange represents a range of sequence numbers that can
- * be safely processed.
- */
-typedef struct SequenceNumberRange
-{
-	uint64		rangeStart;
-	uint64		rangeEnd;
-}			SequenceNumberRange;
+static SequenceNumberRange * GetSequenceNumberRange(char *pipelineName);
+static BlockNumber PrefetchNewBlocks(Oid relationId, SequenceNumberRange * range);
+static void UpdateSequencePipelineProgress(char *pipelineName, int64 lastSequenceNumber,
+										   BlockNumber blockNumber);
 
 
-static SequenceNumberRange * PopSequenceNumberRange(char *pipelineName, Oid sequenceId);
-static SequenceNumberRange * GetSequenceNumberRange(char *pipelineName);
+/* maximum number of new heap blocks to prefetch before processing a range */
+int			PrefetchBlockLimit = 0;
 
 
 PG_FUNCTION_INFO_V1(incremental_sequence_range);
+PG_FUNCTION_INFO_V1(incremental_set_sequence_watermark);
+PG_FUNCTION_INFO_V1(incremental_reset_sequence_watermark);
 
 
 /*
  * InitializeSequencePipelineStats adds the initial sequence pipeline state.
  */
 void
-InitializeSequencePipelineState(char *pipelineName, Oid sequenceId)
+InitializeSequencePipelineState(char *pipelineName, Oid sequenceId, char *watermarkName,
+								bool foreignSource)
 {
 	Oid			savedUserId = InvalidOid;
 	int			savedSecurityContext = 0;
@@ -54,18 +60,25 @@ InitializeSequencePipelineState(char *pipelineName, Oid sequenceId)
 
 	char	   *query =
 		"insert into incremental.sequence_pipelines "
-		"(pipeline_name, sequence_name) "
-		"values ($1, $2)";
+		"(pipeline_name, sequence_name, watermark_name, foreign_source) "
+		"values ($1, $2, $3, $4)";
 
 	bool		readOnly = false;
 	int			tupleCount = 0;
-	int			argCount = 2;
-	Oid			argTypes[] = {TEXTOID, OIDOID};
+	int			argCount = 4;
+	Oid			argTypes[] = {TEXTOID, OIDOID, TEXTOID, BOOLOID};
 	Datum		argValues[] = {
 		CStringGetTextDatum(pipelineName),
-		ObjectIdGetDatum(sequenceId)
+		ObjectIdGetDatum(sequenceId),
+		watermarkName != NULL ? CStringGetTextDatum(watermarkName) : 0,
+		BoolGetDatum(foreignSource)
+	};
+	char		argNulls[] = {
+		' ',
+		OidIsValid(sequenceId) ? ' ' : 'n',
+		watermarkName != NULL ? ' ' : 'n',
+		' '
 	};
-	char	   *argNulls = "   ";
 
 	SPI_connect();
 	SPI_execute_with_args(query,
@@ -106,6 +119,20 @@ ExecuteSequenceRangePipeline(char *pipelineName, char *command)
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
+	EnsureSequenceRangePartitions(pipelineName, pipelineDesc->sourceRelationId,
+								  range->rangeStart, range->rangeEnd);
+
+	/* copy the results to a remote table instead of executing locally */
+	RemoteSink *sink = ReadRemoteSink(pipelineName);
+
+	if (sink != NULL)
+	{
+		ExecuteRemoteSinkForRange(pipelineName, sink, command,
+								  range->rangeStart, range->rangeEnd);
+		PopActiveSnapshot();
+		return;
+	}
+
 	bool		readOnly = false;
 	int			tupleCount = 0;
 	int			argCount = 2;
@@ -140,34 +167,67 @@ ExecuteSequenceRangePipeline(char *pipelineName, char *command)
  * Note: An assumptions is that writers will only insert sequence numbers
  * that were obtained after locking the table.
  */
-static SequenceNumberRange *
+SequenceNumberRange *
 PopSequenceNumberRange(char *pipelineName, Oid relationId)
 {
 	SequenceNumberRange *range = GetSequenceNumberRange(pipelineName);
 
+	/*
+	 * For a foreign table, the remote server waits for its own writers and
+	 * returns a safe upper bound. The pipeline row stays locked meanwhile,
+	 * so concurrent executions cannot overlap.
+	 */
+	if (range->fromForeignSource)
+		range->rangeEnd = GetForeignSourceSafeSequenceNumber(relationId);
+
 	if (range->rangeStart <= range->rangeEnd)
 	{
-		LOCKTAG		tableLockTag;
+		/*
+		 * Start reading the blocks that were appended since the last run, such
+		 * that the I/O overlaps with waiting for lockers.
+		 */
+		BlockNumber blockNumber = InvalidBlockNumber;
 
-		SET_LOCKTAG_RELATION(tableLockTag, MyDatabaseId, relationId);
+		if (PrefetchBlockLimit > 0)
+			blockNumber = PrefetchNewBlocks(relationId, range);
 
 		/*
-		 * Wait for concurrent writers that may have seen sequence numbers <=
-		 * the last-drawn sequence number.
+		 * A watermark is only replicated after all writes with lower sequence
+		 * numbers committed, and is applied in commit order, so there is no
+		 * need to wait.
 		 */
-		WaitForLockers(tableLockTag, ShareLock, true);
+		if (!range->fromWatermark && !range->fromForeignSource)
+			WaitForSequenceWriters(relationId);
 
 		/*
 		 * We update the last-processed sequence number, which will commit or
 		 * abort with the current (sub)transaction.
 		 */
-		UpdateLastProcessedSequenceNumber(pipelineName, range->rangeEnd);
+		UpdateSequencePipelineProgress(pipelineName, range->rangeEnd, blockNumber);
 	}
 
 	return range;
 }
 
 
+/*
+ * WaitForSequenceWriters waits for concurrent writers to the given relation
+ * that may have seen sequence numbers <= the last-drawn sequence number.
+ */
+void
+WaitForSequenceWriters(Oid relationId)
+{
+	LOCKTAG		tableLockTag;
+
+	SET_LOCKTAG_RELATION(tableLockTag, MyDatabaseId, relationId);
+
+	TimestampTz waitStart = GetCurrentTimestamp();
+
+	WaitForLockers(tableLockTag, ShareLock, true);
+	RecordLockWait(waitStart);
+}
+
+
 /*
  * GetSequenceNumberRange reads the current state of the given sequence pipeline
  * and returns whether there are rows to process.
@@ -189,15 +249,24 @@ GetSequenceNumberRange(char *pipelineName)
 
 	/*
 	 * Get the last-drawn sequence number, which may be part of a write that
-	 * has not committed yet. Also block other pipeline rollups.
+	 * has not committed yet, or the last replicated watermark. Also block
+	 * other pipeline rollups.
 	 */
 	char	   *query =
 		"select"
 		" last_processed_sequence_number + 1,"
-		" pg_catalog.pg_sequence_last_value(sequence_name) seq "
-		"from incremental.sequence_pipelines "
+		" case when watermark_name is null"
+		"  then pg_catalog.pg_sequence_last_value(sequence_name)"
+		"  else (select last_safe_sequence_number"
+		"        from incremental.sequence_watermarks w"
+		"        where w.watermark_name operator(pg_catalog.=) p.watermark_name)"
+		" end seq,"
+		" watermark_name is not null,"
+		" last_block_number,"
+		" foreign_source "
+		"from incremental.sequence_pipelines p "
 		"where pipeline_name operator(pg_catalog.=) $1 "
-		"for update";
+		"for update of p";
 
 	bool		readOnly = false;
 	int			tupleCount = 0;
@@ -239,6 +308,27 @@ GetSequenceNumberRange(char *pipelineName)
 	if (!rangeEndIsNull)
 		range->rangeEnd = DatumGetInt64(rangeEndDatum);
 
+	/* read whether the pipeline uses a watermark */
+	bool		fromWatermarkIsNull = false;
+	Datum		fromWatermarkDatum = SPI_getbinval(row, rowDesc, 3, &fromWatermarkIsNull);
+
+	range->fromWatermark = DatumGetBool(fromWatermarkDatum);
+
+	/* read the number of heap blocks at the time of the previous run */
+	bool		lastBlockNumberIsNull = false;
+	Datum		lastBlockNumberDatum = SPI_getbinval(row, rowDesc, 4, &lastBlockNumberIsNull);
+
+	if (!lastBlockNumberIsNull)
+		range->lastBlockNumber = (BlockNumber) DatumGetInt64(lastBlockNumberDatum);
+	else
+		range->lastBlockNumber = InvalidBlockNumber;
+
+	/* read whether the range end comes from a remote server */
+	bool		fromForeignSourceIsNull = false;
+	Datum		fromForeignSourceDatum = SPI_getbinval(row, rowDesc, 5, &fromForeignSourceIsNull);
+
+	range->fromForeignSource = DatumGetBool(fromForeignSourceDatum);
+
 	SPI_finish();
 
 	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
@@ -247,12 +337,68 @@ GetSequenceNumberRange(char *pipelineName)
 	return range;
 }
 
+/*
+ * PrefetchNewBlocks issues prefetch requests for the heap blocks that were
+ * added to the relation since the previous run, which likely contain the
+ * rows in the range, and returns the current number of blocks.
+ *
+ * New rows are usually appended to the end of the heap, so block-number
+ * tracking is a cheap approximation of where the range lives. Rows that
+ * went into free space in older blocks are simply not prefetched.
+ */
+static BlockNumber
+PrefetchNewBlocks(Oid relationId, SequenceNumberRange * range)
+{
+	Relation	relation = try_relation_open(relationId, AccessShareLock);
+
+	if (relation == NULL)
+		return InvalidBlockNumber;
+
+	/* partitioned and foreign tables do not have local heap blocks */
+	if (relation->rd_rel->relkind != RELKIND_RELATION)
+	{
+		relation_close(relation, AccessShareLock);
+		return InvalidBlockNumber;
+	}
+
+	BlockNumber blockCount = RelationGetNumberOfBlocks(relation);
+	BlockNumber startBlock = 0;
+
+	if (blockCount > (BlockNumber) PrefetchBlockLimit)
+		startBlock = blockCount - PrefetchBlockLimit;
+
+	/* skip blocks that were already there during the previous run */
+	if (BlockNumberIsValid(range->lastBlockNumber) && range->lastBlockNumber > startBlock)
+		startBlock = range->lastBlockNumber;
+
+	for (BlockNumber blockNumber = startBlock; blockNumber < blockCount; blockNumber++)
+		PrefetchBuffer(relation, MAIN_FORKNUM, blockNumber);
+
+	relation_close(relation, AccessShareLock);
+
+	return blockCount;
+}
+
+
 /*
  * UpdateLastProcessedSequenceNumber updates the last_processed_sequence_number
  * in pipeline.pipelines to the given values.
  */
 void
 UpdateLastProcessedSequenceNumber(char *pipelineName, int64 lastSequenceNumber)
+{
+	UpdateSequencePipelineProgress(pipelineName, lastSequenceNumber, InvalidBlockNumber);
+}
+
+
+/*
+ * UpdateSequencePipelineProgress updates the last_processed_sequence_number
+ * and, if valid, the last_block_number of a sequence pipeline in a single
+ * update, such that prefetching does not add a write per run.
+ */
+static void
+UpdateSequencePipelineProgress(char *pipelineName, int64 lastSequenceNumber,
+							   BlockNumber blockNumber)
 {
 	Oid			savedUserId = InvalidOid;
 	int			savedSecurityContext = 0;
@@ -270,18 +416,24 @@ UpdateLastProcessedSequenceNumber(char *pipelineName, int64 lastSequenceNumber)
 	 */
 	char	   *query =
 		"update incremental.sequence_pipelines "
-		"set last_processed_sequence_number = $2 "
+		"set last_processed_sequence_number = $2,"
+		" last_block_number = coalesce($3, last_block_number) "
 		"where pipeline_name operator(pg_catalog.=) $1";
 
 	bool		readOnly = false;
 	int			tupleCount = 0;
-	int			argCount = 2;
-	Oid			argTypes[] = {TEXTOID, INT8OID};
+	int			argCount = 3;
+	Oid			argTypes[] = {TEXTOID, INT8OID, INT8OID};
 	Datum		argValues[] = {
 		CStringGetTextDatum(pipelineName),
-		Int64GetDatum(lastSequenceNumber)
+		Int64GetDatum(lastSequenceNumber),
+		Int64GetDatum((int64) blockNumber)
+	};
+	char		argNulls[] = {
+		' ',
+		' ',
+		BlockNumberIsValid(blockNumber) ? ' ' : 'n'
 	};
-	char	   *argNulls = "  ";
 
 	SPI_connect();
 	SPI_execute_with_args(query,
@@ -303,6 +455,228 @@ UpdateLastProcessedSequenceNumber(char *pipelineName, int64 lastSequenceNumber)
 }
 
 
+/*
+ * incremental_set_sequence_watermark records the last sequence number up to
+ * which all writes are known to be committed, typically from a sequence
+ * pipeline on a publisher. Sequence pipelines on a logical replication
+ * subscriber can use the replicated watermark as the end of their range.
+ */
+Datum
+incremental_set_sequence_watermark(PG_FUNCTION_ARGS)
+{
+	char	   *watermarkName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	int64		sequenceNumber = PG_GETARG_INT64(1);
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the watermarks table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	bool		isSuperuser = superuser_arg(savedUserId);
+
+	SPI_connect();
+
+	/*
+	 * Pipelines of other roles may already follow a watermark that does not
+	 * exist yet, in which case creating it would control their range end.
+	 */
+	if (!isSuperuser)
+	{
+		char	   *usedQuery =
+			"select 1 from incremental.sequence_pipelines s "
+			"join incremental.pipelines p using (pipeline_name) "
+			"where s.watermark_name operator(pg_catalog.=) $1 "
+			"and p.owner_id operator(pg_catalog.<>) $2 "
+			"and not exists (select 1 from incremental.sequence_watermarks w "
+			"where w.watermark_name operator(pg_catalog.=) $1)";
+
+		Oid			usedArgTypes[] = {TEXTOID, OIDOID};
+		Datum		usedArgValues[] = {
+			CStringGetTextDatum(watermarkName),
+			ObjectIdGetDatum(savedUserId)
+		};
+
+		SPI_execute_with_args(usedQuery, 2, usedArgTypes, usedArgValues, "  ",
+							  true, 1);
+
+		if (SPI_processed > 0)
+			ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							errmsg("permission denied for watermark %s", watermarkName)));
+	}
+
+	/*
+	 * Only the role that created the watermark (or a superuser) can advance
+	 * it, and watermarks never go backwards.
+	 */
+	char	   *query =
+		"insert into incremental.sequence_watermarks "
+		"(watermark_name, last_safe_sequence_number, owner_id) "
+		"values ($1, $2, $3) "
+		"on conflict (watermark_name) do update set "
+		"last_safe_sequence_number = pg_catalog.greatest("
+		"sequence_watermarks.last_safe_sequence_number, "
+		"excluded.last_safe_sequence_number) "
+		"where sequence_watermarks.owner_id operator(pg_catalog.=) excluded.owner_id "
+		"or $4";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 4;
+	Oid			argTypes[] = {TEXTOID, INT8OID, OIDOID, BOOLOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(watermarkName),
+		Int64GetDatum(sequenceNumber),
+		ObjectIdGetDatum(savedUserId),
+		BoolGetDatum(isSuperuser)
+	};
+	char	   *argNulls = "    ";
+
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+						errmsg("permission denied for watermark %s", watermarkName)));
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * incremental_reset_sequence_watermark sets a watermark to the given sequence
+ * number, even if it is lower than the current one, for instance after a
+ * logical replication subscriber was resynchronized.
+ */
+Datum
+incremental_reset_sequence_watermark(PG_FUNCTION_ARGS)
+{
+	char	   *watermarkName = text_to_cstring(PG_GETARG_TEXT_P(0));
+	int64		sequenceNumber = PG_GETARG_INT64(1);
+
+	EnsureWatermarkOwner(watermarkName);
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the watermarks table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"update incremental.sequence_watermarks "
+		"set last_safe_sequence_number = $2, updated_time = pg_catalog.now() "
+		"where watermark_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TEXTOID, INT8OID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(watermarkName),
+		Int64GetDatum(sequenceNumber)
+	};
+	char	   *argNulls = "  ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("watermark \"%s\" does not exist", watermarkName)));
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * EnsureWatermarkOwner throws an error if the watermark exists and the
+ * current user is not superuser and not the owner of the watermark, such
+ * that only the owner can control the range end of pipelines that use it.
+ */
+void
+EnsureWatermarkOwner(char *watermarkName)
+{
+	if (superuser())
+		return;
+
+	Oid			userId = GetUserId();
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have read
+	 * privileges for the watermarks table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"select owner_id from incremental.sequence_watermarks "
+		"where watermark_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = true;
+	int			tupleCount = 1;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(watermarkName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed > 0)
+	{
+		bool		isNull = false;
+		Oid			ownerId = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+															 SPI_tuptable->tupdesc,
+															 1, &isNull));
+
+		if (ownerId != userId)
+			ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+							errmsg("permission denied for watermark %s", watermarkName)));
+	}
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
 /*
  * FindSequenceForRelation returns the Oid of a sequence belonging to the
  * given relation.
@@ -0,0 +1,345 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "commands/dbcommands.h"
+#include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/stats.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * PipelineStatsShared is the shared memory area that holds pipeline
+ * statistics.
+ */
+typedef struct PipelineStatsShared
+{
+	/* protects the entries */
+	LWLock	   *lock;
+
+	/* number of entries */
+	int			maxEntries;
+
+	PipelineStats entries[FLEXIBLE_ARRAY_MEMBER];
+}			PipelineStatsShared;
+
+
+static void PipelineStatsShmemRequest(void);
+static void PipelineStatsShmemStartup(void);
+static Size PipelineStatsShmemSize(void);
+static PipelineStats * FindPipelineStats(char *pipelineName, bool createIfMissing);
+
+
+PG_FUNCTION_INFO_V1(incremental_pipeline_stats);
+
+
+/* maximum number of pipelines for which statistics are tracked */
+int			MaxTrackedPipelines = 256;
+
+static shmem_request_hook_type PreviousShmemRequestHook = NULL;
+static shmem_startup_hook_type PreviousShmemStartupHook = NULL;
+static PipelineStatsShared * PipelineStatsState = NULL;
+
+/* time spent waiting for lockers in the current pipeline execution */
+static int64 CurrentLockWait = 0;
+
+/* name of the current database, looked up once outside of error handling */
+static char CurrentDatabaseName[NAMEDATALEN] = "";
+
+
+/*
+ * InitializePipelineStats sets up the hooks for the shared memory statistics.
+ * It should be called from _PG_init when loaded via shared_preload_libraries.
+ */
+void
+InitializePipelineStats(void)
+{
+	PreviousShmemRequestHook = shmem_request_hook;
+	shmem_request_hook = PipelineStatsShmemRequest;
+
+	PreviousShmemStartupHook = shmem_startup_hook;
+	shmem_startup_hook = PipelineStatsShmemStartup;
+}
+
+
+/*
+ * PipelineStatsShmemRequest requests the shared memory and lock needed for
+ * pipeline statistics.
+ */
+static void
+PipelineStatsShmemRequest(void)
+{
+	if (PreviousShmemRequestHook != NULL)
+		PreviousShmemRequestHook();
+
+	RequestAddinShmemSpace(PipelineStatsShmemSize());
+	RequestNamedLWLockTranche("pg_incremental", 1);
+}
+
+
+/*
+ * PipelineStatsShmemStartup initializes the shared memory area for pipeline
+ * statistics.
+ */
+static void
+PipelineStatsShmemStartup(void)
+{
+	bool		found = false;
+
+	if (PreviousShmemStartupHook != NULL)
+		PreviousShmemStartupHook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	PipelineStatsState = ShmemInitStruct("pg_incremental pipeline stats",
+										 PipelineStatsShmemSize(),
+										 &found);
+	if (!found)
+	{
+		memset(PipelineStatsState, 0, PipelineStatsShmemSize());
+
+		PipelineStatsState->lock = &(GetNamedLWLockTranche("pg_incremental"))->lock;
+		PipelineStatsState->maxEntries = MaxTrackedPipelines;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * PipelineStatsShmemSize returns the size of the shared memory area for
+ * pipeline statistics.
+ */
+static Size
+PipelineStatsShmemSize(void)
+{
+	return add_size(offsetof(PipelineStatsShared, entries),
+					mul_size(MaxTrackedPipelines, sizeof(PipelineStats)));
+}
+
+
+/*
+ * PipelineStatsEnabled returns whether shared memory statistics are available,
+ * which requires pg_incremental to be in shared_preload_libraries.
+ */
+bool
+PipelineStatsEnabled(void)
+{
+	return PipelineStatsState != NULL;
+}
+
+
+/*
+ * StartPipelineStats resets the lock wait time at the start of a pipeline
+ * execution.
+ */
+void
+StartPipelineStats(void)
+{
+	CurrentLockWait = 0;
+
+	if (PipelineStatsEnabled() && CurrentDatabaseName[0] == '\0')
+	{
+		char	   *databaseName = get_database_name(MyDatabaseId);
+
+		if (databaseName != NULL)
+			strlcpy(CurrentDatabaseName, databaseName, NAMEDATALEN);
+	}
+}
+
+
+/*
+ * RecordLockWait adds the time since waitStart to the lock wait time of the
+ * current pipeline execution.
+ */
+void
+RecordLockWait(TimestampTz waitStart)
+{
+	CurrentLockWait += GetCurrentTimestamp() - waitStart;
+}
+
+
+/*
+ * RecordPipelineRun adds an execution of a pipeline to the statistics.
+ *
+ * Statistics are not transactional, so an execution that succeeded may
+ * still be rolled back by the caller.
+ */
+void
+RecordPipelineRun(char *pipelineName, PipelineType pipelineType,
+				  TimestampTz startTime, bool succeeded)
+{
+	if (!PipelineStatsEnabled())
+		return;
+
+	TimestampTz endTime = GetCurrentTimestamp();
+
+	LWLockAcquire(PipelineStatsState->lock, LW_EXCLUSIVE);
+
+	PipelineStats *stats = FindPipelineStats(pipelineName, true);
+
+	if (stats != NULL)
+	{
+		stats->pipelineType = pipelineType;
+		stats->runCount++;
+		stats->lastDuration = endTime - startTime;
+		stats->totalDuration += stats->lastDuration;
+		stats->totalLockWait += CurrentLockWait;
+		stats->lastRunTime = startTime;
+
+		if (succeeded)
+			stats->lastSuccessTime = startTime;
+		else
+			stats->failureCount++;
+	}
+
+	LWLockRelease(PipelineStatsState->lock);
+
+	CurrentLockWait = 0;
+}
+
+
+/*
+ * RemovePipelineStats removes the statistics of a dropped pipeline.
+ */
+void
+RemovePipelineStats(char *pipelineName)
+{
+	if (!PipelineStatsEnabled())
+		return;
+
+	LWLockAcquire(PipelineStatsState->lock, LW_EXCLUSIVE);
+
+	PipelineStats *stats = FindPipelineStats(pipelineName, false);
+
+	if (stats != NULL)
+		memset(stats, 0, sizeof(PipelineStats));
+
+	LWLockRelease(PipelineStatsState->lock);
+}
+
+
+/*
+ * CopyPipelineStats copies the statistics of up to maxCount pipelines in
+ * all databases into statsArray and returns the number of pipelines.
+ */
+int
+CopyPipelineStats(PipelineStats * statsArray, int maxCount)
+{
+	int			statsCount = 0;
+
+	if (!PipelineStatsEnabled())
+		return 0;
+
+	LWLockAcquire(PipelineStatsState->lock, LW_SHARED);
+
+	for (int entryIndex = 0; entryIndex < PipelineStatsState->maxEntries; entryIndex++)
+	{
+		PipelineStats *stats = &PipelineStatsState->entries[entryIndex];
+
+		if (!stats->inUse)
+			continue;
+
+		if (statsCount >= maxCount)
+			break;
+
+		statsArray[statsCount++] = *stats;
+	}
+
+	LWLockRelease(PipelineStatsState->lock);
+
+	return statsCount;
+}
+
+
+/*
+ * FindPipelineStats returns the statistics entry of a pipeline in the current
+ * database, or claims a free entry if createIfMissing is true. Returns NULL if
+ * the pipeline is not found or there are no free entries.
+ *
+ * The caller should hold the lock in exclusive mode.
+ */
+static PipelineStats *
+FindPipelineStats(char *pipelineName, bool createIfMissing)
+{
+	PipelineStats *freeEntry = NULL;
+
+	for (int entryIndex = 0; entryIndex < PipelineStatsState->maxEntries; entryIndex++)
+	{
+		PipelineStats *stats = &PipelineStatsState->entries[entryIndex];
+
+		if (!stats->inUse)
+		{
+			if (freeEntry == NULL)
+				freeEntry = stats;
+
+			continue;
+		}
+
+		if (stats->databaseId == MyDatabaseId &&
+			strncmp(stats->pipelineName, pipelineName, STATS_PIPELINE_NAME_LEN - 1) == 0)
+			return stats;
+	}
+
+	if (!createIfMissing || freeEntry == NULL)
+		return NULL;
+
+	memset(freeEntry, 0, sizeof(PipelineStats));
+	freeEntry->inUse = true;
+	freeEntry->databaseId = MyDatabaseId;
+	strlcpy(freeEntry->databaseName, CurrentDatabaseName, NAMEDATALEN);
+	strlcpy(freeEntry->pipelineName, pipelineName, STATS_PIPELINE_NAME_LEN);
+
+	return freeEntry;
+}
+
+
+/*
+ * incremental_pipeline_stats returns the statistics of the pipelines in the
+ * current database.
+ */
+Datum
+incremental_pipeline_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	if (!PipelineStatsEnabled())
+		PG_RETURN_VOID();
+
+	PipelineStats *statsArray = palloc0(sizeof(PipelineStats) * MaxTrackedPipelines);
+	int			statsCount = CopyPipelineStats(statsArray, MaxTrackedPipelines);
+
+	for (int statsIndex = 0; statsIndex < statsCount; statsIndex++)
+	{
+		PipelineStats *stats = &statsArray[statsIndex];
+
+		if (stats->databaseId != MyDatabaseId)
+			continue;
+
+		Datum		values[8];
+		bool		nulls[8];
+
+		memset(nulls, false, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(stats->pipelineName);
+		values[1] = Int64GetDatum(stats->runCount);
+		values[2] = Int64GetDatum(stats->failureCount);
+		values[3] = Float8GetDatum(stats->totalDuration / 1000.0);
+		values[4] = Float8GetDatum(stats->lastDuration / 1000.0);
+		values[5] = Float8GetDatum(stats->totalLockWait / 1000.0);
+		values[6] = TimestampTzGetDatum(stats->lastRunTime);
+		values[7] = TimestampTzGetDatum(stats->lastSuccessTime);
+		nulls[7] = stats->lastSuccessTime == 0;
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,784 @@
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "access/relation.h"
+#include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "crunchy/incremental/partition.h"
+#include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/sequence.h"
+#include "crunchy/incremental/time_bucket.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/fmgrprotos.h"
+#include "utils/lsyscache.h"
+#include "utils/palloc.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * TimeBucketPipeline contains the state of a time bucket pipeline.
+ */
+typedef struct TimeBucketPipeline
+{
+	/* name of the sequence column in the source table */
+	char	   *sequenceColumn;
+
+	/* name of the event time column in the source and staging table */
+	char	   *timeColumn;
+
+	/* table in which rows are kept until their bucket closes */
+	Oid			stagingRelationId;
+
+	/* bucket width */
+	Interval   *timeInterval;
+
+	/* how long after the end of a bucket rows may still arrive */
+	Interval   *allowedLateness;
+
+	/* command to run for rows that arrive after their bucket closed */
+	char	   *correctionCommand;
+
+	/* how long past the current time to close buckets without new rows, or NULL */
+	Interval   *idleTimeout;
+
+	/* end of the last closed bucket (exclusive) */
+	bool		hasClosedBuckets;
+	TimestampTz closedUntil;
+
+	/* lowest event time of newly-arrived rows, never goes backwards */
+	bool		hasWatermark;
+	TimestampTz watermark;
+}			TimeBucketPipeline;
+
+
+static TimeBucketPipeline * LockTimeBucketPipeline(char *pipelineName);
+static bool StageSequenceRange(TimeBucketPipeline * pipeline, Oid sourceRelationId,
+							   SequenceNumberRange * range, TimestampTz openTime,
+							   TimestampTz *minTime);
+static void HandleLateRows(char *pipelineName, TimeBucketPipeline * pipeline,
+						   Oid sourceRelationId, SequenceNumberRange * range);
+static bool GetFirstStagedBucket(TimeBucketPipeline * pipeline, TimestampTz *bucketStart);
+static TimestampTz GetBucketEnd(TimeBucketPipeline * pipeline, TimestampTz bucketStart);
+static char *StagingColumnList(Oid stagingRelationId);
+static void ExecuteTimeBucketPipelineForBucket(char *pipelineName, char *command,
+											   TimeBucketPipeline * pipeline,
+											   TimestampTz bucketStart,
+											   TimestampTz bucketEnd);
+static void UpdateTimeBucketState(char *pipelineName, TimeBucketPipeline * pipeline);
+static char *QualifiedRelationName(Oid relationId);
+static char *TimestampTzToCString(TimestampTz timestamp);
+
+
+/*
+ * InitializeTimeBucketPipelineState adds the initial time bucket pipeline state.
+ */
+void
+InitializeTimeBucketPipelineState(char *pipelineName, char *sequenceColumn,
+								  char *timeColumn, Oid stagingRelationId,
+								  Interval *timeInterval, Interval *allowedLateness,
+								  char *correctionCommand, Interval *idleTimeout)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"insert into incremental.time_bucket_pipelines "
+		"(pipeline_name, sequence_column, time_column, staging_table, time_interval, "
+		"allowed_lateness, correction_command, idle_timeout) "
+		"values ($1, $2, $3, $4, $5, $6, $7, $8)";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 8;
+	Oid			argTypes[] = {
+		TEXTOID, TEXTOID, TEXTOID, OIDOID, INTERVALOID, INTERVALOID, TEXTOID, INTERVALOID
+	};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		CStringGetTextDatum(sequenceColumn),
+		CStringGetTextDatum(timeColumn),
+		ObjectIdGetDatum(stagingRelationId),
+		IntervalPGetDatum(timeInterval),
+		IntervalPGetDatum(allowedLateness),
+		correctionCommand != NULL ? CStringGetTextDatum(correctionCommand) : 0,
+		idleTimeout != NULL ? IntervalPGetDatum(idleTimeout) : 0
+	};
+	char		argNulls[] = {
+		' ', ' ', ' ', ' ', ' ', ' ',
+		correctionCommand != NULL ? ' ' : 'n',
+		idleTimeout != NULL ? ' ' : 'n'
+	};
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * EnsureStagingColumnsMatch throws an error if a column of the staging table
+ * does not exist in the source table with the same type. The staging table
+ * may have fewer columns than the source table.
+ */
+void
+EnsureStagingColumnsMatch(Oid sourceRelationId, Oid stagingRelationId)
+{
+	Relation	stagingRelation = relation_open(stagingRelationId, AccessShareLock);
+	TupleDesc	stagingDesc = RelationGetDescr(stagingRelation);
+
+	for (int columnIndex = 0; columnIndex < stagingDesc->natts; columnIndex++)
+	{
+		Form_pg_attribute column = TupleDescAttr(stagingDesc, columnIndex);
+
+		if (column->attisdropped || column->attgenerated)
+			continue;
+
+		char	   *columnName = NameStr(column->attname);
+		AttrNumber	sourceAttNum = get_attnum(sourceRelationId, columnName);
+
+		if (sourceAttNum == InvalidAttrNumber)
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+							errmsg("column \"%s\" of staging table \"%s\" does not exist "
+								   "in source table \"%s\"",
+								   columnName, get_rel_name(stagingRelationId),
+								   get_rel_name(sourceRelationId))));
+
+		Oid			sourceTypeId = get_atttype(sourceRelationId, sourceAttNum);
+
+		if (sourceTypeId != column->atttypid)
+			ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH),
+							errmsg("column \"%s\" of staging table \"%s\" is of type %s, "
+								   "but it is of type %s in source table \"%s\"",
+								   columnName, get_rel_name(stagingRelationId),
+								   format_type_be(column->atttypid),
+								   format_type_be(sourceTypeId),
+								   get_rel_name(sourceRelationId))));
+	}
+
+	relation_close(stagingRelation, AccessShareLock);
+}
+
+
+/*
+ * ExecuteTimeBucketPipeline moves the rows in a new safe sequence range into
+ * the staging table, passes rows that arrived after their bucket closed to the
+ * correction command, and then runs the command for every bucket whose end
+ * plus the allowed lateness has been passed by the event time watermark.
+ */
+void
+ExecuteTimeBucketPipeline(char *pipelineName, char *command)
+{
+	PipelineDesc *pipelineDesc = ReadPipelineDesc(pipelineName);
+	TimeBucketPipeline *pipeline = LockTimeBucketPipeline(pipelineName);
+
+	SequenceNumberRange *range =
+		PopSequenceNumberRange(pipelineName, pipelineDesc->sourceRelationId);
+
+	/* rows before the end of the last closed bucket are late */
+	TimestampTz openTime = 0;
+
+	if (pipeline->hasClosedBuckets)
+		openTime = pipeline->closedUntil;
+	else
+		TIMESTAMP_NOBEGIN(openTime);
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	/*
+	 * The lowest event time among the new rows tells us how far event time
+	 * has progressed. If there were no new on-time rows, the watermark stays
+	 * where it is, unless the pipeline has an idle timeout.
+	 */
+	bool		hasNewWatermark = false;
+	TimestampTz newWatermark = 0;
+
+	if (range->rangeStart <= range->rangeEnd)
+	{
+		ereport(NOTICE, (errmsg("pipeline %s: staging sequence values from "
+								INT64_FORMAT " to " INT64_FORMAT,
+								pipelineName, range->rangeStart, range->rangeEnd)));
+
+		hasNewWatermark = StageSequenceRange(pipeline, pipelineDesc->sourceRelationId,
+											 range, openTime, &newWatermark);
+
+		if (pipeline->hasClosedBuckets)
+			HandleLateRows(pipelineName, pipeline, pipelineDesc->sourceRelationId, range);
+	}
+
+	if (!hasNewWatermark && pipeline->idleTimeout != NULL)
+	{
+		/* close buckets once the current time passed them by the idle timeout */
+		newWatermark =
+			DatumGetTimestampTz(DirectFunctionCall2(timestamptz_mi_interval,
+													TimestampTzGetDatum(GetCurrentTransactionStartTimestamp()),
+													IntervalPGetDatum(pipeline->idleTimeout)));
+		hasNewWatermark = true;
+	}
+
+	if (hasNewWatermark &&
+		(!pipeline->hasWatermark || newWatermark > pipeline->watermark))
+	{
+		pipeline->watermark = newWatermark;
+		pipeline->hasWatermark = true;
+	}
+
+	/*
+	 * Close buckets in order, skipping buckets without staged rows, since
+	 * rows of closed buckets are removed from the staging table.
+	 */
+	TimestampTz bucketStart = 0;
+
+	while (pipeline->hasWatermark && GetFirstStagedBucket(pipeline, &bucketStart))
+	{
+		TimestampTz bucketEnd = GetBucketEnd(pipeline, bucketStart);
+		TimestampTz closeTime =
+			DatumGetTimestampTz(DirectFunctionCall2(timestamptz_pl_interval,
+													TimestampTzGetDatum(bucketEnd),
+													IntervalPGetDatum(pipeline->allowedLateness)));
+
+		/* rows for this bucket may still arrive */
+		if (closeTime > pipeline->watermark)
+			break;
+
+		EnsureTargetPartitions(pipelineName, bucketStart, bucketEnd);
+		ExecuteTimeBucketPipelineForBucket(pipelineName, command, pipeline,
+										   bucketStart, bucketEnd);
+
+		pipeline->closedUntil = bucketEnd;
+		pipeline->hasClosedBuckets = true;
+	}
+
+	PopActiveSnapshot();
+
+	/*
+	 * We update the closed buckets and watermark, which will commit or abort
+	 * with the current (sub)transaction.
+	 */
+	UpdateTimeBucketState(pipelineName, pipeline);
+}
+
+
+/*
+ * ResetTimeBucketPipeline resets a time bucket pipeline to its initial
+ * state and removes all staged rows.
+ */
+void
+ResetTimeBucketPipeline(char *pipelineName)
+{
+	TimeBucketPipeline *pipeline = LockTimeBucketPipeline(pipelineName);
+
+	/* staged rows will be staged again, use the privileges of the caller */
+	char	   *deleteQuery = psprintf("delete from %s",
+									   QualifiedRelationName(pipeline->stagingRelationId));
+
+	SPI_connect();
+	SPI_execute(deleteQuery, false, 0);
+	SPI_finish();
+
+	pipeline->hasClosedBuckets = false;
+	pipeline->hasWatermark = false;
+
+	UpdateTimeBucketState(pipelineName, pipeline);
+	UpdateLastProcessedSequenceNumber(pipelineName, 0);
+}
+
+
+/*
+ * LockTimeBucketPipeline reads the state of a time bucket pipeline and
+ * blocks other executions of the same pipeline.
+ */
+static TimeBucketPipeline *
+LockTimeBucketPipeline(char *pipelineName)
+{
+	TimeBucketPipeline *pipeline = (TimeBucketPipeline *) palloc0(sizeof(TimeBucketPipeline));
+
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	char	   *query =
+		"select sequence_column, time_column, staging_table, time_interval, "
+		"allowed_lateness, correction_command, closed_until, watermark, idle_timeout "
+		"from incremental.time_bucket_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1 "
+		"for update";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		sequenceColumnDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+	Datum		timeColumnDatum = SPI_getbinval(row, rowDesc, 2, &isNull);
+	Datum		stagingTableDatum = SPI_getbinval(row, rowDesc, 3, &isNull);
+	Datum		timeIntervalDatum = SPI_getbinval(row, rowDesc, 4, &isNull);
+	Datum		allowedLatenessDatum = SPI_getbinval(row, rowDesc, 5, &isNull);
+
+	bool		correctionCommandIsNull = false;
+	Datum		correctionCommandDatum = SPI_getbinval(row, rowDesc, 6, &correctionCommandIsNull);
+
+	bool		closedUntilIsNull = false;
+	Datum		closedUntilDatum = SPI_getbinval(row, rowDesc, 7, &closedUntilIsNull);
+
+	bool		watermarkIsNull = false;
+	Datum		watermarkDatum = SPI_getbinval(row, rowDesc, 8, &watermarkIsNull);
+
+	bool		idleTimeoutIsNull = false;
+	Datum		idleTimeoutDatum = SPI_getbinval(row, rowDesc, 9, &idleTimeoutIsNull);
+
+	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+	pipeline->sequenceColumn = TextDatumGetCString(sequenceColumnDatum);
+	pipeline->timeColumn = TextDatumGetCString(timeColumnDatum);
+	pipeline->stagingRelationId = DatumGetObjectId(stagingTableDatum);
+
+	pipeline->timeInterval = palloc0(sizeof(Interval));
+	memcpy(pipeline->timeInterval, DatumGetIntervalP(timeIntervalDatum), sizeof(Interval));
+
+	pipeline->allowedLateness = palloc0(sizeof(Interval));
+	memcpy(pipeline->allowedLateness, DatumGetIntervalP(allowedLatenessDatum), sizeof(Interval));
+
+	if (!correctionCommandIsNull)
+		pipeline->correctionCommand = TextDatumGetCString(correctionCommandDatum);
+
+	pipeline->hasClosedBuckets = !closedUntilIsNull;
+	if (!closedUntilIsNull)
+		pipeline->closedUntil = DatumGetTimestampTz(closedUntilDatum);
+
+	pipeline->hasWatermark = !watermarkIsNull;
+	if (!watermarkIsNull)
+		pipeline->watermark = DatumGetTimestampTz(watermarkDatum);
+
+	if (!idleTimeoutIsNull)
+	{
+		pipeline->idleTimeout = palloc0(sizeof(Interval));
+		memcpy(pipeline->idleTimeout, DatumGetIntervalP(idleTimeoutDatum), sizeof(Interval));
+	}
+
+	MemoryContextSwitchTo(spiContext);
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+
+	return pipeline;
+}
+
+
+/*
+ * StageSequenceRange copies the rows in the sequence range that belong to
+ * buckets that are still open into the staging table and returns whether
+ * any rows were staged. The lowest event time of the staged rows is returned
+ * via minTime.
+ */
+static bool
+StageSequenceRange(TimeBucketPipeline * pipeline, Oid sourceRelationId,
+				   SequenceNumberRange * range, TimestampTz openTime,
+				   TimestampTz *minTime)
+{
+	char	   *sequenceColumn = quote_identifier(pipeline->sequenceColumn);
+	char	   *timeColumn = quote_identifier(pipeline->timeColumn);
+	char	   *columnList = StagingColumnList(pipeline->stagingRelationId);
+
+	/* we use the privileges of the caller */
+	char	   *query =
+		psprintf("with staged as ("
+				 "insert into %s (%s) select %s from %s "
+				 "where %s operator(pg_catalog.>=) $1 "
+				 "and %s operator(pg_catalog.<=) $2 "
+				 "and %s operator(pg_catalog.>=) $3 "
+				 "returning %s) "
+				 "select pg_catalog.min(%s) from staged",
+				 QualifiedRelationName(pipeline->stagingRelationId),
+				 columnList, columnList,
+				 QualifiedRelationName(sourceRelationId),
+				 sequenceColumn, sequenceColumn, timeColumn,
+				 timeColumn, timeColumn);
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 3;
+	Oid			argTypes[] = {INT8OID, INT8OID, TIMESTAMPTZOID};
+	Datum		argValues[] = {
+		Int64GetDatum(range->rangeStart),
+		Int64GetDatum(range->rangeEnd),
+		TimestampTzGetDatum(openTime)
+	};
+	char	   *argNulls = "   ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		minTimeDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+
+	if (!isNull)
+		*minTime = DatumGetTimestampTz(minTimeDatum);
+
+	SPI_finish();
+
+	return !isNull;
+}
+
+
+/*
+ * HandleLateRows passes the sequence range to the correction command, which
+ * is expected to handle rows with an event time before the end of the last
+ * closed bucket. Without a correction command, late rows are skipped.
+ */
+static void
+HandleLateRows(char *pipelineName, TimeBucketPipeline * pipeline,
+			   Oid sourceRelationId, SequenceNumberRange * range)
+{
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 3;
+	Oid			argTypes[] = {INT8OID, INT8OID, TIMESTAMPTZOID};
+	Datum		argValues[] = {
+		Int64GetDatum(range->rangeStart),
+		Int64GetDatum(range->rangeEnd),
+		TimestampTzGetDatum(pipeline->closedUntil)
+	};
+	char	   *argNulls = "   ";
+
+	if (pipeline->correctionCommand != NULL)
+	{
+		ereport(NOTICE, (errmsg("pipeline %s: correcting late rows before %s",
+								pipelineName,
+								TimestampTzToCString(pipeline->closedUntil))));
+
+		SPI_connect();
+		SPI_execute_with_args(pipeline->correctionCommand,
+							  argCount,
+							  argTypes,
+							  argValues,
+							  argNulls,
+							  readOnly,
+							  tupleCount);
+		SPI_finish();
+		return;
+	}
+
+	char	   *sequenceColumn = quote_identifier(pipeline->sequenceColumn);
+	char	   *timeColumn = quote_identifier(pipeline->timeColumn);
+
+	char	   *query =
+		psprintf("select pg_catalog.count(*) from %s "
+				 "where %s operator(pg_catalog.>=) $1 "
+				 "and %s operator(pg_catalog.<=) $2 "
+				 "and %s operator(pg_catalog.<) $3",
+				 QualifiedRelationName(sourceRelationId),
+				 sequenceColumn, sequenceColumn, timeColumn);
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	bool		isNull = false;
+	Datum		lateCountDatum = SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc,
+											   1, &isNull);
+	int64		lateCount = DatumGetInt64(lateCountDatum);
+
+	SPI_finish();
+
+	if (lateCount > 0)
+		ereport(WARNING, (errmsg("pipeline %s: skipped " INT64_FORMAT " rows that arrived "
+								 "after their time bucket was closed",
+								 pipelineName, lateCount),
+						  errhint("Use a correction_command to handle late rows.")));
+}
+
+
+/*
+ * GetFirstStagedBucket finds the start of the bucket of the earliest staged
+ * row and returns whether there are any staged rows.
+ */
+static bool
+GetFirstStagedBucket(TimeBucketPipeline * pipeline, TimestampTz *bucketStart)
+{
+	char	   *query =
+		psprintf("select pg_catalog.date_bin($1, pg_catalog.min(%s), '2001-01-01') from %s",
+				 quote_identifier(pipeline->timeColumn),
+				 QualifiedRelationName(pipeline->stagingRelationId));
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {INTERVALOID};
+	Datum		argValues[] = {
+		IntervalPGetDatum(pipeline->timeInterval)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	bool		isNull = false;
+	Datum		bucketStartDatum = SPI_getbinval(SPI_tuptable->vals[0],
+												 SPI_tuptable->tupdesc,
+												 1, &isNull);
+
+	if (!isNull)
+		*bucketStart = DatumGetTimestampTz(bucketStartDatum);
+
+	SPI_finish();
+
+	return !isNull;
+}
+
+
+/*
+ * GetBucketEnd returns the end of the bucket that starts at bucketStart.
+ *
+ * date_bin treats a day as 24 hours regardless of daylight saving time, so
+ * we add the interval as a fixed duration to get the start of the next bucket
+ * that date_bin would return. Intervals with months are rejected on creation.
+ */
+static TimestampTz
+GetBucketEnd(TimeBucketPipeline * pipeline, TimestampTz bucketStart)
+{
+	Interval   *timeInterval = pipeline->timeInterval;
+
+	return bucketStart + timeInterval->day * USECS_PER_DAY + timeInterval->time;
+}
+
+
+/*
+ * ExecuteTimeBucketPipelineForBucket runs the command for a closed bucket
+ * and removes its rows from the staging table.
+ */
+static void
+ExecuteTimeBucketPipelineForBucket(char *pipelineName, char *command,
+								   TimeBucketPipeline * pipeline,
+								   TimestampTz bucketStart, TimestampTz bucketEnd)
+{
+	ereport(NOTICE, (errmsg("pipeline %s: closing time bucket from %s to %s",
+							pipelineName,
+							TimestampTzToCString(bucketStart),
+							TimestampTzToCString(bucketEnd))));
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 2;
+	Oid			argTypes[] = {TIMESTAMPTZOID, TIMESTAMPTZOID};
+	Datum		argValues[] = {
+		TimestampTzGetDatum(bucketStart),
+		TimestampTzGetDatum(bucketEnd)
+	};
+	char	   *argNulls = "  ";
+
+	char	   *deleteQuery =
+		psprintf("delete from %s where %s operator(pg_catalog.<) $2",
+				 QualifiedRelationName(pipeline->stagingRelationId),
+				 quote_identifier(pipeline->timeColumn));
+
+	SPI_connect();
+	SPI_execute_with_args(command,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	SPI_execute_with_args(deleteQuery,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+	SPI_finish();
+}
+
+
+/*
+ * UpdateTimeBucketState stores the end of the last closed bucket and the
+ * watermark.
+ */
+static void
+UpdateTimeBucketState(char *pipelineName, TimeBucketPipeline * pipeline)
+{
+	Oid			savedUserId = InvalidOid;
+	int			savedSecurityContext = 0;
+
+	/*
+	 * Switch to superuser in case the current user does not have write
+	 * privileges for the pipelines table.
+	 */
+	GetUserIdAndSecContext(&savedUserId, &savedSecurityContext);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID, SECURITY_LOCAL_USERID_CHANGE);
+
+	char	   *query =
+		"update incremental.time_bucket_pipelines "
+		"set closed_until = $2, watermark = $3 "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 3;
+	Oid			argTypes[] = {TEXTOID, TIMESTAMPTZOID, TIMESTAMPTZOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName),
+		TimestampTzGetDatum(pipeline->closedUntil),
+		TimestampTzGetDatum(pipeline->watermark)
+	};
+	char		argNulls[] = {
+		' ',
+		pipeline->hasClosedBuckets ? ' ' : 'n',
+		pipeline->hasWatermark ? ' ' : 'n'
+	};
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	SPI_finish();
+
+	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
+}
+
+
+/*
+ * StagingColumnList returns the quoted names of the columns of the staging
+ * table, such that rows are copied by column name rather than position.
+ */
+static char *
+StagingColumnList(Oid stagingRelationId)
+{
+	StringInfoData columnList;
+
+	initStringInfo(&columnList);
+
+	Relation	stagingRelation = relation_open(stagingRelationId, AccessShareLock);
+	TupleDesc	stagingDesc = RelationGetDescr(stagingRelation);
+
+	for (int columnIndex = 0; columnIndex < stagingDesc->natts; columnIndex++)
+	{
+		Form_pg_attribute column = TupleDescAttr(stagingDesc, columnIndex);
+
+		if (column->attisdropped || column->attgenerated)
+			continue;
+
+		appendStringInfo(&columnList, "%s%s",
+						 columnList.len > 0 ? ", " : "",
+						 quote_identifier(NameStr(column->attname)));
+	}
+
+	relation_close(stagingRelation, AccessShareLock);
+
+	return columnList.data;
+}
+
+
+/*
+ * QualifiedRelationName returns the quoted, schema-qualified name of a
+ * relation.
+ */
+static char *
+QualifiedRelationName(Oid relationId)
+{
+	char	   *relationName = get_rel_name(relationId);
+
+	if (relationName == NULL)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_TABLE),
+						errmsg("relation with OID %u does not exist", relationId)));
+
+	char	   *schemaName = get_namespace_name(get_rel_namespace(relationId));
+
+	return quote_qualified_identifier(schemaName, relationName);
+}
+
+
+/*
+ * TimestampTzToCString returns the text representation of a timestamptz.
+ */
+static char *
+TimestampTzToCString(TimestampTz timestamp)
+{
+	return DatumGetCString(DirectFunctionCall1(timestamptz_out,
+											   TimestampTzGetDatum(timestamp)));
+}
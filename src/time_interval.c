@@ -5,12 +5,18 @@
 
 #include "catalog/dependency.h"
 #include "catalog/pg_authid.h"
+#include "crunchy/incremental/partition.h"
 #include "crunchy/incremental/pipeline.h"
+#include "crunchy/incremental/stats.h"
 #include "crunchy/incremental/time_interval.h"
 #include "executor/spi.h"
 #include "storage/lmgr.h"
 #include "storage/lock.h"
+#if (PG_VERSION_NUM < 160000)
+#include "storage/sinvaladt.h"
+#endif
 #include "utils/acl.h"
+#include "utils/backend_status.h"
 #include "utils/builtins.h"
 #include "utils/fmgrprotos.h"
 #include "utils/lsyscache.h"
@@ -31,14 +37,31 @@ typedef struct TimeIntervalRange
 
 	Interval   *interval;
 	bool		batched;
+
+	/* type as which the range is passed to the command */
+	TimeParameterType parameterType;
 }			TimeIntervalRange;
 
 
 static void ExecuteTimeIntervalPipelineForRange(char *pipelineName, char *command,
-												TimestampTz rangeStart, TimestampTz rangeEnd);
+												TimestampTz rangeStart, TimestampTz rangeEnd,
+												TimeParameterType parameterType);
 static TimeIntervalRange * PopTimeIntervalRange(char *pipelineName,
 												Oid relationId);
 static TimeIntervalRange * GetSafeTimeIntervalRange(char *pipelineName);
+static void WaitForTimeIntervalWriters(Oid relationId, TimestampTz rangeEnd);
+static TimestampTz GetLockerTransactionStart(VirtualTransactionId locker);
+static int64 TimestampTzToEpochUnits(TimestampTz timestamp, int64 usecsPerUnit);
+
+
+/* names of the time parameter types, indexed by TimeParameterType */
+static const char *TimeParameterTypeNames[] = {
+	"timestamptz",
+	"timestamp",
+	"date",
+	"epoch_seconds",
+	"epoch_ms"
+};
 
 
 /*
@@ -49,7 +72,8 @@ InitializeTimeRangePipelineState(char *pipelineName,
 								 bool batched,
 								 TimestampTz startTime,
 								 Interval *timeInterval,
-								 Interval *minDelay)
+								 Interval *minDelay,
+								 TimeParameterType parameterType)
 {
 	Oid			savedUserId = InvalidOid;
 	int			savedSecurityContext = 0;
@@ -63,21 +87,23 @@ InitializeTimeRangePipelineState(char *pipelineName,
 
 	char	   *query =
 		"insert into incremental.time_interval_pipelines "
-		"(pipeline_name, batched, last_processed_time, time_interval, min_delay) "
-		"values ($1, $2, $3, $4, $5)";
+		"(pipeline_name, batched, last_processed_time, time_interval, min_delay, "
+		"parameter_type) "
+		"values ($1, $2, $3, $4, $5, $6)";
 
 	bool		readOnly = false;
 	int			tupleCount = 0;
-	int			argCount = 5;
-	Oid			argTypes[] = {TEXTOID, BOOLOID, TIMESTAMPTZOID, INTERVALOID, INTERVALOID};
+	int			argCount = 6;
+	Oid			argTypes[] = {TEXTOID, BOOLOID, TIMESTAMPTZOID, INTERVALOID, INTERVALOID, TEXTOID};
 	Datum		argValues[] = {
 		CStringGetTextDatum(pipelineName),
 		BoolGetDatum(batched),
 		TimestampTzGetDatum(startTime),
 		IntervalPGetDatum(timeInterval),
-		IntervalPGetDatum(minDelay)
+		IntervalPGetDatum(minDelay),
+		CStringGetTextDatum(TimeParameterTypeNames[parameterType])
 	};
-	char		argNulls[] = "     ";
+	char		argNulls[] = "      ";
 
 	SPI_connect();
 	SPI_execute_with_args(query,
@@ -112,10 +138,13 @@ ExecuteTimeIntervalPipeline(char *pipelineName, char *command)
 		return;
 	}
 
+	EnsureTargetPartitions(pipelineName, range->rangeStart, range->rangeEnd);
+
 	if (range->batched)
 	{
 		ExecuteTimeIntervalPipelineForRange(pipelineName, command,
-											range->rangeStart, range->rangeEnd);
+											range->rangeStart, range->rangeEnd,
+											range->parameterType);
 	}
 	else
 	{
@@ -151,7 +180,8 @@ ExecuteTimeIntervalPipeline(char *pipelineName, char *command)
 
 			/* execute the pipeline */
 			ExecuteTimeIntervalPipelineForRange(pipelineName, command,
-												currentStart, currentEnd);
+												currentStart, currentEnd,
+												range->parameterType);
 
 			/* next interval starts at the end of this one */
 			nextStart = currentEnd;
@@ -162,11 +192,12 @@ ExecuteTimeIntervalPipeline(char *pipelineName, char *command)
 
 /*
  * ExecuteTimeIntervalPipelineForRange executes a time interval pipeline for
- * the given time range.
+ * the given time range, converted to the parameter type of the pipeline.
  */
 static void
 ExecuteTimeIntervalPipelineForRange(char *pipelineName, char *command,
-									TimestampTz rangeStart, TimestampTz rangeEnd)
+									TimestampTz rangeStart, TimestampTz rangeEnd,
+									TimeParameterType parameterType)
 {
 	Datum		rangeStartDatum = TimestampTzGetDatum(rangeStart);
 	Datum		rangeEndDatum = TimestampTzGetDatum(rangeEnd);
@@ -181,13 +212,15 @@ ExecuteTimeIntervalPipelineForRange(char *pipelineName, char *command,
 
 	PushActiveSnapshot(GetTransactionSnapshot());
 
+	Oid			paramTypeId = TimeParameterTypeId(parameterType);
+
 	bool		readOnly = false;
 	int			tupleCount = 0;
 	int			argCount = 2;
-	Oid			argTypes[] = {TIMESTAMPTZOID, TIMESTAMPTZOID};
+	Oid			argTypes[] = {paramTypeId, paramTypeId};
 	Datum		argValues[] = {
-		rangeStartDatum,
-		rangeEndDatum
+		ConvertTimeParameter(rangeStart, parameterType),
+		ConvertTimeParameter(rangeEnd, parameterType)
 	};
 	char	   *argNulls = "  ";
 
@@ -222,15 +255,11 @@ PopTimeIntervalRange(char *pipelineName, Oid relationId)
 
 	if (range->rangeStart < range->rangeEnd)
 	{
-		LOCKTAG		tableLockTag;
-
-		SET_LOCKTAG_RELATION(tableLockTag, MyDatabaseId, relationId);
-
 		/*
 		 * Wait for concurrent writers that may have seen now() results lower
-		 * than the start of the time range.
+		 * than the end of the time range.
 		 */
-		WaitForLockers(tableLockTag, ShareLock, true);
+		WaitForTimeIntervalWriters(relationId, range->rangeEnd);
 
 		/*
 		 * We update the last-processed time interval, which will commit or
@@ -243,6 +272,89 @@ PopTimeIntervalRange(char *pipelineName, Oid relationId)
 }
 
 
+/*
+ * WaitForTimeIntervalWriters waits for concurrent writers to the given
+ * relation whose transaction started before the end of the range.
+ *
+ * Writers that started at or after the end of the range can only insert
+ * now() values that belong to a later range, and on a busy table there is
+ * nearly always such a writer, so we do not wait for those.
+ */
+static void
+WaitForTimeIntervalWriters(Oid relationId, TimestampTz rangeEnd)
+{
+	LOCKTAG		tableLockTag;
+	int			lockerCount = 0;
+
+	SET_LOCKTAG_RELATION(tableLockTag, MyDatabaseId, relationId);
+
+	TimestampTz waitStart = GetCurrentTimestamp();
+	VirtualTransactionId *lockers = GetLockConflicts(&tableLockTag, ShareLock,
+													 &lockerCount);
+	bool		waited = false;
+
+	for (int lockerIndex = 0; lockerIndex < lockerCount; lockerIndex++)
+	{
+		TimestampTz transactionStart = GetLockerTransactionStart(lockers[lockerIndex]);
+
+		/* 0 means unknown, in which case we need to wait */
+		if (transactionStart != 0 && transactionStart >= rangeEnd)
+			continue;
+
+		VirtualXactLock(lockers[lockerIndex], true);
+		waited = true;
+	}
+
+	if (waited)
+		RecordLockWait(waitStart);
+}
+
+
+/*
+ * GetLockerTransactionStart returns the start time of the current transaction
+ * of the backend that holds a lock, or 0 if it is unknown.
+ *
+ * The backend status comes from the snapshot of the current transaction,
+ * which may be older than the lock. The transaction start of a backend can
+ * only increase, so an older value can only cause an unnecessary wait.
+ */
+static TimestampTz
+GetLockerTransactionStart(VirtualTransactionId locker)
+{
+	PgBackendStatus *status = NULL;
+
+#if (PG_VERSION_NUM >= 170000)
+	status = pgstat_get_beentry_by_proc_number(locker.procNumber);
+#elif (PG_VERSION_NUM >= 160000)
+	status = pgstat_get_beentry_by_backend_id(locker.backendId);
+#else
+	PGPROC	   *proc = BackendIdGetProc(locker.backendId);
+
+	if (proc == NULL)
+		return 0;
+
+	int			backendCount = pgstat_fetch_stat_numbackends();
+
+	for (int backendIndex = 1; backendIndex <= backendCount; backendIndex++)
+	{
+		PgBackendStatus *candidate = pgstat_fetch_stat_beentry(backendIndex);
+
+		if (candidate != NULL && candidate->st_procpid == proc->pid)
+		{
+			status = candidate;
+			break;
+		}
+	}
+#endif
+
+	/* prepared transactions and backends that do not track activity */
+	if (status == NULL)
+		return 0;
+
+	return status->st_xact_start_timestamp;
+}
+
+
 /*
  * GetSafeTimeIntervalRange reads the current state of the given sequence pipeline
  * and returns whether there are rows to process.
@@ -273,7 +385,8 @@ GetSafeTimeIntervalRange(char *pipelineName)
 		" last_processed_time,"
 		" pg_catalog.date_bin(time_interval, now() - min_delay, '2001-01-01'),"
 		" time_interval,"
-		" batched "
+		" batched,"
+		" parameter_type "
 		"from incremental.time_interval_pipelines "
 		"where pipeline_name operator(pg_catalog.=) $1 "
 		"for update";
@@ -324,6 +437,10 @@ GetSafeTimeIntervalRange(char *pipelineName)
 
 	range->batched = DatumGetBool(batchedDatum);
 
+	Datum		parameterTypeDatum = SPI_getbinval(row, rowDesc, 5, &isNull);
+
+	range->parameterType = ParseTimeParameterType(TextDatumGetCString(parameterTypeDatum));
+
 	SPI_finish();
 
 	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
@@ -388,3 +505,147 @@ UpdateLastProcessedTimeInterval(char *pipelineName, TimestampTz lastProcessedInt
 
 	SetUserIdAndSecContext(savedUserId, savedSecurityContext);
 }
+
+
+/*
+ * ParseTimeParameterType returns the TimeParameterType with the given name.
+ */
+TimeParameterType
+ParseTimeParameterType(char *parameterTypeName)
+{
+	for (int typeIndex = 0; typeIndex < lengthof(TimeParameterTypeNames); typeIndex++)
+	{
+		if (pg_strcasecmp(parameterTypeName, TimeParameterTypeNames[typeIndex]) == 0)
+			return (TimeParameterType) typeIndex;
+	}
+
+	ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					errmsg("invalid parameter_type: %s", parameterTypeName),
+					errhint("Use timestamptz, timestamp, date, epoch_seconds, or epoch_ms")));
+}
+
+
+/*
+ * TimeParameterTypeId returns the type OID as which parameters of the given
+ * TimeParameterType are passed.
+ */
+Oid
+TimeParameterTypeId(TimeParameterType parameterType)
+{
+	switch (parameterType)
+	{
+		case TIME_PARAMETER_TIMESTAMPTZ:
+			return TIMESTAMPTZOID;
+
+		case TIME_PARAMETER_TIMESTAMP:
+			return TIMESTAMPOID;
+
+		case TIME_PARAMETER_DATE:
+			return DATEOID;
+
+		case TIME_PARAMETER_EPOCH_SECONDS:
+		case TIME_PARAMETER_EPOCH_MS:
+			return INT8OID;
+
+		default:
+			elog(ERROR, "unknown time parameter type: %d", parameterType);
+	}
+}
+
+
+/*
+ * ConvertTimeParameter converts the start or end of a time range to the
+ * given TimeParameterType once, such that the command can compare it to the
+ * source column without casts.
+ */
+Datum
+ConvertTimeParameter(TimestampTz timestamp, TimeParameterType parameterType)
+{
+	switch (parameterType)
+	{
+		case TIME_PARAMETER_TIMESTAMPTZ:
+			return TimestampTzGetDatum(timestamp);
+
+		case TIME_PARAMETER_TIMESTAMP:
+			return DirectFunctionCall1(timestamptz_timestamp, TimestampTzGetDatum(timestamp));
+
+		case TIME_PARAMETER_DATE:
+			return DirectFunctionCall1(timestamptz_date, TimestampTzGetDatum(timestamp));
+
+		case TIME_PARAMETER_EPOCH_SECONDS:
+			return Int64GetDatum(TimestampTzToEpochUnits(timestamp, USECS_PER_SEC));
+
+		case TIME_PARAMETER_EPOCH_MS:
+			return Int64GetDatum(TimestampTzToEpochUnits(timestamp, USECS_PER_SEC / 1000));
+
+		default:
+			elog(ERROR, "unknown time parameter type: %d", parameterType);
+	}
+}
+
+
+/*
+ * TimestampTzToEpochUnits converts a timestamp to the number of units of
+ * usecsPerUnit microseconds since the Unix epoch, rounded down.
+ */
+static int64
+TimestampTzToEpochUnits(TimestampTz timestamp, int64 usecsPerUnit)
+{
+	int64		units = timestamp / usecsPerUnit;
+
+	if (timestamp % usecsPerUnit < 0)
+		units--;
+
+	/* TimestampTz counts from 2000-01-01 */
+	return units + (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY *
+		(USECS_PER_SEC / usecsPerUnit);
+}
+
+
+/*
+ * ReadTimeParameterType returns the parameter type of a time interval
+ * pipeline.
+ */
+TimeParameterType
+ReadTimeParameterType(char *pipelineName)
+{
+	char	   *query =
+		"select parameter_type "
+		"from incremental.time_interval_pipelines "
+		"where pipeline_name operator(pg_catalog.=) $1";
+
+	bool		readOnly = false;
+	int			tupleCount = 0;
+	int			argCount = 1;
+	Oid			argTypes[] = {TEXTOID};
+	Datum		argValues[] = {
+		CStringGetTextDatum(pipelineName)
+	};
+	char	   *argNulls = " ";
+
+	SPI_connect();
+	SPI_execute_with_args(query,
+						  argCount,
+						  argTypes,
+						  argValues,
+						  argNulls,
+						  readOnly,
+						  tupleCount);
+
+	if (SPI_processed <= 0)
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("pipeline \"%s\" cannot be found",
+							   pipelineName)));
+
+	TupleDesc	rowDesc = SPI_tuptable->tupdesc;
+	HeapTuple	row = SPI_tuptable->vals[0];
+
+	bool		isNull = false;
+	Datum		parameterTypeDatum = SPI_getbinval(row, rowDesc, 1, &isNull);
+	TimeParameterType parameterType =
+		ParseTimeParameterType(TextDatumGetCString(parameterTypeDatum));
+
+	SPI_finish();
+
+	return parameterType;
+}